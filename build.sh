@@ -13,9 +13,12 @@ CPP=clang++
 
 compile="$CPP -std=c++17 -I . -I core -I values -I compiler -Wall -Wno-sign-compare"
 
-# Compile core_words.cc with special flags to suppress unnecessary stack frames
+# Compile the core words with special flags to suppress unnecessary stack frames
 $compile -c -O3 -fomit-frame-pointer -fno-stack-check -fno-stack-protector \
     core/core_words.cc more_words.cc
+# ...and the typed core without SLP vectorization; see the comment at the top of typed_core.cc
+$compile -c -O3 -fomit-frame-pointer -fno-stack-check -fno-stack-protector \
+    -fno-tree-slp-vectorize core/typed_core.cc
 
 $compile -c {values,compiler}/*.cc
 
@@ -27,6 +30,9 @@ echo "Building 'tails' REPL ..."
 $CC -c -I ../vendor/linenoise ../vendor/linenoise/{linenoise,utf8}.c
 $compile -c -O3 {values,compiler}/*.cc
 $compile -O3 -I ../vendor/linenoise *.o repl.cc -o ../tails
+
+echo "Building 'tails_bench' benchmarks ..."
+$compile -O3 *.o bench.cc -o ../tails_bench
 rm *.o
 
 echo "Done."
@@ -0,0 +1,460 @@
+//
+// bench.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmarks of the interpreter, compiler and garbage collector.
+//
+// Each benchmark runs a fixed workload several times and reports its fastest run, as one line of
+// JSON per benchmark, so results can be compared between builds:
+//
+//   tails_bench [--repeat N] [BENCHMARK ...]
+//
+// `ops` counts the workload's natural unit (calls, loop iterations, tokens, objects.) Where the
+// number of Tails instructions dispatched is known, `instructions_per_sec` gives the VM's speed.
+
+#include "compiler.hh"
+#include "continuation.hh"
+#include "core_words.hh"
+#include "gc.hh"
+#include "interpreter.hh"
+#include "invocation.hh"
+#include "more_words.hh"
+#include "native_tier.hh"
+#include "stack_effect_parser.hh"
+#include "typed_word.hh"
+#include "vocabulary.hh"
+#include "word_cache.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace tails;
+using namespace tails::core_words;
+
+
+#ifdef ENABLE_TRACING
+namespace tails {
+    void TRACE(Value *sp, const Instruction *pc) { }
+}
+#endif
+
+
+#pragma mark - UTILITIES:
+
+
+/// Compiles a named word and adds it to the current vocabulary.
+static const Word& define(const char *name, const char *effect, const char *source,
+                          size_t inlineBudget = Compiler::kDefaultInlineBudget,
+                          ProfileMode profiling = ProfileMode::None) {
+    Compiler compiler{string(name)};
+    compiler.setStackEffect(parseStackEffect(effect));
+    compiler.setInlineBudget(inlineBudget);
+    compiler.setProfiling(profiling);
+    compiler.parse(string(source));
+    return *new CompiledWord(move(compiler));
+}
+
+
+/// Counts the instructions dispatched when running straight through code from `pc` until it
+/// returns or branches backwards, i.e. one iteration of a loop. Conditional branches are taken
+/// only if `takeBranches` is true. The instructions of interpreted words it calls are included,
+/// but not those of recursive calls.
+static size_t pathLength(const Instruction *pc, bool takeBranches = false) {
+    size_t count = 0;
+    while (true) {
+        const Word *op = Compiler::activeVocabularies().lookup(*pc);
+        assert(op && op->isNative());
+        ++count;
+        if (*op == _RETURN)
+            return count;
+        if (op->hasWordParams()) {
+            bool isTail = false;
+            for (auto tail : kInterpWords[1])
+                isTail = isTail || (*op == *tail);
+            for (int p = 1; p <= op->parameters(); ++p)
+                count += pathLength(pc[p].word);
+            if (isTail)
+                return count;
+        } else if (op->hasIntParams() && *op != _RECURSE && *op != _RECURSE_METERED) {
+            // A branch's offset is relative to its parameter, minus one: see `_BRANCH`.
+            intptr_t offset = pc[1].offset;
+            if ((*op == _BRANCH || *op == _LOOP) && offset < 0)
+                return count;
+            if (*op == _BRANCH || takeBranches) {
+                pc += 2 + offset;
+                continue;
+            }
+        }
+        pc += 1 + op->parameters();
+    }
+}
+
+
+/// Counts the instructions in one iteration of a word's (first) loop.
+static size_t loopLength(const Word &word) {
+    for (const Instruction *pc = word.instruction().word; ; ) {
+        const Word *op = Compiler::activeVocabularies().lookup(*pc);
+        assert(op && op->isNative() && *op != _RETURN);
+        if ((*op == _BRANCH || *op == _LOOP) && pc[1].offset < 0)
+            return pathLength(pc + 2 + pc[1].offset);
+        pc += 1 + op->parameters();
+    }
+}
+
+
+/// What one run of a benchmark did.
+struct Workload {
+    double ops;                 // Number of operations, in the benchmark's unit
+    double instructions = 0;    // Number of Tails instructions dispatched, if known
+};
+
+
+struct Benchmark {
+    const char*              name;
+    const char*              unit;
+    function<Workload()>     run;
+};
+
+
+static void report(const Benchmark &bench, const Workload &work, double seconds, size_t allocs) {
+    ostringstream out;
+    out.precision(6);
+    out << "{\"benchmark\":\"" << bench.name << "\",\"unit\":\"" << bench.unit << "\""
+        << ",\"ops\":" << work.ops
+        << ",\"seconds\":" << seconds
+        << ",\"ns_per_op\":" << (seconds / work.ops * 1e9)
+        << ",\"ops_per_sec\":" << (work.ops / seconds)
+        << ",\"instructions_per_sec\":";
+    if (work.instructions > 0)
+        out << (work.instructions / seconds);
+    else
+        out << "null";
+    out << ",\"allocs_per_op\":" << (allocs / work.ops) << "}\n";
+    cout << out.str() << flush;
+}
+
+
+#pragma mark - BENCHMARKS:
+
+
+static vector<Benchmark> makeBenchmarks(Interpreter &interpreter) {
+    vector<Benchmark> benchmarks;
+
+    // Doubly-recursive Fibonacci, exercising `_RECURSE` (and the GuardedStack it runs on.)
+    {
+        auto &fib = define("fib", "# -- #", "DUP 2 >= IF DUP 1 - RECURSE SWAP 2 - RECURSE + THEN");
+        auto fibFn = make_shared<Invocation>(interpreter.prepare(fib));
+        // Calls with n < 2 take the IF's branch; the others fall through it.
+        size_t baseLen = pathLength(fib.instruction().word, true);
+        size_t recurseLen = pathLength(fib.instruction().word, false);
+        constexpr int n = 27;
+        double fibs[n + 2] = {0, 1};
+        for (int i = 2; i < n + 2; ++i)
+            fibs[i] = fibs[i - 1] + fibs[i - 2];
+        // fib(n) makes fib(n+1) calls with n < 2, and one fewer calls that recurse:
+        double base = fibs[n + 1], recursive = base - 1;
+        Workload work {base + recursive, base * baseLen + recursive * recurseLen};
+        benchmarks.push_back({"fib", "call", [=] {
+            Value result = (*fibFn)({Value(n)});
+            assert(result == Value(fibs[n]));
+            return work;
+        }});
+    }
+
+    // A tight BEGIN/WHILE loop of native words.
+    {
+        auto &sum = define("sumloop", "# -- #",
+                           "0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP");
+        auto sumFn = make_shared<Invocation>(interpreter.prepare(sum));
+        size_t len = loopLength(sum);
+        benchmarks.push_back({"while_loop", "iteration", [=] {
+            constexpr double n = 10'000'000;
+            Value result = (*sumFn)({Value(n)});
+            assert(result == Value(n * (n + 1) / 2));
+            return Workload{n, n * len};
+        }});
+    }
+
+    // The same sum as a DO/LOOP, whose index is kept off the data stack.
+    {
+        auto &sum = define("doloop", "# -- #", "0 SWAP 1 + 1 DO I + LOOP");
+        auto sumFn = make_shared<Invocation>(interpreter.prepare(sum));
+        size_t len = loopLength(sum);
+        benchmarks.push_back({"do_loop", "iteration", [=] {
+            constexpr double n = 10'000'000;
+            Value result = (*sumFn)({Value(n)});
+            assert(result == Value(n * (n + 1) / 2));
+            return Workload{n, n * len};
+        }});
+    }
+
+    // The BEGIN/WHILE sum compiled with fuel metering, run as a Continuation that suspends
+    // every 10,000 iterations, as a scheduler giving it time slices would.
+    {
+        interpreter.metering = true;
+        auto &sum = define("msumloop", "# -- #",
+                           "0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP");
+        interpreter.metering = false;
+        size_t len = loopLength(sum);
+        benchmarks.push_back({"while_loop_metered", "iteration", [&interpreter, &sum, len] {
+            constexpr double n = 10'000'000;
+            Continuation cont(sum, interpreter, {Value(n)});
+            while (!cont.resume(10'000))
+                ;
+            Value result = cont.stack()[0];
+            assert(result == Value(n * (n + 1) / 2));
+            return Workload{n, n * len};
+        }});
+    }
+
+    // Fibonacci and the BEGIN/WHILE sum again, promoted to native code. (The instruction counts
+    // are left out, since native code doesn't dispatch them.)
+    if (NativeTier::kAvailable) {
+        auto &fib = define("nfib", "# -- #", "DUP 2 >= IF DUP 1 - RECURSE SWAP 2 - RECURSE + THEN",
+                           Compiler::kDefaultInlineBudget, ProfileMode::Counts);
+        auto &sum = define("nsumloop", "# -- #",
+                           "0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP",
+                           Compiler::kDefaultInlineBudget, ProfileMode::Counts);
+        if (!NativeTier::promote(fib) || !NativeTier::promote(sum))
+            throw runtime_error("couldn't promote the native benchmarks");
+        auto fibFn = make_shared<Invocation>(interpreter.prepare(fib));
+        auto sumFn = make_shared<Invocation>(interpreter.prepare(sum));
+        constexpr int n = 27;
+        double fibs[n + 2] = {0, 1};
+        for (int i = 2; i < n + 2; ++i)
+            fibs[i] = fibs[i - 1] + fibs[i - 2];
+        double calls = 2 * fibs[n + 1] - 1;
+        benchmarks.push_back({"fib_native", "call", [=] {
+            Value result = (*fibFn)({Value(n)});
+            assert(result == Value(fibs[n]));
+            return Workload{calls};
+        }});
+        benchmarks.push_back({"while_loop_native", "iteration", [=] {
+            constexpr double n = 10'000'000;
+            Value result = (*sumFn)({Value(n)});
+            assert(result == Value(n * (n + 1) / 2));
+            return Workload{n};
+        }});
+    }
+
+    // Fibonacci and the BEGIN/WHILE sum again, translated to the typed cores, whose stacks hold
+    // raw numbers. The translation is one for one, so the instruction counts are the same.
+    {
+        auto &fib = define("tfib", "# -- #", "DUP 2 >= IF DUP 1 - RECURSE SWAP 2 - RECURSE + THEN");
+        auto &sum = define("tsumloop", "# -- #",
+                           "0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP");
+        size_t baseLen = pathLength(fib.instruction().word, true);
+        size_t recurseLen = pathLength(fib.instruction().word, false);
+        size_t sumLen = loopLength(sum);
+        constexpr int n = 27;
+        double fibs[n + 2] = {0, 1};
+        for (int i = 2; i < n + 2; ++i)
+            fibs[i] = fibs[i - 1] + fibs[i - 2];
+        double base = fibs[n + 1], recursive = base - 1;
+        Workload fibWork {base + recursive, base * baseLen + recursive * recurseLen};
+
+        auto addTyped = [&](auto policy, const char *fibName, const char *sumName) {
+            using Policy = decltype(policy);
+            using Slot = typename Policy::Slot;
+            auto fibT = make_shared<TypedWord<Policy>>(fib);
+            auto sumT = make_shared<TypedWord<Policy>>(sum);
+            if (!fibT->isTranslated() || !sumT->isTranslated())
+                throw runtime_error("couldn't translate the typed benchmarks");
+            Slot fibN = Slot(fibs[n]);
+            benchmarks.push_back({fibName, "call", [=] {
+                Slot result = fibT->run({n})[0];
+                assert(result == fibN);
+                (void)result;
+                return fibWork;
+            }});
+            benchmarks.push_back({sumName, "iteration", [=] {
+                constexpr Slot n = 10'000'000;
+                Slot result = sumT->run({n})[0];
+                assert(result == n * (n + 1) / 2);
+                (void)result;
+                return Workload{double(n), double(n) * sumLen};
+            }});
+        };
+        addTyped(Int64Policy{}, "fib_int64", "while_loop_int64");
+    }
+
+    // Calls to interpreted words, compiled into `_INTERP4`. (Without automatic inlining, which
+    // would otherwise inline them.)
+    {
+        define("inc", "# -- #", "1 +");
+        define("dec", "# -- #", "1 -");
+        auto &chain = define("chain4", "# # -- # #", "BEGIN DUP WHILE SWAP inc dec inc inc SWAP 1 - REPEAT", 0);
+        auto chainFn = make_shared<Invocation>(interpreter.prepare(chain));
+        size_t len = loopLength(chain);
+        benchmarks.push_back({"interp4_calls", "call", [=] {
+            constexpr double n = 2'000'000;
+            Value out[2];
+            chainFn->run({Value(0), Value(n)}, out);
+            assert(out[0] == Value(2 * n));
+            return Workload{4 * n, n * len};
+        }});
+    }
+
+    // Scoring each item of a big array with MAP, and with PMAP, which splits it between threads.
+    {
+        auto &score = define("score", "[] -- []", "{(# -- #) DUP * 3 * 7 + 1000 MOD} MAP");
+        auto &pscore = define("pscore", "[] -- []", "{(# -- #) DUP * 3 * 7 + 1000 MOD} PMAP");
+        constexpr size_t n = 1'000'000;
+        for (auto word : {&score, &pscore}) {
+            auto fn = make_shared<Invocation>(interpreter.prepare(*word));
+            benchmarks.push_back({word == &score ? "map_score" : "pmap_score", "item", [=] {
+                vector<Value> items(n);
+                for (size_t i = 0; i < n; ++i)
+                    items[i] = Value(double(i));
+                Value result = (*fn)({Value(move(items))});
+                assert(result.length() == Value(n));
+                return Workload{double(n)};
+            }});
+        }
+    }
+
+    // Building a string with `+`.
+    {
+        auto &build = define("buildstr", "# -- str",
+                             R"("" SWAP BEGIN DUP WHILE SWAP "xyz" + SWAP 1 - REPEAT DROP)");
+        auto buildFn = make_shared<Invocation>(interpreter.prepare(build));
+        size_t len = loopLength(build);
+        benchmarks.push_back({"string_append", "append", [=] {
+            constexpr double n = 1000, reps = 200;
+            for (int i = 0; i < reps; ++i) {
+                Value result = (*buildFn)({Value(n)});
+                assert(result.length() == 3 * n);
+            }
+            return Workload{n * reps, n * reps * len};
+        }});
+    }
+
+    // Building an array with `+`.
+    {
+        auto &build = define("buildarr", "# -- array", R"([ ] SWAP BEGIN DUP WHILE SWAP "item" + SWAP 1 - REPEAT DROP)");
+        auto buildFn = make_shared<Invocation>(interpreter.prepare(build));
+        size_t len = loopLength(build);
+        benchmarks.push_back({"array_append", "append", [=] {
+            constexpr double n = 1000, reps = 200;
+            for (int i = 0; i < reps; ++i) {
+                Value result = (*buildFn)({Value(n)});
+                assert(result.length() == n);
+            }
+            return Workload{n * reps, n * reps * len};
+        }});
+    }
+
+    // Parsing and compiling a large generated source: a long chain of arithmetic and IFs.
+    {
+        auto source = make_shared<string>();
+        size_t tokens = 1;
+        *source = "0";
+        for (int i = 0; i < 500; ++i) {
+            *source += " DUP 3 > IF 1 + ELSE 2 * THEN 1 - ";
+            tokens += 10;
+        }
+        benchmarks.push_back({"compile", "token", [=] {
+            constexpr int reps = 10;
+            for (int i = 0; i < reps; ++i) {
+                Compiler compiler;
+                compiler.parse(*source);
+                CompiledWord word(move(compiler));
+            }
+            return Workload{double(tokens * reps)};
+        }});
+        // The same source again, found in a WordCache after the first time:
+        auto cache = make_shared<WordCache>(interpreter);
+        benchmarks.push_back({"compile_cached", "token", [=] {
+            constexpr int reps = 1000;
+            for (int i = 0; i < reps; ++i)
+                cache->compile(*source, nullptr, nullptr);
+            return Workload{double(tokens * reps)};
+        }});
+    }
+
+    // A major collection sweeping a big heap, half of which is garbage.
+    {
+        benchmarks.push_back({"gc_sweep", "object", [] {
+            constexpr size_t n = 200'000;
+            vector<Value> live;
+            live.reserve(n / 2);
+            for (size_t i = 0; i < n; ++i) {
+                Value str("a string too long to fit inline");
+                if (i % 2)
+                    live.push_back(str);
+            }
+            gc::object::beginCollection(false);
+            Compiler::activeVocabularies().gcScan();
+            gc::object::scanStack(&live.front(), &live.back());
+            auto [kept, freed] = gc::object::sweep();
+            assert(kept >= n / 2 && freed >= n / 2);
+            return Workload{double(n)};
+        }});
+    }
+
+    return benchmarks;
+}
+
+
+#pragma mark - MAIN:
+
+
+int main(int argc, const char **argv) {
+    Interpreter interpreter;
+    Interpreter::Using using_(interpreter);
+    Vocabulary defaultVocab(word::kWords);
+    Compiler::activeVocabularies().push(defaultVocab);
+    Compiler::activeVocabularies().setCurrent(defaultVocab);
+
+    int repeat = 5;
+    vector<string> selected;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = max(1, atoi(argv[++i]));
+        else
+            selected.emplace_back(argv[i]);
+    }
+
+    auto benchmarks = makeBenchmarks(interpreter);
+    for (auto &bench : benchmarks) {
+        if (!selected.empty() && find(selected.begin(), selected.end(), bench.name) == selected.end())
+            continue;
+        bench.run();                                    // warm up
+        double best = INFINITY;
+        Workload work;
+        size_t allocs = 0;
+        for (int i = 0; i < repeat; ++i) {
+            size_t allocsBefore = gc::object::allocationCount();
+            auto start = chrono::steady_clock::now();
+            work = bench.run();
+            chrono::duration<double> time = chrono::steady_clock::now() - start;
+            if (time.count() < best) {
+                best = time.count();
+                allocs = gc::object::allocationCount() - allocsBefore;
+            }
+        }
+        report(bench, work, best, allocs);
+    }
+    return 0;
+}
@@ -0,0 +1,411 @@
+//
+// batch.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "batch.hh"
+#include "core_words.hh"
+#include "gc.hh"
+#include "guarded_stack.hh"
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+
+namespace tails {
+    using namespace std;
+    using namespace tails::core_words;
+
+
+#pragma mark - DECODING:
+
+
+    /// One vectorized operation. Superinstructions decode into several of these.
+    struct Batch::Step {
+        enum Kind : uint8_t {
+            Literal,        // Pushes `literal`
+            Dup, Drop, Swap, Over, Rot,
+            Binary,         // (x y -- x `op` y)
+            LitBinary,      // (x -- x `op` literal)
+            Length,
+            Branch,         // Jumps to step `target`
+            ZBranch,        // (x -- ) Jumps to step `target` if x is falsey
+            Return,
+        };
+
+        Kind     kind = Return;
+        ArithOp  op = ArithOp::Plus;
+        bool     numeric = false;   // Operands are known to be numbers (a `_NUM` word)
+        Value    literal = NullValue;
+        uint32_t target = 0;        // Branch destination; a PC until the end of decoding
+    };
+
+
+    // Appends the steps equivalent to the instruction at `pc`, whose PC offset in its word is
+    // `pcOffset`. Returns the number of instructions (op plus parameters) it occupies, or 0 if it
+    // has no vectorized form.
+    size_t Batch::decode(const Instruction *pc, uint32_t pcOffset, vector<Step> &steps) {
+        auto add = [&](Step::Kind kind) -> Step& {
+            Step &step = steps.emplace_back();
+            step.kind = kind;
+            return step;
+        };
+        // A branch's offset is relative to its parameter, minus one: see `_BRANCH`.
+        auto branchTarget = [&] {return uint32_t(pcOffset + 2 + pc[1].offset);};
+
+        const Instruction op = *pc;
+        if (op == _LITERAL)             add(Step::Literal).literal = pc[1].literal;
+        else if (op == ZERO)            add(Step::Literal).literal = Value(0);
+        else if (op == ONE)             add(Step::Literal).literal = Value(1);
+        else if (op == NULL_)           add(Step::Literal).literal = NullValue;
+        else if (op == DUP)             add(Step::Dup);
+        else if (op == DROP)            add(Step::Drop);
+        else if (op == SWAP)            add(Step::Swap);
+        else if (op == OVER)            add(Step::Over);
+        else if (op == ROT)             add(Step::Rot);
+        else if (op == _OVER2)          {add(Step::Over); add(Step::Over);}
+        else if (op == LENGTH)          add(Step::Length);
+        else if (op == _BRANCH)         add(Step::Branch).target = branchTarget();
+        else if (op == _ZBRANCH || op == _ZBRANCH_NUM)
+                                        add(Step::ZBranch).target = branchTarget();
+        else if (op == _DUP_ZBRANCH)    {add(Step::Dup); add(Step::ZBranch).target = branchTarget();}
+        else if (op == _DUPMULT || op == _DUPMULT_NUM) {
+            add(Step::Dup);
+            Step &step = add(Step::Binary);
+            step.op = ArithOp::Mult;
+            step.numeric = (op == _DUPMULT_NUM);
+        } else if (op == _EQZ_ZBRANCH) {
+            // Branches if nonzero, i.e. `0= 0BRANCH`:
+            Step &step = add(Step::LitBinary);
+            step.op = ArithOp::Eq;
+            step.literal = Value(0);
+            add(Step::ZBranch).target = branchTarget();
+        } else if (op == _RETURN) {
+            add(Step::Return);
+        } else {
+            auto aw = lookupArithWord(op);
+            if (!aw)
+                return 0;
+            using F = ArithForm;
+            if (aw->form == F::DupWithLiteral)
+                add(Step::Dup);
+            Step &step = add((aw->form == F::Binary || aw->form == F::Branch) ? Step::Binary
+                                                                              : Step::LitBinary);
+            step.op = aw->op;
+            step.numeric = aw->numeric;
+            if (aw->form == F::WithLiteral || aw->form == F::DupWithLiteral)
+                step.literal = pc[1].literal;
+            else if (aw->form == F::WithZero)
+                step.literal = Value(0);
+            if (aw->form == F::Branch)
+                add(Step::ZBranch).target = branchTarget();
+            return (aw->form == F::Binary || aw->form == F::WithZero) ? 1 : 2;
+        }
+        return 1 + (op == _LITERAL || op == _BRANCH || op == _ZBRANCH || op == _ZBRANCH_NUM
+                    || op == _DUP_ZBRANCH || op == _EQZ_ZBRANCH);
+    }
+
+
+    Batch::Batch(const Word &word)
+    :_word(word)
+    {
+        assert(!word.isNative());
+        StackEffect effect = word.stackEffect();
+        if (effect.isWeird() || effect.maxIsUnknown())
+            return;
+
+        // Decode the instructions, remembering which step each one starts at:
+        vector<uint32_t> stepAtPC;
+        const Instruction *start = word.instruction().word;
+        for (const Instruction *pc = start; ; ) {
+            bool isReturn = (*pc == _RETURN);
+            auto pcOffset = uint32_t(pc - start);
+            stepAtPC.resize(pcOffset + 1, UINT32_MAX);
+            stepAtPC[pcOffset] = uint32_t(_steps.size());
+            size_t len = decode(pc, pcOffset, _steps);
+            if (len == 0) {
+                _steps.clear();
+                return;                 // Not vectorizable
+            }
+            pc += len;
+            if (isReturn)
+                break;
+        }
+
+        // Convert branch targets from PCs to step indices:
+        for (Step &step : _steps) {
+            if (step.kind == Step::Branch || step.kind == Step::ZBranch) {
+                assert(step.target < stepAtPC.size() && stepAtPC[step.target] != UINT32_MAX);
+                step.target = stepAtPC[step.target];
+            }
+        }
+        _vectorized = true;
+    }
+
+
+    Batch::~Batch() = default;
+
+
+#pragma mark - RUNNING:
+
+
+    Batch::Results Batch::run(const vector<Column> &inputs, size_t rowCount) const {
+        if (inputs.size() != _word.stackEffect().inputCount())
+            throw invalid_argument("Wrong number of input columns");
+        if (rowCount == 0)
+            return Results(_word.stackEffect().outputCount());
+        else if (_vectorized)
+            return runVectorized(inputs, rowCount);
+        else
+            return runScalar(inputs, rowCount);
+    }
+
+
+    namespace {
+
+        /// The set of rows that have reached the same step, all with the same stack depth.
+        struct Rows {
+            vector<uint32_t> rows;
+            size_t           depth = 0;
+
+            // Calls `fn` on each row. If all the rows are present, it loops over them directly,
+            // which the C++ compiler can vectorize.
+            template <class Fn>
+            void forEach(size_t rowCount, Fn fn) const {
+                if (rows.size() == rowCount) {
+                    for (uint32_t r = 0; r < rowCount; ++r)
+                        fn(r);
+                } else {
+                    for (uint32_t r : rows)
+                        fn(r);
+                }
+            }
+        };
+
+
+        // Applies `op` to column `x` and operand `y` (a column or a constant), leaving the
+        // results in `x`.
+        template <bool Numeric, class Y>
+        void applyArith(ArithOp op, Value *x, Y y, const Rows &rows, size_t rowCount) {
+            #define ARITH_CASE(OP, INFIXOP) \
+                case ArithOp::OP: \
+                    if constexpr (Numeric) \
+                        rows.forEach(rowCount, [=](uint32_t r) { \
+                            x[r] = Value(x[r].asDouble() INFIXOP y(r).asDouble());}); \
+                    else \
+                        rows.forEach(rowCount, [=](uint32_t r) {x[r] = Value(x[r] INFIXOP y(r));}); \
+                    break;
+            // Numbers are compared for equality bitwise, so those just use `Value`'s operators:
+            #define EQUALITY_CASE(OP, INFIXOP) \
+                case ArithOp::OP: \
+                    rows.forEach(rowCount, [=](uint32_t r) {x[r] = Value(x[r] INFIXOP y(r));}); \
+                    break;
+            switch (op) {
+                ARITH_CASE(Plus,  +)
+                ARITH_CASE(Minus, -)
+                ARITH_CASE(Mult,  *)
+                ARITH_CASE(Div,   /)
+                EQUALITY_CASE(Eq, ==)
+                EQUALITY_CASE(Ne, !=)
+                ARITH_CASE(Gt,    >)
+                ARITH_CASE(Ge,    >=)
+                ARITH_CASE(Lt,    <)
+                ARITH_CASE(Le,    <=)
+                case ArithOp::Mod:
+                    rows.forEach(rowCount, [=](uint32_t r) {x[r] = Value(x[r] % y(r));});
+                    break;
+            }
+            #undef ARITH_CASE
+            #undef EQUALITY_CASE
+        }
+
+        template <class Y>
+        void applyArith(ArithOp op, bool numeric, Value *x, Y y, const Rows &rows,
+                        size_t rowCount) {
+            if (numeric)
+                applyArith<true>(op, x, y, rows, rowCount);
+            else
+                applyArith<false>(op, x, y, rows, rowCount);
+        }
+
+    }
+
+
+    Batch::Results Batch::runVectorized(const vector<Column> &inputs, size_t rowCount) const {
+        StackEffect effect = _word.stackEffect();
+        size_t nInputs = inputs.size();
+
+        // Each stack slot is a column. (The stack checker computed the maximum depth.)
+        vector<vector<Value>> slots(nInputs + effect.max() + 1, vector<Value>(rowCount));
+        for (size_t i = 0; i < nInputs; ++i) {
+            Value *slot = slots[i].data();
+            for (size_t r = 0; r < rowCount; ++r)
+                slot[r] = inputs[i][r];
+        }
+
+        // Rows waiting to run, keyed by step index. Always running the lowest step first lets
+        // rows that took different paths through the code merge before continuing.
+        map<uint32_t, Rows> pending;
+        {
+            Rows all;
+            all.depth = nInputs;
+            all.rows.resize(rowCount);
+            for (uint32_t r = 0; r < rowCount; ++r)
+                all.rows[r] = r;
+            pending.emplace(0, move(all));
+        }
+        auto schedule = [&](uint32_t step, Rows &&rows) {
+            if (rows.rows.empty())
+                return;
+            auto [i, added] = pending.try_emplace(step, move(rows));
+            if (!added) {
+                assert(i->second.depth == rows.depth);      // the stack checker ensures this
+                i->second.rows.insert(i->second.rows.end(), rows.rows.begin(), rows.rows.end());
+            }
+        };
+
+        while (!pending.empty()) {
+            uint32_t s = pending.begin()->first;
+            Rows rows = move(pending.begin()->second);
+            pending.erase(pending.begin());
+
+            // Run steps until reaching a branch or the end:
+            for (bool running = true; running; ++s) {
+                const Step &step = _steps[s];
+                size_t &d = rows.depth;
+                auto slot = [&](size_t i) {return slots[d - 1 - i].data();};    // 0 is top
+                switch (step.kind) {
+                    case Step::Literal: {
+                        Value *dst = slots[d++].data();
+                        Value lit = step.literal;
+                        rows.forEach(rowCount, [=](uint32_t r) {dst[r] = lit;});
+                        break;
+                    }
+                    case Step::Dup: {
+                        Value *src = slot(0), *dst = slots[d++].data();
+                        rows.forEach(rowCount, [=](uint32_t r) {dst[r] = src[r];});
+                        break;
+                    }
+                    case Step::Drop:
+                        --d;
+                        break;
+                    case Step::Swap: {
+                        Value *a = slot(1), *b = slot(0);
+                        rows.forEach(rowCount, [=](uint32_t r) {std::swap(a[r], b[r]);});
+                        break;
+                    }
+                    case Step::Over: {
+                        Value *src = slot(1), *dst = slots[d++].data();
+                        rows.forEach(rowCount, [=](uint32_t r) {dst[r] = src[r];});
+                        break;
+                    }
+                    case Step::Rot: {
+                        Value *a = slot(2), *b = slot(1), *c = slot(0);
+                        rows.forEach(rowCount, [=](uint32_t r) {
+                            Value tmp = a[r]; a[r] = b[r]; b[r] = c[r]; c[r] = tmp;
+                        });
+                        break;
+                    }
+                    case Step::Binary: {
+                        const Value *y = slot(0);
+                        applyArith(step.op, step.numeric, slot(1), [=](uint32_t r) {return y[r];},
+                                   rows, rowCount);
+                        --d;
+                        break;
+                    }
+                    case Step::LitBinary: {
+                        Value lit = step.literal;
+                        applyArith(step.op, step.numeric, slot(0), [=](uint32_t) {return lit;},
+                                   rows, rowCount);
+                        break;
+                    }
+                    case Step::Length: {
+                        Value *x = slot(0);
+                        rows.forEach(rowCount, [=](uint32_t r) {x[r] = x[r].length();});
+                        break;
+                    }
+                    case Step::Branch:
+                        schedule(step.target, move(rows));
+                        running = false;
+                        break;
+                    case Step::ZBranch: {
+                        // Split the rows by the condition; both sets run when their turn comes.
+                        const Value *cond = slots[--d].data();
+                        Rows taken, notTaken;
+                        taken.depth = notTaken.depth = d;
+                        for (uint32_t r : rows.rows)
+                            (cond[r] ? notTaken : taken).rows.push_back(r);
+                        schedule(step.target, move(taken));
+                        schedule(s + 1, move(notTaken));
+                        running = false;
+                        break;
+                    }
+                    case Step::Return:
+                        // The outputs are now at the bottom of the stack, where they'll stay
+                        // since other rows only write to their own entries.
+                        assert(d == effect.outputCount());
+                        running = false;
+                        break;
+                }
+            }
+        }
+
+        slots.resize(effect.outputCount());
+        return slots;
+    }
+
+
+    // Runs the word with the regular interpreter, one row at a time.
+    Batch::Results Batch::runScalar(const vector<Column> &inputs, size_t rowCount) const {
+        StackEffect effect = _word.stackEffect();
+        size_t nInputs = inputs.size(), nOutputs = effect.outputCount();
+        // A recursive word runs on a GuardedStack, which turns overflow into an exception:
+        unique_ptr<GuardedStack> guarded;
+        vector<Value> stack;
+        Value *base;
+        if (effect.maxIsUnknown()) {
+            guarded = make_unique<GuardedStack>();
+            base = guarded->base();
+        } else {
+            stack.resize(kStackSlop + nInputs + effect.max());
+            base = &stack[kStackSlop];
+        }
+        // The word's safepoints mustn't collect garbage; that would free the results of previous
+        // rows. Without a gc::Execution scope they don't, and GuardedStack::run's own scope is
+        // kept from collecting by nesting it inside this one.
+        optional<gc::Execution> noCollection;
+        if (guarded)
+            noCollection.emplace(_word, base);
+        Results results(nOutputs, vector<Value>(rowCount));
+        for (size_t r = 0; r < rowCount; ++r) {
+            for (size_t i = 0; i < nInputs; ++i)
+                base[i] = inputs[i][r];
+            Value *sp;
+            if (guarded)
+                sp = guarded->run(_word, base + nInputs - 1);
+            else
+                sp = call(base + nInputs - 1, _word.instruction().word);
+            assert(sp == base + nOutputs - 1);
+            (void)sp;
+            for (size_t i = 0; i < nOutputs; ++i)
+                results[i][r] = base[i];
+        }
+        return results;
+    }
+
+}
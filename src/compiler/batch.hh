@@ -0,0 +1,79 @@
+//
+// batch.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "word.hh"
+#include <vector>
+
+
+namespace tails {
+
+    /// Runs an interpreted word over many rows of input at once, as in a database query.
+    ///
+    /// Instead of calling the word once per row, each instruction is applied to a whole column of
+    /// rows before going on to the next, so the cost of dispatching it is paid once per batch.
+    /// Every stack slot becomes a column, indexed by the stack depth the compiler's stack checker
+    /// has verified. A conditional branch splits the rows into those that take it and those that
+    /// don't; the rows reaching the same instruction are merged again, so the branches of an IF,
+    /// or the iterations of a loop, run together.
+    ///
+    /// Words using instructions with no vectorized form, such as `RECURSE`, `CALL`, or calls to
+    /// other interpreted words, are instead run one row at a time by the regular interpreter.
+    /// A recursive word then runs on a GuardedStack, so overflowing it throws `stack_overflow`.
+    ///
+    /// No garbage is collected while a batch runs.
+    class Batch {
+    public:
+        /// A column of input values: either `Value`s or raw `double`s.
+        struct Column {
+            Column(const Value *v)                      :values(v) { }
+            Column(const double *d)                     :numbers(d) { }
+            Value operator[] (size_t row) const    {return values ? values[row] : Value(numbers[row]);}
+
+            const Value*  values = nullptr;
+            const double* numbers = nullptr;
+        };
+
+        using Results = std::vector<std::vector<Value>>;
+
+        /// Prepares to run `word`, which must be interpreted and must outlive this object.
+        explicit Batch(const Word &word);
+        ~Batch();
+
+        /// True if the word will run vectorized; false if it falls back to running each row.
+        bool isVectorized() const                       {return _vectorized;}
+
+        /// Runs the word on `rowCount` rows. `inputs` has one column per input in the word's
+        /// stack effect, in stack order (bottom first), each with at least `rowCount` items.
+        /// Returns one column of results per output, also bottom first.
+        Results run(const std::vector<Column> &inputs, size_t rowCount) const;
+
+    private:
+        struct Step;
+
+        static size_t decode(const Instruction*, uint32_t pcOffset, std::vector<Step>&);
+
+        Results runVectorized(const std::vector<Column>&, size_t rowCount) const;
+        Results runScalar(const std::vector<Column>&, size_t rowCount) const;
+
+        const Word&       _word;
+        std::vector<Step> _steps;       // Decoded instructions, if vectorizable
+        bool              _vectorized = false;
+    };
+
+}
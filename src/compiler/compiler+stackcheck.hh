@@ -53,6 +53,11 @@ namespace tails {
             return _stack[_stack.size() - 1 - i];
         }
 
+        /// The possible types of the item at depth `i`.
+        TypeSet typesAt(size_t i) const {
+            return itemTypes(at(i));
+        }
+
         optional<Value> literalAt(size_t i) const {
             if (i < depth()) {
                 if (auto valP = std::get_if<Value>(&at(i)); valP)
@@ -184,16 +189,12 @@ namespace tails {
         ,sourceCode(source)
         { }
 
-        void branchesTo(InstructionPos pos) {
-            branchTo = pos;
-            pos->isBranchDestination = true;
-        }
-
         const char*  sourceCode;                        // Points to source code where word appears
-        std::optional<EffectStack> knownStack;          // Stack effect at this point, once known
-        std::optional<InstructionPos> branchTo;         // Points to where a branch goes
+        std::optional<InstructionPos> branchTo;         // Index of where a branch goes
         int pc;                                         // Relative address during code-gen
         const Word* interpWord = nullptr;               // Which INTERP-family word to use
+        int8_t knownNumbers = -1;                       // # of top stack items known to be numbers,
+                                                        //   or -1 if not known (unreachable)
         bool isBranchDestination = false;               // True if a branch points here
     };
 
@@ -201,94 +202,207 @@ namespace tails {
 #pragma mark - COMPILER STACK CHECKER:
 
 
-    // Computes the stack effect of the word, throwing if it's inconsistent.
-    void Compiler::computeEffect() {
-        computeEffect(_words.begin(), EffectStack(_effect));
-    }
+    /// Computes a word's stack effect by dataflow analysis over its basic blocks.
+    ///
+    /// A basic block is a run of instructions that's only entered at its start and only left at
+    /// its end. The checker stores the simulated stack at the entry of each block, and keeps a
+    /// worklist of the blocks whose entry stack has changed. Processing a block runs its
+    /// instructions on a copy of its entry stack, then merges the result into the entry stacks of
+    /// its successors, queueing any that change. Merging only widens literals to types, and types
+    /// to unions of types, so this soon reaches a fixed point.
+    ///
+    /// The stack at the RETURN, merged from all paths, determines the word's outputs. Finally each
+    /// block is replayed once from its final entry stack, to find the maximum stack depth and to
+    /// note the operands known to be numbers.
+    class Compiler::StackChecker {
+    public:
+        explicit StackChecker(Compiler &compiler)
+        :_compiler(compiler)
+        ,_words(compiler._words)
+        ,_blockOf(_words.size())
+        {
+            // A block starts at the first instruction, at each branch destination, and after
+            // each branch:
+            bool startsBlock = true;
+            for (InstructionPos i = 0; i < _words.size(); ++i) {
+                if (startsBlock || _words[i].isBranchDestination)
+                    _blocks.push_back({i, i});
+                _blockOf[i] = uint32_t(_blocks.size() - 1);
+                _blocks.back().end = i + 1;
+                const Word *word = _words[i].word;
+                startsBlock = (word == &_BRANCH || word == &_ZBRANCH
+                               || word == &_DO || word == &_LOOP);
+            }
+        }
 
+        void run() {
+            enter(0, EffectStack(_compiler._effect));
+            while (!_worklist.empty()) {
+                auto b = _worklist.back();
+                _worklist.pop_back();
+                _blocks[b].queued = false;
+                runBlock(b);
+            }
 
-    // Subroutine that traces control flow, memoizing stack effects at each instruction.
-    // @param i  The item in `_words` to start at
-    // @param curStack  The known stack before the word at `i`
-    // @param finalEffect  The cumulative stack effect will be stored here.
-    // @throw compile_error if stack is inconsistent or there's an invalid branch offset.
-    void Compiler::computeEffect(InstructionPos i, EffectStack curStack)
-    {
-        while (true) {
-            assert(i != _words.end());
-            // Store (memoize) the current stack at i, or verify it matches a previously stored one:
-            if (i->knownStack) {
-                if (*i->knownStack == curStack)
-                    return;         // Nothing to do: already handled this control flow + types
-                else
-                    curStack.mergeWith(*i->knownStack, i->sourceCode);
+            // The stack when RETURN is reached determines the word's output effect.
+            StackEffect &effect = _compiler._effect;
+            if (_exit) {
+                _exit->checkOutputs(effect, _compiler._effectCanAddOutputs);
+                _compiler._effectCanAddOutputs = false;
             }
-            i->knownStack = curStack;
 
-            // apply the instruction's effect:
-            if (i->word == &_LITERAL) {
-                // A literal, just push it
-                curStack.add(i->param.literal);
-            } else {
-                // Determine the effect of a word:
-                StackEffect nextEffect = i->word->stackEffect();
-                if (nextEffect.isWeird()) {
-                    if (i->word == &_RECURSE) {
-                        if (_effectCanAddInputs || _effectCanAddOutputs)
-                            throw compile_error("RECURSE requires an explicit stack effect declaration",
-                                                i->sourceCode);
-                        nextEffect = _effect;
-                        if (!returnsImmediately(next(i))) {
-                            if (_flags & Word::Inline)
-                                throw compile_error("Illegal recursion in an inline word",
-                                                    i->sourceCode);
-                            nextEffect = nextEffect.withUnknownMax();   // non-tail recursion
-                        }
-                    } else if (i->word == &IFELSE) {
-                        nextEffect = effectOfIFELSE(i, curStack);
-                    } else {
-                        throw compile_error("Oops, don't know word's stack effect", i->sourceCode);
-                    }
+            // Replay each reachable block to find the max depth and the known numeric operands:
+            size_t maxGrowth = 0;
+            for (auto &block : _blocks) {
+                if (!block.entry)
+                    continue;       // unreachable
+                EffectStack stack = *block.entry;
+                for (auto i = block.begin; i < block.end; ++i) {
+                    _words[i].knownNumbers = countNumbers(stack);
+                    add(i, stack);
                 }
+                maxGrowth = max(maxGrowth, stack.maxGrowth());
+            }
+            if (maxGrowth > effect.max())
+                effect = effect.withMax(int(maxGrowth));
+        }
 
-                if (_effectCanAddInputs) {
-                    // We are parsing code with unknown inputs, i.e. a quotation. If the word being
-                    // called takes more inputs than are on the stack, make them inputs of this code.
-                    const auto nInputs = nextEffect.inputCount();
-                    auto nAvailable = curStack.depth();
-                    for (auto i = int(nAvailable); i < nInputs; ++i) {
-                        auto entry = nextEffect.inputs()[i];
-                        curStack.addAtBottom(entry);
-                        _effect.addInputAtBottom(entry);
-                    }
-                }
+    private:
+        struct Block {
+            InstructionPos begin, end;                  // Range of instructions in `_words`
+            optional<EffectStack> entry {};             // Stack on entry, once known
+            bool queued = false;                        // True if it's in the worklist
+        };
 
-                // apply the word's effect:
-                curStack.add(i->word, nextEffect, i->sourceCode);
+        // Simulates the instructions of a block, then passes the stack on to its successors.
+        void runBlock(size_t b) {
+            const Block &block = _blocks[b];
+            EffectStack stack = *block.entry;
+            for (auto i = block.begin; i < block.end; ++i)
+                add(i, stack);
+
+            const SourceWord &last = _words[block.end - 1];
+            if (last.word == &_RETURN) {
+                merge(_exit, stack, last.sourceCode);
+            } else if (last.word == &_BRANCH || last.word == &_ZBRANCH
+                                             || last.word == &_DO || last.word == &_LOOP) {
+                // (`_DO` may skip the loop, and `_LOOP` may exit it, so they're conditional.)
+                assert(last.branchTo);
+                // (The fall-through is queued last, so it's processed first.)
+                enter(_blockOf[*last.branchTo], stack);
+                if (last.word != &_BRANCH)
+                    enter(b + 1, stack);
+            } else {
+                enter(b + 1, stack);
             }
+        }
 
-            if (i->word == &_RETURN) {
-                // The stack when RETURN is reached determines the word's output effect.
-                curStack.checkOutputs(_effect, _effectCanAddOutputs);
-                _effectCanAddOutputs = false;
-                if (curStack.maxGrowth() > _effect.max())
-                    _effect = _effect.withMax(int(curStack.maxGrowth()));
-                return;
+        // Merges a stack into a block's entry stack, and queues the block if that changed it.
+        void enter(size_t b, const EffectStack &stack) {
+            assert(b < _blocks.size());
+            Block &block = _blocks[b];
+            if (merge(block.entry, stack, _words[block.begin].sourceCode) && !block.queued) {
+                block.queued = true;
+                _worklist.push_back(b);
+            }
+        }
+
+        // Merges a stack into a stored one; returns true if the stored stack changed.
+        static bool merge(optional<EffectStack> &stored, const EffectStack &stack,
+                          const char *sourceCode) {
+            if (!stored) {
+                stored = stack;
+                return true;
+            } else if (*stored == stack) {
+                return false;
+            }
+            EffectStack merged = stack;
+            merged.mergeWith(*stored, sourceCode);
+            if (merged == *stored)
+                return false;
+            stored = move(merged);
+            return true;
+        }
 
-            } else if (i->word == &_BRANCH || i->word == &_ZBRANCH) {
-                assert(i->branchTo);
-                // If this is a 0BRANCH, recurse to follow the non-branch case too:
-                if (i->word == &_ZBRANCH)
-                    computeEffect(next(i), curStack);
+        // Applies the effect of the instruction at `i` to the stack.
+        // @throw compile_error if the stack is inconsistent with it.
+        void add(InstructionPos i, EffectStack &curStack) {
+            const SourceWord &w = _words[i];
+            if (w.word == &_LITERAL) {
+                // A literal, just push it
+                curStack.add(w.param.literal);
+                return;
+            }
 
-                // Follow the branch:
-                i = *i->branchTo;
+            // Determine the effect of a word:
+            Compiler &c = _compiler;
+            StackEffect nextEffect = w.word->stackEffect();
+            if (nextEffect.isWeird()) {
+                if (w.word == &_RECURSE) {
+                    if (c._effectCanAddInputs || c._effectCanAddOutputs)
+                        throw compile_error("RECURSE requires an explicit stack effect declaration",
+                                            w.sourceCode);
+                    nextEffect = c._effect;
+                    if (!c.returnsImmediately(i + 1)) {
+                        if (c._flags & Word::Inline)
+                            throw compile_error("Illegal recursion in an inline word",
+                                                w.sourceCode);
+                        nextEffect = nextEffect.withUnknownMax();   // non-tail recursion
+                    }
+                } else if (w.word == &IFELSE) {
+                    nextEffect = c.effectOfIFELSE(i, curStack);
+                } else if (w.word == &MAP || w.word == &FILTER || w.word == &REDUCE
+                                            || w.word == &EACH || w.word == &TIMES
+                                            || w.word == &PMAP || w.word == &PFILTER
+                                            || w.word == &PREDUCE) {
+                    nextEffect = c.effectOfCombinator(i, curStack);
+                } else {
+                    throw compile_error("Oops, don't know word's stack effect", w.sourceCode);
+                }
+            }
 
-            } else {
-                // Continue to next instruction:
-                ++i;
+            if (c._effectCanAddInputs) {
+                // We are parsing code with unknown inputs, i.e. a quotation. If the word being
+                // called takes more inputs than are on the stack, make them inputs of this code.
+                // They're below everything else, so they're added to every stack known so far.
+                const auto nInputs = nextEffect.inputCount();
+                for (auto d = int(curStack.depth()); d < nInputs; ++d) {
+                    auto entry = nextEffect.inputs()[d];
+                    curStack.addAtBottom(entry);
+                    c._effect.addInputAtBottom(entry);
+                    for (auto &block : _blocks)
+                        if (block.entry)
+                            block.entry->addAtBottom(entry);
+                    if (_exit)
+                        _exit->addAtBottom(entry);
+                }
             }
+
+            // apply the word's effect:
+            curStack.add(w.word, nextEffect, w.sourceCode);
         }
+
+        // The number of items at the top of the stack that are known to be numbers.
+        static int8_t countNumbers(const EffectStack &stack) {
+            int8_t n = 0;
+            while (n < INT8_MAX && n < stack.depth()
+                        && (stack.typesAt(n) - TypeSet(Value::ANumber)).typeFlags() == 0)
+                ++n;
+            return n;
+        }
+
+        Compiler&                   _compiler;
+        std::vector<SourceWord>&    _words;
+        std::vector<Block>          _blocks;            // The basic blocks, in code order
+        std::vector<uint32_t>       _blockOf;           // Maps instruction index to its block
+        std::vector<size_t>         _worklist;          // Blocks whose entry stack has changed
+        optional<EffectStack>       _exit;              // Stack at the RETURN, once known
+    };
+
+
+    // Computes the stack effect of the word, throwing if it's inconsistent.
+    void Compiler::computeEffect() {
+        StackChecker(*this).run();
     }
 
 
@@ -300,7 +414,7 @@ namespace tails {
                 if (auto quote = valP->asQuote(); quote)
                     return quote->stackEffect();
             }
-            throw compile_error("IFELSE must be preceded by two quotations", pos->sourceCode);
+            throw compile_error("IFELSE must be preceded by two quotations", _words[pos].sourceCode);
         };
         StackEffect a = getQuoteEffect(1), b = getQuoteEffect(0);
 
@@ -316,7 +430,7 @@ namespace tails {
                 entry = entry & result.inputs()[i];
                 if (!entry)
                     throw compile_error(format("IFELSE quotes have incompatible parameter #%d", i),
-                                        pos->sourceCode);
+                                        _words[pos].sourceCode);
                 result.inputs()[i] = entry;
             } else {
                 result.addInput(entry);
@@ -340,4 +454,86 @@ namespace tails {
         return result.withMax( max(0, max(a.max(), b.max()) - 3) );
     }
 
+
+    StackEffect Compiler::effectOfCombinator(InstructionPos pos, EffectStack &curStack) {
+        // Special case for MAP, FILTER, REDUCE, EACH and TIMES, whose effects depend on the
+        // quotation they call once per array item (or per count.) It must be a literal quotation value (not just a type):
+        const Word *word = _words[pos].word;
+        const char *sourceCode = _words[pos].sourceCode;
+        StackEffect q;
+        const Word *quote = nullptr;
+        if (auto valP = curStack.literalAt(0); valP && valP->asQuote())
+            quote = valP->asQuote();
+        else
+            throw compile_error(format("%s must be preceded by a quotation", word->name()),
+                                sourceCode);
+        q = quote->stackEffect();
+        auto fail = [&](const char *message) {
+            throw compile_error(format("%s quotation %s", word->name(), message), sourceCode);
+        };
+        // PMAP, PFILTER and PREDUCE run the quotation on other threads, so it has to be pure:
+        bool parallel = (word == &PMAP || word == &PFILTER || word == &PREDUCE);
+        if (parallel && !quote->isPure())
+            fail("must be pure (no I/O, impure words, profiling or metering)");
+        // The quote's output types aren't related to any of my inputs:
+        auto outputType = [&](int i) {return q.outputs()[i] & TypeSet::anyType();};
+        // Each call's outputs are the next call's inputs, so they must be compatible:
+        auto checkFeedback = [&](int out, int in) {
+            if (outputType(out) - q.inputs()[in])
+                fail("output type doesn't match its input");
+        };
+
+        const TypeSet Arr(Value::AnArray), Quote(Value::AQuote);
+        StackEffect result;
+        if (word == &MAP || word == &FILTER || word == &PMAP || word == &PFILTER) {
+            // ([a] {x -- y} -- [b])
+            if (q.inputCount() != 1 || q.outputCount() != 1)
+                fail("must have one input and one output");
+            result = StackEffect({Arr, Quote}, {Arr});
+        } else if (word == &REDUCE || word == &PREDUCE) {
+            // ([a] acc {acc x -- acc} -- acc)
+            if (q.inputCount() != 2 || q.outputCount() != 1)
+                fail("must have two inputs and one output");
+            checkFeedback(0, 1);
+            if (parallel)
+                checkFeedback(0, 0);    // Chunks' results are combined, as items are
+            result = StackEffect({Arr, q.inputs()[1], Quote},
+                                 {q.inputs()[1] | outputType(0)});
+        } else if (word == &TIMES) {
+            // (a... n {a... -- a...} -- a...)
+            if (q.outputCount() != q.inputCount())
+                fail("must have as many outputs as inputs");
+            for (int i = q.inputCount() - 1; i >= 0; --i) {
+                checkFeedback(i, i);
+                result.addInput(q.inputs()[i]);
+            }
+            result.addInput(TypeSet(Value::ANumber));
+            result.addInput(Quote);
+            // (If n is 0 the quote isn't called, so the outputs may also be the inputs:)
+            for (int i = q.outputCount() - 1; i >= 0; --i)
+                result.addOutput(outputType(i) | q.inputs()[i]);
+            // While the quote runs, the count and quote have been popped:
+            if (q.maxIsUnknown())
+                return result.withUnknownMax();
+            return result.withMax( max(0, q.max() - 2) );
+        } else {
+            // (a... [x] {a... x -- a...} -- a...)
+            if (q.inputCount() < 1 || q.outputCount() != q.inputCount() - 1)
+                fail("must have one more input than outputs");
+            for (int i = q.inputCount() - 1; i >= 1; --i) {
+                checkFeedback(i - 1, i);
+                result.addInput(q.inputs()[i]);
+            }
+            result.addInput(Arr);
+            result.addInput(Quote);
+            for (int i = q.outputCount() - 1; i >= 0; --i)
+                result.addOutput(outputType(i));
+        }
+
+        // While the quote runs, the array and quote have been popped and an item pushed:
+        if (q.maxIsUnknown())
+            return result.withUnknownMax();
+        return result.withMax( max(0, q.max() - 1) );
+    }
+
 }
@@ -20,9 +20,12 @@
 #include "compiler+stackcheck.hh"
 #include "disassembler.hh"
 #include "core_words.hh"
+#include "interpreter.hh"
+#include "profiler.hh"
 #include "stack_effect_parser.hh"
 #include "utils.hh"
 #include "vocabulary.hh"
+#include <algorithm>
 #include <optional>
 #include <sstream>
 #include <string>
@@ -37,15 +40,17 @@ namespace tails {
 #pragma mark - COMPILEDWORD:
 
 
-    CompiledWord::CompiledWord(string &&name, StackEffect effect, vector<Instruction> &&instrs)
+    CompiledWord::CompiledWord(string &&name, StackEffect effect, vector<Instruction> &&instrs,
+                               Flags flags)
     :_nameStr(toupper(name))
     ,_instrs(move(instrs))
     {
         _effect = effect;
+        _flags = flags;
         _instr = &_instrs.front();
         if (!_nameStr.empty()) {
             _name = _nameStr.c_str();
-            Compiler::activeVocabularies.current()->add(*this);
+            Compiler::activeVocabularies().current()->add(*this);
         }
     }
 
@@ -54,27 +59,49 @@ namespace tails {
     :CompiledWord(move(compiler._name), {}, compiler.generateInstructions())
     {
         // Compiler's flags & effect are not valid until after generateInstructions(), above.
-        assert((compiler._flags & ~(Word::Inline | Word::Recursive | Word::Magic)) == 0);
+        assert((compiler._flags & ~(Word::Inline | Word::Recursive | Word::Magic
+                                    | Word::Metered | Word::Pure)) == 0);
         _flags = compiler._flags;
         _effect = compiler._effect;
     }
 
 
-    CompiledWord::CompiledWord(const CompiledWord &word, std::string &&name)
-    :CompiledWord(move(name), word.stackEffect(), vector<Instruction>(word._instrs))
+    CompiledWord::CompiledWord(Value quote, std::string &&name)
+    :_nameStr(toupper(name))
     {
-        _flags = word._flags;
+        const Word *body = quote.asQuote();
+        assert(body && !_nameStr.empty());
+        _instr = body->instruction();
+        _effect = body->stackEffect();
+        _flags = body->flags();
+        _name = _nameStr.c_str();
+        Compiler::activeVocabularies().current()->add(*this, quote);
+        // The word shares the quotation's profile counters; give them a name:
+        if (_instr.word[0] == _PROFILE || _instr.word[0] == _PROFILE_TIMED)
+            Profiler::nameProfile(_instr.word[1].profile, _nameStr);
+    }
+
+
+    CompiledWord::~CompiledWord() {
+        // A word sharing a quotation's instructions leaves them, and their profile, to it:
+        if (!_instrs.empty())
+            Profiler::freeProfile(_instrs.data());
     }
 
 
 #pragma mark - COMPILER:
 
 
-    VocabularyStack Compiler::activeVocabularies;
+    VocabularyStack& Compiler::activeVocabularies() {
+        return Interpreter::current().vocabularies;
+    }
 
 
-    Compiler::Compiler() {
-        assert(activeVocabularies.current() != nullptr);
+    Compiler::Compiler()
+    :_profiling(Interpreter::current().profiling)
+    ,_metering(Interpreter::current().metering)
+    {
+        assert(activeVocabularies().current() != nullptr);
         _words.push_back({NOP});
     }
 
@@ -102,43 +129,135 @@ namespace tails {
 
 
     Compiler::InstructionPos Compiler::add(const WordRef &ref, const char *source) {
-        auto i = prev(_words.end());
-        bool isDst = i->isBranchDestination;
-        *i = SourceWord(ref, source);
-        i->isBranchDestination = isDst;  // preserve this flag
+        InstructionPos i = _words.size() - 1;
+        bool isDst = _words[i].isBranchDestination;
+        _words[i] = SourceWord(ref, source);
+        _words[i].isBranchDestination = isDst;  // preserve this flag
 
         _words.push_back({NOP});
         return i;
     }
 
 
+    // Interpreted words at most this long are inlined automatically...
+    static constexpr size_t kMaxAutoInlineSize = 8;
+    // ...or this long, if profiling shows they've been called at least `kHotCallCount` times.
+    static constexpr size_t kMaxHotInlineSize = 24;
+    static constexpr uint64_t kHotCallCount = 1000;
+
+
+    // Decides whether to inline a call to an interpreted word that isn't flagged `Inline`, based
+    // on its size and on how often the profiler has seen it called, and if so deducts its size
+    // from the inlining budget. Recursive words aren't inlined.
+    bool Compiler::shouldInline(const Word &word) {
+        if (word.isNative() || word.hasFlag(Word::Recursive) || word.isMagic())
+            return false;
+        size_t maxSize = min(kMaxAutoInlineSize, _inlineBudget);
+        if (auto profile = Profiler::profileOf(word); profile && profile->calls >= kHotCallCount)
+            maxSize = min(kMaxHotInlineSize, _inlineBudget);
+
+        size_t size = 0;
+        for (Disassembler dis(word.instruction().word); ; ) {
+            WordRef ref = dis.next();
+            if (ref.word == &_RETURN)
+                break;
+            else if (ref.word == &_PROFILE || ref.word == &_PROFILE_TIMED
+                                           || ref.word == &_PROFILE_LOOP)
+                continue;
+            else if (ref.word == &_RECURSE || ++size > maxSize)
+                return false;
+        }
+        _inlineBudget -= size;
+        return true;
+    }
+
+
     void Compiler::addInline(const Word &word, const char *source) {
         if (word.isNative()) {
             add({word});
         } else {
-            Disassembler dis(word.instruction().word);
+            // Branch offsets in the word's code are relative to its instructions' addresses, so
+            // remember where each instruction's code starts in `_words`, and afterwards point
+            // each branch at the instruction its offset lands on:
+            const Instruction *start = word.instruction().word;
+            vector<InstructionPos> posOfPC;
+            vector<pair<InstructionPos,size_t>> branches;   // (branch, destination PC)
+            Disassembler dis(start);
             while (true) {
+                size_t pc = dis.pc() - start;
+                posOfPC.resize(pc + 1);
+                posOfPC[pc] = _words.size() - 1;
                 WordRef ref = dis.next();
                 if (ref.word == &_RETURN)
                     break;
-                add(ref, source);
+                else if (ref.word == &_PROFILE || ref.word == &_PROFILE_TIMED
+                                               || ref.word == &_PROFILE_LOOP)
+                    continue;       // Inlined code is profiled as part of its caller, if at all
+                addUnfused(ref, source);
+                // (If it was a superinstruction ending in a branch, the branch was added last.)
+                InstructionPos last = _words.size() - 2;
+                if (auto w = _words[last].word; w == &_BRANCH || w == &_ZBRANCH
+                                                     || w == &_DO || w == &_LOOP)
+                    branches.push_back({last, pc + 2 + ref.param.offset});
+            }
+            for (auto [branch, dstPC] : branches) {
+                assert(dstPC < posOfPC.size());
+                setBranchTarget(branch, posOfPC[dstPC]);
             }
         }
     }
 
 
+    // Adds an instruction, first expanding a superinstruction back into its component words (and
+    // numeric variants back to generic words), so the stack checker and the optimization passes
+    // see the code the same way as if it were written out.
+    void Compiler::addUnfused(const WordRef &ref, const char *source) {
+        // First go back from a numeric-only variant to the generic word:
+        const Word *word = ref.word;
+        for (auto var = kNumericVariants; var->generic; ++var) {
+            if (var->numeric == word) {
+                word = var->generic;
+                break;
+            }
+        }
+        for (auto super = kSuperinstructions; super->fused; ++super) {
+            if (super->fused == word) {
+                for (auto word : super->words) {
+                    if (!word)
+                        break;
+                    else if (word->parameters())
+                        add({*word, ref.param}, source);
+                    else
+                        add({*word}, source);
+                }
+                return;
+            }
+        }
+        if (word != ref.word)
+            add(word->parameters() ? WordRef(*word, ref.param) : WordRef(*word), source);
+        else
+            add(ref, source);
+    }
+
+
     void Compiler::addRecurse() {
-        add({_RECURSE, intptr_t(-1)})->branchesTo(_words.begin());
+        setBranchTarget(add({_RECURSE, intptr_t(-1)}), 0);
     }
 
 
     void Compiler::addBranchBackTo(InstructionPos pos) {
-        add({_BRANCH, intptr_t(-1)})->branchesTo(pos);
+        setBranchTarget(add({_BRANCH, intptr_t(-1)}), pos);
     }
 
 
     void Compiler::fixBranch(InstructionPos src) {
-        src->branchesTo(prev(_words.end()));
+        setBranchTarget(src, _words.size() - 1);
+    }
+
+
+    void Compiler::setBranchTarget(InstructionPos src, InstructionPos dst) {
+        _words[src].branchTo = dst;
+        _words[dst].isBranchDestination = true;
     }
 
 
@@ -149,7 +268,7 @@ namespace tails {
         if (branch)
             branchRef = add({*branch, intptr_t(-1)}, _curToken.data());
         else
-            branchRef = prev(_words.end()); // Will point to next word to be added
+            branchRef = _words.size() - 1;  // Will point to next word to be added
         _controlStack.push_back({identifier, branchRef});
     }
 
@@ -169,92 +288,516 @@ namespace tails {
 
     // Returns true if this instruction a RETURN, or a BRANCH to a RETURN.
     bool Compiler::returnsImmediately(Compiler::InstructionPos pos) {
-        if (pos->word == &_BRANCH)
-            return returnsImmediately(*pos->branchTo);
+        const SourceWord &w = _words[pos];
+        if (w.word == &_BRANCH)
+            return returnsImmediately(*w.branchTo);
         else
-            return (pos->word == &_RETURN);
+            return (w.word == &_RETURN);
+    }
+
+
+#pragma mark - OPTIMIZATION PASSES:
+
+
+    namespace {
+        using SourceWord = Compiler::SourceWord;
+        using InstructionPos = Compiler::InstructionPos;
+
+        /// Rewrites a word's instructions in a single forward pass, building a new list in which
+        /// each old instruction may be copied, replaced, dropped, or have new ones put before it.
+        /// When it's finished, all branches are retargeted at once: a branch to an instruction
+        /// goes to whatever took its place, or if it was dropped, to whatever follows it.
+        /// (Updating the branches after every change instead would make a pass quadratic.)
+        class Rewriter {
+        public:
+            explicit Rewriter(vector<SourceWord> &words)
+            :old(words)
+            ,_remap(words.size(), kUnmapped)
+            {
+                out.reserve(words.size());
+            }
+
+            /// Marks the old instruction `i` as being replaced by whatever's emitted next.
+            void mark(InstructionPos i) {
+                _remap[i] = out.size();
+                _marked = max(_marked, i + 1);
+            }
+
+            /// Drops the old instruction `i`.
+            void drop(InstructionPos i) {
+                mark(i);
+                _pendingDestination |= old[i].isBranchDestination;
+            }
+
+            /// Copies the old instruction `i` to the output.
+            SourceWord& copy(InstructionPos i) {
+                mark(i);
+                return emit(old[i]);
+            }
+
+            /// Adds an instruction to the output.
+            SourceWord& emit(SourceWord w) {
+                if (_pendingDestination) {
+                    w.isBranchDestination = true;
+                    _pendingDestination = false;
+                }
+                return out.emplace_back(move(w));
+            }
+
+            /// Removes output instructions from the end, leaving `size` of them. Old instructions
+            /// that were replaced by them are now replaced by whatever's emitted next.
+            void truncate(size_t size) {
+                for (auto i = size; i < out.size(); ++i)
+                    _pendingDestination |= out[i].isBranchDestination;
+                out.erase(out.begin() + size, out.end());
+                for (auto i = _marked; i-- > 0 && (_remap[i] > size); ) {
+                    if (_remap[i] != kUnmapped)
+                        _remap[i] = size;
+                }
+            }
+
+            /// Replaces the old instructions with the output, retargeting branches.
+            void finish() {
+                // Unmarked instructions map to whatever follows them:
+                size_t next = out.size();
+                for (auto i = _remap.rbegin(); i != _remap.rend(); ++i) {
+                    if (*i == kUnmapped)
+                        *i = next;
+                    next = *i;
+                }
+                for (auto &w : out) {
+                    w.isBranchDestination = false;
+                    if (w.branchTo)
+                        w.branchTo = _remap[*w.branchTo];
+                }
+                for (auto &w : out) {
+                    if (w.branchTo) {
+                        assert(*w.branchTo < out.size());
+                        out[*w.branchTo].isBranchDestination = true;
+                    }
+                }
+                old = move(out);
+            }
+
+            vector<SourceWord> &old;                    // The instructions being rewritten
+            vector<SourceWord> out;                     // The new instructions
+
+        private:
+            static constexpr size_t kUnmapped = SIZE_MAX;
+            vector<size_t> _remap;                      // Maps old index to new index
+            size_t _marked = 0;                         // 1 + highest old index marked
+            bool _pendingDestination = false;           // Next emitted word is a destination
+        };
+    }
+
+
+    // If this instruction just pushes a constant, returns its value.
+    static optional<Value> literalValue(const Compiler::WordRef &ref) {
+        if (ref.word == &_LITERAL)  return ref.param.literal;
+        else if (ref.word == &ZERO) return Value(0);
+        else if (ref.word == &ONE)  return Value(1);
+        else if (ref.word == &NULL_) return NullValue;
+        else                        return nullopt;
+    }
+
+
+    // An instruction that pushes a constant value.
+    static Compiler::WordRef literalRef(Value v) {
+        if (v == Value(0))          return {ZERO};
+        else if (v == Value(1))     return {ONE};
+        else if (v.isNull())        return {NULL_};
+        else                        return {_LITERAL, v};
+    }
+
+
+    // Constant folding: Evaluates pure native words whose inputs are all literals, replacing them
+    // with literals of their results. Also turns a 0BRANCH of a literal into a BRANCH or nothing,
+    // and removes the code it skips as unreachable.
+    // Nothing is folded across a branch destination, since other paths may arrive there.
+    void Compiler::foldConstants() {
+        while (foldConstantsPass())
+            ;
+    }
+
+
+    // One pass of constant folding; returns true if anything changed.
+    // Along the way it removes instructions following a BRANCH that aren't branch destinations,
+    // since they can't be reached, and a BRANCH that just goes to the next instruction. Removing a
+    // branch may leave its destination with no branches to it, so that folding can continue
+    // through it in the same pass. (Backward branches are only noticed by the next pass.)
+    bool Compiler::foldConstantsPass() {
+        vector<uint32_t> branchesTo(_words.size());
+        for (auto &w : _words) {
+            if (w.branchTo)
+                ++branchesTo[*w.branchTo];
+        }
+        auto removeBranch = [&](const SourceWord &w) {
+            if (w.branchTo && --branchesTo[*w.branchTo] == 0)
+                _words[*w.branchTo].isBranchDestination = false;
+        };
+
+        bool changed = false;
+        Rewriter rw(_words);
+        auto &out = rw.out;
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            const SourceWord &w = _words[i];
+            if (!out.empty() && out.back().word == &_BRANCH) {
+                if (!w.isBranchDestination && w.word != &_RETURN) {
+                    // Unreachable instruction after a branch:
+                    removeBranch(w);
+                    rw.drop(i);
+                    changed = true;
+                    continue;
+                } else if (*out.back().branchTo == i) {
+                    // A BRANCH to the next instruction is a no-op:
+                    removeBranch(out.back());
+                    rw.truncate(out.size() - 1);
+                    changed = true;
+                }
+            }
+
+            const Word *word = w.word;
+            if (word == &_ZBRANCH && !out.empty() && !w.isBranchDestination) {
+                if (auto cond = literalValue(out.back()); cond) {
+                    rw.truncate(out.size() - 1);
+                    if (*cond) {
+                        // Condition is true, so it never branches:
+                        removeBranch(w);
+                        rw.drop(i);
+                    } else {
+                        // Condition is false, so it always branches:
+                        rw.copy(i).word = &_BRANCH;
+                    }
+                    changed = true;
+                    continue;
+                }
+            } else if (word->isPure() && word->isNative() && !word->parameters()
+                            && word->stackEffect().inputCount() > 0) {
+                // Look for enough literals preceding the word to supply its inputs:
+                auto effect = word->stackEffect();
+                auto nInputs = effect.inputCount();
+                size_t first = out.size();
+                bool blocked = w.isBranchDestination;
+                size_t n;
+                for (n = 0; n < nInputs; ++n) {
+                    if (blocked || first == 0 || !literalValue(out[first - 1]))
+                        break;
+                    blocked = out[--first].isBranchDestination;
+                }
+                if (n == nInputs) {
+                    // Run the word on a temporary stack holding the literals:
+                    vector<Value> stack(kStackSlop + nInputs + effect.outputCount() + effect.max());
+                    Value *base = &stack[kStackSlop], *sp = base - 1;
+                    for (auto lit = first; lit < out.size(); ++lit)
+                        *++sp = *literalValue(out[lit]);
+                    const Instruction code[2] = {*word, _RETURN};
+                    sp = call(sp, code);
+
+                    // Replace the literals and the word with the results:
+                    const char *source = out[first].sourceCode;
+                    rw.truncate(first);
+                    for (Value *vp = base; vp <= sp; ++vp)
+                        rw.emit(SourceWord(literalRef(*vp), source));
+                    rw.drop(i);
+                    changed = true;
+                    continue;
+                }
+            }
+            rw.copy(i);
+        }
+        rw.finish();
+        return changed;
+    }
+
+
+    // Replaces common sequences of native words with superinstructions.
+    void Compiler::fuseSuperinstructions() {
+        Rewriter rw(_words);
+        for (InstructionPos i = 0; i < _words.size();) {
+            SourceWord *w = &rw.copy(i++);
+            InstructionPos fusedFrom = i;
+            while (fuseSuperinstruction(*w, i)) {
+                for (; fusedFrom < i; ++fusedFrom)
+                    rw.drop(fusedFrom);
+            }
+        }
+        rw.finish();
+    }
+
+
+    // If `first`, followed by the instructions starting at `next`, match a superinstruction,
+    // changes `first` to it and advances `next` past the instructions it absorbed.
+    // Only the first instruction of the sequence may be a branch destination, else the branch
+    // would land in the middle of the superinstruction. `0` and `1` match `_LITERAL`.
+    bool Compiler::fuseSuperinstruction(SourceWord &first, InstructionPos &next) {
+        for (auto super = kSuperinstructions; super->fused; ++super) {
+            // Check whether the sequence matches, and find its parameter if any:
+            Instruction param {intptr_t(0)};
+            optional<InstructionPos> branchTo;
+            size_t n;
+            for (n = 0; n < Superinstruction::kMaxWords && super->words[n]; ++n) {
+                if (n > 0 && (next + n - 1 >= _words.size() || _words[next + n - 1].isBranchDestination))
+                    break;
+                const SourceWord &w = (n == 0) ? first : _words[next + n - 1];
+                if (w.word == super->words[n]) {
+                    if (w.word->parameters()) {
+                        param = w.param;
+                        branchTo = w.branchTo;
+                    }
+                } else if (super->words[n] == &_LITERAL && (w.word == &ZERO || w.word == &ONE)) {
+                    param = Value(w.word == &ONE);
+                } else {
+                    break;
+                }
+            }
+            if (n < Superinstruction::kMaxWords && super->words[n])
+                continue;
+
+            // Replace the first instruction with the superinstruction, and skip the rest:
+            first.word = super->fused;
+            first.param = param;
+            first.branchTo = branchTo;
+            next += n - 1;
+            return true;
+        }
+        return false;
+    }
+
+
+    // If the word has a numeric-only variant, and the stack checker has proven that its inputs
+    // (and literal parameter, if any) are numbers, replaces it with that variant.
+    void Compiler::useNumericVariant(SourceWord &w) {
+        if (w.knownNumbers < 0)
+            return;     // unreachable
+        for (auto var = kNumericVariants; var->generic; ++var) {
+            if (var->generic == w.word) {
+                if (w.word->stackEffect().inputCount() > w.knownNumbers)
+                    return;
+                if (w.word->hasValParams() && !w.param.literal.isDouble())
+                    return;
+                w.word = var->numeric;
+                return;
+            }
+        }
+    }
+
+
+    // Instruments the word for profiling: adds a prologue that counts (and maybe times) calls, and
+    // a counter before each backward branch. A non-tail RECURSE is changed to call the prologue,
+    // so recursive calls are counted; tail recursion, which becomes a BRANCH, counts as a loop.
+    void Compiler::addProfiling() {
+        WordProfile *profile = Profiler::newProfile(toupper(_name));
+        const Word &prologue = (_profiling == ProfileMode::Cycles) ? _PROFILE_TIMED : _PROFILE;
+        Rewriter rw(_words);
+        rw.emit(WordRef(prologue, Instruction(profile)));
+        vector<InstructionPos> recursions;
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            const SourceWord &w = _words[i];
+            bool backward;
+            if (w.word == &_RECURSE && !returnsImmediately(i + 1)) {
+                recursions.push_back(rw.out.size());
+                backward = false;
+            } else {
+                backward = (w.word == &_RECURSE || w.word == &_LOOP
+                                || (w.word == &_BRANCH && *w.branchTo <= i));
+            }
+            if (backward) {
+                // Insert the counter; branches to the BRANCH will go through it:
+                rw.mark(i);
+                rw.emit(SourceWord({_PROFILE_LOOP, Instruction(profile)}, w.sourceCode));
+                rw.emit(w);
+            } else {
+                rw.copy(i);
+            }
+        }
+        rw.finish();
+        for (auto i : recursions)
+            setBranchTarget(i, 0);
+    }
+
+
+    // Adds a `_FUEL` before each back-edge -- a backward branch, `_LOOP` or `_RECURSE` -- so the
+    // word can be suspended when it runs in a Continuation. (Tail recursion, which later becomes
+    // a BRANCH, gets one too.) Branches to the back-edge go through its `_FUEL`.
+    void Compiler::addMetering() {
+        Rewriter rw(_words);
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            const SourceWord &w = _words[i];
+            if (w.word == &_RECURSE || (w.branchTo && *w.branchTo <= i)) {
+                rw.mark(i);
+                rw.emit(SourceWord({_FUEL}, w.sourceCode));
+                rw.emit(w);
+            } else {
+                rw.copy(i);
+            }
+        }
+        rw.finish();
+    }
+
+
+    // Sets the Pure flag if all the code does is compute its outputs from its inputs, so that PMAP
+    // and its kin can run it on other threads: it uses only pure native words, calls to pure
+    // words, control flow, and literals that can be shared between threads. `I` only counts
+    // inside the word's own `DO` loop. Profiling and metering instructions make a word impure.
+    void Compiler::computePurity() {
+        int loopDepth = 0;
+        for (const SourceWord &w : _words) {
+            const Word *word = w.word;
+            if (word == &_DO)
+                ++loopDepth;
+            else if (word == &_LOOP)
+                --loopDepth;
+            if (word->hasValParams() && !w.param.literal.prepareToShare())
+                return;
+            bool pure = word->isPure() || word == &_RETURN || word == &NOP
+                     || (word->isNative() && word->hasIntParams())     // branches, DO, RECURSE
+                     || (word == &I_ && loopDepth > 0);
+            if (!pure)
+                return;
+        }
+        _flags = Word::Flags(_flags | Word::Pure);
+    }
+
+
+    // Converts tail recursion into a BRANCH, removes unreachable instructions and BRANCHes to the
+    // next instruction, and short-circuits branches to BRANCHes.
+    void Compiler::removeDeadBranches() {
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            if (_words[i].word == &_RECURSE) {
+                // Detect tail recursion: Change RECURSE to BRANCH if it's followed by RETURN:
+                if (returnsImmediately(i + 1))
+                    _words[i].word = &_BRANCH;
+                else
+                    _flags = Word::Flags(_flags | Word::Recursive);
+            }
+        }
+
+        Rewriter rw(_words);
+        bool afterBranch = false;
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            const SourceWord &w = _words[i];
+            if (afterBranch && !w.isBranchDestination && w.word != &_RETURN) {
+                // Unreachable instruction after a branch
+                rw.drop(i);
+                continue;
+            }
+            if (afterBranch && *rw.out.back().branchTo == i) {
+                // A BRANCH to the next instruction is a no-op:
+                rw.truncate(rw.out.size() - 1);
+            }
+            SourceWord &copy = rw.copy(i);
+            if (auto dst = copy.branchTo; dst) {
+                // Follow chains of branches, but not around a cycle: that's an infinite loop,
+                // as `BEGIN 1 WHILE REPEAT` becomes once its constant test is folded away.
+                vector<InstructionPos> visited {i};
+                while (_words[*dst].word == &_BRANCH
+                        && find(visited.begin(), visited.end(), *dst) == visited.end()) {
+                    visited.push_back(*dst);
+                    dst = _words[*dst].branchTo;
+                }
+                copy.branchTo = dst;
+            }
+            afterBranch = (w.word == &_BRANCH);
+        }
+        rw.finish();
     }
 
 
     vector<Instruction> Compiler::generateInstructions() {
         if (!_controlStack.empty())
-            throw compile_error("Unfinished IF-ELSE-THEN or BEGIN-WHILE-REPEAT)", nullptr);
+            throw compile_error("Unfinished IF-ELSE-THEN, BEGIN-WHILE-REPEAT or DO-LOOP", nullptr);
 
-        // Add a RETURN, replacing the "next word" placeholder:
+        // Add a RETURN, replacing the "next word" placeholder (which may be a branch destination,
+        // as after a final REPEAT):
         assert(_words.back().word == &NOP);
+        bool isDst = _words.back().isBranchDestination;
         _words.back() = {_RETURN};
+        _words.back().isBranchDestination = isDst;
 
         // Compute the stack effect and do type-checking:
         computeEffect();
 
-        // Assign a PC offset to each instruction, and do some optimizations:
+        // Evaluate constant expressions, and remove branches whose condition is constant:
+        foldConstants();
+
+        // Replace common sequences of native words with superinstructions:
+        fuseSuperinstructions();
+
+        // Use numeric-only variants of words whose operands are known to be numbers:
+        for (auto &w : _words)
+            useNumericVariant(w);
+
+        // Add instrumentation, if profiling:
+        if (_profiling != ProfileMode::None)
+            addProfiling();
+        if (_metering)
+            addMetering();
+
+        removeDeadBranches();
+        computePurity();
+
+        // Assign a PC offset to each instruction, and choose the INTERP words:
         int interpCount = 0;
-        InstructionPos firstInterp;
-        bool afterBranch = false;
+        InstructionPos firstInterp = 0;
         int pc = 0;
-        for (auto i = _words.begin(); i != _words.end();) {
-            if (afterBranch && !i->isBranchDestination) {
-                // Unreachable instruction after a branch
-                i = _words.erase(i);
-                continue;
-            }
-
-            i->pc = pc;
-            if (i->word->isNative()) {
-                if (i->word == &_RECURSE) {
-                    // Detect tail recursion: Change RECURSE to BRANCH if it's followed by RETURN:
-                    if (returnsImmediately(next(i)))
-                        i->word = &_BRANCH;
-                    else
-                        _flags = Word::Flags(_flags | Word::Recursive);
-                }
-                if (auto dst = i->branchTo; dst) {
-                    // Follow chains of branches:
-                    while ((*dst)->word == &_BRANCH)
-                        dst = (*dst)->branchTo;
-                    i->branchTo = dst;
-                }
+        for (InstructionPos i = 0; i < _words.size(); ++i) {
+            SourceWord &w = _words[i];
+            w.pc = pc;
+            if (w.word == &_FUEL)
+                _flags = Word::Flags(_flags | Word::Metered);
+            if (w.word->isNative()) {
                 // Note: We could optimize a BRANCH to RETURN into a RETURN; but currently we use
                 // RETURN as an end-of-word marker, so it can only appear at the end of a word.
                 interpCount = 0;
-                pc += i->word->parameters();
+                pc += w.word->parameters();
+            } else if (w.word->isMetered()) {
+                // A metered word may suspend, so it gets an `_INTERP_METERED` of its own, which
+                // records where to resume; or a `_TAILINTERP`, since then there's nothing to
+                // resume here.
+                _flags = Word::Flags(_flags | Word::Metered);
+                firstInterp = i;
+                pc += 1;
+                w.interpWord = returnsImmediately(i + 1) ? &_TAILINTERP : &_INTERP_METERED;
+                interpCount = kMaxInterp;
             } else {
                 // In a series of 1 or more interpreted words, set the _first_ one's `interpWord` to
                 // the appropriate word. As more words are found it's changed from INTERP to INTERP2
                 // etc.; and if the final one is followed by RETURN it's changed to the matching
                 // TAILINTERP word.
-                if (interpCount == 0 || interpCount >= kMaxInterp || i->isBranchDestination) {
+                if (interpCount == 0 || interpCount >= kMaxInterp || w.isBranchDestination) {
                     interpCount = 0;
                     firstInterp = i;
                     pc += 1;
                 }
-                bool isTail = returnsImmediately(next(i));
-                firstInterp->interpWord = kInterpWords[isTail][interpCount];
+                bool isTail = returnsImmediately(i + 1);
+                _words[firstInterp].interpWord = kInterpWords[isTail][interpCount];
                 ++interpCount;
             }
-            afterBranch = (i->word == &_BRANCH);
             ++pc;
-            ++i;
         }
 
         // Assemble `_words` into a series of instructions:
         vector<Instruction> instrs;
         instrs.reserve(pc);
-        for (auto i = _words.begin(); i != _words.end(); ++i) {
-            if (i->word->isNative()) {
-                // Add a native word. If it's a branch, compute its PC offset. Then add any param:
-                instrs.push_back(*i->word);
-                if (i->branchTo)
-                    i->param.offset = (*i->branchTo)->pc - i->pc - 2;
-                if (i->word->parameters())
-                    instrs.push_back(i->param);
+        for (auto &w : _words) {
+            if (w.word->isNative()) {
+                // Add a native word. If it's a branch, compute its PC offset. Then add any param.
+                // (A metered word's suspension has to record where a `_RECURSE` resumes.)
+                if (w.word == &_RECURSE && (_flags & Word::Metered))
+                    instrs.push_back(_RECURSE_METERED);
+                else
+                    instrs.push_back(*w.word);
+                if (w.branchTo)
+                    w.param.offset = _words[*w.branchTo].pc - w.pc - 2;
+                if (w.word->parameters())
+                    instrs.push_back(w.param);
             } else {
                 // The first of a series of interpreted words will have `interpWord` set to the
                 // appropriate INTERP-family native word, so emit it:
-                if (i->interpWord)
-                    instrs.push_back(*i->interpWord);
+                if (w.interpWord)
+                    instrs.push_back(*w.interpWord);
                 // For each interpreted word add its word as a parameter:
-                instrs.push_back(*i->word);
+                instrs.push_back(*w.word);
             }
         }
         assert(instrs.size() == pc);
@@ -273,11 +816,14 @@ namespace tails {
 
     namespace core_words {
 
-        NATIVE_WORD(DEFINE, "DEFINE", "{code} $name -- "_sfx) {
-            auto name = sp[0].asString();
-            auto quote = (const CompiledWord*)sp[-1].asQuote();
-            sp -= 2;
-            new CompiledWord(*quote, string(name));
+        // (The DEFINE Word object itself is in core_words.cc.)
+        extern "C" Value* f_DEFINE(NATIVE_PARAMS);
+
+        Value* f_DEFINE(NATIVE_PARAMS) {
+            string name(Value(S0).asString());     // copy, since a short string lives inside the Value
+            Value quote = S1;
+            DROPN(2);
+            new CompiledWord(quote, move(name));
             NEXT();
         }
 
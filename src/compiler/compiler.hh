@@ -17,10 +17,10 @@
 //
 
 #pragma once
+#include "profile.hh"
 #include "word.hh"
 #include <optional>
 #include <stdexcept>
-#include <list>
 #include <string>
 #include <vector>
 
@@ -39,13 +39,19 @@ namespace tails {
     /// created at runtime.
     class CompiledWord : public Word {
     public:
-        CompiledWord(std::string &&name, StackEffect effect, std::vector<Instruction> &&instrs);
+        CompiledWord(std::string &&name, StackEffect effect, std::vector<Instruction> &&instrs,
+                     Flags flags =NoFlags);
 
         /// Constructs a word from a compiler. Call this instead of Compiler::finish.
         explicit CompiledWord(Compiler&&);
 
-        /// Copies a CompiledWord, adding a name.
-        CompiledWord(const CompiledWord&, std::string &&name);
+        /// Constructs a named word that shares the instructions of a quotation, as `DEFINE` does.
+        /// The current Vocabulary keeps the quotation alive.
+        CompiledWord(Value quote, std::string &&name);
+
+        ~CompiledWord();
+        CompiledWord(const CompiledWord&) = delete;
+        CompiledWord& operator=(const CompiledWord&) = delete;
 
     private:
         std::string const              _nameStr;   // Backing store for inherited _name
@@ -118,14 +124,30 @@ namespace tails {
 
         void setInline()                            {_flags = Word::Flags(_flags | Word::Inline);}
 
+        /// The default number of instructions `parse` may inline, in total, from calls to small
+        /// interpreted words that aren't flagged `Inline`.
+        static constexpr size_t kDefaultInlineBudget = 64;
+
+        /// Sets how many instructions `parse` may inline automatically. Zero turns it off.
+        void setInlineBudget(size_t budget)         {_inlineBudget = budget;}
+
+        /// Sets how the word is instrumented for profiling (see profiler.hh.) The default is the
+        /// current Interpreter's `profiling` mode.
+        void setProfiling(ProfileMode mode)         {_profiling = mode;}
+
+        /// Sets whether the word is compiled with fuel metering, so it can be suspended when it
+        /// runs in a `Continuation`. The default is the current Interpreter's `metering`.
+        /// (A word that calls a metered word is metered regardless.)
+        void setMetering(bool metering)             {_metering = metering;}
+
         /// Breaks the input string into words and adds them.
         void parse(const std::string &input);
 
         //---- Adding individual words:
 
         struct SourceWord;
-        /// A reference to a WordRef added to the Compiler.
-        using InstructionPos = std::list<SourceWord>::iterator;
+        /// A reference to a WordRef added to the Compiler: its index in the instruction list.
+        using InstructionPos = size_t;
 
         /// Adds an instruction to a word being compiled.
         /// @return  An opaque reference to this instruction, that can be used later to fix branches.
@@ -156,11 +178,13 @@ namespace tails {
 
         //---- Vocabularies
 
-        /// The vocabularies the parser looks up words from
-        static VocabularyStack activeVocabularies;
+        /// The vocabularies the parser looks up words from: those of the current `Interpreter`.
+        static VocabularyStack& activeVocabularies();
 
     private:
         friend class CompiledWord;
+        friend class WordCache;
+        class StackChecker;
 
         using BranchTarget = std::pair<char, InstructionPos>;
 
@@ -169,22 +193,39 @@ namespace tails {
         Value parseString(std::string_view token);
         Value parseArray(const char* &input);
         Value parseQuote(const char* &input);
+        Value makeQuote();
+        void addDependency(const Word*);
+        void addUnfused(const WordRef&, const char *source);
+        bool shouldInline(const Word&);
         void pushBranch(char identifier, const Word *branch =nullptr);
         InstructionPos popBranch(const char *matching);
+        void setBranchTarget(InstructionPos src, InstructionPos dst);
         bool returnsImmediately(InstructionPos);
+        void foldConstants();
+        bool foldConstantsPass();
+        void fuseSuperinstructions();
+        bool fuseSuperinstruction(SourceWord&, InstructionPos &next);
+        void useNumericVariant(SourceWord&);
+        void addProfiling();
+        void addMetering();
+        void removeDeadBranches();
+        void computePurity();
         void computeEffect();
-        void computeEffect(InstructionPos i,
-                           EffectStack stack);
         StackEffect effectOfIFELSE(InstructionPos, EffectStack&);
+        StackEffect effectOfCombinator(InstructionPos, EffectStack&);
 
         std::string                 _name;
         Word::Flags                 _flags {};
-        std::list<SourceWord>       _words;
+        ProfileMode                 _profiling;
+        bool                        _metering;
+        size_t                      _inlineBudget = kDefaultInlineBudget;
+        std::vector<SourceWord>     _words;
         StackEffect                 _effect;
         bool                        _effectCanAddInputs = true;
         bool                        _effectCanAddOutputs = true;
         std::string_view            _curToken;
         std::vector<BranchTarget>   _controlStack;
+        std::vector<const Word*>    _dependencies;  // Words looked up by name, for WordCache
     };
 
 }
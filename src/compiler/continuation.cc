@@ -0,0 +1,129 @@
+//
+// continuation.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "continuation.hh"
+#include "guarded_stack.hh"
+#include "interpreter.hh"
+#include "word.hh"
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace tails {
+    using namespace std;
+    using namespace tails::core_words;
+
+
+    Continuation::Continuation(const Word &word, Interpreter &interpreter, span<const Value> inputs)
+    :_word(&word)
+    ,_interpreter(&interpreter)
+    {
+        if (word.isNative())
+            throw invalid_argument("Only interpreted words can be continuations");
+        const StackEffect effect = word.stackEffect();
+        if (effect.isWeird())
+            throw invalid_argument("Word's stack effect is not fixed");
+        size_t nInputs = effect.inputCount();
+        if (inputs.size() != nInputs)
+            throw invalid_argument("Wrong number of inputs");
+#ifndef NDEBUG
+        auto types = effect.inputs();
+        for (size_t i = 0; i < nInputs; ++i)
+            assert(types[nInputs - 1 - i].canBeType(inputs[i].type()));
+#endif
+
+        // The stack has to persist while suspended, and recursion may make it any size, so it's
+        // a GuardedStack; a small known size only commits a page.
+        size_t capacity = GuardedStack::kDefaultCapacity;
+        if (!effect.maxIsUnknown())
+            capacity = max(nInputs + max(effect.max(), 0), size_t(1));
+        _stack = make_unique<GuardedStack>(capacity);
+        Value *base = _stack->base();
+        copy(inputs.begin(), inputs.end(), base);
+        _sp = base + nInputs - 1;
+        _frames.push_back(word.instruction().word);
+
+        Interpreter::Using using_(interpreter);
+        gc::object::addRootRange(base, _sp);
+    }
+
+
+    Continuation::~Continuation() {
+        Interpreter::Using using_(*_interpreter);
+        gc::object::removeRootRange(_stack->base());
+    }
+
+
+    bool Continuation::resume(int64_t fuel) {
+        if (_running)
+            throw logic_error("Continuation is already running");
+        if (finished())
+            return true;
+
+        Interpreter::Using using_(*_interpreter);
+        Value *base = _stack->base();
+        size_t loopBase = loopDepth();
+        FuelMeter meter {fuel, gc::object::rootDepth(), loopBase, true};
+
+        // While running, the stack is scanned like any other; afterwards it's a root again.
+        gc::object::removeRootRange(base);
+        struct Resuming {
+            Continuation &cont;
+            FuelMeter prevMeter;
+            Resuming(Continuation &c, const FuelMeter &m)
+            :cont(c), prevMeter(swapFuelMeter(m))  {cont._running = true;}
+            ~Resuming() {
+                swapFuelMeter(prevMeter);
+                cont._running = false;
+                gc::object::addRootRange(cont._stack->base(), cont._sp);
+            }
+        } resuming(*this, meter);
+
+        restoreLoops(_loops);
+        _loops.clear();
+        try {
+            // Run each frame, innermost first, until one suspends:
+            while (!_frames.empty()) {
+                _sp = _stack->run(*_word, _frames.back(), _sp);
+                _frames.pop_back();
+            }
+        } catch (Suspension &s) {
+            // The frame that suspended is replaced by the ones the Suspension recorded:
+            _frames.pop_back();
+            _frames.insert(_frames.end(), s.frames.rbegin(), s.frames.rend());
+            _sp = s.sp;
+            _loops = move(s.loops);
+            unwindLoops(loopBase);
+            return false;
+        } catch (...) {
+            _frames.clear();
+            _sp = base - 1;
+            unwindLoops(loopBase);
+            throw;
+        }
+        assert(loopDepth() == loopBase);
+        assert(_sp == base + _word->stackEffect().outputCount() - 1);
+        return true;
+    }
+
+
+    span<const Value> Continuation::stack() const {
+        return {_stack->base(), size_t(_sp + 1 - _stack->base())};
+    }
+
+}
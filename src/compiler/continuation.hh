@@ -0,0 +1,87 @@
+//
+// continuation.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "core_words.hh"
+#include "value.hh"
+#include "utils.hh"
+#include <memory>
+#include <vector>
+
+
+namespace tails {
+    class GuardedStack;
+    class Interpreter;
+    class Word;
+
+
+    /// A call of a word that can be suspended partway through and resumed later, so that many
+    /// long-running words can take turns on a few threads. Each `resume` gives the word a budget
+    /// of "fuel"; when that's used up, the word suspends, and `resume` returns.
+    ///
+    /// Fuel is used by the `_FUEL` ops the compiler puts before the back-edges of words compiled
+    /// with metering (see `Interpreter::metering`): one unit per loop iteration or recursive call.
+    /// Code without back-edges can't run long, so it's free. Words that aren't metered, and the
+    /// native code of the `NativeTier`, run to completion. So do the quotations called by native
+    /// combinators, like `MAP`'s: if the fuel runs out in one, the word suspends at the first
+    /// `_FUEL` after the combinator returns.
+    ///
+    /// Suspending unwinds the C stack, so it's only a little slower than returning. On the way
+    /// out, each interpreted word records where it will resume; those "return frames", the
+    /// stack, and the index and limit of any counted loops, are saved in the Continuation. The
+    /// stack is kept alive across garbage collections while it's suspended.
+    ///
+    /// A Continuation can be resumed on any thread, but it runs in its Interpreter, which is made
+    /// current during `resume`; so it can only move between threads along with the Interpreter.
+    /// Its word, and the words it calls, must outlive it, and so must the Interpreter.
+    class Continuation {
+    public:
+        /// Prepares to call `word`, which must be interpreted, with `inputs` in stack order
+        /// (bottom first), whose types match its stack effect. It doesn't start running until
+        /// `resume`. Throws `std::invalid_argument` if the stack effect isn't fixed.
+        Continuation(const Word &word, Interpreter&, span<const Value> inputs);
+
+        ~Continuation();
+
+        Continuation(const Continuation&) = delete;
+        Continuation& operator=(const Continuation&) = delete;
+
+        const Word& word() const                        {return *_word;}
+
+        /// Runs the word until it returns, or until it's used up `fuel` units of fuel and
+        /// suspended. Returns true if it's finished. If the word throws an exception, it
+        /// propagates, and the Continuation is finished, with no results.
+        bool resume(int64_t fuel);
+
+        /// True once the word has returned (or thrown an exception.)
+        bool finished() const                           {return _frames.empty();}
+
+        /// The items on the word's stack, bottom first: once it's finished, its results.
+        span<const Value> stack() const;
+
+    private:
+        const Word*                         _word;
+        Interpreter*                        _interpreter;
+        std::unique_ptr<GuardedStack>       _stack;
+        Value*                              _sp;
+        std::vector<const Instruction*>     _frames;    // Where each word resumes; innermost last
+        std::vector<core_words::LoopFrame>  _loops;     // Suspended counted loops, outermost first
+        bool                                _running = false;
+    };
+
+}
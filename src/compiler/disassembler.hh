@@ -20,6 +20,7 @@
 #include "compiler.hh"
 #include "core_words.hh"
 #include "word.hh"
+#include "utils.hh"
 #include "vocabulary.hh"
 
 namespace tails {
@@ -33,11 +34,14 @@ namespace tails {
 
         explicit operator bool() const  {return _pc != nullptr;}
 
+        /// The address of the next instruction, or nullptr after the RETURN.
+        const Instruction* pc() const   {return _pc;}
+
         std::optional<Compiler::WordRef> _next() {
             assert(_pc);
-            const Word *word = Compiler::activeVocabularies.lookup(*_pc++);
+            const Word *word = Compiler::activeVocabularies().lookup(*_pc++);
             if (!_literal && word && word->hasWordParams())
-                word = Compiler::activeVocabularies.lookup(*_pc++);
+                word = Compiler::activeVocabularies().lookup(*_pc++);
             if (!word)
                 return nullopt;
             else if (word->parameters())
@@ -49,10 +53,13 @@ namespace tails {
             }
         }
 
+        /// Returns the next instruction, or throws if it's not a known word (or parameter.)
         Compiler::WordRef next() {
+            auto pc = _pc;
             if (auto ref = _next(); ref)
                 return *ref;
-            throw runtime_error("Unknown instruction");
+            throw runtime_error(format("Disassembler: unknown instruction %p in code at %p",
+                                       (const void*)pc->word, (const void*)pc));
         }
 
 
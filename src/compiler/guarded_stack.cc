@@ -0,0 +1,268 @@
+//
+// guarded_stack.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "guarded_stack.hh"
+#include "gc.hh"
+#include "instruction.hh"
+#include "interpreter.hh"
+#include "word.hh"
+#include <csetjmp>
+#include <csignal>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace tails {
+    using namespace std;
+
+
+#pragma mark - FAULT HANDLING:
+
+
+    namespace {
+        // An active `GuardedMemory::guard` call, which a fault can jump back to.
+        struct RunContext {
+            const GuardedMemory* stack;
+            RunContext*         prev;
+            sigjmp_buf          env;
+        };
+
+        enum { kDataStackOverflow = 1, kNativeStackOverflow };
+
+        thread_local RunContext* tCurrentRun = nullptr;     // Innermost active run
+        thread_local const char* tNativeStackLow = nullptr; // Lowest address of native stack
+
+        struct sigaction sPrevSEGV, sPrevBUS;               // Handlers I replaced
+
+
+        // Overflowing the native stack leaves no room on it to run the signal handler, so the
+        // handler runs on an alternate stack, set up once per thread (unless it already has one.)
+        class AltStack {
+        public:
+            AltStack() {
+                stack_t cur;
+                if (sigaltstack(nullptr, &cur) == 0 && !(cur.ss_flags & SS_DISABLE))
+                    return;
+                stack_t ss = {};
+                ss.ss_sp = _memory = malloc(kSize);
+                ss.ss_size = kSize;
+                if (_memory && sigaltstack(&ss, &_prev) == 0)
+                    _installed = true;
+            }
+            ~AltStack() {
+                if (_installed)
+                    sigaltstack(&_prev, nullptr);
+                free(_memory);
+            }
+        private:
+            static constexpr size_t kSize = 64 * 1024;
+            void*   _memory = nullptr;
+            stack_t _prev {};
+            bool    _installed = false;
+        };
+    }
+
+
+    // A fault within this distance below the native stack's lowest address (or slightly above
+    // it) is taken to be native stack overflow.
+    static constexpr size_t kNativeGuardZone = 1 << 20, kNativeGuardSlop = 64 * 1024;
+
+
+    // Finds the lowest address of the calling thread's native stack.
+    static void findNativeStack() {
+        if (tNativeStackLow)
+            return;
+#ifdef __APPLE__
+        pthread_t self = pthread_self();
+        tNativeStackLow = (const char*)pthread_get_stackaddr_np(self)
+                            - pthread_get_stacksize_np(self);
+#else
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void *addr = nullptr;
+            size_t size = 0;
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+                tNativeStackLow = (const char*)addr;
+            pthread_attr_destroy(&attr);
+        }
+#endif
+    }
+
+
+    static int faultKind(const RunContext &run, const char *addr) {
+        if (run.stack->inGuardPage(addr))
+            return kDataStackOverflow;
+        if (const char *low = tNativeStackLow; low && addr < low + kNativeGuardSlop
+                                                   && addr >= low - kNativeGuardZone)
+            return kNativeStackOverflow;
+        return 0;
+    }
+
+
+    static void handleFault(int sig, siginfo_t *info, void *context) {
+        if (RunContext *run = tCurrentRun; run) {
+            if (int kind = faultKind(*run, (const char*)info->si_addr); kind)
+                siglongjmp(run->env, kind);
+        }
+        // Not an overflow, so pass it on:
+        const struct sigaction &prev = (sig == SIGBUS) ? sPrevBUS : sPrevSEGV;
+        if (prev.sa_flags & SA_SIGINFO)
+            prev.sa_sigaction(sig, info, context);
+        else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN)
+            prev.sa_handler(sig);
+        else {
+            // Ignoring a fault would only re-run the faulting instruction forever, so either way
+            // crash the default way: the re-raised signal is delivered when this returns.
+            struct sigaction dfl = {};
+            dfl.sa_handler = SIG_DFL;
+            sigemptyset(&dfl.sa_mask);
+            sigaction(sig, &dfl, nullptr);
+            raise(sig);
+        }
+    }
+
+
+    static void installFaultHandler() {
+        struct sigaction action = {};
+        action.sa_sigaction = handleFault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &sPrevSEGV);
+        sigaction(SIGBUS, &action, &sPrevBUS);
+    }
+
+
+#pragma mark - GUARDEDMEMORY:
+
+
+    GuardedMemory::GuardedMemory(size_t size) {
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t bytes = (size + page - 1) / page * page;
+
+        // Map the whole range inaccessible, then open up all but the first and last pages:
+        int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        size_t mappingSize = bytes + 2 * page;
+        void *mapping = mmap(nullptr, mappingSize, PROT_NONE, flags, -1, 0);
+        if (mapping == MAP_FAILED)
+            throw bad_alloc();
+        if (mprotect((char*)mapping + page, bytes, PROT_READ | PROT_WRITE) != 0) {
+            munmap(mapping, mappingSize);
+            throw bad_alloc();
+        }
+        _mapping = mapping;
+        _mappingSize = mappingSize;
+        _guardSize = page;
+    }
+
+
+    GuardedMemory::~GuardedMemory() {
+        munmap(_mapping, _mappingSize);
+    }
+
+
+    bool GuardedMemory::inGuardPage(const void *addr) const {
+        auto start = (const char*)_mapping, end = start + _mappingSize, a = (const char*)addr;
+        return (a >= start && a < start + _guardSize) || (a >= end - _guardSize && a < end);
+    }
+
+
+    void* GuardedMemory::guard(void* (*body)(void*), void (*recover)(void*), void *context) {
+        static once_flag sInstalled;
+        call_once(sInstalled, installFaultHandler);
+        static thread_local AltStack tAltStack;
+        (void)tAltStack;
+        findNativeStack();
+
+        RunContext run {this, tCurrentRun, {}};
+        struct Restore {
+            RunContext &run;
+            ~Restore()                      {tCurrentRun = run.prev;}
+        } restore {run};
+        tCurrentRun = &run;
+
+        int fault = sigsetjmp(run.env, 1);
+        if (fault == 0)
+            return body(context);
+        if (recover)
+            recover(context);
+        if (fault == kDataStackOverflow)
+            throw stack_overflow("Stack overflow");
+        else
+            throw stack_overflow("Native stack overflow (recursion is too deep)");
+    }
+
+
+#pragma mark - GUARDEDSTACK:
+
+
+    GuardedStack::GuardedStack(size_t capacity)
+    :GuardedMemory((kStackSlop + capacity) * sizeof(Value))
+    { }
+
+
+    Value* GuardedStack::base() const       {return (Value*)start() + kStackSlop;}
+    size_t GuardedStack::capacity() const   {return size() / sizeof(Value) - kStackSlop;}
+
+
+    Value* GuardedStack::run(const Word &word, Value *sp) {
+        assert(!word.isNative());
+        return run(word, word.instruction().word, sp);
+    }
+
+
+    Value* GuardedStack::run(const Word &word, const Instruction *start, Value *sp) {
+        assert(!word.isNative());
+        assert(sp >= base() - 1 && sp < base() + capacity());
+
+        // A fault jumps back to `guard`, skipping the destructors in the frames in between.
+        // Those can include RAII scopes that changed this thread's state: `Interpreter::Using`
+        // or a scratch heap, and nested `gc::Execution`s with their roots, loops and timed
+        // profiling calls. So the current Interpreter and Heap are saved now and put back after
+        // a fault, and `exec` is made innermost again, so its destructor cleans up the rest.
+        // Everything else that needs cleaning up is constructed before calling `guard`, so
+        // throwing then destructs it normally.
+        struct Context {
+            Interpreter*        interpreter;
+            gc::Heap*           heap;
+            gc::Execution&      exec;
+            const Instruction*  start;
+            Value*              sp;
+        };
+        gc::Execution exec(word, base());
+        Context ctx {Interpreter::currentOrNull(), &gc::Heap::current(), exec, start, sp};
+        auto body = [](void *c) -> void* {
+            auto &ctx = *(Context*)c;
+            return call(ctx.sp, ctx.start);
+        };
+        auto recover = [](void *c) {
+            auto &ctx = *(Context*)c;
+            Interpreter::setCurrent(ctx.interpreter);
+            gc::Heap::setCurrent(ctx.heap);
+            ctx.exec.reinstate();
+        };
+        return (Value*)guard(body, recover, &ctx);
+    }
+
+}
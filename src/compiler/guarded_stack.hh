@@ -0,0 +1,134 @@
+//
+// guarded_stack.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "value.hh"
+#include <stdexcept>
+
+
+namespace tails {
+    union Instruction;
+    class Word;
+
+
+    /// Thrown when a running word overflows its GuardedStack, or the native stack.
+    class stack_overflow : public std::runtime_error {
+    public:
+        using runtime_error::runtime_error;
+    };
+
+
+    /// Memory allocated with `mmap`, with inaccessible "guard pages" past both ends, for a stack
+    /// that code can run on at full speed, with no depth checks: writing past the end hits the
+    /// guard page, and `guard` turns the resulting memory fault into a `stack_overflow`
+    /// exception. Pages are only committed as the stack grows into them, so a big size costs
+    /// only address space. GuardedStack and GuardedSlotStack are stacks of this kind.
+    ///
+    /// Recursion also uses the native stack, so while `guard` is active, overflowing the
+    /// thread's native stack is caught the same way. (That needs the fault to happen in Tails
+    /// code, as it nearly always does; a fault deep inside the C library may leave it in a bad
+    /// state.)
+    class GuardedMemory {
+    public:
+        /// Allocates at least `size` bytes between the guard pages.
+        /// Throws `std::bad_alloc` if the memory can't be mapped.
+        explicit GuardedMemory(size_t size);
+
+        ~GuardedMemory();
+        GuardedMemory(const GuardedMemory&) = delete;
+        GuardedMemory& operator=(const GuardedMemory&) = delete;
+
+        /// The start of the accessible memory.
+        void* start() const                             {return (char*)_mapping + _guardSize;}
+
+        /// The size of the accessible memory, a multiple of the page size.
+        size_t size() const                             {return _mappingSize - 2 * _guardSize;}
+
+        /// True if `addr` is in one of my guard pages.
+        bool inGuardPage(const void *addr) const;
+
+    protected:
+        /// Calls `body(context)` and returns its result. If it overflows this stack or the
+        /// native stack, the fault jumps back here, skipping the destructors of the frames in
+        /// between; then `recover(context)` (unless it's nullptr) is called, and
+        /// `stack_overflow` is thrown. Calls can nest, but only one may use this memory at a time.
+        void* guard(void* (*body)(void*), void (*recover)(void*), void *context);
+
+    private:
+        void*   _mapping = nullptr;     // Start of the mapped memory, a guard page
+        size_t  _mappingSize = 0;
+        size_t  _guardSize = 0;         // Size of each guard page
+    };
+
+
+    /// A Value stack with guard pages, which words whose maximum stack depth isn't known --
+    /// those using non-tail `RECURSE` -- can run on without depth checks; see GuardedMemory.
+    ///
+    /// A GuardedStack can be reused for any number of calls, but only for one at a time.
+    class GuardedStack : public GuardedMemory {
+    public:
+        /// The default capacity, in Values. (8MB, which is only committed as it's used.)
+        static constexpr size_t kDefaultCapacity = 1 << 20;
+
+        /// Allocates a stack with room for at least `capacity` Values.
+        /// Throws `std::bad_alloc` if the memory can't be mapped.
+        explicit GuardedStack(size_t capacity = kDefaultCapacity);
+
+        /// The bottom of the stack. The `kStackSlop` items below it are accessible too.
+        Value* base() const;
+
+        /// The number of Values that fit, starting at `base()`.
+        size_t capacity() const;
+
+        /// Runs an interpreted word whose inputs have been stored starting at `base()`.
+        /// @param sp  Points to the top input, or to `base() - 1` if there are none.
+        /// @return  The stack pointer on completion, pointing to the top output.
+        /// @throw stack_overflow if the word overflows this stack or the native stack.
+        Value* run(const Word&, Value *sp);
+
+        /// Runs an interpreted word starting at the instruction `start` rather than its first,
+        /// as when resuming a suspended Continuation.
+        Value* run(const Word&, const Instruction *start, Value *sp);
+    };
+
+
+    /// A stack of some other type of slot with guard pages, such as a `TypedCore`'s, for running
+    /// code whose maximum depth isn't known; see GuardedMemory.
+    template <class Slot>
+    class GuardedSlotStack : public GuardedMemory {
+    public:
+        /// Allocates a stack with room for at least `capacity` Slots.
+        /// Throws `std::bad_alloc` if the memory can't be mapped.
+        explicit GuardedSlotStack(size_t capacity = GuardedStack::kDefaultCapacity)
+        :GuardedMemory(capacity * sizeof(Slot)) { }
+
+        /// The bottom of the stack.
+        Slot* base() const                              {return (Slot*)start();}
+
+        /// The number of Slots that fit, starting at `base()`.
+        size_t capacity() const                         {return size() / sizeof(Slot);}
+
+        /// Calls `fn()`, which runs code on this stack and returns the final stack pointer.
+        /// @throw stack_overflow if the code overflows this stack or the native stack.
+        template <class Fn>
+        Slot* run(Fn fn) {
+            return (Slot*)guard([](void *ctx) -> void* {return (*(Fn*)ctx)();}, nullptr, &fn);
+        }
+    };
+
+}
@@ -0,0 +1,506 @@
+//
+// image.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "image.hh"
+#include "compiler.hh"
+#include "core_words.hh"
+#include "gc.hh"
+#include "utils.hh"
+#include "vocabulary.hh"
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace tails {
+    using namespace std;
+
+
+#pragma mark - FILE FORMAT:
+
+
+    // An image file consists of a Header followed by these sections, each 8-byte aligned:
+    //   SymbolEntry[nSymbols]  Words referred to by name
+    //   WordEntry[nWords]      Words defined in the image: named ones first, then quotations
+    //   ValueEntry[nValues]    Literal values; an array's items come before it
+    //   uint32_t[nElements]    Value indices of array items
+    //   Reloc[nRelocs]         Pointers to patch in the code, in increasing order of `pc`
+    //   Instruction[nCode]     The words' code, with zeroes where pointers go
+    //   char[stringsSize]      Names and string literals, each followed by a 0 byte
+    // Numbers are stored in native byte order, so an image is only readable on the same
+    // architecture that wrote it.
+
+    static constexpr char     kMagic[8] = {'T','a','i','l','s','I','m','g'};
+    static constexpr uint32_t kVersion  = 1;
+    static constexpr uint32_t kNoName   = UINT32_MAX;
+
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint16_t instructionSize, effectSize;   // For detecting incompatible builds
+        uint32_t nSymbols, nWords, nValues, nElements, nRelocs, nCode, stringsSize;
+        uint32_t _reserved;
+    };
+
+    struct SymbolEntry {
+        uint32_t name;                          // Offset in strings
+        uint32_t isNative;
+    };
+
+    struct WordEntry {
+        uint32_t    name;                       // Offset in strings, or kNoName for a quotation
+        uint32_t    code, length;               // Range of instructions in code
+        uint16_t    flags;
+        uint16_t    _reserved;
+        StackEffect effect;
+    };
+
+    enum ValueKind : uint32_t {
+        kNumberValue,                           // `data` is the Value's bits (number or null)
+        kStringValue,                           // `data` is offset in strings; `size` is length
+        kArrayValue,                            // `data` is index of first item in elements
+        kQuoteValue,                            // `data` is index in words
+    };
+
+    struct ValueEntry {
+        ValueKind kind;
+        uint32_t  size;
+        uint64_t  data;
+    };
+
+    enum RelocKind : uint32_t {
+        kOpReloc,                               // `target` is a native word's symbol
+        kExternalWordReloc,                     // `target` is an interpreted word's symbol
+        kLocalWordReloc,                        // `target` is index in words
+        kValueReloc,                            // `target` is index in values
+    };
+
+    struct Reloc {
+        uint32_t  pc;                           // Index in code
+        RelocKind kind;
+        uint32_t  target;
+    };
+
+    static_assert(sizeof(Value) == sizeof(uint64_t));
+    static_assert(sizeof(Instruction) == 8);
+    static_assert(is_trivially_copyable_v<StackEffect>);
+
+
+    static constexpr size_t align8(size_t n)    {return (n + 7) & ~size_t(7);}
+
+    // The file offsets of the sections.
+    struct Layout {
+        size_t symbols, words, values, elements, relocs, code, strings, end;
+
+        explicit Layout(const Header &h) {
+            symbols  = align8(sizeof(Header));
+            words    = align8(symbols  + size_t(h.nSymbols)  * sizeof(SymbolEntry));
+            values   = align8(words    + size_t(h.nWords)    * sizeof(WordEntry));
+            elements = align8(values   + size_t(h.nValues)   * sizeof(ValueEntry));
+            relocs   = align8(elements + size_t(h.nElements) * sizeof(uint32_t));
+            code     = align8(relocs   + size_t(h.nRelocs)   * sizeof(Reloc));
+            strings  = align8(code     + size_t(h.nCode)     * sizeof(Instruction));
+            end      = strings + h.stringsSize;
+        }
+    };
+
+
+#pragma mark - WRITING:
+
+
+    namespace {
+
+        /// Serializes words into the image format.
+        class ImageWriter {
+        public:
+            explicit ImageWriter(const vector<const Word*> &words) {
+                // Assign indices to all the words first, so calls between them are local:
+                for (auto word : words) {
+                    if (word->isNative() || !word->name())
+                        throw runtime_error("Only named interpreted words can be saved in an image");
+                    _localWords.insert({word->instruction().word, uint32_t(_words.size())});
+                    _words.push_back({addString(word->name()), 0, 0, word->flags(), 0,
+                                      word->stackEffect()});
+                }
+                for (size_t i = 0; i < words.size(); ++i)
+                    addCode(*words[i], uint32_t(i));
+            }
+
+            string data() const {
+                Header h = {};
+                copy(begin(kMagic), end(kMagic), h.magic);
+                h.version = kVersion;
+                h.instructionSize = sizeof(Instruction);
+                h.effectSize = sizeof(StackEffect);
+                h.nSymbols = uint32_t(_symbols.size());
+                h.nWords = uint32_t(_words.size());
+                h.nValues = uint32_t(_values.size());
+                h.nElements = uint32_t(_elements.size());
+                h.nRelocs = uint32_t(_relocs.size());
+                h.nCode = uint32_t(_code.size());
+                h.stringsSize = uint32_t(_strings.size());
+                Layout layout(h);
+
+                string out(layout.end, '\0');
+                auto put = [&](size_t offset, const void *data, size_t size) {
+                    if (size > 0)
+                        memcpy(&out[offset], data, size);
+                };
+                put(0,               &h, sizeof(h));
+                put(layout.symbols,  _symbols.data(),  _symbols.size() * sizeof(SymbolEntry));
+                put(layout.words,    _words.data(),    _words.size() * sizeof(WordEntry));
+                put(layout.values,   _values.data(),   _values.size() * sizeof(ValueEntry));
+                put(layout.elements, _elements.data(), _elements.size() * sizeof(uint32_t));
+                put(layout.relocs,   _relocs.data(),   _relocs.size() * sizeof(Reloc));
+                put(layout.code,     _code.data(),     _code.size() * sizeof(Instruction));
+                put(layout.strings,  _strings.data(),  _strings.size());
+                return out;
+            }
+
+        private:
+            uint32_t addString(string_view str) {
+                auto offset = uint32_t(_strings.size());
+                _strings.append(str);
+                _strings.push_back('\0');
+                return offset;
+            }
+
+            uint32_t addSymbol(const Word &word) {
+                auto [i, added] = _symbolIndex.insert({&word, uint32_t(_symbols.size())});
+                if (added)
+                    _symbols.push_back({addString(word.name()), word.isNative()});
+                return i->second;
+            }
+
+            // The native word whose Op is at `pc`.
+            static const Word& opAt(const Instruction *pc) {
+                const Word *op = Compiler::activeVocabularies().lookup(*pc);
+                if (!op || !op->isNative() || !op->name())
+                    throw runtime_error(format("Unknown instruction %p in code at %p",
+                                               (const void*)pc->word, (const void*)pc));
+                return *op;
+            }
+
+            uint32_t addValue(Value v) {
+                ValueEntry entry = {};
+                switch (v.type()) {
+                    case Value::ANull:
+                    case Value::ANumber:
+                        entry.kind = kNumberValue;
+                        memcpy(&entry.data, &v, sizeof(v));
+                        break;
+                    case Value::AString: {
+                        string_view str = v.asString();
+                        entry = {kStringValue, uint32_t(str.size()), addString(str)};
+                        break;
+                    }
+                    case Value::AnArray: {
+                        // (Items are added first, since they may add elements of their own.)
+                        vector<uint32_t> items;
+                        ArrayItems array = v.asArray().value();
+                        for (Value item : array)
+                            items.push_back(addValue(item));
+                        entry = {kArrayValue, uint32_t(items.size()), _elements.size()};
+                        _elements.insert(_elements.end(), items.begin(), items.end());
+                        break;
+                    }
+                    case Value::AQuote: {
+                        auto index = uint32_t(_words.size());
+                        const Word *quote = v.asQuote();
+                        _words.push_back({kNoName, 0, 0, quote->flags(), 0, quote->stackEffect()});
+                        addCode(*quote, index);
+                        entry = {kQuoteValue, 0, index};
+                        break;
+                    }
+                }
+                _values.push_back(entry);
+                return uint32_t(_values.size() - 1);
+            }
+
+            // Appends a word's code, replacing pointers with relocations.
+            void addCode(const Word &word, uint32_t wordIndex) {
+                const Instruction *start = word.instruction().word;
+
+                // First find the extent of the code, and add the literal values it pushes. This is
+                // done before adding any code, so quotations' code comes before the code that
+                // pushes them; that lets the loader create them while it patches this code.
+                vector<uint32_t> literals;
+                size_t length;
+                for (const Instruction *pc = start; ; ) {
+                    const Word &op = opAt(pc);
+                    if (op == core_words::_PROFILE || op == core_words::_PROFILE_TIMED
+                                                   || op == core_words::_PROFILE_LOOP)
+                        throw runtime_error("Can't save a word compiled with profiling");
+                    if (op.hasValParams()) {
+                        for (int p = 1; p <= op.parameters(); ++p) {
+                            if (pc[p].literal.type() >= Value::AString)
+                                literals.push_back(addValue(pc[p].literal));
+                        }
+                    }
+                    pc += 1 + op.parameters();
+                    if (op == core_words::_RETURN) {
+                        length = pc - start;
+                        break;
+                    }
+                }
+
+                auto base = uint32_t(_code.size());
+                _words[wordIndex].code = base;
+                _words[wordIndex].length = uint32_t(length);
+                _code.insert(_code.end(), start, start + length);
+
+                auto literal = literals.begin();
+                auto relocate = [&](const Instruction *pc, RelocKind kind, uint32_t target) {
+                    auto offset = uint32_t(base + (pc - start));
+                    _relocs.push_back({offset, kind, target});
+                    _code[offset] = Instruction(intptr_t(0));
+                };
+                for (const Instruction *pc = start; pc < start + length; ) {
+                    const Word &op = opAt(pc);
+                    relocate(pc, kOpReloc, addSymbol(op));
+                    for (int p = 1; p <= op.parameters(); ++p) {
+                        if (op.hasWordParams()) {
+                            auto target = pc[p].word;
+                            if (auto i = _localWords.find(target); i != _localWords.end()) {
+                                relocate(&pc[p], kLocalWordReloc, i->second);
+                            } else {
+                                auto called = Compiler::activeVocabularies().lookup(pc[p]);
+                                if (!called || called->isNative() || !called->name())
+                                    throw runtime_error("Can't save a call to an unregistered word");
+                                relocate(&pc[p], kExternalWordReloc, addSymbol(*called));
+                            }
+                        } else if (op.hasValParams() && pc[p].literal.type() >= Value::AString) {
+                            relocate(&pc[p], kValueReloc, *literal++);
+                        }
+                    }
+                    pc += 1 + op.parameters();
+                }
+                assert(literal == literals.end());
+            }
+
+            vector<SymbolEntry>     _symbols;
+            vector<WordEntry>       _words;
+            vector<ValueEntry>      _values;
+            vector<uint32_t>        _elements;
+            vector<Reloc>           _relocs;
+            vector<Instruction>     _code;
+            string                  _strings;
+
+            unordered_map<const Word*, uint32_t>        _symbolIndex;
+            unordered_map<const Instruction*, uint32_t> _localWords;
+        };
+
+    }
+
+
+    void Image::write(const string &path, const vector<const Word*> &words) {
+        string data = ImageWriter(words).data();
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(data.data(), data.size());
+        out.close();
+        if (!out)
+            throw runtime_error(format("Couldn't write image file %s", path.c_str()));
+    }
+
+
+    void Image::write(const string &path, const Vocabulary &vocab) {
+        vector<const Word*> words;
+        for (auto &entry : vocab) {
+            if (!entry.second->isNative())
+                words.push_back(entry.second);
+        }
+        write(path, words);
+    }
+
+
+#pragma mark - LOADING:
+
+
+    Image::Image(const string &path, Vocabulary &vocab) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error(format("Couldn't open image file %s: %s",
+                                       path.c_str(), strerror(errno)));
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(Header))) {
+            _size = st.st_size;
+            // A private mapping is copy-on-write, so the code can be patched in place:
+            _mapping = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (_mapping == MAP_FAILED)
+                _mapping = nullptr;
+        }
+        int err = errno;
+        ::close(fd);
+        if (!_mapping)
+            throw runtime_error(format("Couldn't map image file %s: %s",
+                                       path.c_str(), (_size ? strerror(err) : "too short")));
+        try {
+            load(vocab);
+        } catch (...) {
+            munmap(_mapping, _size);
+            throw;
+        }
+    }
+
+
+    Image::~Image() {
+        munmap(_mapping, _size);
+    }
+
+
+    void Image::load(Vocabulary &vocab) {
+        auto invalid = [] { return runtime_error("Invalid or incompatible image file"); };
+
+        char *base = (char*)_mapping;
+        const Header &h = *(const Header*)base;
+        if (memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion
+                || h.instructionSize != sizeof(Instruction) || h.effectSize != sizeof(StackEffect))
+            throw invalid();
+        Layout layout(h);
+        if (layout.end > _size || (h.stringsSize > 0 && base[layout.end - 1] != '\0'))
+            throw invalid();
+        auto symbols  = (const SymbolEntry*)(base + layout.symbols);
+        auto entries  = (const WordEntry*)  (base + layout.words);
+        auto values   = (const ValueEntry*) (base + layout.values);
+        auto elements = (const uint32_t*)   (base + layout.elements);
+        auto relocs   = (const Reloc*)      (base + layout.relocs);
+        auto code     = (Instruction*)      (base + layout.code);
+        const char *strings = base + layout.strings;
+        auto stringAt = [&](uint32_t offset, uint32_t length = 0) -> const char* {
+            if (offset >= h.stringsSize || length >= h.stringsSize - offset)
+                throw invalid();
+            return strings + offset;
+        };
+
+        // Look up the words referred to by name:
+        vector<const Word*> resolved(h.nSymbols);
+        for (uint32_t i = 0; i < h.nSymbols; ++i) {
+            const char *name = stringAt(symbols[i].name);
+            auto word = Compiler::activeVocabularies().lookup(name);
+            if (!word || word->isNative() != bool(symbols[i].isNative))
+                throw runtime_error(format("Image refers to unknown word '%s'", name));
+            resolved[i] = word;
+        }
+
+        // Create the Words, whose code is in the mapped file:
+        _words.reserve(h.nWords);
+        for (uint32_t i = 0; i < h.nWords; ++i) {
+            const WordEntry &entry = entries[i];
+            if (entry.length == 0 || entry.code > h.nCode || entry.length > h.nCode - entry.code
+                    || (entry.flags & Word::Native))
+                throw invalid();
+            const char *name = (entry.name == kNoName) ? nullptr : stringAt(entry.name);
+            _words.emplace_back(name, entry.effect, &code[entry.code], Word::Flags(entry.flags));
+        }
+
+        // Patch the code. Literal values are created on demand; a quotation's code precedes the
+        // code that pushes it, so it's already been patched by the time it's needed.
+        vector<Value> literals(h.nValues);
+        vector<bool> created(h.nValues);
+        uint32_t pc = 0;
+        auto literal = [&](uint32_t i, auto &literal) -> Value {
+            if (i >= h.nValues)
+                throw invalid();
+            if (created[i])
+                return literals[i];
+            const ValueEntry &entry = values[i];
+            Value v;
+            switch (entry.kind) {
+                case kNumberValue:
+                    memcpy((void*)&v, &entry.data, sizeof(v));
+                    if (v.type() > Value::ANumber)
+                        throw invalid();
+                    break;
+                case kStringValue:
+                    v = Value::internedString({stringAt(uint32_t(entry.data), entry.size),
+                                               entry.size});
+                    break;
+                case kArrayValue: {
+                    if (entry.data > h.nElements || entry.size > h.nElements - entry.data)
+                        throw invalid();
+                    vector<Value> items;
+                    items.reserve(entry.size);
+                    for (uint32_t e = 0; e < entry.size; ++e) {
+                        uint32_t item = elements[entry.data + e];
+                        if (item >= i)
+                            throw invalid();        // items always precede their array
+                        items.push_back(literal(item, literal));
+                    }
+                    v = Value(move(items));
+                    break;
+                }
+                case kQuoteValue: {
+                    if (entry.data >= h.nWords)
+                        throw invalid();
+                    const WordEntry &word = entries[entry.data];
+                    if (word.code + word.length > pc)
+                        throw invalid();            // code isn't patched yet
+                    v = Value(gc::Quote::make(word.effect, Word::Flags(word.flags),
+                                              &code[word.code], word.length));
+                    break;
+                }
+                default:
+                    throw invalid();
+            }
+            created[i] = true;
+            return literals[i] = v;
+        };
+
+        for (uint32_t r = 0; r < h.nRelocs; ++r) {
+            const Reloc &reloc = relocs[r];
+            if (reloc.pc < pc || reloc.pc >= h.nCode)
+                throw invalid();
+            pc = reloc.pc;
+            switch (reloc.kind) {
+                case kOpReloc:
+                case kExternalWordReloc:
+                    if (reloc.target >= h.nSymbols
+                            || resolved[reloc.target]->isNative() != (reloc.kind == kOpReloc))
+                        throw invalid();
+                    code[pc] = resolved[reloc.target]->instruction();
+                    break;
+                case kLocalWordReloc:
+                    if (reloc.target >= h.nWords)
+                        throw invalid();
+                    code[pc] = _words[reloc.target].instruction();
+                    break;
+                case kValueReloc:
+                    code[pc] = literal(reloc.target, literal);
+                    break;
+                default:
+                    throw invalid();
+            }
+        }
+
+        // Finally register the named words:
+        for (auto &word : _words) {
+            if (word.name()) {
+                vocab.add(word);
+                _named.push_back(&word);
+            }
+        }
+    }
+
+}
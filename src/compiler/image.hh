@@ -0,0 +1,73 @@
+//
+// image.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "word.hh"
+#include <string>
+#include <vector>
+
+
+namespace tails {
+    class Vocabulary;
+
+
+    /// A file containing precompiled interpreted words, which can be loaded much faster than
+    /// parsing and compiling their source code.
+    ///
+    /// The image holds each word's instructions, stack effect, flags and name, plus the literal
+    /// Values they push (strings, arrays and quotations.) Since the addresses of native ops and of
+    /// other words differ between processes, every pointer in the code is replaced by a symbolic
+    /// ID listed in a relocation table. Native words and interpreted words outside the image are
+    /// identified by name, and must be in the active vocabularies when the image is loaded.
+    ///
+    /// Loading memory-maps the file, patches the pointers in place in a single pass, and adds the
+    /// words to a Vocabulary. The words' code lives in the mapped file, so the Image must outlive
+    /// any use of them.
+    class Image {
+    public:
+        /// Writes the given interpreted words to an image file. Words they call that aren't in
+        /// the list are saved as references by name.
+        /// Throws `std::runtime_error` if the code can't be saved, or on an I/O error.
+        static void write(const std::string &path, const std::vector<const Word*> &words);
+
+        /// Writes all the interpreted words in a Vocabulary to an image file.
+        static void write(const std::string &path, const Vocabulary&);
+
+        /// Loads an image file and adds its words to `vocab`. The current Interpreter's active
+        /// vocabularies must contain the words the image refers to by name.
+        /// Throws `std::runtime_error` if the file can't be read, isn't a valid image, or refers
+        /// to an unknown word.
+        Image(const std::string &path, Vocabulary &vocab);
+
+        ~Image();
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        /// The named words loaded from the image.
+        const std::vector<const Word*>& words() const       {return _named;}
+
+    private:
+        void load(Vocabulary&);
+
+        void*                    _mapping = nullptr;    // The mmap'd file
+        size_t                   _size = 0;             // Size of the file
+        std::vector<Word>        _words;                // All words, including quotations
+        std::vector<const Word*> _named;                // The named Words in `_words`
+    };
+
+}
@@ -0,0 +1,89 @@
+//
+// interpreter.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "gc.hh"
+#include "output_sink.hh"
+#include "profile.hh"
+#include "vocabulary.hh"
+#include <utility>
+#include <assert.h>
+
+namespace tails {
+    class GuardedStack;
+    class Invocation;
+    class Word;
+    class WordCache;
+
+    /// The mutable state of a Tails interpreter: its garbage-collected heap, the vocabularies the
+    /// compiler looks up and defines words in, and output state.
+    ///
+    /// Each thread running Tails code needs a current Interpreter, set with `Interpreter::Using`.
+    /// Separate Interpreters share nothing but immutable data like the core words, so they can
+    /// run concurrently on different threads without locking. An Interpreter must only be used
+    /// by one thread at a time, and Values must not be passed between Interpreters.
+    class Interpreter {
+    public:
+        Interpreter() = default;
+        Interpreter(const Interpreter&) = delete;
+        Interpreter& operator=(const Interpreter&) = delete;
+
+        /// The calling thread's current Interpreter.
+        static Interpreter& current()           {assert(sCurrent); return *sCurrent;}
+        /// The calling thread's current Interpreter, or nullptr if it has none.
+        static Interpreter* currentOrNull()     {return sCurrent;}
+        /// Sets the calling thread's current Interpreter (but not its heap), returning the
+        /// previous one. `Using` is normally the way to do this.
+        static Interpreter* setCurrent(Interpreter *i) {return std::exchange(sCurrent, i);}
+
+        /// Makes an Interpreter, and its heap, current on this thread while in scope.
+        class Using {
+        public:
+            explicit Using(Interpreter &interp)
+            :_prev(std::exchange(sCurrent, &interp))
+            ,_prevHeap(gc::Heap::setCurrent(&interp.heap))
+            { }
+            ~Using() {
+                sCurrent = _prev;
+                gc::Heap::setCurrent(_prevHeap);
+            }
+            Using(const Using&) = delete;
+            Using& operator=(const Using&) = delete;
+        private:
+            Interpreter* _prev;
+            gc::Heap*    _prevHeap;
+        };
+
+        /// Prepares a word to be run repeatedly from C++ with little overhead; see `Invocation`.
+        /// (Declared in `invocation.hh`.)
+        Invocation prepare(const Word&);
+        /// Prepares a word to run on a stack provided by the caller.
+        Invocation prepare(const Word&, GuardedStack&);
+
+        gc::Heap        heap;                   ///< Where its Values are allocated
+        VocabularyStack vocabularies;           ///< The vocabularies the parser looks up words in
+        OutputSink      output;                 ///< Where the words that print write
+        ProfileMode     profiling = ProfileMode::None; ///< How new words are instrumented
+        bool            metering = false;       ///< Whether new words use fuel (continuation.hh)
+        WordCache*      wordCache = nullptr;    ///< Shares compiled quotations (word_cache.hh)
+
+    private:
+        static inline thread_local Interpreter* sCurrent = nullptr;
+    };
+
+}
@@ -0,0 +1,129 @@
+//
+// invocation.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "invocation.hh"
+#include "guarded_stack.hh"
+#include "interpreter.hh"
+#include "word.hh"
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace tails {
+    using namespace std;
+
+
+    Invocation Interpreter::prepare(const Word &word) {
+        return Invocation(word, *this);
+    }
+
+    Invocation Interpreter::prepare(const Word &word, GuardedStack &stack) {
+        return Invocation(word, *this, stack);
+    }
+
+
+    Invocation::Invocation(const Word &word, Interpreter &interpreter)
+    :_word(&word)
+    ,_interpreter(&interpreter)
+    {
+        checkEffect();
+        const StackEffect effect = word.stackEffect();
+        if (effect.maxIsUnknown()) {
+            _ownStack = make_unique<GuardedStack>();
+            _guardedStack = _ownStack.get();
+        } else {
+            // `max` is the growth past the inputs; it's at least the outputs' net growth.
+            size_t depth = _inputCount + max(effect.max(), 0);
+            _stack = make_unique<Value[]>(kStackSlop + max(depth, size_t(1)));
+        }
+    }
+
+
+    Invocation::Invocation(const Word &word, Interpreter &interpreter, GuardedStack &stack)
+    :_word(&word)
+    ,_interpreter(&interpreter)
+    ,_guardedStack(&stack)
+    {
+        checkEffect();
+        const StackEffect effect = word.stackEffect();
+        size_t depth = _inputCount + (effect.maxIsUnknown() ? 0 : max(effect.max(), 0));
+        if (depth > stack.capacity())
+            throw invalid_argument("Word's stack effect doesn't fit in the stack");
+    }
+
+
+    Invocation::Invocation(Invocation&&) = default;
+    Invocation& Invocation::operator=(Invocation&&) = default;
+    Invocation::~Invocation() = default;
+
+
+    void Invocation::checkEffect() {
+        if (_word->isNative())
+            throw invalid_argument("Only interpreted words can be prepared");
+        const StackEffect effect = _word->stackEffect();
+        if (effect.isWeird())
+            throw invalid_argument("Word's stack effect is not fixed");
+        _inputCount = effect.inputCount();
+        _outputCount = effect.outputCount();
+    }
+
+
+    void Invocation::run(span<const Value> inputs, span<Value> outputs) {
+        assert(inputs.size() == _inputCount);
+        assert(outputs.size() >= _outputCount);
+        if (_running)
+            throw logic_error("Invocation is already running");
+
+#ifndef NDEBUG
+        // Check the input types, which the stack checker assumed:
+        const StackEffect effect = _word->stackEffect();
+        auto types = effect.inputs();
+        for (size_t i = 0; i < _inputCount; ++i)
+            assert(types[_inputCount - 1 - i].canBeType(inputs[i].type()));
+#endif
+
+        Interpreter::Using using_(*_interpreter);
+        Value *base = _guardedStack ? _guardedStack->base() : &_stack[kStackSlop];
+        copy(inputs.begin(), inputs.end(), base);
+
+        struct Running {
+            bool &flag;
+            explicit Running(bool &f) :flag(f) {flag = true;}
+            ~Running()                          {flag = false;}
+        } running(_running);
+
+        Value *top;
+        if (_guardedStack) {
+            top = _guardedStack->run(*_word, base + _inputCount - 1);
+        } else {
+            gc::Execution exec(*_word, base);
+            top = call(base + _inputCount - 1, _word->instruction().word);
+        }
+        assert(top == base + _outputCount - 1);
+        (void)top;
+        copy(base, base + _outputCount, outputs.begin());
+    }
+
+
+    Value Invocation::operator() (span<const Value> inputs) {
+        Value *base = _guardedStack ? _guardedStack->base() : &_stack[kStackSlop];
+        run(inputs, span<Value>(base, _outputCount));
+        return _outputCount ? base[_outputCount - 1] : NullValue;
+    }
+
+}
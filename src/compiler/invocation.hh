@@ -0,0 +1,90 @@
+//
+// invocation.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "value.hh"
+#include "utils.hh"
+#include <memory>
+
+
+namespace tails {
+    class GuardedStack;
+    class Interpreter;
+    class Word;
+
+
+    /// A word prepared to be called many times from C++, as by an application embedding Tails.
+    /// Create one with `Interpreter::prepare`.
+    ///
+    /// Preparing checks the word's stack effect and allocates a stack big enough for it, once.
+    /// A word whose maximum stack depth is unknown, because it uses non-tail `RECURSE`, gets a
+    /// `GuardedStack` instead, which detects overflow without any checks in the word itself.
+    /// After that, `run` just copies the inputs onto the stack, calls the word, and copies out the
+    /// results: it doesn't allocate memory, compile anything, or check the inputs (except by
+    /// debug assertions.)
+    ///
+    /// The word runs in the Interpreter that prepared it, which is made current during the call.
+    /// An Invocation must only be used by one thread at a time. Separate Invocations are
+    /// independent, so a native word may run one while another is running; but an Invocation
+    /// can't be run again while it's already running.
+    class Invocation {
+    public:
+        /// Prepares to run `word`, which must be interpreted and must outlive this object.
+        /// Throws `std::invalid_argument` if its stack effect isn't fixed.
+        Invocation(const Word &word, Interpreter&);
+
+        /// Prepares to run `word` on a stack provided by the caller, which may be reused by other
+        /// Invocations that don't run at the same time. Throws `std::invalid_argument` if its
+        /// stack effect isn't fixed, or is known not to fit in the stack.
+        Invocation(const Word &word, Interpreter&, GuardedStack&);
+
+        ~Invocation();
+
+        Invocation(Invocation&&);
+        Invocation& operator=(Invocation&&);
+
+        const Word& word() const                        {return *_word;}
+        size_t inputCount() const                       {return _inputCount;}
+        size_t outputCount() const                      {return _outputCount;}
+
+        /// Runs the word. `inputs` must have `inputCount()` items, in stack order (bottom first),
+        /// whose types match the word's declared stack effect. The results are stored into
+        /// `outputs`, which must have room for `outputCount()` items, also bottom first.
+        ///
+        /// The results aren't protected from garbage collection: the caller must keep them
+        /// reachable, e.g. by passing them to `gc::object::scanStack`, across collections.
+        ///
+        /// If it runs on a GuardedStack, `run` throws `stack_overflow` if the word overflows it.
+        void run(span<const Value> inputs, span<Value> outputs);
+
+        /// Runs the word, returning its top output (or null if it has none.)
+        Value operator() (span<const Value> inputs);
+
+    private:
+        void checkEffect();
+
+        const Word*              _word;
+        Interpreter*             _interpreter;
+        std::unique_ptr<Value[]> _stack;            // Includes `kStackSlop`
+        std::unique_ptr<GuardedStack> _ownStack;    // GuardedStack I allocated, if any
+        GuardedStack*            _guardedStack = nullptr;
+        size_t                   _inputCount, _outputCount;
+        bool                     _running = false;
+    };
+
+}
@@ -0,0 +1,644 @@
+//
+// native_tier.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "native_tier.hh"
+#include "compiler.hh"
+#include "core_words.hh"
+#include "gc.hh"
+#include "vocabulary.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#   define NATIVE_TIER 1
+#   include <sys/mman.h>
+#   include <unistd.h>
+
+    // Registers DWARF unwind info for JIT code; from libgcc or libunwind.
+    extern "C" void __register_frame(void*);
+    extern "C" void __deregister_frame(void*);
+#endif
+
+
+namespace tails {
+    using namespace std;
+    using namespace core_words;
+
+
+#ifdef NATIVE_TIER
+    const bool NativeTier::kAvailable = true;
+#else
+    const bool NativeTier::kAvailable = false;
+#endif
+
+    static atomic<bool> sEnabled {true};
+
+    // Makes the `_PROFILE` op promote hot words to this tier, when the program starts.
+    static const bool sInstalled = [] {
+        WordProfile::promoter = [](const Instruction *code, WordProfile &profile) {
+            NativeTier::promote(code, profile);
+        };
+        return true;
+    }();
+
+    void NativeTier::setEnabled(bool enabled)   {sEnabled = enabled;}
+    bool NativeTier::enabled()                  {return kAvailable && sEnabled;}
+
+
+    bool NativeTier::promote(const Word &word) {
+        if (word.isNative())
+            return false;
+        const Instruction *code = word.instruction().word;
+        if (code[0] != _PROFILE)
+            return false;
+        promote(code, *code[1].profile);
+        return code[1].profile->nativeCode.load() != nullptr;
+    }
+
+
+    void NativeTier::promote(const Instruction *code, WordProfile &profile) {
+        static mutex sMutex;
+        unique_lock<mutex> lock(sMutex);
+        if (!enabled() || profile.nativeCode.load(memory_order_relaxed))
+            return;
+        if (Op native = compile(code, profile); native)
+            profile.nativeCode.store(native, memory_order_release);
+    }
+
+
+#ifndef NATIVE_TIER
+
+    Op NativeTier::compile(const Instruction *code, WordProfile&) {
+        return nullptr;
+    }
+
+    void NativeTier::release(WordProfile&)      { }
+    size_t NativeTier::count()                  {return 0;}
+
+#else
+
+#pragma mark - STENCILS:
+
+
+    namespace {
+
+        /// What's patched into a stencil after it's copied.
+        enum class Hole : uint8_t {
+            None,
+            Imm64,      ///< 8 bytes at offset 2: the instruction's literal parameter, or an address
+            Rel32,      ///< The last 4 bytes: the offset to the branch target
+        };
+
+        struct Stencil {
+            string_view code;
+            Hole        hole = Hole::None;
+        };
+
+        #define CODE(BYTES)     string_view(BYTES, sizeof(BYTES) - 1)
+
+        // The stencils keep the stack pointer in rdi, and the whole stack in memory, as it is
+        // between native ops. rax, rcx, rdx, rsi and xmm0-1 are scratch.
+        #define LOAD_S0_XMM0    "\xF2\x0F\x10\x47\x00"          /* movsd   xmm0, [rdi]      */
+        #define LOAD_S1_XMM0    "\xF2\x0F\x10\x47\xF8"          /* movsd   xmm0, [rdi-8]    */
+        #define STORE_XMM0_S0   "\xF2\x0F\x11\x47\x00"          /* movsd   [rdi], xmm0      */
+        #define POP1            "\x48\x83\xEF\x08"              /* sub     rdi, 8           */
+        #define PUSH1           "\x48\x83\xC7\x08"              /* add     rdi, 8           */
+        #define LOAD_TOS        "\x48\x8B\x57\x00"              /* mov     rdx, [rdi]       */
+        #define LITERAL_XMM1    "\x48\xB8\0\0\0\0\0\0\0\0"      /* mov     rax, LITERAL     */ \
+                                "\x66\x48\x0F\x6E\xC8"          /* movq    xmm1, rax        */
+
+        // A NaN result is stored as null, as by `Value(double)`:
+        #define NAN_TO_NULL     "\x66\x0F\x2E\xC0"              /* ucomisd xmm0, xmm0       */ \
+                                "\x7B\x0F"                      /* jnp     +15              */ \
+                                "\x48\xB8\0\0\0\0\0\0\xFC\xFF"  /* mov     rax, null        */ \
+                                "\x66\x48\x0F\x6E\xC0"          /* movq    xmm0, rax        */
+
+        // Turns the all-ones or all-zeroes mask from `cmpsd` into 1.0 or 0.0:
+        #define MASK_TO_BOOL    "\x48\xB8\0\0\0\0\0\0\xF0\x3F"  /* mov     rax, 1.0         */ \
+                                "\x66\x48\x0F\x6E\xC8"          /* movq    xmm1, rax        */ \
+                                "\x66\x0F\x54\xC1"              /* andpd   xmm0, xmm1       */
+
+        // (a b -- a OP b), where OP is an SSE2 scalar opcode, or `cmpsd` with predicate PRED:
+        #define ARITH(OP)       LOAD_S1_XMM0 "\xF2\x0F" OP "\x47\x00" POP1 NAN_TO_NULL STORE_XMM0_S0
+        #define COMPARE(PRED)   LOAD_S1_XMM0 "\xF2\x0F\xC2\x47\x00" PRED POP1 MASK_TO_BOOL \
+                                STORE_XMM0_S0
+        // (a -- a OP literal)
+        #define LIT_ARITH(OP)   LITERAL_XMM1 LOAD_S0_XMM0 "\xF2\x0F" OP "\xC1" NAN_TO_NULL \
+                                STORE_XMM0_S0
+        #define LIT_COMPARE(PRED) LITERAL_XMM1 LOAD_S0_XMM0 "\xF2\x0F\xC2\xC1" PRED MASK_TO_BOOL \
+                                STORE_XMM0_S0
+        // (a b -- ), branching if !(a OP b); CC is the `jcc` opcode that branches then:
+        #define COMPARE_BRANCH(CC)  "\x48\x83\xEF\x10"          /* sub     rdi, 16          */ \
+                                "\xF2\x0F\x10\x47\x08"          /* movsd   xmm0, [rdi+8]    */ \
+                                "\x66\x0F\x2E\x47\x10"          /* ucomisd xmm0, [rdi+16]   */ \
+                                "\x0F" CC "\0\0\0\0"            /* jcc     TARGET           */
+
+        // `=` and `<>` compare numbers bit for bit, as `Value` does, so -0 isn't equal to 0.
+        // (a b -- a OP b), and (a -- a OP literal), where SETCC is `sete` or `setne`:
+        #define INT_TO_DOUBLE   "\xF2\x48\x0F\x2A\xC1"      /* cvtsi2sd xmm0, rcx       */
+        #define EQUALITY(SETCC) "\x48\x8B\x47\xF8"          /* mov     rax, [rdi-8]     */ \
+                                "\x31\xC9"                    /* xor     ecx, ecx         */ \
+                                "\x48\x3B\x47\x00"          /* cmp     rax, [rdi]       */ \
+                                "\x0F" SETCC "\xC1"           /* setcc   cl               */ \
+                                POP1 INT_TO_DOUBLE STORE_XMM0_S0
+        #define LIT_EQUALITY(SETCC) "\x48\xB8\0\0\0\0\0\0\0\0"  /* mov rax, LITERAL */ \
+                                "\x31\xC9"                    /* xor     ecx, ecx         */ \
+                                "\x48\x3B\x47\x00"          /* cmp     rax, [rdi]       */ \
+                                "\x0F" SETCC "\xC1"           /* setcc   cl               */ \
+                                INT_TO_DOUBLE STORE_XMM0_S0
+        // (a b -- ), branching if the bits of a and b differ (CC is `jne`) or match (`je`):
+        #define EQUALITY_BRANCH(CC) "\x48\x83\xEF\x10"      /* sub     rdi, 16          */ \
+                                "\x48\x8B\x47\x08"          /* mov     rax, [rdi+8]     */ \
+                                "\x48\x3B\x47\x10"          /* cmp     rax, [rdi+16]    */ \
+                                "\x0F" CC "\0\0\0\0"            /* jcc     TARGET           */
+
+        #define ADD "\x58"
+        #define SUB "\x5C"
+        #define MUL "\x59"
+        #define DIV "\x5E"
+        #define LT_ "\x01"
+        #define LE_ "\x02"
+        #define GE_ "\x05"      /* "not less than": the same, since numbers are never NaN */
+        #define GT_ "\x06"      /* "not less or equal" */
+        #define SETE  "\x94"
+        #define SETNE "\x95"
+
+        const pair<const Word*, Stencil> kStencils[] = {
+            {&NOP,              {CODE("")}},
+            {&DUP,              {CODE("\x48\x8B\x47\x00"        /* mov     rax, [rdi]       */
+                                      "\x48\x89\x47\x08"        /* mov     [rdi+8], rax     */
+                                      PUSH1)}},
+            {&DROP,             {CODE(POP1)}},
+            {&SWAP,             {CODE("\x48\x8B\x47\x00"        /* mov     rax, [rdi]       */
+                                      "\x48\x8B\x4F\xF8"        /* mov     rcx, [rdi-8]     */
+                                      "\x48\x89\x4F\x00"        /* mov     [rdi], rcx       */
+                                      "\x48\x89\x47\xF8")}},    /* mov     [rdi-8], rax     */
+            {&OVER,             {CODE("\x48\x8B\x47\xF8"        /* mov     rax, [rdi-8]     */
+                                      "\x48\x89\x47\x08"        /* mov     [rdi+8], rax     */
+                                      PUSH1)}},
+            {&ROT,              {CODE("\x48\x8B\x47\xF0"        /* mov     rax, [rdi-16]    */
+                                      "\x48\x8B\x4F\xF8"        /* mov     rcx, [rdi-8]     */
+                                      "\x48\x89\x4F\xF0"        /* mov     [rdi-16], rcx    */
+                                      "\x48\x8B\x4F\x00"        /* mov     rcx, [rdi]       */
+                                      "\x48\x89\x4F\xF8"        /* mov     [rdi-8], rcx     */
+                                      "\x48\x89\x47\x00")}},    /* mov     [rdi], rax       */
+            {&_OVER2,           {CODE("\x48\x8B\x47\xF8"        /* mov     rax, [rdi-8]     */
+                                      "\x48\x8B\x4F\x00"        /* mov     rcx, [rdi]       */
+                                      "\x48\x89\x47\x08"        /* mov     [rdi+8], rax     */
+                                      "\x48\x89\x4F\x10"        /* mov     [rdi+16], rcx    */
+                                      "\x48\x83\xC7\x10")}},    /* add     rdi, 16          */
+
+            {&_DUPMULT_NUM,     {CODE(LOAD_S0_XMM0
+                                      "\xF2\x0F\x59\xC0"        /* mulsd   xmm0, xmm0       */
+                                      STORE_XMM0_S0)}},
+
+            {&_BRANCH,          {CODE("\xE9\0\0\0\0"), Hole::Rel32}},   /* jmp TARGET       */
+            // Zero and null are falsey; doubling clears the sign bit, so -0 is zero too:
+            {&_ZBRANCH,         {CODE(POP1
+                                      "\x48\x8B\x47\x08"        /* mov     rax, [rdi+8]     */
+                                      "\x48\xB9\0\0\0\0\0\0\xFC\xFF"  /* mov rcx, null      */
+                                      "\x31\xD2"                /* xor     edx, edx         */
+                                      "\x48\x39\xC8"            /* cmp     rax, rcx         */
+                                      "\x48\x0F\x44\xC2"        /* cmove   rax, rdx         */
+                                      "\x48\x01\xC0"            /* add     rax, rax         */
+                                      "\x0F\x84\0\0\0\0"), Hole::Rel32}},   /* jz TARGET    */
+            {&_ZBRANCH_NUM,     {CODE(POP1
+                                      "\x48\x8B\x47\x08"        /* mov     rax, [rdi+8]     */
+                                      "\x48\x01\xC0"            /* add     rax, rax         */
+                                      "\x0F\x84\0\0\0\0"), Hole::Rel32}},   /* jz TARGET    */
+        };
+
+
+        // The stencils of the numeric words in `kArithWords`, keyed by the form and operator
+        // each applies rather than by word, so a numeric variant added there finds its stencil.
+        struct ArithStencil {
+            ArithForm   form;
+            ArithOp     op;
+            Stencil     stencil;
+        };
+
+        using F = ArithForm;
+        using A = ArithOp;
+
+        const ArithStencil kArithStencils[] = {
+            {F::Binary, A::Plus,        {CODE(ARITH(ADD))}},
+            {F::Binary, A::Minus,       {CODE(ARITH(SUB))}},
+            {F::Binary, A::Mult,        {CODE(ARITH(MUL))}},
+            {F::Binary, A::Div,         {CODE(ARITH(DIV))}},
+            {F::Binary, A::Eq,          {CODE(EQUALITY(SETE))}},
+            {F::Binary, A::Ne,          {CODE(EQUALITY(SETNE))}},
+            {F::Binary, A::Gt,          {CODE(COMPARE(GT_))}},
+            {F::Binary, A::Ge,          {CODE(COMPARE(GE_))}},
+            {F::Binary, A::Lt,          {CODE(COMPARE(LT_))}},
+            {F::Binary, A::Le,          {CODE(COMPARE(LE_))}},
+
+            {F::WithLiteral, A::Plus,   {CODE(LIT_ARITH(ADD)), Hole::Imm64}},
+            {F::WithLiteral, A::Minus,  {CODE(LIT_ARITH(SUB)), Hole::Imm64}},
+            {F::WithLiteral, A::Mult,   {CODE(LIT_ARITH(MUL)), Hole::Imm64}},
+            {F::WithLiteral, A::Eq,     {CODE(LIT_EQUALITY(SETE)), Hole::Imm64}},
+            {F::WithLiteral, A::Gt,     {CODE(LIT_COMPARE(GT_)), Hole::Imm64}},
+            {F::WithLiteral, A::Lt,     {CODE(LIT_COMPARE(LT_)), Hole::Imm64}},
+
+            {F::DupWithLiteral, A::Gt,  {CODE(LITERAL_XMM1 LOAD_S0_XMM0
+                                              "\xF2\x0F\xC2\xC1" GT_    /* cmpnlesd xmm0, xmm1  */
+                                              MASK_TO_BOOL
+                                              "\xF2\x0F\x11\x47\x08"    /* movsd   [rdi+8], xmm0 */
+                                              PUSH1), Hole::Imm64}},
+
+            {F::Branch, A::Eq,  {CODE(EQUALITY_BRANCH("\x85")), Hole::Rel32}},  /* jne         */
+            {F::Branch, A::Ne,  {CODE(EQUALITY_BRANCH("\x84")), Hole::Rel32}},  /* je          */
+            {F::Branch, A::Gt,  {CODE(COMPARE_BRANCH("\x86")), Hole::Rel32}},   /* jbe         */
+            {F::Branch, A::Ge,  {CODE(COMPARE_BRANCH("\x82")), Hole::Rel32}},   /* jb          */
+            {F::Branch, A::Lt,  {CODE(COMPARE_BRANCH("\x83")), Hole::Rel32}},   /* jae         */
+            {F::Branch, A::Le,  {CODE(COMPARE_BRANCH("\x87")), Hole::Rel32}},   /* ja          */
+        };
+
+        // (The stack pointer doesn't change across a call, so the stack stays aligned to 16.)
+        const Stencil kPrologue      {CODE("\x48\x83\xEC\x08"   /* sub     rsp, 8           */
+#ifdef CACHE_TOS
+                                           "\x48\x89\x57\x00"   /* mov     [rdi], rdx (tos) */
+#endif
+                                           )};
+        const Stencil kReturn        {CODE("\x48\x89\xF8"       /* mov     rax, rdi         */
+                                           "\x48\x83\xC4\x08"   /* add     rsp, 8           */
+                                           "\xC3")};            /* ret                      */
+        const Stencil kPushLiteral   {CODE("\x48\xB8\0\0\0\0\0\0\0\0"   /* mov rax, LITERAL */
+                                           "\x48\x89\x47\x08"   /* mov     [rdi+8], rax     */
+                                           PUSH1), Hole::Imm64};
+        const Stencil kIncrement     {CODE("\x48\xB8\0\0\0\0\0\0\0\0"   /* mov rax, COUNTER */
+                                           "\x48\xFF\x00"), Hole::Imm64};   /* inc [rax]    */
+        // Calls `op(sp, pc)`, with holes for `pc` at offset 2 and `op` at offset 12:
+        const Stencil kCallOp        {CODE("\x48\xBE\0\0\0\0\0\0\0\0"   /* mov rsi, PC      */
+                                           "\x48\xB8\0\0\0\0\0\0\0\0"   /* mov rax, OP      */
+#ifdef CACHE_TOS
+                                           LOAD_TOS
+#endif
+                                           "\xFF\xD0"           /* call    rax              */
+                                           "\x48\x89\xC7")};    /* mov     rdi, rax         */
+        // Jumps to `op(sp, pc)`, for a tail call, with the same holes as kCallOp:
+        const Stencil kTailCallOp    {CODE("\x48\xBE\0\0\0\0\0\0\0\0"   /* mov rsi, PC      */
+                                           "\x48\xB8\0\0\0\0\0\0\0\0"   /* mov rax, OP      */
+#ifdef CACHE_TOS
+                                           LOAD_TOS
+#endif
+                                           "\x48\x83\xC4\x08"   /* add     rsp, 8           */
+                                           "\xFF\xE0")};          /* jmp     rax              */
+        // Calls the native code itself, for a RECURSE:
+        const Stencil kCallSelf      {CODE(
+#ifdef CACHE_TOS
+                                           LOAD_TOS
+#endif
+                                           "\xE8\0\0\0\0"), Hole::Rel32};   /* call ENTRY   */
+        const Stencil kCallResult    {CODE("\x48\x89\xC7")};    /* mov     rdi, rax         */
+
+
+        static const Stencil* stencilFor(const Word *word) {
+            for (auto &[w, stencil] : kStencils) {
+                if (w == word)
+                    return &stencil;
+            }
+            if (auto aw = lookupArithWord(word->instruction()); aw && aw->numeric) {
+                for (auto &as : kArithStencils) {
+                    if (as.form == aw->form && as.op == aw->op)
+                        return &as.stencil;
+                }
+            }
+            return nullptr;
+        }
+
+
+        static uint64_t bitsOf(Value v) {
+            uint64_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            return bits;
+        }
+
+
+        /// Assembles native code by copying and patching stencils.
+        class Assembler {
+        public:
+            size_t size() const                     {return _code.size();}
+
+            /// Copies a stencil, patching its hole (if any) with `patch`: the value of an Imm64
+            /// hole, or for a Rel32 the index of the instruction to branch to.
+            void emit(const Stencil &stencil, uint64_t patch = 0) {
+                size_t start = _code.size();
+                _code.insert(_code.end(), stencil.code.begin(), stencil.code.end());
+                if (stencil.hole == Hole::Imm64)
+                    memcpy(&_code[start + 2], &patch, 8);
+                else if (stencil.hole == Hole::Rel32)
+                    _branches.push_back({_code.size() - 4, size_t(patch)});
+            }
+
+            /// Emits a call to a native op, or to interpreted code, with `pc` as its parameter.
+            void emitCall(Op op, const Instruction *pc) {
+                size_t start = _code.size();
+                emit(kCallOp);
+                memcpy(&_code[start + 2], &pc, 8);
+                memcpy(&_code[start + 12], &op, 8);
+            }
+
+            /// Emits a tail call to a native op, or to interpreted code, with `pc` as its parameter.
+            void emitTailCall(Op op, const Instruction *pc) {
+                size_t start = _code.size();
+                emit(kTailCallOp);
+                memcpy(&_code[start + 2], &pc, 8);
+                memcpy(&_code[start + 12], &op, 8);
+            }
+
+            /// Emits a call to the start of this code.
+            void emitCallSelf() {
+                _code.insert(_code.end(), kCallSelf.code.begin(), kCallSelf.code.end());
+                int32_t rel = -int32_t(_code.size());
+                memcpy(&_code[_code.size() - 4], &rel, 4);
+                emit(kCallResult);
+            }
+
+            /// Patches the branches, given the native offset of each instruction index. Returns
+            /// false if a branch goes to an instruction that wasn't compiled.
+            bool patchBranches(const vector<size_t> &offsetOf) {
+                for (auto [pos, target] : _branches) {
+                    if (target >= offsetOf.size() || offsetOf[target] == SIZE_MAX)
+                        return false;
+                    int32_t rel = int32_t(offsetOf[target]) - int32_t(pos + 4);
+                    memcpy(&_code[pos], &rel, 4);
+                }
+                return true;
+            }
+
+            /// Copies the code, followed by its unwind info, into new executable memory, and
+            /// registers the unwind info. The memory's size is stored in `size`, and the pointer
+            /// to pass to `__deregister_frame` in `frame`.
+            Op install(size_t &size, void* &frame) const {
+                size_t frameStart = (_code.size() + 7) & ~size_t(7);
+                vector<uint8_t> unwind = unwindInfo(0);
+                size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+                size = (frameStart + unwind.size() + pageSize - 1) / pageSize * pageSize;
+                void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                                 -1, 0);
+                if (mem == MAP_FAILED)
+                    return nullptr;
+                memcpy(mem, _code.data(), _code.size());
+                unwind = unwindInfo(uintptr_t(mem));
+                memcpy((uint8_t*)mem + frameStart, unwind.data(), unwind.size());
+                if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+                    munmap(mem, size);
+                    return nullptr;
+                }
+                frame = (uint8_t*)mem + frameStart;
+#ifdef __APPLE__
+                frame = (uint8_t*)frame + kCIESize;     // libunwind registers a single FDE
+#endif
+                __register_frame(frame);
+                return reinterpret_cast<Op>(mem);
+            }
+
+        private:
+            static constexpr size_t kCIESize = 24;
+
+            /// The DWARF call frame info of the code, as in an `.eh_frame` section, so that C++
+            /// exceptions thrown by the ops it calls can unwind through it: a CIE, an FDE
+            /// covering the code starting at `start`, and a terminating zero.
+            /// The code's frame is just the return address, and the 8 bytes the prologue's
+            /// `sub rsp, 8` reserves. (The epilogues' `add rsp, 8` is never followed by a call,
+            /// so the unwinder never sees it.)
+            vector<uint8_t> unwindInfo(uintptr_t start) const {
+                vector<uint8_t> info;
+                auto append = [&](auto n) {
+                    info.insert(info.end(), (const uint8_t*)&n, (const uint8_t*)&n + sizeof(n));
+                };
+                auto appendBytes = [&](string_view bytes) {
+                    info.insert(info.end(), bytes.begin(), bytes.end());
+                };
+                // CIE:
+                append(uint32_t(kCIESize - 4));                     // length
+                append(uint32_t(0));                                // CIE id
+                appendBytes(CODE("\x01"                             // version
+                                 "zR\0"                             // augmentation
+                                 "\x01"                             // code alignment 1
+                                 "\x78"                             // data alignment -8
+                                 "\x10"                             // return address: r16
+                                 "\x01\x00"                         // pointers are absolute
+                                 "\x0C\x07\x08"                     // CFA = rsp + 8
+                                 "\x90\x01"                         // r16 at CFA - 8
+                                 "\0\0"));                          // padding
+                assert(info.size() == kCIESize);
+                // FDE:
+                append(uint32_t(28));                               // length
+                append(uint32_t(info.size()));                      // offset back to the CIE
+                append(uint64_t(start));                            // start of code
+                append(uint64_t(_code.size()));                     // size of code
+                appendBytes(CODE("\x00"                             // no augmentation data
+                                 "\x44"                             // after 4 bytes (`sub`),
+                                 "\x0E\x10"                         //   CFA = rsp + 16
+                                 "\0\0\0\0"));                      // padding
+                append(uint32_t(0));                                // end
+                return info;
+            }
+
+            vector<uint8_t>             _code;
+            vector<pair<size_t,size_t>> _branches;  // (position of rel32, target instruction)
+        };
+
+    }
+
+
+#pragma mark - COMPILING:
+
+
+    // A `pc` for calling a native op without parameters: it returns as soon as the op finishes.
+    static const Instruction kReturnCode[1] = {_RETURN};
+
+    // The memory of each word's native code, and the `pc`s it made for calling ops with
+    // parameters. They're freed by `release` when the word's code is freed.
+    struct NativeCode {
+        void*                       mem;
+        size_t                      size;
+        void*                       frame;      // Registered unwind info
+        vector<vector<Instruction>> paramCode;
+    };
+    static unordered_multimap<const WordProfile*, NativeCode> sNativeCode;
+    static mutex sNativeCodeMutex;
+
+
+    // Called at the native code's safepoints, where the interpreted code has them: before a
+    // `_BRANCH` or a `_RECURSE`.
+    static Value* safepointOp(Value *sp, const Instruction*
+#ifdef CACHE_TOS
+                              , Value
+#endif
+                              )
+    {
+        if (_usuallyFalse(gc::object::overBudget()))
+            gc::object::safepoint(sp);
+        return sp;
+    }
+
+
+    // True if the stencils alone can run the instruction, so it can't allocate.
+    static bool hasOwnStencil(const Word *word) {
+        return word == &_RETURN || word == &_LITERAL || word == &ZERO || word == &ONE
+            || word == &NULL_ || word == &_PROFILE_LOOP || word == &_RECURSE
+            || stencilFor(word) != nullptr;
+    }
+
+
+    Op NativeTier::compile(const Instruction *code, WordProfile &profile) {
+        assert(code[0] == _PROFILE);
+        assert(bitsOf(NullValue) == 0xFFFC'0000'0000'0000);    // (as in the stencils)
+        Assembler as;
+        as.emit(kPrologue);
+        vector<size_t> offsetOf;                            // Native offset of each instruction
+        vector<vector<Instruction>> paramCode;      // (moving these doesn't move their items)
+
+        // Calls a word's native op, with its parameters followed by a RETURN:
+        auto callOp = [&](const Word *word, const Instruction *params) {
+            const Instruction *pc = kReturnCode;
+            if (auto n = word->parameters(); n > 0) {
+                auto &call = paramCode.emplace_back(params, params + n);
+                call.push_back(_RETURN);
+                pc = call.data();
+            }
+            as.emitCall(word->instruction().native, pc);
+        };
+
+        // Code that only runs stencils never allocates, so only code that calls other words
+        // needs safepoints; and those in a loop or recursion are where garbage builds up.
+        bool needsSafepoints = false;
+        for (const Instruction *pc = code + 2; *pc != _RETURN; ) {
+            const Word *word = Compiler::activeVocabularies().lookup(*pc);
+            if (!word)
+                return nullptr;
+            needsSafepoints = needsSafepoints || !hasOwnStencil(word);
+            pc += 1 + word->parameters();
+        }
+        auto safepoint = [&] {
+            if (needsSafepoints)
+                as.emitCall(&safepointOp, kReturnCode);
+        };
+
+        for (const Instruction *pc = code + 2; ; ) {
+            size_t index = pc - code;
+            offsetOf.resize(index + 1, SIZE_MAX);
+            offsetOf[index] = as.size();
+            const Word *word = Compiler::activeVocabularies().lookup(*pc);
+            if (!word || !word->isNative())
+                return nullptr;
+            const Instruction *param = pc + 1;
+            pc = param + word->parameters();
+            // A branch's offset is relative to its parameter, minus one: see `_BRANCH`.
+            size_t target = (param - code) + 1 + (word->hasIntParams() ? param->offset : 0);
+
+            if (word == &_RETURN) {
+                as.emit(kReturn);
+                break;
+            } else if (word == &_LITERAL) {
+                as.emit(kPushLiteral, bitsOf(param->literal));
+            } else if (word == &ZERO || word == &ONE || word == &NULL_) {
+                Value v = (word == &NULL_) ? NullValue : Value(word == &ONE);
+                as.emit(kPushLiteral, bitsOf(v));
+            } else if (auto stencil = stencilFor(word); stencil) {
+                if (word == &_BRANCH)
+                    safepoint();
+                if (stencil->hole == Hole::Imm64)
+                    as.emit(*stencil, bitsOf(param->literal));
+                else
+                    as.emit(*stencil, target);
+            } else if (word == &_PROFILE_LOOP) {
+                as.emit(kIncrement, uint64_t(&param->profile->loops));
+            } else if (word == &_RECURSE) {
+                safepoint();
+                as.emit(kIncrement, uint64_t(&profile.calls));
+                as.emitCallSelf();
+            } else if (word->hasWordParams()) {
+                // An `_INTERP` word: call each interpreted word, as `call` does, or for a
+                // `_TAILINTERP` jump to the last one, so tail calls don't grow the native stack.
+                // (The `_RETURN` that follows is unreachable.) A metered word can't be called,
+                // since a Suspension's frames couldn't be resumed in native code.
+                auto &tails = kInterpWords[1];
+                bool tail = find(begin(tails), end(tails), word) != end(tails);
+                for (int i = 0; i < word->parameters(); ++i) {
+                    if (auto callee = Compiler::activeVocabularies().lookup(param[i]);
+                            callee && callee->isMetered())
+                        return nullptr;
+                    const Instruction *start = param[i].word;
+                    if (tail && i == word->parameters() - 1)
+                        as.emitTailCall(start->native, start + 1);
+                    else
+                        as.emitCall(start->native, start + 1);
+                }
+            } else if (word->hasIntParams()) {
+                // A branch without a stencil. If it's a superinstruction ending in `0BRANCH`,
+                // call the words before the branch, then use the branch's stencil:
+                auto super = kSuperinstructions;
+                while (super->fused && super->fused != word)
+                    ++super;
+                if (!super->fused)
+                    return nullptr;                         // e.g. `_DO` or `_LOOP`
+                for (auto w : super->words) {
+                    if (w == &_ZBRANCH)
+                        as.emit(*stencilFor(w), target);
+                    else if (w)
+                        callOp(w, nullptr);
+                }
+            } else if (word == &_PROFILE || word == &_PROFILE_TIMED || word == &_FUEL) {
+                return nullptr;
+            } else {
+                callOp(word, param);
+            }
+        }
+
+        if (!as.patchBranches(offsetOf))
+            return nullptr;
+        size_t size;
+        void *frame;
+        Op native = as.install(size, frame);
+        if (native) {
+            unique_lock<mutex> lock(sNativeCodeMutex);
+            sNativeCode.emplace(&profile, NativeCode{(void*)native, size, frame,
+                                                     move(paramCode)});
+        }
+        return native;
+    }
+
+
+    void NativeTier::release(WordProfile &profile) {
+        profile.nativeCode.store(nullptr);
+        unique_lock<mutex> lock(sNativeCodeMutex);
+        auto [begin, end] = sNativeCode.equal_range(&profile);
+        for (auto i = begin; i != end; ++i) {
+            __deregister_frame(i->second.frame);
+            munmap(i->second.mem, i->second.size);
+        }
+        sNativeCode.erase(begin, end);
+    }
+
+
+    size_t NativeTier::count() {
+        unique_lock<mutex> lock(sNativeCodeMutex);
+        return sNativeCode.size();
+    }
+
+#endif // NATIVE_TIER
+
+}
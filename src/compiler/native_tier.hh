@@ -0,0 +1,83 @@
+//
+// native_tier.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "instruction.hh"
+#include "profile.hh"
+#include <cstddef>
+
+
+namespace tails {
+    class Word;
+
+    /// An optional second tier for hot interpreted words, which compiles them to machine code by
+    /// "copy and patch": each instruction's stencil, a fixed sequence of x86-64 code, is copied
+    /// into an executable buffer, and its literal, branch target or callee is patched into it.
+    /// The result runs the word without the indirect jump between instructions.
+    ///
+    /// Only words compiled with `ProfileMode::Counts` are promoted: when the `_PROFILE` op at the
+    /// start of a word sees its call count reach `kPromotionCalls`, it compiles the word, and
+    /// from then on jumps to the native code instead of running the rest of the instructions.
+    /// The instructions are unchanged, so they're still what the Disassembler shows, and they
+    /// still keep the word's literals alive. A word containing an instruction the tier can't
+    /// compile just stays interpreted. The native code is freed when the word's code is, along
+    /// with its profile.
+    ///
+    /// Stack manipulation, literals, branches and the numeric-only arithmetic words have stencils
+    /// of their own. Other words are called, like an interpreted word, with a `pc` pointing to
+    /// their parameter (if any) followed by a `_RETURN`. Words that branch, and haven't a stencil,
+    /// such as `_DO` and `_LOOP`, prevent promotion, as do metered words and calls to them, since
+    /// a suspended Continuation couldn't resume inside native code. Other exceptions unwind
+    /// through it normally: each function's unwind info is registered with the C++ runtime
+    /// (`__register_frame`) when it's installed. A word that calls other words
+    /// has GC safepoints where the interpreted code does, at each `_BRANCH` and `_RECURSE`, so a
+    /// loop that allocates still collects its garbage; one that only runs stencils can't
+    /// allocate, so it needs none. Tail calls are jumps, as in the interpreter.
+    class NativeTier {
+    public:
+        /// True if the native tier is implemented on this platform (x86-64.)
+        static const bool kAvailable;
+
+        /// A profiled word is promoted to native code after this many calls.
+        static constexpr uint64_t kPromotionCalls = WordProfile::kPromotionCalls;
+
+        /// Enables or disables promotion, which is enabled by default (where available.)
+        static void setEnabled(bool);
+        static bool enabled();
+
+        /// Compiles a word compiled with profiling to native code now, whatever its call count;
+        /// returns true if it's now running in native code.
+        static bool promote(const Word&);
+
+        /// Called by `_PROFILE`, as the `WordProfile::promoter`, when a word's call count reaches
+        /// `kPromotionCalls`. `code` points to the word's first instruction, the `_PROFILE`.
+        static void promote(const Instruction *code, WordProfile&);
+
+        /// Compiles code, starting after its `_PROFILE` prologue, to a native function with the
+        /// same signature as a native word's. Returns nullptr if it can't.
+        static Op compile(const Instruction *code, WordProfile&);
+
+        /// Frees the native code compiled for a profile. Called by `Profiler::freeProfile` when
+        /// the word's code is freed, so it mustn't be running.
+        static void release(WordProfile&);
+
+        /// The number of native functions currently allocated.
+        static size_t count();
+    };
+
+}
@@ -0,0 +1,138 @@
+//
+// output_sink.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "output_sink.hh"
+#include "io.hh"
+#include "word.hh"
+#include <charconv>
+#include <cstdio>
+#include <sstream>
+
+
+namespace tails {
+    using namespace std;
+
+
+    void OutputSink::writeToStdout(string_view text) {
+        fwrite(text.data(), 1, text.size(), stdout);
+    }
+
+
+    OutputSink::OutputSink()
+    :OutputSink(writeToStdout)
+    { }
+
+
+    OutputSink::OutputSink(FlushFn fn, size_t capacity)
+    :_flush(move(fn))
+    ,_capacity(capacity)
+    {
+        _buffer.reserve(capacity);
+    }
+
+
+    void OutputSink::setFlush(FlushFn fn, size_t capacity) {
+        flush();
+        _flush = move(fn);
+        _capacity = capacity;
+        _buffer.reserve(capacity);
+    }
+
+
+    void OutputSink::flush() {
+        if (!_buffer.empty()) {
+            _flush(_buffer);
+            _buffer.clear();
+        }
+    }
+
+
+    void OutputSink::write(string_view str) {
+        if (str.empty())
+            return;
+        reserve(str.size());
+        if (_capacity > 0 && str.size() > _capacity)
+            _flush(str);                // Too big to buffer; pass it straight through
+        else
+            _buffer.append(str);
+        _atLeftMargin = (str.back() == '\n');
+    }
+
+
+    void OutputSink::write(char c) {
+        reserve(1);
+        _buffer.push_back(c);
+        _atLeftMargin = (c == '\n');
+    }
+
+
+    void OutputSink::write(double n) {
+        char buf[32];
+        auto result = to_chars(buf, buf + sizeof(buf), n, chars_format::general, 6);
+        assert(result.ec == errc());
+        write(string_view(buf, result.ptr - buf));
+    }
+
+
+    void OutputSink::writeQuoted(string_view str) {
+        reserve(str.size() + 2);
+        _buffer.push_back('"');
+        for (char c : str) {
+            if (c == '"' || c == '\\')
+                _buffer.push_back('\\');
+            _buffer.push_back(c);
+        }
+        _buffer.push_back('"');
+        _atLeftMargin = false;
+    }
+
+
+    void OutputSink::writeValue(Value value) {
+        switch (value.type()) {
+            case Value::ANull:
+                write("null");
+                break;
+            case Value::ANumber:
+                write(value.asDouble());
+                break;
+            case Value::AString:
+                writeQuoted(value.asString());
+                break;
+            case Value::AnArray: {
+                write('[');
+                int n = 0;
+                auto items = value.asArray();
+                for (Value item : *items) {
+                    if (n++ > 0)
+                        write(", ");
+                    writeValue(item);
+                }
+                write(']');
+                break;
+            }
+            case Value::AQuote: {
+                // Quotes are rarely printed, so it's simplest to use the ostream formatter.
+                ostringstream out;
+                out << value;
+                write(out.str());
+                break;
+            }
+        }
+    }
+
+}
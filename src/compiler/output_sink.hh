@@ -0,0 +1,90 @@
+//
+// output_sink.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "value.hh"
+#include <functional>
+#include <string>
+#include <string_view>
+
+
+namespace tails {
+
+    /// Where an Interpreter's printing words (`.`, `SP.`, `NL.`, `NL?`) write. Text is appended
+    /// to a buffer, which is handed to a flush function when it fills up, or on `flush`. Numbers
+    /// are formatted with `std::to_chars` and strings escaped straight into the buffer, so once
+    /// the buffer has grown, printing doesn't allocate.
+    ///
+    /// By default the text goes to stdout. A host can capture it instead with `setFlush`; with a
+    /// capacity of 0 nothing is flushed until it asks, so it gets all the output as one block.
+    class OutputSink {
+    public:
+        /// Receives buffered text.
+        using FlushFn = std::function<void(std::string_view)>;
+
+        static constexpr size_t kDefaultCapacity = 4096;
+
+        /// Constructs a sink that writes to stdout.
+        OutputSink();
+        /// Constructs a sink that flushes to `fn` whenever `capacity` bytes are buffered,
+        /// or only when explicitly flushed if `capacity` is 0.
+        explicit OutputSink(FlushFn fn, size_t capacity = kDefaultCapacity);
+        ~OutputSink()                               {flush();}
+
+        OutputSink(const OutputSink&) = delete;
+        OutputSink& operator=(const OutputSink&) = delete;
+
+        /// The default flush function, which writes to stdout.
+        static void writeToStdout(std::string_view);
+
+        /// Flushes any pending text, then sends future output to `fn`.
+        void setFlush(FlushFn fn, size_t capacity = kDefaultCapacity);
+
+        void write(std::string_view);
+        void write(char);
+        /// Writes a number in the same format as `std::ostream`'s default, i.e. `%g`.
+        void write(double);
+        /// Writes a Value in the same format as its `operator<<`: strings are quoted and escaped.
+        void writeValue(Value);
+        /// Writes a string in double-quotes, escaping quotes and backslashes, like `std::quoted`.
+        void writeQuoted(std::string_view);
+
+        /// Writes a newline if the last thing written wasn't one.
+        void endLine()                              {if (!_atLeftMargin) write('\n');}
+        /// True if nothing has been written yet, or the last thing written was a newline.
+        bool atLeftMargin() const                   {return _atLeftMargin;}
+
+        /// The text buffered since the last flush.
+        std::string_view pending() const            {return _buffer;}
+
+        /// Passes the buffered text, if any, to the flush function and empties the buffer.
+        void flush();
+
+    private:
+        void reserve(size_t n) {
+            if (_capacity > 0 && _buffer.size() + n > _capacity)
+                flush();
+        }
+
+        std::string _buffer;
+        FlushFn     _flush;
+        size_t      _capacity;
+        bool        _atLeftMargin = true;
+    };
+
+}
@@ -0,0 +1,220 @@
+//
+// parallel_words.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "core_words.hh"
+#include "gc.hh"
+#include "guarded_stack.hh"
+#include "thread_pool.hh"
+#include <atomic>
+#include <vector>
+
+
+// The implementations of PMAP, PFILTER and PREDUCE. They need the ThreadPool and GuardedStack,
+// which are above the core, so they're here; their Word objects are in core_words.cc.
+
+namespace tails::core_words {
+
+    extern "C" Value* f_PMAP(NATIVE_PARAMS);
+    extern "C" Value* f_PFILTER(NATIVE_PARAMS);
+    extern "C" Value* f_PREDUCE(NATIVE_PARAMS);
+
+    // PMAP, PFILTER and PREDUCE split a big array into chunks, which run on the threads of the
+    // shared ThreadPool. The stack checker only allows them a pure quotation, which doesn't
+    // touch the Interpreter, so it can run on a thread without one.
+    //
+    // A heap is only used by one thread, so each thread runs the quotation with a scratch heap
+    // of its own. Pure code computing numbers doesn't allocate; if the quotation did allocate,
+    // as by concatenating strings, its results can't outlive the scratch heap. Then they're
+    // thrown away and the serial combinator runs instead -- which is safe, since the quotation
+    // has no side effects.
+
+    static constexpr size_t kParallelGrain = 1024;      // Items per chunk
+
+    struct ParallelScratch {
+        gc::Heap     heap;
+        GuardedStack stack;
+
+        ParallelScratch() {
+            // Never collect at a safepoint, which would need an Interpreter:
+            gc::Heap *prev = gc::Heap::setCurrent(&heap);
+            gc::object::setBudget(SIZE_MAX, SIZE_MAX);
+            gc::Heap::setCurrent(prev);
+        }
+    };
+
+    static ParallelScratch& threadScratch() {
+        static thread_local ParallelScratch tScratch;
+        return tScratch;
+    }
+
+    // Calls `fn(stack)` with this thread's scratch heap current. Returns false if it allocated.
+    template <class FN>
+    static bool withScratch(FN fn) {
+        ParallelScratch &scratch = threadScratch();
+        struct Using {
+            gc::Heap *prev;
+            ~Using() {
+                if (gc::object::instanceCount() > 0) {
+                    // Free everything, since nothing's marked:
+                    gc::object::beginCollection(false);
+                    gc::object::sweep();
+                }
+                gc::Heap::setCurrent(prev);
+            }
+        };
+        Using using_ {gc::Heap::setCurrent(&scratch.heap)};
+        fn(scratch.stack);
+        return gc::object::instanceCount() == 0;
+    }
+
+    // Runs `fn(begin, end, stack)` on chunks of `n` items on the ThreadPool, with each thread's
+    // scratch heap current. Returns false if anything was allocated.
+    template <class FN>
+    static bool parallelChunks(size_t n, FN fn) {
+        std::atomic<bool> allocated {false};
+        ThreadPool::shared().parallelFor(n, kParallelGrain, [&](size_t begin, size_t end) {
+            if (!withScratch([&](GuardedStack &stack) {fn(begin, end, stack);}))
+                allocated = true;
+        });
+        return !allocated;
+    }
+
+    // Only a big array is worth splitting up, and only if its items can be shared by threads.
+    static bool shouldRunParallel(Value quote, ArrayItems items) {
+        if (items.size() < 2 * kParallelGrain || ThreadPool::shared().concurrency() < 2
+                || !quote.asQuote()->isPure())
+            return false;
+        for (Value item : items)
+            if (!item.prepareToShare())
+                return false;
+        return true;
+    }
+
+    // Calls the quotation on a scratch stack, to whose base its inputs have been pushed.
+    static inline Value* callQuote(const Word *quote, GuardedStack &stack, Value *sp) {
+        if (quote->stackEffect().maxIsUnknown())
+            return stack.run(*quote, sp);
+        return call(sp, quote->instruction().word);
+    }
+
+    // ([a] {x -- y} -- [b])
+    NOINLINE static Value* doPMAP(Value *sp) {
+        Value quote = sp[0], array = sp[-1];
+        auto items = array.asArray().value();
+        if (!shouldRunParallel(quote, items) || hasArrayKernel(quote, false))
+            return doMAP(sp);
+        const Word *q = quote.asQuote();
+        std::vector<Value> result(items.size());
+        bool ok = parallelChunks(items.size(), [&](size_t begin, size_t end, GuardedStack &stack) {
+            Value *base = stack.base();
+            for (size_t i = begin; i < end; ++i) {
+                *base = items[i];
+                result[i] = *callQuote(q, stack, base);
+            }
+        });
+        if (!ok)
+            return doMAP(sp);
+        *--sp = Value(std::move(result));
+        return sp;
+    }
+
+    // ([a] {x -- ?} -- [a])
+    NOINLINE static Value* doPFILTER(Value *sp) {
+        Value quote = sp[0], array = sp[-1];
+        auto items = array.asArray().value();
+        if (!shouldRunParallel(quote, items) || hasArrayKernel(quote, false))
+            return doFILTER(sp);
+        const Word *q = quote.asQuote();
+        std::vector<uint8_t> keep(items.size());
+        bool ok = parallelChunks(items.size(), [&](size_t begin, size_t end, GuardedStack &stack) {
+            Value *base = stack.base();
+            for (size_t i = begin; i < end; ++i) {
+                *base = items[i];
+                keep[i] = bool(*callQuote(q, stack, base));
+            }
+        });
+        if (!ok)
+            return doFILTER(sp);
+        std::vector<Value> result;
+        for (size_t i = 0; i < items.size(); ++i)
+            if (keep[i])
+                result.push_back(items[i]);
+        *--sp = Value(std::move(result));
+        return sp;
+    }
+
+    // ([a] init {acc x -- acc} -- acc)
+    // Each chunk is folded starting with its first item, then the chunks' results are folded into
+    // `init` in order. So the quotation must be associative, like `{+}` or `{MAX}`, for the
+    // result to match REDUCE's; floating-point rounding may still differ.
+    NOINLINE static Value* doPREDUCE(Value *sp) {
+        Value quote = sp[0], init = sp[-1], array = sp[-2];
+        auto items = array.asArray().value();
+        if (!shouldRunParallel(quote, items) || !init.prepareToShare()
+                || hasArrayKernel(quote, true))
+            return doREDUCE(sp);
+        const Word *q = quote.asQuote();
+        std::vector<Value> partial((items.size() + kParallelGrain - 1) / kParallelGrain);
+        bool ok = parallelChunks(items.size(), [&](size_t begin, size_t end, GuardedStack &stack) {
+            Value *base = stack.base();
+            Value acc = items[begin];
+            for (size_t i = begin + 1; i < end; ++i) {
+                base[0] = acc;
+                base[1] = items[i];
+                acc = *callQuote(q, stack, base + 1);
+            }
+            partial[begin / kParallelGrain] = acc;
+        });
+        Value acc = init;
+        ok = ok && withScratch([&](GuardedStack &stack) {
+            Value *base = stack.base();
+            for (Value p : partial) {
+                base[0] = acc;
+                base[1] = p;
+                acc = *callQuote(q, stack, base + 1);
+            }
+        });
+        if (!ok)
+            return doREDUCE(sp);
+        sp -= 2;
+        *sp = acc;
+        return sp;
+    }
+
+    Value* f_PMAP(NATIVE_PARAMS) {
+        SPILL();
+        sp = doPMAP(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    Value* f_PFILTER(NATIVE_PARAMS) {
+        SPILL();
+        sp = doPFILTER(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    Value* f_PREDUCE(NATIVE_PARAMS) {
+        SPILL();
+        sp = doPREDUCE(sp);
+        RELOAD();
+        NEXT();
+    }
+
+}
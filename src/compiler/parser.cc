@@ -18,8 +18,12 @@
 
 #include "compiler.hh"
 #include "core_words.hh"
+#include "gc.hh"
+#include "interpreter.hh"
 #include "stack_effect_parser.hh"
 #include "vocabulary.hh"
+#include "word_cache.hh"
+#include <algorithm>
 #include <optional>
 #include <sstream>
 #include <string>
@@ -166,11 +170,26 @@ namespace tails {
                 addBranchBackTo(beginPos);
                 fixBranch(whilePos);
 
+            } else if (match(token, "DO")) {
+                // DO compiles into _DO, whose offset (TBD) skips the loop if it's empty, and
+                // remembers the address of the loop body, which follows it:
+                pushBranch('d', &_DO);
+
+            } else if (match(token, "LOOP")) {
+                // LOOP compiles into _LOOP, which branches back to the body while the index is
+                // below the limit, and fixes up the DO to point to the next instruction:
+                if (_controlStack.empty() || _controlStack.back().first != 'd')
+                    throw compile_error("no matching DO for this LOOP", sourcePos);
+                auto doPos = popBranch("d");
+                setBranchTarget(add({_LOOP, intptr_t(-1)}, sourcePos), doPos + 1);
+                fixBranch(doPos);
+
             } else if (match(token, "RECURSE")) {
                 addRecurse();
 
-            } else if (const Word *word = Compiler::activeVocabularies.lookup(token); word) {
+            } else if (const Word *word = Compiler::activeVocabularies().lookup(token); word) {
                 // Known word is added as an instruction:
+                addDependency(word);
                 if (word->isMagic())
                         throw compile_error("Special word " + string(token)
                                             + " cannot be added by parser", sourcePos);
@@ -184,7 +203,7 @@ namespace tails {
                         add({*word, (intptr_t)*param}, sourcePos);
                     else
                         add({*word, Value(*param)}, sourcePos);
-                } else if (word->hasFlag(Word::Inline)) {
+                } else if (word->hasFlag(Word::Inline) || shouldInline(*word)) {
                     addInline(*word, sourcePos);
                 } else {
                     add(*word, sourcePos);
@@ -207,13 +226,12 @@ namespace tails {
         if (token.size() == 1 || token[token.size()-1] != '"')
             throw compile_error("Unfinished string literal", token.end());
         token = token.substr(1, token.size() - 2);
-        return Value(token.data(), token.size());
+        return Value::internedString(token);
     }
 
 
     Value Compiler::parseArray(const char* &input) {
-        Value arrayVal({});
-        std::vector<Value> *array = arrayVal.asArray();
+        std::vector<Value> array;
         while (true) {
             string_view token = readToken(input);
             if (token == "]")
@@ -221,19 +239,51 @@ namespace tails {
             else if (token.empty())
                 throw compile_error("Unfinished array literal", input);
             else if (token[0] == '"')
-                array->push_back(parseString(token));
+                array.push_back(parseString(token));
             else if (token == "[")
-                array->push_back(parseArray(input));
+                array.push_back(parseArray(input));
             else if (auto np = asNumber(token); np)
-                array->push_back(Value(*np));
+                array.push_back(Value(*np));
             else
                 throw compile_error("Invalid literal '" + string(token) + "' in array", token.data());
         }
-        return arrayVal;
+        return Value(move(array));
+    }
+
+
+    // Returns a pointer to the '}' matching an already-consumed '{', or nullptr if none.
+    static const char* findQuoteEnd(const char *input) {
+        int depth = 1;
+        while (true) {
+            string_view token = readToken(input);
+            if (token.empty())
+                return nullptr;
+            else if (token == "{")
+                ++depth;
+            else if (token == "}" && --depth == 0)
+                return token.data();
+        }
     }
 
 
     Value Compiler::parseQuote(const char* &input) {
+        // With a WordCache, an identical quotation compiled before is shared instead of parsed:
+        WordCache *cache = Interpreter::current().wordCache;
+        string key;
+        if (cache) {
+            if (const char *end = findQuoteEnd(input); end) {
+                key = cache->keyPrefix('Q');
+                WordCache::appendNormalized(key, string_view(input, end - input));
+                vector<const Word*> dependencies;
+                if (Value quote = cache->lookup(key, dependencies); !quote.isNull()) {
+                    for (const Word *word : dependencies)
+                        addDependency(word);
+                    input = end + 1;
+                    return quote;
+                }
+            }
+        }
+
         Compiler quoteCompiler;
         // Check if there's a stack effect declaration:
         if (peek(input) == '(') {
@@ -253,7 +303,25 @@ namespace tails {
             throw compile_error("Missing '}'; unfinished quotation", input);
         ++input;
 
-        return Value(new CompiledWord(move(quoteCompiler)));
+        Value quote = quoteCompiler.makeQuote();
+        for (const Word *word : quoteCompiler._dependencies)
+            addDependency(word);
+        if (!key.empty())
+            cache->add(move(key), quote, quoteCompiler._dependencies);
+        return quote;
+    }
+
+
+    // Generates the instructions and returns them as a new quotation.
+    Value Compiler::makeQuote() {
+        vector<Instruction> code = generateInstructions();
+        return Value(gc::Quote::make(_effect, _flags, code.data(), code.size()));
+    }
+
+
+    void Compiler::addDependency(const Word *word) {
+        if (find(_dependencies.begin(), _dependencies.end(), word) == _dependencies.end())
+            _dependencies.push_back(word);
     }
 
 }
@@ -0,0 +1,119 @@
+//
+// profiler.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "profiler.hh"
+#include "core_words.hh"
+#include "native_tier.hh"
+#include "utils.hh"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+
+namespace tails {
+    using namespace std;
+
+
+    // All the WordProfiles whose code hasn't been freed.
+    static unordered_map<const WordProfile*, unique_ptr<WordProfile>> sProfiles;
+    static mutex sProfilesMutex;
+
+
+    WordProfile* Profiler::newProfile(string name) {
+        auto profile = make_unique<WordProfile>(move(name));
+        WordProfile *result = profile.get();
+        unique_lock<mutex> lock(sProfilesMutex);
+        sProfiles.emplace(result, move(profile));
+        return result;
+    }
+
+
+    void Profiler::freeProfile(const Instruction *code) {
+        if (code[0] != core_words::_PROFILE && code[0] != core_words::_PROFILE_TIMED)
+            return;
+        NativeTier::release(*code[1].profile);
+        unique_lock<mutex> lock(sProfilesMutex);
+        sProfiles.erase(code[1].profile);
+    }
+
+
+    void Profiler::nameProfile(WordProfile *profile, const string &name) {
+        unique_lock<mutex> lock(sProfilesMutex);
+        if (profile->name.empty())
+            profile->name = name;
+    }
+
+
+    const WordProfile* Profiler::profileOf(const Word &word) {
+        if (word.isNative())
+            return nullptr;
+        const Instruction *code = word.instruction().word;
+        if (code[0] == core_words::_PROFILE || code[0] == core_words::_PROFILE_TIMED)
+            return code[1].profile;
+        return nullptr;
+    }
+
+
+    vector<Profiler::Entry> Profiler::hottest(size_t maxCount) {
+        vector<Entry> entries;
+        {
+            unique_lock<mutex> lock(sProfilesMutex);
+            for (auto &[_, profile] : sProfiles) {
+                Entry entry {profile->name, profile->calls, profile->loops, profile->cycles};
+                if (entry.calls == 0 && entry.loops == 0)
+                    continue;
+                if (entry.name.empty())
+                    entry.name = "{quotation}";
+                entries.push_back(move(entry));
+            }
+        }
+        sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            if (a.cycles != b.cycles)
+                return a.cycles > b.cycles;
+            return a.calls + a.loops > b.calls + b.loops;
+        });
+        if (entries.size() > maxCount)
+            entries.resize(maxCount);
+        return entries;
+    }
+
+
+    void Profiler::report(ostream &out, size_t maxCount) {
+        auto entries = hottest(maxCount);
+        out << format("%-24s %14s %14s %16s %12s\n",
+                      "WORD", "CALLS", "LOOPS", "CYCLES", "CYCLES/CALL");
+        for (auto &e : entries) {
+            out << format("%-24s %14llu %14llu", e.name.c_str(),
+                          (unsigned long long)e.calls, (unsigned long long)e.loops);
+            if (e.cycles > 0)
+                out << format(" %16llu %12llu", (unsigned long long)e.cycles,
+                              (unsigned long long)(e.cycles / max(e.calls, uint64_t(1))));
+            out << "\n";
+        }
+    }
+
+
+    void Profiler::reset() {
+        unique_lock<mutex> lock(sProfilesMutex);
+        for (auto &[_, profile] : sProfiles)
+            profile->reset();
+    }
+
+}
@@ -0,0 +1,77 @@
+//
+// profiler.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "profile.hh"
+#include "word.hh"
+#include <iosfwd>
+#include <limits>
+#include <string>
+#include <vector>
+
+
+namespace tails {
+
+    /// Collects the counters of words compiled with profiling, and reports the hottest ones.
+    ///
+    /// Profiling is chosen when a word is compiled, by setting `Interpreter::profiling` or calling
+    /// `Compiler::setProfiling`, so it can be turned on without rebuilding. A profiled word starts
+    /// with a `_PROFILE` op that counts its calls (and with `ProfileMode::Cycles`, times them),
+    /// and each backward branch in it is preceded by a `_PROFILE_LOOP` op counting iterations.
+    /// Words compiled without profiling run exactly as before.
+    ///
+    /// Cycle totals are inclusive: they include the time spent in the words it calls, but the
+    /// time of a recursive call is only added once, by the outermost call.
+    class Profiler {
+    public:
+        /// A snapshot of one word's counters.
+        struct Entry {
+            std::string name;       ///< The word's name, or "{quotation}"
+            uint64_t    calls;      ///< Number of calls
+            uint64_t    loops;      ///< Number of loop iterations (backward branches)
+            uint64_t    cycles;     ///< Total cycles spent in calls, if timed
+        };
+
+        /// Creates the counters for a word being compiled. They belong to the code that points
+        /// to them, a CompiledWord's or a quotation's (which `DEFINE` shares rather than
+        /// copies), and are freed along with it by `freeProfile`.
+        static WordProfile* newProfile(std::string name);
+
+        /// Frees the counters of code compiled with profiling, and its native code if it was
+        /// promoted (see native_tier.hh), when the code itself is freed.
+        /// Does nothing if the code isn't profiled.
+        static void freeProfile(const Instruction *code);
+
+        /// Names an anonymous word's counters, when it's given a name by `DEFINE`.
+        static void nameProfile(WordProfile*, const std::string &name);
+
+        /// Returns the counters of a word compiled with profiling, else nullptr.
+        static const WordProfile* profileOf(const Word&);
+
+        /// Returns the profiled words that have run, hottest first: ordered by cycles, then by
+        /// calls plus loop iterations.
+        static std::vector<Entry> hottest(size_t maxCount = std::numeric_limits<size_t>::max());
+
+        /// Writes a table of the hottest words.
+        static void report(std::ostream&, size_t maxCount = 20);
+
+        /// Resets all the counters to zero.
+        static void reset();
+    };
+
+}
@@ -0,0 +1,178 @@
+//
+// thread_pool.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "thread_pool.hh"
+#include <algorithm>
+
+
+namespace tails {
+    using namespace std;
+
+
+    // True on a thread running chunks of a loop, so a nested loop runs serially.
+    static thread_local bool tInLoop = false;
+
+
+    ThreadPool& ThreadPool::shared() {
+        static ThreadPool sPool(max(thread::hardware_concurrency(), 1u) - 1);
+        return sPool;
+    }
+
+
+    ThreadPool::ThreadPool(unsigned workers) {
+        startWorkers(workers);
+    }
+
+
+    ThreadPool::~ThreadPool() {
+        stopWorkers();
+    }
+
+
+    void ThreadPool::setWorkerCount(unsigned workers) {
+        lock_guard<mutex> loopLock(_loopMutex);
+        stopWorkers();
+        startWorkers(workers);
+    }
+
+
+    void ThreadPool::startWorkers(unsigned workers) {
+        _stopping = false;
+        _queues = make_unique<Queue[]>(workers + 1);
+        for (unsigned i = 1; i <= workers; ++i)
+            _threads.emplace_back([this, i, gen = _generation] {workerMain(i, gen);});
+    }
+
+
+    void ThreadPool::stopWorkers() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wake.notify_all();
+        for (auto &t : _threads)
+            t.join();
+        _threads.clear();
+    }
+
+
+    void ThreadPool::workerMain(unsigned index, uint64_t generation) {
+        tInLoop = true;
+        while (true) {
+            {
+                unique_lock<mutex> lock(_mutex);
+                _wake.wait(lock, [&] {return _stopping || _generation != generation;});
+                if (_stopping)
+                    return;
+                generation = _generation;
+            }
+            runChunks(index);
+            {
+                lock_guard<mutex> lock(_mutex);
+                if (--_busy == 0)
+                    _done.notify_one();
+            }
+        }
+    }
+
+
+    void ThreadPool::parallelFor(size_t n, size_t grain, const ChunkFn &fn) {
+        grain = max(grain, size_t(1));
+        unique_lock<mutex> loopLock(_loopMutex, try_to_lock);
+        if (_threads.empty() || n <= grain || tInLoop || !loopLock.owns_lock()) {
+            for (size_t begin = 0; begin < n; begin += grain)
+                fn(begin, min(begin + grain, n));
+            return;
+        }
+
+        // Deal the chunks out to the threads, a contiguous share each:
+        size_t nChunks = (n + grain - 1) / grain;
+        unsigned nThreads = concurrency();
+        for (unsigned t = 0; t < nThreads; ++t) {
+            auto &chunks = _queues[t].chunks;
+            for (size_t c = nChunks * t / nThreads; c < nChunks * (t + 1) / nThreads; ++c)
+                chunks.emplace_back(c * grain, min((c + 1) * grain, n));
+        }
+
+        _failed = false;
+        _error = nullptr;
+        {
+            lock_guard<mutex> lock(_mutex);
+            _fn = &fn;
+            _busy = unsigned(_threads.size());
+            ++_generation;
+        }
+        _wake.notify_all();
+
+        tInLoop = true;
+        runChunks(0);
+        tInLoop = false;
+
+        unique_lock<mutex> lock(_mutex);
+        _done.wait(lock, [&] {return _busy == 0;});
+        _fn = nullptr;
+        if (_error)
+            rethrow_exception(exchange(_error, nullptr));
+    }
+
+
+    void ThreadPool::runChunks(unsigned index) {
+        Range chunk;
+        while (!_failed && takeChunk(index, chunk)) {
+            try {
+                (*_fn)(chunk.first, chunk.second);
+            } catch (...) {
+                lock_guard<mutex> lock(_mutex);
+                if (!_failed.exchange(true))
+                    _error = current_exception();
+            }
+        }
+        if (_failed) {
+            // Skip the rest of this thread's chunks:
+            lock_guard<mutex> lock(_queues[index].mutex);
+            _queues[index].chunks.clear();
+        }
+    }
+
+
+    // Pops a chunk from the back of this thread's queue, or else steals one from the front of
+    // another's.
+    bool ThreadPool::takeChunk(unsigned index, Range &chunk) {
+        {
+            Queue &mine = _queues[index];
+            lock_guard<mutex> lock(mine.mutex);
+            if (!mine.chunks.empty()) {
+                chunk = mine.chunks.back();
+                mine.chunks.pop_back();
+                return true;
+            }
+        }
+        unsigned nThreads = concurrency();
+        for (unsigned i = 1; i < nThreads; ++i) {
+            Queue &victim = _queues[(index + i) % nThreads];
+            lock_guard<mutex> lock(victim.mutex);
+            if (!victim.chunks.empty()) {
+                chunk = victim.chunks.front();
+                victim.chunks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+}
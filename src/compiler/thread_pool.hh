@@ -0,0 +1,97 @@
+//
+// thread_pool.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace tails {
+
+    /// A pool of worker threads for data-parallel loops, used by `PMAP`, `PFILTER` and `PREDUCE`.
+    ///
+    /// `parallelFor` splits a range of indexes into chunks, which the calling thread and the
+    /// workers run. Each thread starts with a contiguous share of the chunks in a deque of its
+    /// own, taking them from the back; when it runs out it steals from the front of another
+    /// thread's deque. So a thread that gets cheap chunks, or starts late, ends up doing more of
+    /// them, and all the threads finish at about the same time.
+    ///
+    /// The pool runs one loop at a time. A loop started while another is running -- by a thread
+    /// running a different Interpreter, or from inside a chunk -- just runs on the calling thread.
+    class ThreadPool {
+    public:
+        /// Runs the indexes from `begin` to `end` (exclusive.)
+        using ChunkFn = std::function<void(size_t begin, size_t end)>;
+
+        /// The process-wide pool. By default it has one worker per hardware thread, less one
+        /// for the thread calling `parallelFor`.
+        static ThreadPool& shared();
+
+        explicit ThreadPool(unsigned workers);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /// The number of threads that run a loop: the workers plus the caller.
+        unsigned concurrency() const                {return unsigned(_threads.size()) + 1;}
+
+        /// Stops the workers and starts `workers` new ones. Must not be called during a loop.
+        void setWorkerCount(unsigned workers);
+
+        /// Calls `fn` on chunks of at most `grain` indexes covering 0 to `n`, on this thread and
+        /// the workers, and returns when they've all finished. The chunks may run in any order.
+        /// If `fn` throws, the remaining chunks are skipped, and the first exception is rethrown.
+        void parallelFor(size_t n, size_t grain, const ChunkFn &fn);
+
+    private:
+        using Range = std::pair<size_t,size_t>;
+
+        struct Queue {
+            std::mutex          mutex;
+            std::deque<Range>   chunks;
+        };
+
+        void startWorkers(unsigned);
+        void stopWorkers();
+        void workerMain(unsigned index, uint64_t generation);
+        void runChunks(unsigned index);
+        bool takeChunk(unsigned index, Range&);
+
+        std::vector<std::thread>    _threads;
+        std::unique_ptr<Queue[]>    _queues;        // One per thread; the caller's is [0]
+        std::mutex                  _loopMutex;     // Held by the thread running a loop
+        std::mutex                  _mutex;         // Protects the state below
+        std::condition_variable     _wake, _done;
+        const ChunkFn*              _fn = nullptr;
+        uint64_t                    _generation = 0;    // Incremented at the start of each loop
+        unsigned                    _busy = 0;          // Workers still running the loop
+        bool                        _stopping = false;
+        std::atomic<bool>           _failed {false};
+        std::exception_ptr          _error;
+    };
+
+}
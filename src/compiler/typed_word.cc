@@ -0,0 +1,197 @@
+//
+// typed_word.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "typed_word.hh"
+#include "compiler.hh"
+#include "core_words.hh"
+#include "guarded_stack.hh"
+#include "vocabulary.hh"
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace tails {
+    using namespace std;
+    using namespace tails::core_words;
+
+
+#pragma mark - TRANSLATION:
+
+
+    template <class Policy>
+    TypedWord<Policy>::TypedWord(const Word &word)
+    :_word(word)
+    {
+        assert(!word.isNative());
+        if (word.stackEffect().isWeird() || word.isMetered())
+            return;
+        _start = translate(word.instruction().word);
+    }
+
+
+    // Translates interpreted code, ending with `_RETURN`, and remembers the result. Returns
+    // nullptr if it, or a word it calls, contains an instruction with no typed counterpart.
+    template <class Policy>
+    auto TypedWord<Policy>::translate(const tails::Instruction *code) -> const Instruction* {
+        if (auto i = _translated.find(code); i != _translated.end())
+            return i->second;
+        auto &vocab = Compiler::activeVocabularies();
+        size_t length;
+        for (const tails::Instruction *pc = code; ; ) {
+            const Word *word = vocab.lookup(*pc);
+            if (!word || !word->isNative())
+                return nullptr;
+            pc += 1 + word->parameters();
+            if (word == &_RETURN) {
+                length = pc - code;
+                break;
+            }
+        }
+
+        // Each instruction, and each parameter, becomes one typed instruction:
+        auto typed = make_unique<Instruction[]>(length);
+        for (size_t i = 0; i < length; ) {
+            const Word *word = vocab.lookup(code[i]);
+            if (!translateOp(*word, &code[i + 1], &typed[i]))
+                return nullptr;
+            i += 1 + word->parameters();
+        }
+        const Instruction *start = typed.get();
+        _code.push_back(move(typed));
+        _translated.emplace(code, start);
+        return start;
+    }
+
+
+    // Writes the typed op equivalent to `word`, and its parameters, to `out`.
+    template <class Policy>
+    bool TypedWord<Policy>::translateOp(const Word &word, const tails::Instruction *param,
+                                        Instruction *out)
+    {
+        auto literal = [&](Value v) {
+            Slot s;
+            if (!Policy::fromValue(v, s))
+                return false;
+            out[1] = Instruction::withLiteral(s);
+            return true;
+        };
+
+        if (word.hasIntParams())
+            out[1] = Instruction::withOffset(param->offset);
+
+        if (word == _RETURN)                out[0] = &Core::RETURN;
+        else if (word == NOP)               out[0] = &Core::NOP;
+        else if (word == ZERO)              out[0] = &Core::ZERO;
+        else if (word == ONE)               out[0] = &Core::ONE;
+        else if (word == DUP)               out[0] = &Core::DUP;
+        else if (word == DROP)              out[0] = &Core::DROP;
+        else if (word == SWAP)              out[0] = &Core::SWAP;
+        else if (word == OVER)              out[0] = &Core::OVER;
+        else if (word == ROT)               out[0] = &Core::ROT;
+        else if (word == _OVER2)            out[0] = &Core::OVER2;
+        else if (word == _DUPMULT || word == _DUPMULT_NUM)
+                                            out[0] = &Core::DUPMULT;
+        else if (word == I_)                out[0] = &Core::I;
+        else if (word == _BRANCH)           out[0] = &Core::BRANCH;
+        else if (word == _ZBRANCH || word == _ZBRANCH_NUM)
+                                            out[0] = &Core::ZBRANCH;
+        else if (word == _DUP_ZBRANCH)      out[0] = &Core::DUP_ZBRANCH;
+        else if (word == _EQZ_ZBRANCH)      out[0] = &Core::EQZ_ZBRANCH;
+        else if (word == _RECURSE)          out[0] = &Core::RECURSE;
+        else if (word == _DO)               out[0] = &Core::DO;
+        else if (word == _LOOP)             out[0] = &Core::LOOP;
+        else if (word == _LITERAL) {
+            out[0] = &Core::LITERAL;
+            return literal(param->literal);
+        } else if (word.hasWordParams()) {
+            // An `_INTERP` or `_TAILINTERP` word: translate the words it calls.
+            auto n = word.parameters();
+            bool tail = false;
+            for (auto &interps : kInterpWords) {
+                if (find(begin(interps), end(interps), &word) != end(interps))
+                    tail = (&interps == &kInterpWords[1]);
+            }
+            out[0] = Core::interpOp(n, tail);
+            for (size_t i = 0; i < n; ++i) {
+                auto callee = translate(param[i].word);
+                if (!callee)
+                    return false;
+                out[1 + i] = callee;
+            }
+        } else {
+            // On numbers, a generic word and its numeric variant do the same thing.
+            auto aw = lookupArithWord(word.instruction());
+            if (!aw)
+                return false;
+            switch (aw->form) {
+                case ArithForm::Binary:         out[0] = Core::binaryOp(aw->op); break;
+                case ArithForm::WithZero:       out[0] = Core::zeroOp(aw->op); break;
+                case ArithForm::Branch:         out[0] = Core::branchUnlessOp(aw->op); break;
+                case ArithForm::WithLiteral:    out[0] = Core::literalOp(aw->op);
+                                                return literal(param->literal);
+                case ArithForm::DupWithLiteral: out[0] = Core::dupLiteralOp(aw->op);
+                                                return literal(param->literal);
+            }
+        }
+        return true;
+    }
+
+
+#pragma mark - RUNNING:
+
+
+    template <class Policy>
+    auto TypedWord<Policy>::run(const vector<Slot> &inputs) const -> vector<Slot> {
+        if (!_start)
+            throw logic_error("Word couldn't be translated to the typed core");
+        StackEffect effect = _word.stackEffect();
+        size_t nInputs = effect.inputCount();
+        if (inputs.size() != nInputs)
+            throw invalid_argument("Wrong number of inputs");
+        // A recursive word runs on a GuardedSlotStack, which turns overflow into an exception:
+        unique_ptr<GuardedSlotStack<Slot>> guarded;
+        vector<Slot> stack;
+        Slot *base;                         // (with an empty stack, `sp` points below the base)
+        if (effect.maxIsUnknown()) {
+            guarded = make_unique<GuardedSlotStack<Slot>>();
+            base = guarded->base() + 1;
+        } else {
+            stack.resize(nInputs + effect.max() + 1);
+            base = &stack[1];
+        }
+        copy(inputs.begin(), inputs.end(), base);
+        size_t loopDepth = Core::loopDepth();
+        Slot *sp;
+        try {
+            if (guarded)
+                sp = guarded->run([&] {return call(base + nInputs - 1);});
+            else
+                sp = call(base + nInputs - 1);
+        } catch (...) {
+            Core::unwindLoops(loopDepth);
+            throw;
+        }
+        assert(sp == base + effect.outputCount() - 1);
+        (void)sp;
+        return vector<Slot>(base, base + effect.outputCount());
+    }
+
+
+    template class TypedWord<Int64Policy>;
+
+}
@@ -0,0 +1,80 @@
+//
+// typed_word.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "typed_core.hh"
+#include "word.hh"
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+
+namespace tails {
+
+    /// An interpreted word translated to run on a `TypedCore`, whose stack holds raw numbers
+    /// (such as `int64_t`s, depending on the value policy) instead of `Value`s.
+    ///
+    /// The word is compiled and stack-checked as usual by the Compiler; its instructions are then
+    /// translated one for one into the typed core's, so branch offsets carry over unchanged, and
+    /// interpreted words it calls are translated along with it. This works for words limited to
+    /// numbers: stack manipulation, numeric literals, arithmetic and comparisons, branches,
+    /// `DO ... LOOP`, `RECURSE`, and calls to other such words, along with the superinstructions
+    /// and numeric variants the compiler substitutes for them. Anything else (strings, arrays,
+    /// `null`, combinators, printing, or words compiled with profiling or metering) can't be
+    /// translated; check `isTranslated`.
+    template <class Policy>
+    class TypedWord {
+    public:
+        using Slot = typename Policy::Slot;
+        using Core = TypedCore<Policy>;
+
+        /// Translates `word`, which must be interpreted and must outlive this object.
+        explicit TypedWord(const Word &word);
+
+        /// True if the word could be translated. If not, it can't be run.
+        bool isTranslated() const                       {return _start != nullptr;}
+
+        const Word& word() const                        {return _word;}
+
+        /// Runs the word with `inputs` (bottom of the stack first), returning its outputs.
+        /// A recursive word runs on a GuardedSlotStack, so recursing too deeply throws
+        /// `stack_overflow`. Throws `std::logic_error` if it wasn't translated, or
+        /// `std::invalid_argument` if the number of inputs is wrong.
+        std::vector<Slot> run(const std::vector<Slot> &inputs) const;
+
+        /// Runs the word on a caller-provided stack, where `sp` points to the top item, returning
+        /// the new top. There must be room above `sp` for the stack to grow by the word's max;
+        /// if that's unknown, the stack should be a GuardedSlotStack, called through its `run`.
+        Slot* call(Slot *sp) const                      {return Core::call(sp, _start);}
+
+    private:
+        using Instruction = typename Core::Instruction;
+
+        const Instruction* translate(const tails::Instruction *code);
+        bool translateOp(const Word&, const tails::Instruction *param, Instruction *out);
+
+        const Word&                                         _word;
+        const Instruction*                                  _start = nullptr;
+        std::vector<std::unique_ptr<Instruction[]>>         _code;       // Translated words
+        std::unordered_map<const tails::Instruction*, const Instruction*> _translated;
+    };
+
+
+    extern template class TypedWord<Int64Policy>;
+
+}
@@ -25,7 +25,7 @@
 
 namespace tails {
 
-    const Vocabulary Vocabulary::core(core_words::kWords);
+    const Vocabulary Vocabulary::core(core_words::kWords, core_words::lookupCoreWord);
 
 
     Vocabulary::Vocabulary(const Word* const *wordList) {
@@ -33,31 +33,67 @@ namespace tails {
     }
 
 
+    Vocabulary::Vocabulary(const Word* const *wordList,
+                           const Word* (*lookupFn)(std::string_view) noexcept)
+    :Vocabulary(wordList)
+    {
+        _lookupFn = lookupFn;
+    }
+
+
+    // (Word lists are static, so their words can't have garbage-collected literals to scan.)
     void Vocabulary::add(const Word* const *wordList) {
         while (*wordList)
-            add(**wordList++);
+            add(**wordList++, false);
     }
 
 
     void Vocabulary::add(const Word &word) {
+        add(word, !word.isNative());
+    }
+
+
+    void Vocabulary::add(const Word &word, Value body) {
+        // (The body's literals are marked along with it, so the word itself needn't be scanned.)
+        if (add(word, false))
+            _bodies.push_back(body);
+    }
+
+
+    // A word with the same name as an existing one replaces it. The old Word isn't freed, since
+    // words compiled earlier may still call it; for the same reason its literals are still
+    // scanned, as a retired word.
+    bool Vocabulary::add(const Word &word, bool needsScan) {
+        if (auto i = _words.find(word.name()); i != _words.end()) {
+            if (i->second == &word)
+                return false;
+            _retired.push_back(i->second);
+            _words.erase(i);
+        }
         _words.insert({word.name(), &word});
+        _byInstruction.insert({word.instruction().word, &word});
+        if (needsScan)
+            _newWords.push_back(&word);
+        return true;
     }
 
 
     const Word* Vocabulary::lookup(std::string_view name) const {
-        if (auto i = _words.find(toupper(std::string(name))); i != _words.end())
+        if (_lookupFn)
+            return _lookupFn(name);
+        else if (auto i = _words.find(name); i != _words.end())
             return i->second;
         else
             return nullptr;
     }
 
 
+    // (The index is keyed by `Instruction::word`, which for a native word is its `Op` pointer.)
     const Word* Vocabulary::lookup(Instruction instr) const {
-        for (auto i = _words.begin(); i != _words.end(); ++i) {
-            if (i->second->instruction() == instr)
-                return i->second;
-        }
-        return nullptr;
+        if (auto i = _byInstruction.find(instr.word); i != _byInstruction.end())
+            return i->second;
+        else
+            return nullptr;
     }
 
 
@@ -97,9 +133,29 @@ namespace tails {
     }
 
 
+    void Vocabulary::gcScan() const {
+        if (gc::object::isMinorCollection()) {
+            for (auto word : _newWords)
+                gc::object::scanWord(word);
+        } else {
+            for (auto &entry : _words)
+                gc::object::scanWord(entry.second);
+            for (auto word : _retired)
+                gc::object::scanWord(word);
+        }
+        size_t first = gc::object::isMinorCollection() ? _nScannedBodies : 0;
+        for (size_t i = first; i < _bodies.size(); ++i)
+            _bodies[i].mark();
+        if (!_newWords.empty())
+            _newWords.clear();      // (Vocabulary::core is shared between threads; don't write it)
+        if (_nScannedBodies != _bodies.size())
+            _nScannedBodies = _bodies.size();
+    }
+
+
     void VocabularyStack::gcScan() {
-        for (auto word : *this)
-            gc::object::scanWord(word);
+        for (auto vocab : _active)
+            vocab->gcScan();
     }
 
 
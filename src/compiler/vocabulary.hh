@@ -18,6 +18,7 @@
 
 #pragma once
 #include "instruction.hh"
+#include "utils.hh"
 #include <string_view>
 #include <unordered_map>
 #include <vector>
@@ -33,14 +34,22 @@ namespace tails {
 
         explicit Vocabulary(const Word* const *wordList);
 
+        /// Constructs a Vocabulary whose name lookups go to a faster function, e.g. a perfect hash.
+        Vocabulary(const Word* const *wordList, const Word* (*lookupFn)(std::string_view) noexcept);
+
+        /// Adds a word. If one with the same name exists, the new word replaces it.
         void add(const Word &word);
 
+        /// Adds a word whose instructions belong to a garbage-collected object, `body`, such as
+        /// a quotation named by `DEFINE`. The Vocabulary keeps the body alive.
+        void add(const Word &word, Value body);
+
         void add(const Word* const *wordList);
 
         const Word* lookup(std::string_view name) const;
         const Word* lookup(Instruction) const;
 
-        using map = std::unordered_map<std::string_view, const Word*>;
+        using map = std::unordered_map<std::string_view, const Word*, HashNoCase, EqualNoCase>;
         using iterator = map::const_iterator;
 
         iterator begin() const    {return _words.begin();}
@@ -49,8 +58,22 @@ namespace tails {
         // The vocabulary of core words.
         static const Vocabulary core;
 
+        /// Marks the objects referenced by words' literals, for the garbage collector, including
+        /// those of words that have been replaced, since words compiled earlier still call them.
+        /// In a minor collection only words added since the previous collection are scanned,
+        /// since older words' literals have already been promoted.
+        void gcScan() const;
+
     private:
+        bool add(const Word&, bool needsScan);
+
         map         _words;
+        mutable std::vector<const Word*> _newWords;   // Words added since last gcScan
+        std::vector<const Word*> _retired;          // Words replaced by ones of the same name
+        std::vector<Value> _bodies;                 // Objects owning words' instructions
+        mutable size_t     _nScannedBodies = 0;     // Number of _bodies as of last gcScan
+        const Word* (*_lookupFn)(std::string_view) noexcept = nullptr;
+        std::unordered_map<const Instruction*, const Word*> _byInstruction; // Reverse index
     };
 
 
@@ -71,6 +94,7 @@ namespace tails {
         void setCurrent(Vocabulary* v)              {_current = v;}
         void setCurrent(Vocabulary &v)              {return setCurrent(&v);}
 
+        /// Calls `gcScan` on each active Vocabulary.
         void gcScan();
 
         class iterator {
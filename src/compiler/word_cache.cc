@@ -0,0 +1,157 @@
+//
+// word_cache.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "word_cache.hh"
+#include "compiler.hh"
+#include "gc.hh"
+#include "interpreter.hh"
+#include "word.hh"
+#include <cctype>
+
+
+namespace tails {
+    using namespace std;
+
+
+    WordCache::WordCache(Interpreter &interpreter, size_t capacity)
+    :_interpreter(&interpreter)
+    {
+        _slots.resize(capacity, NullValue);
+        clear();
+        if (capacity > 0) {
+            Interpreter::Using using_(interpreter);
+            gc::object::addRootRange(&_slots.front(), &_slots.back());
+        }
+    }
+
+
+    WordCache::~WordCache() {
+        if (!_slots.empty()) {
+            Interpreter::Using using_(*_interpreter);
+            gc::object::removeRootRange(&_slots.front());
+        }
+        if (_interpreter->wordCache == this)
+            _interpreter->wordCache = nullptr;
+    }
+
+
+    void WordCache::clear() {
+        _index.clear();
+        _entries.clear();
+        fill(_slots.begin(), _slots.end(), NullValue);
+        _freeSlots.clear();
+        for (size_t i = _slots.size(); i-- > 0; )
+            _freeSlots.push_back(i);
+    }
+
+
+    void WordCache::appendNormalized(string &key, string_view source) {
+        bool inString = false, pendingSpace = false, empty = true;
+        for (char c : source) {
+            if (!inString && isspace((unsigned char)c)) {
+                pendingSpace = !empty;
+                continue;
+            }
+            if (pendingSpace)
+                key += ' ';
+            pendingSpace = empty = false;
+            key += c;
+            if (c == '"')
+                inString = !inString;
+        }
+    }
+
+
+    string WordCache::keyPrefix(char kind) const {
+        return {kind, char('0' + int(_interpreter->profiling)), char('0' + _interpreter->metering)};
+    }
+
+
+    const Word& WordCache::compile(const string &source, const Value *bottom, const Value *top) {
+        assert(&Interpreter::current() == _interpreter);
+        string key = keyPrefix('W');
+        if (bottom && top) {
+            for (auto vp = bottom; vp <= top; ++vp)
+                key += char('0' + vp->type());
+        }
+        key += ':';
+        appendNormalized(key, source);
+
+        vector<const Word*> dependencies;
+        Value quote = lookup(key, dependencies);
+        if (quote.isNull()) {
+            Compiler compiler;
+            compiler.setInputStack(bottom, top);
+            compiler.parse(source);
+            quote = compiler.makeQuote();
+            add(move(key), quote, compiler._dependencies);
+        }
+        return *quote.asQuote();
+    }
+
+
+    Value WordCache::lookup(const string &key, vector<const Word*> &dependencies) {
+        auto i = _index.find(key);
+        if (i == _index.end()) {
+            ++_misses;
+            return NullValue;
+        }
+        auto entry = i->second;
+        auto &vocabularies = Compiler::activeVocabularies();
+        for (auto &[name, word] : entry->dependencies) {
+            if (vocabularies.lookup(name) != word) {
+                // A word it calls has been redefined, so it's stale:
+                remove(entry);
+                ++_misses;
+                return NullValue;
+            }
+        }
+        _entries.splice(_entries.begin(), _entries, entry);
+        for (auto &dep : entry->dependencies)
+            dependencies.push_back(dep.second);
+        ++_hits;
+        return _slots[entry->slot];
+    }
+
+
+    void WordCache::add(string key, Value quote, const vector<const Word*> &dependencies) {
+        if (_slots.empty())
+            return;
+        if (auto i = _index.find(key); i != _index.end())
+            remove(i->second);
+        if (_freeSlots.empty())
+            remove(prev(_entries.end()));
+        size_t slot = _freeSlots.back();
+        _freeSlots.pop_back();
+        _slots[slot] = quote;
+
+        Entry &entry = _entries.emplace_front(Entry{move(key), slot, {}});
+        for (const Word *word : dependencies)
+            entry.dependencies.emplace_back(word->name(), word);
+        _index.emplace(entry.key, _entries.begin());
+    }
+
+
+    void WordCache::remove(list<Entry>::iterator entry) {
+        _index.erase(entry->key);
+        _slots[entry->slot] = NullValue;
+        _freeSlots.push_back(entry->slot);
+        _entries.erase(entry);
+    }
+
+}
@@ -0,0 +1,112 @@
+//
+// word_cache.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "value.hh"
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace tails {
+    class Interpreter;
+    class Word;
+
+
+    /// A cache of compiled code, for a host that compiles the same source over and over, like a
+    /// service handling queries made from a few templates, or a REPL.
+    ///
+    /// `compile` looks up the source, normalized by collapsing whitespace outside string
+    /// literals, together with the types of the input stack items and the Interpreter's
+    /// compilation settings. If they've been compiled before, it returns the same word without
+    /// parsing or stack-checking anything. The least recently used entries are evicted when it's
+    /// full.
+    ///
+    /// Set as the Interpreter's `wordCache`, it also hash-conses quotation literals: identical
+    /// `{...}` in any source compiled by that Interpreter share one quotation object and its code.
+    ///
+    /// An entry remembers each word its source called by name. When one of those names no longer
+    /// finds the same word, because it's been redefined by `DEFINE` or is hidden by a word in
+    /// another vocabulary, the entry is stale, and the source is compiled again.
+    ///
+    /// The cached code is kept alive by the cache, across garbage collections. It belongs to the
+    /// Interpreter, which must outlive the cache.
+    class WordCache {
+    public:
+        static constexpr size_t kDefaultCapacity = 256;
+
+        explicit WordCache(Interpreter&, size_t capacity = kDefaultCapacity);
+        ~WordCache();
+
+        WordCache(const WordCache&) = delete;
+        WordCache& operator=(const WordCache&) = delete;
+
+        /// Returns the word compiled from `source`, whose inputs will be the stack items from
+        /// `bottom` to `top` (as in `Compiler::setInputStack`), compiling it if it isn't cached.
+        /// The Interpreter must be current. The word remains valid until the next call to
+        /// `compile` or `clear`, which may evict it.
+        /// @throw compile_error if it can't be compiled; its `location` points into `source`.
+        const Word& compile(const std::string &source, const Value *bottom, const Value *top);
+
+        /// Removes all entries.
+        void clear();
+
+        size_t size() const                             {return _index.size();}
+        size_t capacity() const                         {return _slots.size();}
+
+        /// The number of lookups (by `compile`, or of quotations) that did, or didn't, find
+        /// a valid entry.
+        size_t hits() const                             {return _hits;}
+        size_t misses() const                           {return _misses;}
+
+    private:
+        friend class Compiler;
+
+        /// A word called by name, and the name.
+        using Dependency = std::pair<std::string, const Word*>;
+
+        struct Entry {
+            std::string             key;
+            size_t                  slot;           // Index in `_slots` of the quotation
+            std::vector<Dependency> dependencies;
+        };
+
+        /// Appends source code to a key, collapsing whitespace outside string literals.
+        static void appendNormalized(std::string &key, std::string_view source);
+        /// The key prefix for the Interpreter's current compilation settings.
+        std::string keyPrefix(char kind) const;
+
+        /// Returns the quotation for `key`, or null if there's no valid entry. Appends the
+        /// entry's dependencies to `dependencies`.
+        Value lookup(const std::string &key, std::vector<const Word*> &dependencies);
+        /// Adds a quotation, evicting the least recently used entry if necessary.
+        void add(std::string key, Value quote, const std::vector<const Word*> &dependencies);
+        void remove(std::list<Entry>::iterator);
+
+        Interpreter*                    _interpreter;
+        std::list<Entry>                _entries;   // Most recently used first
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> _index;
+        std::vector<Value>              _slots;     // The quotations; a GC root range
+        std::vector<size_t>             _freeSlots;
+        size_t                          _hits = 0, _misses = 0;
+    };
+
+}
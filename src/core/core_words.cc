@@ -19,7 +19,17 @@
 // Reference: <https://forth-standard.org/standard/core>
 
 #include "core_words.hh"
+#include "gc.hh"
+#include "profile.hh"
 #include "stack_effect.hh"
+#include "stack_effect_parser.hh"
+#include "utils.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
 
 namespace tails::core_words {
@@ -41,7 +51,7 @@ namespace tails::core_words {
     NATIVE_WORD(_INTERP, "_INTERP", StackEffect::weird(),
                 Word::MagicWordParam)
     {
-        sp = call(sp, (pc++)->word);
+        CALL_WORD((pc++)->word);
         NEXT();
     }
 
@@ -49,6 +59,8 @@ namespace tails::core_words {
     NATIVE_WORD(_RETURN, "_RETURN", StackEffect(),
                 Word::Magic)
     {
+        (void)pc;
+        SPILL();
         return sp;
     }
 
@@ -56,9 +68,9 @@ namespace tails::core_words {
     // (The stack effect is declared as untyped, but the stack checker sees the literal value on
     // the simulated stack and knows its exact type.)
     NATIVE_WORD(_LITERAL, "_LITERAL", StackEffect({}, {Any}),
-                Word::MagicValParam)
+                Word::MagicValParam | Word::Pure)
     {
-        *(++sp) = (pc++)->literal;
+        PUSH((pc++)->literal);
         NEXT();
     }
 
@@ -69,8 +81,8 @@ namespace tails::core_words {
     NATIVE_WORD(_INTERP2, "_INTERP2", StackEffect::weird(),
                 Word::MagicWordParam, 2)
     {
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
         NEXT();
     }
 
@@ -78,8 +90,9 @@ namespace tails::core_words {
     NATIVE_WORD(_INTERP3, "_INTERP3", StackEffect::weird(),
                 Word::MagicWordParam, 3)
     {
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
         NEXT();
     }
 
@@ -87,10 +100,10 @@ namespace tails::core_words {
     NATIVE_WORD(_INTERP4, "_INTERP4", StackEffect::weird(),
                 Word::MagicWordParam, 4)
     {
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
         NEXT();
     }
 
@@ -101,34 +114,34 @@ namespace tails::core_words {
     NATIVE_WORD(_TAILINTERP, "_TAILINTERP", StackEffect::weird(),
                 Word::MagicWordParam, 1)
     {
-        MUSTTAIL return call(sp, pc->word);
+        TAIL_CALL(pc->word);
     }
 
     // Interprets 2 following words, jumping to the last one.
     NATIVE_WORD(_TAILINTERP2, "_TAILINTERP2", StackEffect::weird(),
                 Word::MagicWordParam, 2)
     {
-        sp = call(sp, (pc++)->word);
-        MUSTTAIL return call(sp, pc->word);
+        CALL_WORD((pc++)->word);
+        TAIL_CALL(pc->word);
     }
 
     // Interprets 3 following words, jumping to the last one.
     NATIVE_WORD(_TAILINTERP3, "_TAILINTERP3", StackEffect::weird(),
                 Word::MagicWordParam, 3)
     {
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
-        MUSTTAIL return call(sp, pc->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        TAIL_CALL(pc->word);
     }
 
     // Interprets 4 following words, jumping to the last one.
     NATIVE_WORD(_TAILINTERP4, "_TAILINTERP4", StackEffect::weird(),
                 Word::MagicWordParam, 4)
     {
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
-        sp = call(sp, (pc++)->word);
-        MUSTTAIL return call(sp, pc->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        CALL_WORD((pc++)->word);
+        TAIL_CALL(pc->word);
     }
 
     // There's no reason there couldn't be more of these: _INTERP5, _INTERP6, ...
@@ -137,39 +150,40 @@ namespace tails::core_words {
 
 #pragma mark Stack gymnastics:
 
-    NATIVE_WORD(DUP, "DUP", StackEffect({Any}, {Any/0, Any/0})) {
-        ++sp;
-        sp[0] = sp[-1];
+    NATIVE_WORD(DUP, "DUP", StackEffect({Any}, {Any/0, Any/0}), Word::Pure) {
+        PUSH(S0);
         NEXT();
     }
 
-    NATIVE_WORD(DROP, "DROP", StackEffect({Any}, {})) {
-        --sp;
+    NATIVE_WORD(DROP, "DROP", StackEffect({Any}, {}), Word::Pure) {
+        DROPN(1);
         NEXT();
     }
 
     NATIVE_WORD(SWAP, "SWAP", StackEffect({Any,   Any},
-                                          {Any/0, Any/1}))
+                                          {Any/0, Any/1}),
+                Word::Pure)
     {
-        std::swap(sp[0], sp[-1]);
+        std::swap(S0, S1);
         NEXT();
     }
 
     NATIVE_WORD(OVER, "OVER", StackEffect({Any,   Any},
-                                          {Any/1, Any/0, Any/1}))
+                                          {Any/1, Any/0, Any/1}),
+                Word::Pure)
     {
-        ++sp;
-        sp[0] = sp[-2];
+        PUSH(S1);
         NEXT();
     }
 
     NATIVE_WORD(ROT, "ROT", StackEffect({Any,   Any,   Any},
-                                        {Any/1, Any/0, Any/2}))
+                                        {Any/1, Any/0, Any/2}),
+                Word::Pure)
     {
-        auto sp2 = sp[-2];
-        sp[-2] = sp[-1];
-        sp[-1] = sp[ 0];
-        sp[ 0] = sp2;
+        auto s2 = S2;
+        S2 = S1;
+        S1 = S0;
+        S0 = s2;
         NEXT();
     }
 
@@ -188,11 +202,17 @@ namespace tails::core_words {
         But t
      */
 
+    // A GC safepoint: every loop ends with a BRANCH backwards, so garbage can be collected there
+    // when the allocation budget has been used up.
+    #define SAFEPOINT() \
+        if (_usuallyFalse(gc::object::overBudget())) { SPILL(); gc::object::safepoint(sp); }
+
     // reads offset from *pc
     NATIVE_WORD(_BRANCH, "BRANCH", StackEffect(),
                 Word::MagicIntParam)
     {
         pc += pc->offset + 1;
+        SAFEPOINT();
         NEXT();
     }
 
@@ -200,7 +220,7 @@ namespace tails::core_words {
     NATIVE_WORD(_ZBRANCH, "0BRANCH", StackEffect({Any}, {}),
                 Word::MagicIntParam)
     {
-        if (!(*sp--))
+        if (!POP())
             pc += pc->offset;
         ++pc;
         NEXT();
@@ -211,7 +231,152 @@ namespace tails::core_words {
     NATIVE_WORD(_RECURSE, "_RECURSE", StackEffect::weird(),
                 Word::MagicIntParam)
     {
-        call(sp, pc + 1 + pc->offset);
+        SAFEPOINT();
+        CALL_WORD(pc + 1 + pc->offset);
+        ++pc;
+        NEXT();
+    }
+
+
+#pragma mark Counted Loops:
+
+    // The index and limit of each running `DO ... LOOP` or `TIMES` are kept on a per-thread
+    // loop-control stack (like Forth's return stack), not the data stack, so that the loop's body
+    // can use the values below them. `tLoopTop` points just past the innermost loop's frame.
+    // (The hot pointers are plain thread_locals, so using them needs no initialization check.)
+    static thread_local LoopFrame *tLoopBase = nullptr, *tLoopTop = nullptr, *tLoopEnd = nullptr;
+    static thread_local std::unique_ptr<LoopFrame[]> tLoops;   // Owns the frames
+
+    NOINLINE static void growLoops() {
+        size_t depth = tLoopTop - tLoopBase, capacity = std::max(size_t(16), 2 * depth);
+        auto loops = std::make_unique<LoopFrame[]>(capacity);
+        std::copy(tLoopBase, tLoopTop, loops.get());
+        tLoopBase = loops.get();
+        tLoopTop = tLoopBase + depth;
+        tLoopEnd = tLoopBase + capacity;
+        tLoops = std::move(loops);
+    }
+
+    static inline void pushLoop(double index, double limit) {
+        if (_usuallyFalse(tLoopTop == tLoopEnd))
+            growLoops();
+        *tLoopTop++ = {index, limit};
+    }
+
+    [[noreturn]] NOINLINE static void notInLoop() {
+        throw std::runtime_error("I used outside of a loop");
+    }
+
+    size_t loopDepth() noexcept {
+        return tLoopTop - tLoopBase;
+    }
+
+    void unwindLoops(size_t depth) noexcept {
+        tLoopTop = std::min(tLoopTop, tLoopBase + depth);
+    }
+
+    void restoreLoops(const std::vector<LoopFrame> &loops) {
+        for (auto &loop : loops)
+            pushLoop(loop.index, loop.limit);
+    }
+
+    // (limit start -- )  Begins a `DO ... LOOP`, pushing a loop-control frame. If `start` isn't
+    // below `limit` the body is skipped: the offset at *pc goes past the matching `_LOOP`.
+    NATIVE_WORD(_DO, "_DO", StackEffect({Num, Num}, {}),
+                Word::MagicIntParam)
+    {
+        double start = POP().asDouble(), limit = POP().asDouble();
+        if (start < limit) {
+            pushLoop(start, limit);
+            ++pc;
+        } else {
+            pc += pc->offset + 1;
+        }
+        NEXT();
+    }
+
+    // Ends a `DO ... LOOP`: increments the index, and if it's still below the limit, branches back
+    // to the start of the body (by the offset at *pc); else pops the loop-control frame.
+    // The increment, test and branch are fused into one instruction since they run every iteration.
+    NATIVE_WORD(_LOOP, "_LOOP", StackEffect(),
+                Word::MagicIntParam)
+    {
+        LoopFrame &loop = tLoopTop[-1];
+        if (++loop.index < loop.limit) {
+            pc += pc->offset + 1;
+            SAFEPOINT();
+        } else {
+            --tLoopTop;
+            ++pc;
+        }
+        NEXT();
+    }
+
+    // ( -- i)  Pushes the index of the innermost running `DO ... LOOP` or `TIMES`.
+    NATIVE_WORD(I_, "I", StackEffect({}, {Num})) {
+        if (_usuallyFalse(tLoopTop == tLoopBase))
+            notInLoop();
+        PUSH(Value(tLoopTop[-1].index));
+        NEXT();
+    }
+
+
+#pragma mark Fuel Metering:
+
+    static thread_local FuelMeter tFuelMeter;
+
+    FuelMeter swapFuelMeter(const FuelMeter &meter) noexcept {
+        return std::exchange(tFuelMeter, meter);
+    }
+
+    // Called by `_FUEL` when the fuel's used up. Suspends the running continuation, resuming at
+    // `pc`, by throwing a Suspension -- unless a native word is calling interpreted code (it's
+    // pushed a GC root), or no continuation is running; then it returns, leaving the fuel used up.
+    NOINLINE static void outOfFuel(Value *sp, const Instruction *pc) {
+        if (!tFuelMeter.suspendable || gc::object::rootDepth() != tFuelMeter.rootDepth)
+            return;
+        Suspension s {sp, {pc}, {}};
+        s.loops.assign(tLoopBase + tFuelMeter.loopDepth, tLoopTop);
+        throw s;
+    }
+
+    // Precedes each back-edge of a metered word: a backward BRANCH, `_LOOP` or `_RECURSE`.
+    // Uses up a unit of fuel, and if there's none left, suspends the word.
+    NATIVE_WORD(_FUEL, "_FUEL", StackEffect(),
+                Word::Magic)
+    {
+        if (_usuallyFalse(--tFuelMeter.fuel <= 0)) {
+            SPILL();
+            outOfFuel(sp, pc);
+        }
+        NEXT();
+    }
+
+    // The forms of `_INTERP` and `_RECURSE` in metered words. If the word they call suspends,
+    // they add the instruction after the call to the Suspension, so this word will resume there.
+    // (Catching it costs the plain ones too much.)
+    NATIVE_WORD(_INTERP_METERED, "_INTERP_METERED", StackEffect::weird(),
+                Word::MagicWordParam)
+    {
+        try {
+            CALL_WORD((pc++)->word);
+        } catch (Suspension &s) {
+            s.frames.push_back(pc);
+            throw;
+        }
+        NEXT();
+    }
+
+    NATIVE_WORD(_RECURSE_METERED, "_RECURSE_METERED", StackEffect::weird(),
+                Word::MagicIntParam)
+    {
+        SAFEPOINT();
+        try {
+            CALL_WORD(pc + 1 + pc->offset);
+        } catch (Suspension &s) {
+            s.frames.push_back(pc + 1);
+            throw;
+        }
         ++pc;
         NEXT();
     }
@@ -224,9 +389,86 @@ namespace tails::core_words {
     NATIVE_WORD(CALL, "CALL", StackEffect::weird(),
                 Word::Magic)
     {
-        const Word *quote = (*sp--).asQuote();
+        Value quoteVal = POP();
+        const Word *quote = quoteVal.asQuote();
         assert(quote);                                  // FIXME: Handle somehow; exceptions?
-        sp = call(sp, quote->instruction().word);
+        gc::object::pushRoot(quoteVal);                 // keep it alive during safepoints
+        CALL_WORD(quote->instruction().word);
+        gc::object::popRoot();
+        NEXT();
+    }
+
+
+#pragma mark Profiling:
+
+    // The first instruction of a word compiled with ProfileMode::Counts. Counts a call; once
+    // there have been enough, promotes the word to native code, and from then on jumps to that.
+    NATIVE_WORD(_PROFILE, "_PROFILE", StackEffect(),
+                Word::Magic, 1)
+    {
+        WordProfile *profile = (pc++)->profile;
+        profile->countCall();
+        if (_usuallyFalse(profile->calls.load(std::memory_order_relaxed)
+                                == WordProfile::kPromotionCalls)) {
+            if (auto promote = WordProfile::promoter.load(std::memory_order_relaxed); promote)
+                promote(pc - 2, *profile);
+        }
+        if (Op native = profile->nativeCode.load(std::memory_order_acquire); native)
+            JUMP_TO(native);
+        NEXT();
+    }
+
+    // The timed calls in progress on this thread, innermost last, so that the ones an exception
+    // or a stack fault unwinds can still be ended.
+    namespace {
+        struct TimedCall {
+            WordProfile* profile;
+            uint64_t     start;
+        };
+    }
+    static thread_local std::vector<TimedCall> tTimedCalls;
+
+    size_t timedCallDepth() noexcept {
+        return tTimedCalls.size();
+    }
+
+    void unwindTimedCalls(size_t depth) noexcept {
+        uint64_t now = readCycleCounter();
+        while (tTimedCalls.size() > depth) {
+            TimedCall &call = tTimedCalls.back();
+            call.profile->exit(now - call.start);
+            tTimedCalls.pop_back();
+        }
+    }
+
+    // The first instruction of a word compiled with ProfileMode::Cycles. Counts a call, then runs
+    // the rest of the word as a nested call so it can add the number of cycles it took.
+    NATIVE_WORD(_PROFILE_TIMED, "_PROFILE_TIMED", StackEffect(),
+                Word::Magic, 1)
+    {
+        WordProfile *profile = (pc++)->profile;
+        profile->countCall();
+        profile->enter();
+        size_t depth = tTimedCalls.size();
+        tTimedCalls.push_back({profile, readCycleCounter()});
+        try {
+            CALL_WORD(pc);
+        } catch (...) {
+            // (After a Suspension, the rest of the word resumes without this op; so this call
+            // ends now either way.)
+            unwindTimedCalls(depth);
+            throw;
+        }
+        unwindTimedCalls(depth);
+        SPILL();
+        return sp;
+    }
+
+    // Precedes a backward BRANCH in a profiled word. Counts a loop iteration.
+    NATIVE_WORD(_PROFILE_LOOP, "_PROFILE_LOOP", StackEffect(),
+                Word::Magic, 1)
+    {
+        (pc++)->profile->countLoop();
         NEXT();
     }
 
@@ -237,8 +479,314 @@ namespace tails::core_words {
     // Stack effect is dependent on quote1 and quote2; currently this word is special-cased by
     // the compiler's stack-checker.
     NATIVE_WORD(IFELSE, "IFELSE", StackEffect::weird()) {
-        const Word *quote = (!!sp[-2] ? sp[-1] : sp[0]).asQuote();
-        sp = call(sp - 3, quote->instruction().word);
+        Value quoteVal = !!S2 ? S1 : Value(S0);
+        DROPN(3);
+        gc::object::pushRoot(quoteVal);                 // keep it alive during safepoints
+        CALL_WORD(quoteVal.asQuote()->instruction().word);
+        gc::object::popRoot();
+        NEXT();
+    }
+
+    // The array combinators below call their quotation once per item. The item is pushed where
+    // the quotation expects its last input, and the quotation runs directly on the caller's
+    // stack, so no frame or intermediate array is set up per call.
+    //
+    // As a fast path, if the quotation is a single numeric op like `{2 *}`, `{0>}` or `{+}`
+    // and every item of the array is a number, the op is applied directly to the `double`s in a
+    // loop the C++ compiler can vectorize.
+
+    // A numeric op that MAP, FILTER or REDUCE can apply to an array's items directly.
+    enum class Kernel : uint8_t { None, Plus, Minus, Mult, Square, Eq, Ne, Gt, Lt };
+
+    struct KernelWord {
+        const Word* word;
+        Kernel      kernel;
+        bool        hasLiteral;         // The word's parameter is the right-hand operand
+    };
+
+    // Unary forms, `(x -- y)`, usable by MAP and FILTER:
+    static const KernelWord kUnaryKernels[] = {
+        {&_LITPLUS,  Kernel::Plus,  true},  {&_LITPLUS_NUM,  Kernel::Plus,  true},
+        {&_LITMINUS, Kernel::Minus, true},  {&_LITMINUS_NUM, Kernel::Minus, true},
+        {&_LITMULT,  Kernel::Mult,  true},  {&_LITMULT_NUM,  Kernel::Mult,  true},
+        {&_LITEQ,    Kernel::Eq,    true},  {&_LITEQ_NUM,    Kernel::Eq,    true},
+        {&_LITGT,    Kernel::Gt,    true},  {&_LITGT_NUM,    Kernel::Gt,    true},
+        {&_LITLT,    Kernel::Lt,    true},  {&_LITLT_NUM,    Kernel::Lt,    true},
+        {&_DUPMULT,  Kernel::Square, false},{&_DUPMULT_NUM,  Kernel::Square, false},
+        {&EQ_ZERO,   Kernel::Eq,    false}, {&NE_ZERO,       Kernel::Ne,    false},
+        {&GT_ZERO,   Kernel::Gt,    false}, {&LT_ZERO,       Kernel::Lt,    false},
+    };
+
+    // Binary forms, `(acc x -- acc)`, usable by REDUCE:
+    static const KernelWord kBinaryKernels[] = {
+        {&PLUS, Kernel::Plus, false},      {&_PLUS_NUM, Kernel::Plus, false},
+        {&MULT, Kernel::Mult, false},      {&_MULT_NUM, Kernel::Mult, false},
+    };
+
+    // Identifies a quotation consisting of a single op from `table`, returning its kernel and
+    // storing its literal operand (or 0) in `operand`.
+    template <size_t N>
+    static Kernel findKernel(Value quoteVal, const KernelWord (&table)[N], double &operand) {
+        const Word *quote = quoteVal.asQuote();
+        if (quote->isNative())
+            return Kernel::None;
+        const Instruction *pc = quote->instruction().word;
+        for (const KernelWord &k : table) {
+            if (*pc == *k.word) {
+                operand = 0;
+                if (k.hasLiteral) {
+                    if (!pc[1].literal.isDouble())
+                        return Kernel::None;        // e.g. `{"x" +}`
+                    operand = pc[1].literal.asDouble();
+                    ++pc;
+                }
+                return (pc[1] == _RETURN) ? k.kernel : Kernel::None;
+            }
+        }
+        return Kernel::None;
+    }
+
+    bool hasArrayKernel(Value quote, bool binary) {
+        double k;
+        Kernel kernel = binary ? findKernel(quote, kBinaryKernels, k)
+                               : findKernel(quote, kUnaryKernels, k);
+        return kernel != Kernel::None;
+    }
+
+    static bool allNumbers(ArrayItems items) {
+        for (Value item : items)
+            if (!item.isDouble())
+                return false;
+        return true;
+    }
+
+    // Numbers are compared for equality bitwise, as by `Value::operator==`.
+    static inline bool sameNumber(double a, double b) {
+        uint64_t ia, ib;
+        memcpy(&ia, &a, sizeof(ia));
+        memcpy(&ib, &b, sizeof(ib));
+        return ia == ib;
+    }
+
+    // Calls `fn` with a lambda applying the kernel to a double; the switch is outside the loop.
+    template <class FN>
+    static void withKernel(Kernel kernel, double k, FN fn) {
+        switch (kernel) {
+            case Kernel::Plus:   fn([=](double x) {return x + k;}); break;
+            case Kernel::Minus:  fn([=](double x) {return x - k;}); break;
+            case Kernel::Mult:   fn([=](double x) {return x * k;}); break;
+            case Kernel::Square: fn([=](double x) {return x * x;}); break;
+            case Kernel::Eq:     fn([=](double x) {return double(sameNumber(x, k));}); break;
+            case Kernel::Ne:     fn([=](double x) {return double(!sameNumber(x, k));}); break;
+            case Kernel::Gt:     fn([=](double x) {return double(x > k);}); break;
+            case Kernel::Lt:     fn([=](double x) {return double(x < k);}); break;
+            case Kernel::None:   break;
+        }
+    }
+
+    static Value mapNumbers(ArrayItems items, Kernel kernel, double k) {
+        std::vector<Value> result(items.size());
+        withKernel(kernel, k, [&](auto op) {
+            const Value *in = items.begin();
+            Value *out = result.data();
+            for (size_t i = 0, n = items.size(); i < n; ++i)
+                out[i] = Value(op(in[i].asDouble()));
+        });
+        return Value(std::move(result));
+    }
+
+    static Value filterNumbers(ArrayItems items, Kernel kernel, double k) {
+        // First compute which items to keep, in a vectorizable loop, then copy them:
+        auto n = items.size();
+        std::vector<uint8_t> keep(n);
+        withKernel(kernel, k, [&](auto op) {
+            const Value *in = items.begin();
+            for (size_t i = 0; i < n; ++i)
+                keep[i] = (op(in[i].asDouble()) != 0);
+        });
+        std::vector<Value> result;
+        result.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            if (keep[i])
+                result.push_back(items[i]);
+        return Value(std::move(result));
+    }
+
+    static Value reduceNumbers(ArrayItems items, double acc, Kernel kernel) {
+        // This folds left to right, like the interpreted loop, so the result is rounded the
+        // same way; splitting it across SIMD lanes would reassociate the additions.
+        if (kernel == Kernel::Plus) {
+            for (Value item : items)
+                acc += item.asDouble();
+        } else {
+            for (Value item : items)
+                acc *= item.asDouble();
+        }
+        return Value(acc);
+    }
+
+
+    // Calls the quotation starting at `start` once per item of `array`, pushing the item on the
+    // stack first, then calls `fn(sp)` after each call returns.
+    template <class FN>
+    static Value* forEachItem(Value *sp, Value array, const Instruction *start, FN fn) {
+        for (size_t i = 0; ; ++i) {
+            auto items = array.asArray().value();   // re-fetched, since a GC may move the items
+            if (i >= items.size())
+                break;
+            *++sp = items[i];
+            sp = call(sp, start);
+            sp = fn(sp);
+            if (_usuallyFalse(gc::object::overBudget()))
+                gc::object::safepoint(sp);
+        }
+        return sp;
+    }
+
+    // ([a] {x -- y} -- [b])
+    NOINLINE Value* doMAP(Value *sp) {
+        Value quote = sp[0], array = sp[-1];
+        sp -= 2;
+        Value result;
+        double k;
+        if (Kernel kernel = findKernel(quote, kUnaryKernels, k);
+                kernel != Kernel::None && allNumbers(array.asArray().value())) {
+            result = mapNumbers(array.asArray().value(), kernel, k);
+        } else {
+            result = Value(std::vector<Value>());
+            gc::object::pushRoot(quote);
+            gc::object::pushRoot(array);
+            gc::object::pushRoot(result);
+            sp = forEachItem(sp, array, quote.asQuote()->instruction().word, [&](Value *sp) {
+                result.appendToArray(*sp);
+                return sp - 1;
+            });
+            gc::object::popRoot();
+            gc::object::popRoot();
+            gc::object::popRoot();
+        }
+        *++sp = result;
+        return sp;
+    }
+
+    // ([a] {x -- ?} -- [a])
+    NOINLINE Value* doFILTER(Value *sp) {
+        Value quote = sp[0], array = sp[-1];
+        sp -= 2;
+        Value result;
+        double k;
+        if (Kernel kernel = findKernel(quote, kUnaryKernels, k);
+                kernel != Kernel::None && allNumbers(array.asArray().value())) {
+            result = filterNumbers(array.asArray().value(), kernel, k);
+        } else {
+            result = Value(std::vector<Value>());
+            gc::object::pushRoot(quote);
+            gc::object::pushRoot(array);
+            gc::object::pushRoot(result);
+            size_t i = 0;
+            sp = forEachItem(sp, array, quote.asQuote()->instruction().word, [&](Value *sp) {
+                if (*sp)
+                    result.appendToArray(array.asArray().value()[i]);
+                ++i;
+                return sp - 1;
+            });
+            gc::object::popRoot();
+            gc::object::popRoot();
+            gc::object::popRoot();
+        }
+        *++sp = result;
+        return sp;
+    }
+
+    // ([a] init {acc x -- acc} -- acc)
+    NOINLINE Value* doREDUCE(Value *sp) {
+        Value quote = sp[0], init = sp[-1], array = sp[-2];
+        sp -= 2;
+        double k;
+        if (Kernel kernel = findKernel(quote, kBinaryKernels, k);
+                kernel != Kernel::None && init.isDouble() && allNumbers(array.asArray().value())) {
+            *sp = reduceNumbers(array.asArray().value(), init.asDouble(), kernel);
+        } else {
+            *sp = init;                             // The accumulator stays on the stack
+            gc::object::pushRoot(quote);
+            gc::object::pushRoot(array);
+            sp = forEachItem(sp, array, quote.asQuote()->instruction().word,
+                             [](Value *sp) {return sp;});
+            gc::object::popRoot();
+            gc::object::popRoot();
+        }
+        return sp;
+    }
+
+    // (a... [x] {a... x -- a...} -- a...)
+    NOINLINE static Value* doEACH(Value *sp) {
+        Value quote = sp[0], array = sp[-1];
+        sp -= 2;
+        gc::object::pushRoot(quote);
+        gc::object::pushRoot(array);
+        sp = forEachItem(sp, array, quote.asQuote()->instruction().word,
+                         [](Value *sp) {return sp;});
+        gc::object::popRoot();
+        gc::object::popRoot();
+        return sp;
+    }
+
+    // (a... n {a... -- a...} -- a...)
+    // The index is kept here, and copied to a loop-control frame before each call, for `I`.
+    NOINLINE static Value* doTIMES(Value *sp) {
+        Value quote = sp[0];
+        double n = sp[-1].asDouble();
+        sp -= 2;
+        const Instruction *start = quote.asQuote()->instruction().word;
+        gc::object::pushRoot(quote);
+        pushLoop(0, n);
+        for (double i = 0; i < n; ++i) {
+            tLoopTop[-1].index = i;     // (not a saved pointer; a nested loop may move the frames)
+            sp = call(sp, start);
+            if (_usuallyFalse(gc::object::overBudget()))
+                gc::object::safepoint(sp);
+        }
+        --tLoopTop;
+        gc::object::popRoot();
+        return sp;
+    }
+
+
+    // These five have stack effects dependent on their quotation, which must be a literal; like
+    // IFELSE they're special-cased by the compiler's stack-checker.
+
+    NATIVE_WORD(MAP, "MAP", StackEffect::weird()) {
+        SPILL();
+        sp = doMAP(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    NATIVE_WORD(FILTER, "FILTER", StackEffect::weird()) {
+        SPILL();
+        sp = doFILTER(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    NATIVE_WORD(REDUCE, "REDUCE", StackEffect::weird()) {
+        SPILL();
+        sp = doREDUCE(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    NATIVE_WORD(EACH, "EACH", StackEffect::weird()) {
+        SPILL();
+        sp = doEACH(sp);
+        RELOAD();
+        NEXT();
+    }
+
+    NATIVE_WORD(TIMES, "TIMES", StackEffect::weird()) {
+        SPILL();
+        sp = doTIMES(sp);
+        RELOAD();
         NEXT();
     }
 
@@ -247,13 +795,13 @@ namespace tails::core_words {
 
     // These assume the C++ Value type supports arithmetic and relational operators.
 
-    NATIVE_WORD(ZERO, "0", StackEffect({}, {Num})) {
-        *(++sp) = Value(0);
+    NATIVE_WORD(ZERO, "0", StackEffect({}, {Num}), Word::Pure) {
+        PUSH(Value(0));
         NEXT();
     }
 
-    NATIVE_WORD(ONE, "1", StackEffect({}, {Num})) {
-        *(++sp) = Value(1);
+    NATIVE_WORD(ONE, "1", StackEffect({}, {Num}), Word::Pure) {
+        PUSH(Value(1));
         NEXT();
     }
 
@@ -276,25 +824,349 @@ namespace tails::core_words {
     BINARY_OP_WORD(LT,    "<",   kRelEffect, <)
     BINARY_OP_WORD(LE,    "<=",  kRelEffect, <=)
 
-    NATIVE_WORD(EQ_ZERO, "0=",  k0RelEffect)  { sp[0] = Value(sp[0] == Value(0)); NEXT(); }
-    NATIVE_WORD(NE_ZERO, "0<>", k0RelEffect)  { sp[0] = Value(sp[0] != Value(0)); NEXT(); }
-    NATIVE_WORD(GT_ZERO, "0>",  k0RelEffect)  { sp[0] = Value(sp[0] >  Value(0)); NEXT(); }
-    NATIVE_WORD(LT_ZERO, "0<",  k0RelEffect)  { sp[0] = Value(sp[0] <  Value(0)); NEXT(); }
+    NATIVE_WORD(EQ_ZERO, "0=",  k0RelEffect, Word::Pure)  { S0 = Value(Value(S0) == Value(0)); NEXT(); }
+    NATIVE_WORD(NE_ZERO, "0<>", k0RelEffect, Word::Pure)  { S0 = Value(Value(S0) != Value(0)); NEXT(); }
+    NATIVE_WORD(GT_ZERO, "0>",  k0RelEffect, Word::Pure)  { S0 = Value(Value(S0) >  Value(0)); NEXT(); }
+    NATIVE_WORD(LT_ZERO, "0<",  k0RelEffect, Word::Pure)  { S0 = Value(Value(S0) <  Value(0)); NEXT(); }
 
     // [Appended an "_" to the symbol name to avoid conflict with C's `NULL`.]
-    NATIVE_WORD(NULL_, "NULL", StackEffect({}, {Nul})) {
-        *(++sp) = NullValue;
+    NATIVE_WORD(NULL_, "NULL", StackEffect({}, {Nul}), Word::Pure) {
+        PUSH(NullValue);
         NEXT();
     }
 
 
 #pragma mark Strings & Arrays:
 
-    NATIVE_WORD(LENGTH, "LENGTH", StackEffect({Str|Arr}, {Num})) {
-        *sp = sp->length();
+    NATIVE_WORD(LENGTH, "LENGTH", StackEffect({Str|Arr}, {Num}), Word::Pure) {
+        S0 = Value(S0).length();
+        NEXT();
+    }
+
+
+#pragma mark - SUPERINSTRUCTIONS:
+
+    // These are never written in source code; the compiler substitutes them for common sequences
+    // of the words above (see `kSuperinstructions` below), saving one or two dispatches each.
+
+
+    // Equivalent to `_LITERAL` followed by a binary operator.
+    #define LITERAL_OP_WORD(NAME, FORTHNAME, EFFECT, INFIXOP) \
+        NATIVE_WORD(NAME, FORTHNAME, EFFECT, Word::MagicValParam | Word::Pure) { \
+            S0 = Value(Value(S0) INFIXOP (pc++)->literal);\
+            NEXT(); \
+        }
+
+    // Equivalent to a binary relational operator followed by `0BRANCH`.
+    #define BRANCH_OP_WORD(NAME, FORTHNAME, INFIXOP) \
+        NATIVE_WORD(NAME, FORTHNAME, StackEffect({Any, Any}, {}), Word::MagicIntParam) { \
+            bool b = (S1 INFIXOP Value(S0));\
+            DROPN(2);\
+            if (!b)\
+                pc += pc->offset;\
+            ++pc;\
+            NEXT(); \
+        }
+
+
+    // `OVER OVER`, aka `2DUP`
+    NATIVE_WORD(_OVER2, "_OVER2", StackEffect({Any,   Any},
+                                              {Any/1, Any/0, Any/1, Any/0}),
+                Word::Magic | Word::Pure)
+    {
+        Value s1 = S1;
+        PUSH(s1);
+        PUSH(S1);
+        NEXT();
+    }
+
+    // `DUP *`
+    NATIVE_WORD(_DUPMULT, "_DUPMULT", StackEffect({Num}, {Num}),
+                Word::Magic | Word::Pure)
+    {
+        S0 = Value(S0) * Value(S0);
+        NEXT();
+    }
+
+    // `DUP 0BRANCH`, the start of a `BEGIN DUP WHILE` loop
+    NATIVE_WORD(_DUP_ZBRANCH, "_DUP_ZBRANCH", StackEffect({Any}, {Any/0}),
+                Word::MagicIntParam)
+    {
+        if (!Value(S0))
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+    // `DUP _LITERAL >`
+    NATIVE_WORD(_DUP_LITGT, "_DUP_LITGT", StackEffect({Any}, {Any/0, Num}),
+                Word::MagicValParam | Word::Pure)
+    {
+        PUSH(Value(Value(S0) > (pc++)->literal));
+        NEXT();
+    }
+
+    LITERAL_OP_WORD(_LITPLUS,  "_LITPLUS",  StackEffect({Num|Str|Arr}, {(Num|Str|Arr)/0}), +)
+    LITERAL_OP_WORD(_LITMINUS, "_LITMINUS", StackEffect({Num}, {Num}), -)
+    LITERAL_OP_WORD(_LITMULT,  "_LITMULT",  StackEffect({Num}, {Num}), *)
+    LITERAL_OP_WORD(_LITEQ,    "_LITEQ",    k0RelEffect, ==)
+    LITERAL_OP_WORD(_LITGT,    "_LITGT",    k0RelEffect, >)
+    LITERAL_OP_WORD(_LITLT,    "_LITLT",    k0RelEffect, <)
+
+    BRANCH_OP_WORD(_EQ_ZBRANCH, "_EQ_ZBRANCH", ==)
+    BRANCH_OP_WORD(_NE_ZBRANCH, "_NE_ZBRANCH", !=)
+    BRANCH_OP_WORD(_GT_ZBRANCH, "_GT_ZBRANCH", >)
+    BRANCH_OP_WORD(_GE_ZBRANCH, "_GE_ZBRANCH", >=)
+    BRANCH_OP_WORD(_LT_ZBRANCH, "_LT_ZBRANCH", <)
+    BRANCH_OP_WORD(_LE_ZBRANCH, "_LE_ZBRANCH", <=)
+
+    // `0= 0BRANCH`, i.e. branch if nonzero
+    NATIVE_WORD(_EQZ_ZBRANCH, "_EQZ_ZBRANCH", StackEffect({Any}, {}),
+                Word::MagicIntParam)
+    {
+        if (POP() != Value(0))
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+
+    // The compiler tries these in order at each instruction, so longer sequences come first.
+    // To add one, define its word above and add it here and to `kWords`.
+    const Superinstruction kSuperinstructions[] = {
+        {&_DUP_LITGT,   {&DUP, &_LITERAL, &GT}},
+        {&_OVER2,       {&OVER, &OVER}},
+        {&_DUPMULT,     {&DUP, &MULT}},
+        {&_DUP_ZBRANCH, {&DUP, &_ZBRANCH}},
+        {&_LITPLUS,     {&_LITERAL, &PLUS}},
+        {&_LITMINUS,    {&_LITERAL, &MINUS}},
+        {&_LITMULT,     {&_LITERAL, &MULT}},
+        {&_LITEQ,       {&_LITERAL, &EQ}},
+        {&_LITGT,       {&_LITERAL, &GT}},
+        {&_LITLT,       {&_LITERAL, &LT}},
+        {&_EQ_ZBRANCH,  {&EQ, &_ZBRANCH}},
+        {&_NE_ZBRANCH,  {&NE, &_ZBRANCH}},
+        {&_GT_ZBRANCH,  {&GT, &_ZBRANCH}},
+        {&_GE_ZBRANCH,  {&GE, &_ZBRANCH}},
+        {&_LT_ZBRANCH,  {&LT, &_ZBRANCH}},
+        {&_LE_ZBRANCH,  {&LE, &_ZBRANCH}},
+        {&_EQZ_ZBRANCH, {&EQ_ZERO, &_ZBRANCH}},
+        {nullptr, {}}
+    };
+
+#pragma mark - NUMERIC WORDS:
+
+    // Variants of the above that only work on numbers, skipping the type dispatch in `Value`'s
+    // operators. The compiler substitutes them when the stack checker has proven the operands
+    // are numbers (see `kNumericVariants` below.) They're never written in source code.
+
+
+    // The operators applied by the numeric words. Equality is bitwise, as in `Value::operator==`
+    // and the generic words, so `-0` isn't equal to `0`.
+    namespace num {
+        static inline double plus(double a, double b)   {return a + b;}
+        static inline double minus(double a, double b)  {return a - b;}
+        static inline double mult(double a, double b)   {return a * b;}
+        static inline double div(double a, double b)    {return a / b;}
+        static inline bool eq(double a, double b)       {return sameNumber(a, b);}
+        static inline bool ne(double a, double b)       {return !sameNumber(a, b);}
+        static inline bool gt(double a, double b)       {return a > b;}
+        static inline bool ge(double a, double b)       {return a >= b;}
+        static inline bool lt(double a, double b)       {return a < b;}
+        static inline bool le(double a, double b)       {return a <= b;}
+    }
+
+    #define NUMERIC_OP_WORD(NAME, FORTHNAME, EFFECT, FN) \
+        NATIVE_WORD(NAME, FORTHNAME, EFFECT, Word::Magic | Word::Pure) { \
+            double b_ = POP().asDouble();\
+            S0 = Value(num::FN(Value(S0).asDouble(), b_));\
+            NEXT(); \
+        }
+
+    #define NUMERIC_LITERAL_OP_WORD(NAME, FORTHNAME, EFFECT, FN) \
+        NATIVE_WORD(NAME, FORTHNAME, EFFECT, Word::MagicValParam | Word::Pure) { \
+            S0 = Value(num::FN(Value(S0).asDouble(), (pc++)->literal.asDouble()));\
+            NEXT(); \
+        }
+
+    #define NUMERIC_BRANCH_OP_WORD(NAME, FORTHNAME, FN) \
+        NATIVE_WORD(NAME, FORTHNAME, StackEffect({Num, Num}, {}), Word::MagicIntParam) { \
+            double b_ = POP().asDouble();\
+            if (!num::FN(POP().asDouble(), b_))\
+                pc += pc->offset;\
+            ++pc;\
+            NEXT(); \
+        }
+
+
+    static constexpr StackEffect kNumRelEffect({Num, Num}, {Num});
+    static constexpr StackEffect kNumEffect({Num}, {Num});
+
+    NUMERIC_OP_WORD(_PLUS_NUM,  "_PLUS_NUM",  kBinEffect, plus)
+    NUMERIC_OP_WORD(_MINUS_NUM, "_MINUS_NUM", kBinEffect, minus)
+    NUMERIC_OP_WORD(_MULT_NUM,  "_MULT_NUM",  kBinEffect, mult)
+    NUMERIC_OP_WORD(_DIV_NUM,   "_DIV_NUM",   kBinEffect, div)
+
+    NUMERIC_OP_WORD(_EQ_NUM,    "_EQ_NUM",    kNumRelEffect, eq)
+    NUMERIC_OP_WORD(_NE_NUM,    "_NE_NUM",    kNumRelEffect, ne)
+    NUMERIC_OP_WORD(_GT_NUM,    "_GT_NUM",    kNumRelEffect, gt)
+    NUMERIC_OP_WORD(_GE_NUM,    "_GE_NUM",    kNumRelEffect, ge)
+    NUMERIC_OP_WORD(_LT_NUM,    "_LT_NUM",    kNumRelEffect, lt)
+    NUMERIC_OP_WORD(_LE_NUM,    "_LE_NUM",    kNumRelEffect, le)
+
+    // A number is falsey only if it's zero. (Numbers are never NaN; that's stored as null.)
+    NATIVE_WORD(_ZBRANCH_NUM, "_ZBRANCH_NUM", StackEffect({Num}, {}),
+                Word::MagicIntParam)
+    {
+        if (POP().asDouble() == 0)
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+    NATIVE_WORD(_DUPMULT_NUM, "_DUPMULT_NUM", StackEffect({Num}, {Num}),
+                Word::Magic | Word::Pure)
+    {
+        double d = Value(S0).asDouble();
+        S0 = Value(d * d);
+        NEXT();
+    }
+
+    NATIVE_WORD(_DUP_LITGT_NUM, "_DUP_LITGT_NUM", StackEffect({Num}, {Num/0, Num}),
+                Word::MagicValParam | Word::Pure)
+    {
+        PUSH(Value(Value(S0).asDouble() > (pc++)->literal.asDouble()));
         NEXT();
     }
 
+    NUMERIC_LITERAL_OP_WORD(_LITPLUS_NUM,  "_LITPLUS_NUM",  kNumEffect, plus)
+    NUMERIC_LITERAL_OP_WORD(_LITMINUS_NUM, "_LITMINUS_NUM", kNumEffect, minus)
+    NUMERIC_LITERAL_OP_WORD(_LITMULT_NUM,  "_LITMULT_NUM",  kNumEffect, mult)
+    NUMERIC_LITERAL_OP_WORD(_LITEQ_NUM,    "_LITEQ_NUM",    kNumEffect, eq)
+    NUMERIC_LITERAL_OP_WORD(_LITGT_NUM,    "_LITGT_NUM",    kNumEffect, gt)
+    NUMERIC_LITERAL_OP_WORD(_LITLT_NUM,    "_LITLT_NUM",    kNumEffect, lt)
+
+    NUMERIC_BRANCH_OP_WORD(_EQ_ZBRANCH_NUM, "_EQ_ZBRANCH_NUM", eq)
+    NUMERIC_BRANCH_OP_WORD(_NE_ZBRANCH_NUM, "_NE_ZBRANCH_NUM", ne)
+    NUMERIC_BRANCH_OP_WORD(_GT_ZBRANCH_NUM, "_GT_ZBRANCH_NUM", gt)
+    NUMERIC_BRANCH_OP_WORD(_GE_ZBRANCH_NUM, "_GE_ZBRANCH_NUM", ge)
+    NUMERIC_BRANCH_OP_WORD(_LT_ZBRANCH_NUM, "_LT_ZBRANCH_NUM", lt)
+    NUMERIC_BRANCH_OP_WORD(_LE_ZBRANCH_NUM, "_LE_ZBRANCH_NUM", le)
+
+
+    // To add one, define its word above and add it here and to `kWords`.
+    const Word* const kLiteralWords[] = {
+        &_LITERAL, &_DUP_LITGT,
+        &_LITPLUS, &_LITMINUS, &_LITMULT, &_LITEQ, &_LITGT, &_LITLT,
+        &_DUP_LITGT_NUM,
+        &_LITPLUS_NUM, &_LITMINUS_NUM, &_LITMULT_NUM, &_LITEQ_NUM, &_LITGT_NUM, &_LITLT_NUM,
+        nullptr
+    };
+
+
+    const NumericVariant kNumericVariants[] = {
+        {&PLUS,         &_PLUS_NUM},
+        {&MINUS,        &_MINUS_NUM},
+        {&MULT,         &_MULT_NUM},
+        {&DIV,          &_DIV_NUM},
+        {&EQ,           &_EQ_NUM},
+        {&NE,           &_NE_NUM},
+        {&GT,           &_GT_NUM},
+        {&GE,           &_GE_NUM},
+        {&LT,           &_LT_NUM},
+        {&LE,           &_LE_NUM},
+        {&_ZBRANCH,     &_ZBRANCH_NUM},
+        {&_DUPMULT,     &_DUPMULT_NUM},
+        {&_DUP_LITGT,   &_DUP_LITGT_NUM},
+        {&_LITPLUS,     &_LITPLUS_NUM},
+        {&_LITMINUS,    &_LITMINUS_NUM},
+        {&_LITMULT,     &_LITMULT_NUM},
+        {&_LITEQ,       &_LITEQ_NUM},
+        {&_LITGT,       &_LITGT_NUM},
+        {&_LITLT,       &_LITLT_NUM},
+        {&_EQ_ZBRANCH,  &_EQ_ZBRANCH_NUM},
+        {&_NE_ZBRANCH,  &_NE_ZBRANCH_NUM},
+        {&_GT_ZBRANCH,  &_GT_ZBRANCH_NUM},
+        {&_GE_ZBRANCH,  &_GE_ZBRANCH_NUM},
+        {&_LT_ZBRANCH,  &_LT_ZBRANCH_NUM},
+        {&_LE_ZBRANCH,  &_LE_ZBRANCH_NUM},
+        {nullptr, nullptr}
+    };
+
+
+    // To add a word here, it must apply one operator in one of the `ArithForm`s. On numbers, a
+    // generic word and its numeric variant do the same thing.
+    const ArithWord kArithWords[] = {
+        #define A ArithOp
+        #define F ArithForm
+        {&PLUS,             A::Plus,   false, F::Binary},
+        {&_PLUS_NUM,        A::Plus,   true,  F::Binary},
+        {&MINUS,            A::Minus,  false, F::Binary},
+        {&_MINUS_NUM,       A::Minus,  true,  F::Binary},
+        {&MULT,             A::Mult,   false, F::Binary},
+        {&_MULT_NUM,        A::Mult,   true,  F::Binary},
+        {&DIV,              A::Div,    false, F::Binary},
+        {&_DIV_NUM,         A::Div,    true,  F::Binary},
+        {&MOD,              A::Mod,    false, F::Binary},
+        {&EQ,               A::Eq,     false, F::Binary},
+        {&_EQ_NUM,          A::Eq,     true,  F::Binary},
+        {&NE,               A::Ne,     false, F::Binary},
+        {&_NE_NUM,          A::Ne,     true,  F::Binary},
+        {&GT,               A::Gt,     false, F::Binary},
+        {&_GT_NUM,          A::Gt,     true,  F::Binary},
+        {&GE,               A::Ge,     false, F::Binary},
+        {&_GE_NUM,          A::Ge,     true,  F::Binary},
+        {&LT,               A::Lt,     false, F::Binary},
+        {&_LT_NUM,          A::Lt,     true,  F::Binary},
+        {&LE,               A::Le,     false, F::Binary},
+        {&_LE_NUM,          A::Le,     true,  F::Binary},
+
+        {&_LITPLUS,         A::Plus,   false, F::WithLiteral},
+        {&_LITPLUS_NUM,     A::Plus,   true,  F::WithLiteral},
+        {&_LITMINUS,        A::Minus,  false, F::WithLiteral},
+        {&_LITMINUS_NUM,    A::Minus,  true,  F::WithLiteral},
+        {&_LITMULT,         A::Mult,   false, F::WithLiteral},
+        {&_LITMULT_NUM,     A::Mult,   true,  F::WithLiteral},
+        {&_LITEQ,           A::Eq,     false, F::WithLiteral},
+        {&_LITEQ_NUM,       A::Eq,     true,  F::WithLiteral},
+        {&_LITGT,           A::Gt,     false, F::WithLiteral},
+        {&_LITGT_NUM,       A::Gt,     true,  F::WithLiteral},
+        {&_LITLT,           A::Lt,     false, F::WithLiteral},
+        {&_LITLT_NUM,       A::Lt,     true,  F::WithLiteral},
+        {&_DUP_LITGT,       A::Gt,     false, F::DupWithLiteral},
+        {&_DUP_LITGT_NUM,   A::Gt,     true,  F::DupWithLiteral},
+
+        {&EQ_ZERO,          A::Eq,     false, F::WithZero},
+        {&NE_ZERO,          A::Ne,     false, F::WithZero},
+        {&GT_ZERO,          A::Gt,     false, F::WithZero},
+        {&LT_ZERO,          A::Lt,     false, F::WithZero},
+
+        {&_EQ_ZBRANCH,      A::Eq,     false, F::Branch},
+        {&_EQ_ZBRANCH_NUM,  A::Eq,     true,  F::Branch},
+        {&_NE_ZBRANCH,      A::Ne,     false, F::Branch},
+        {&_NE_ZBRANCH_NUM,  A::Ne,     true,  F::Branch},
+        {&_GT_ZBRANCH,      A::Gt,     false, F::Branch},
+        {&_GT_ZBRANCH_NUM,  A::Gt,     true,  F::Branch},
+        {&_GE_ZBRANCH,      A::Ge,     false, F::Branch},
+        {&_GE_ZBRANCH_NUM,  A::Ge,     true,  F::Branch},
+        {&_LT_ZBRANCH,      A::Lt,     false, F::Branch},
+        {&_LT_ZBRANCH_NUM,  A::Lt,     true,  F::Branch},
+        {&_LE_ZBRANCH,      A::Le,     false, F::Branch},
+        {&_LE_ZBRANCH_NUM,  A::Le,     true,  F::Branch},
+        #undef A
+        #undef F
+        {nullptr, {}, false, {}}
+    };
+
+
+    const ArithWord* lookupArithWord(Instruction instr) noexcept {
+        for (auto aw = kArithWords; aw->word; ++aw) {
+            if (instr == aw->word->instruction())
+                return aw;
+        }
+        return nullptr;
+    }
+
 
 #pragma mark - INTERPRETED WORDS:
 
@@ -332,16 +1204,36 @@ namespace tails::core_words {
     );
 
 
+#pragma mark - DEFINED ELSEWHERE:
+
+    // DEFINE's implementation needs the compiler, so it's in compiler.cc; but its Word object is
+    // defined here so its name is known at compile time, for the perfect hash table below.
+    extern "C" Value* f_DEFINE(NATIVE_PARAMS);
+    constexpr Word DEFINE("DEFINE", f_DEFINE, "{code} $name -- "_sfx);
+
+    // Likewise, PMAP, PFILTER and PREDUCE need the ThreadPool and GuardedStack, so they're in
+    // parallel_words.cc.
+    extern "C" Value* f_PMAP(NATIVE_PARAMS);
+    extern "C" Value* f_PFILTER(NATIVE_PARAMS);
+    extern "C" Value* f_PREDUCE(NATIVE_PARAMS);
+    constexpr Word PMAP("PMAP", f_PMAP, StackEffect::weird());
+    constexpr Word PFILTER("PFILTER", f_PFILTER, StackEffect::weird());
+    constexpr Word PREDUCE("PREDUCE", f_PREDUCE, StackEffect::weird());
+
+
 #pragma mark - LIST OF CORE WORDS:
 
 
     // This null-terminated list is used to register these words in the Vocabulary at startup.
 
-    const Word* const kWords[] = {
+    constexpr const Word* kWords[] = {
         &_INTERP, &_INTERP2, &_INTERP3, &_INTERP4,
         &_TAILINTERP, &_TAILINTERP2, &_TAILINTERP3, &_TAILINTERP4, 
         &_LITERAL, &_RETURN, &_BRANCH, &_ZBRANCH,
         &NOP, &_RECURSE,
+        &_DO, &_LOOP, &I_,
+        &_PROFILE, &_PROFILE_TIMED, &_PROFILE_LOOP,
+        &_FUEL, &_INTERP_METERED, &_RECURSE_METERED,
         &DROP, &DUP, &OVER, &ROT, &SWAP,
         &ZERO, &ONE,
         &EQ, &NE, &EQ_ZERO, &NE_ZERO,
@@ -352,9 +1244,92 @@ namespace tails::core_words {
         &CALL,
         &NULL_,
         &LENGTH,
-        &IFELSE,
+        &IFELSE, &MAP, &FILTER, &REDUCE, &EACH, &TIMES,
+        &PMAP, &PFILTER, &PREDUCE,
         &DEFINE,
+        &_OVER2, &_DUPMULT, &_DUP_ZBRANCH, &_DUP_LITGT,
+        &_LITPLUS, &_LITMINUS, &_LITMULT, &_LITEQ, &_LITGT, &_LITLT,
+        &_EQ_ZBRANCH, &_NE_ZBRANCH, &_GT_ZBRANCH, &_GE_ZBRANCH, &_LT_ZBRANCH, &_LE_ZBRANCH,
+        &_EQZ_ZBRANCH,
+        &_PLUS_NUM, &_MINUS_NUM, &_MULT_NUM, &_DIV_NUM,
+        &_EQ_NUM, &_NE_NUM, &_GT_NUM, &_GE_NUM, &_LT_NUM, &_LE_NUM,
+        &_ZBRANCH_NUM, &_DUPMULT_NUM, &_DUP_LITGT_NUM,
+        &_LITPLUS_NUM, &_LITMINUS_NUM, &_LITMULT_NUM, &_LITEQ_NUM, &_LITGT_NUM, &_LITLT_NUM,
+        &_EQ_ZBRANCH_NUM, &_NE_ZBRANCH_NUM, &_GT_ZBRANCH_NUM, &_GE_ZBRANCH_NUM,
+        &_LT_ZBRANCH_NUM, &_LE_ZBRANCH_NUM,
         nullptr
     };
 
+
+
+#pragma mark - LOOKUP BY NAME:
+
+
+    /// A perfect hash table of Words, built at compile time by "hash and displace": the words are
+    /// grouped into buckets by their unseeded hash, then each bucket is given a seed with which its
+    /// words all hash to empty slots. Looking up a name is just two hashes and one comparison.
+    template <size_t N>
+    class PerfectWordTable {
+    public:
+        static constexpr size_t kBuckets = N / 4 + 1;
+        static constexpr size_t kSlots   = 2 * N + 1;
+
+        constexpr explicit PerfectWordTable(const Word* const *words) {
+            size_t bucketOf[N] {}, bucketSize[kBuckets] {};
+            for (size_t i = 0; i < N; ++i)
+                ++bucketSize[ bucketOf[i] = hashNoCase(words[i]->name()) % kBuckets ];
+
+            // Place the biggest buckets first, while there are the most empty slots:
+            for (size_t size = N; size > 0; --size) {
+                for (size_t b = 0; b < kBuckets; ++b) {
+                    if (bucketSize[b] == size) {
+                        uint32_t seed = 1;
+                        while (!place(words, bucketOf, b, seed))
+                            ++seed;
+                        _seeds[b] = seed;
+                    }
+                }
+            }
+        }
+
+        constexpr const Word* lookup(std::string_view name) const noexcept {
+            uint32_t seed = _seeds[hashNoCase(name) % kBuckets];
+            const Word *word = _slots[hashNoCase(name, seed) % kSlots];
+            return (word && equalNoCase(word->name(), name)) ? word : nullptr;
+        }
+
+    private:
+        // Tries to put the words in bucket `b` into empty slots, using `seed`.
+        constexpr bool place(const Word* const *words, const size_t bucketOf[], size_t b,
+                             uint32_t seed)
+        {
+            size_t placed[N] {}, nPlaced = 0;
+            for (size_t i = 0; i < N; ++i) {
+                if (bucketOf[i] == b) {
+                    size_t slot = hashNoCase(words[i]->name(), seed) % kSlots;
+                    if (_slots[slot]) {
+                        // Collision; undo:
+                        while (nPlaced > 0)
+                            _slots[placed[--nPlaced]] = nullptr;
+                        return false;
+                    }
+                    _slots[slot] = words[i];
+                    placed[nPlaced++] = slot;
+                }
+            }
+            return true;
+        }
+
+        uint32_t    _seeds[kBuckets] {};
+        const Word* _slots[kSlots] {};
+    };
+
+
+    static constexpr PerfectWordTable<std::size(kWords) - 1> kWordTable(kWords);
+
+
+    const Word* lookupCoreWord(std::string_view name) noexcept {
+        return kWordTable.lookup(name);
+    }
+
 }
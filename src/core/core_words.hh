@@ -18,6 +18,7 @@
 
 #pragma once
 #include "word.hh"
+#include <vector>
 
 
 namespace tails::core_words {
@@ -38,11 +39,162 @@ namespace tails::core_words {
         ONE, ZERO,
         DEFINE;
     
-    extern const Word NULL_, LENGTH, CALL, IFELSE;
+    extern const Word NULL_, LENGTH, CALL, IFELSE, MAP, FILTER, REDUCE, EACH, TIMES;
+
+    /// Parallel forms of MAP, FILTER and REDUCE, which run a pure quotation over a big array on
+    /// the shared ThreadPool (thread_pool.hh).
+    extern const Word PMAP, PFILTER, PREDUCE;
+
+    /// The serial implementations of MAP, FILTER and REDUCE, which PMAP and its kin fall back on.
+    /// Each takes and returns the stack pointer, with the top of the stack spilled.
+    Value* doMAP(Value *sp);
+    Value* doFILTER(Value *sp);
+    Value* doREDUCE(Value *sp);
+
+    /// True if a quotation is a single numeric op that MAP and FILTER (or if `binary` is true,
+    /// REDUCE) apply directly to the items of an all-numeric array, which beats threads.
+    bool hasArrayKernel(Value quote, bool binary);
+
+    /// Counted loops: the compiler brackets the body of a `DO ... LOOP` with `_DO` and `_LOOP`,
+    /// which keep its index and limit on a per-thread loop-control stack. `I_` is `I`.
+    extern const Word _DO, _LOOP, I_;
+
+    /// The number of counted loops (`DO ... LOOP` or `TIMES`) running on this thread.
+    size_t loopDepth() noexcept;
+
+    /// Forgets the innermost running loops, leaving `depth` of them. For use after an exception
+    /// has been thrown out of their bodies. (`gc::Execution` does this.) Does nothing if there
+    /// are fewer, as when the loops of a resumed Continuation have since ended.
+    void unwindLoops(size_t depth) noexcept;
+
+    /// A running counted loop's index and limit, as kept on the loop-control stack.
+    struct LoopFrame {
+        double index, limit;
+    };
+
+    /// Pushes loop-control frames, outermost first, as saved by a `Suspension`.
+    void restoreLoops(const std::vector<LoopFrame>&);
+
+    /// Fuel metering, which lets a word run as a resumable `Continuation` (see continuation.hh.)
+    /// The compiler puts a `_FUEL` before each back-edge of a metered word; each one uses up a
+    /// unit of the thread's fuel, and when there's none left it suspends the word.
+    /// A metered word calls metered words, and itself, with `_INTERP_METERED` and
+    /// `_RECURSE_METERED`, which record where to resume after a suspension.
+    extern const Word _FUEL, _INTERP_METERED, _RECURSE_METERED;
+
+    /// A thread's fuel, and what a `_FUEL` op needs to know to suspend the word it's in.
+    struct FuelMeter {
+        int64_t fuel        = INT64_MAX;
+        size_t  rootDepth   = 0;        ///< GC roots pushed when the continuation resumed
+        size_t  loopDepth   = 0;        ///< Counted loops running when the continuation resumed
+        bool    suspendable = false;    ///< True while a continuation is running
+    };
+
+    /// Installs a fuel meter on this thread, returning the previous one.
+    FuelMeter swapFuelMeter(const FuelMeter&) noexcept;
+
+    /// Thrown by `_FUEL` to suspend, when the fuel is used up. On its way out, each
+    /// `_INTERP_METERED` or `_RECURSE_METERED` it passes through adds the instruction its word
+    /// will resume at.
+    ///
+    /// It's only thrown when no native word that calls interpreted code (a combinator like
+    /// `MAP`, recognizable by the GC root it's pushed) is between the `_FUEL` and the start of
+    /// the continuation, since a native word's C++ frame couldn't be resumed. Otherwise the fuel
+    /// stays used up, and the first `_FUEL` reached after the native word returns suspends.
+    struct Suspension {
+        Value*                          sp;         ///< The stack pointer, with the top spilled
+        std::vector<const Instruction*> frames;     ///< Where to resume each word, innermost first
+        std::vector<LoopFrame>          loops;      ///< The continuation's loops, outermost first
+    };
+
+    /// Instrumentation the compiler adds to words compiled with profiling (see profiler.hh.)
+    extern const Word _PROFILE, _PROFILE_TIMED, _PROFILE_LOOP;
+
+    /// The number of `_PROFILE_TIMED` calls in progress on this thread.
+    size_t timedCallDepth() noexcept;
+
+    /// Ends the innermost timed calls in progress, leaving `depth` of them, and adds the cycles
+    /// they've taken so far. For use after they've been unwound by an exception, or by a stack
+    /// fault that skipped their ops' cleanup. (`gc::Execution` does this.)
+    void unwindTimedCalls(size_t depth) noexcept;
+
+    /// Superinstructions, which the compiler substitutes for common sequences of the above.
+    extern const Word
+        _OVER2, _DUPMULT, _DUP_ZBRANCH, _DUP_LITGT,
+        _LITPLUS, _LITMINUS, _LITMULT, _LITEQ, _LITGT, _LITLT,
+        _EQ_ZBRANCH, _NE_ZBRANCH, _GT_ZBRANCH, _GE_ZBRANCH, _LT_ZBRANCH, _LE_ZBRANCH,
+        _EQZ_ZBRANCH;
+
+    /// Numeric-only variants, which the compiler substitutes when the operands are known numbers.
+    extern const Word
+        _PLUS_NUM, _MINUS_NUM, _MULT_NUM, _DIV_NUM,
+        _EQ_NUM, _NE_NUM, _GT_NUM, _GE_NUM, _LT_NUM, _LE_NUM,
+        _ZBRANCH_NUM, _DUPMULT_NUM, _DUP_LITGT_NUM,
+        _LITPLUS_NUM, _LITMINUS_NUM, _LITMULT_NUM, _LITEQ_NUM, _LITGT_NUM, _LITLT_NUM,
+        _EQ_ZBRANCH_NUM, _NE_ZBRANCH_NUM, _GT_ZBRANCH_NUM, _GE_ZBRANCH_NUM,
+        _LT_ZBRANCH_NUM, _LE_ZBRANCH_NUM;
 
     /// Array of pointers to the above core words, ending in nullptr
     extern const Word* const kWords[];
 
+    /// A native word that does the same thing as a short sequence of other native words.
+    /// At most one word in the sequence may have a parameter; it becomes the fused word's.
+    struct Superinstruction {
+        static constexpr size_t kMaxWords = 3;
+        const Word* fused;              ///< The superinstruction
+        const Word* words[kMaxWords];   ///< The sequence it replaces, padded with nullptr
+    };
+
+    /// Table of superinstructions, ending with a nullptr `fused`. The compiler tries them in order.
+    extern const Superinstruction kSuperinstructions[];
+
+    /// A polymorphic word, and a variant of it that skips type dispatch since it only works on
+    /// numbers. The compiler uses the latter when all the word's stack inputs, and its literal
+    /// parameter if any, are known to be numbers.
+    struct NumericVariant {
+        const Word* generic;
+        const Word* numeric;
+    };
+
+    /// Table of numeric variants, ending with a nullptr `generic`.
+    extern const NumericVariant kNumericVariants[];
+
+    /// The arithmetic and comparison operators applied by the words in `kArithWords`.
+    enum class ArithOp : uint8_t {Plus, Minus, Mult, Div, Mod, Eq, Ne, Gt, Ge, Lt, Le};
+
+    /// How a word in `kArithWords` applies its operator.
+    enum class ArithForm : uint8_t {
+        Binary,             ///< (x y -- x `op` y)
+        WithLiteral,        ///< (x -- x `op` literal), with the literal as parameter
+        WithZero,           ///< (x -- x `op` 0)
+        Branch,             ///< (x y -- ) branch if !(x `op` y), with the offset as parameter
+        DupWithLiteral,     ///< (x -- x x `op` literal), with the literal as parameter
+    };
+
+    /// A word that applies one ArithOp: a generic word, a superinstruction or a numeric variant.
+    struct ArithWord {
+        const Word* word;
+        ArithOp     op;
+        bool        numeric;    ///< True if it's a numeric variant, which only works on numbers
+        ArithForm   form;
+    };
+
+    /// Table of the words that apply one ArithOp, ending with a nullptr `word`. Code that
+    /// translates compiled words into another form, like Batch and TypedWord, decodes arithmetic
+    /// through it.
+    extern const ArithWord kArithWords[];
+
+    /// Looks up an instruction in `kArithWords`; returns nullptr if it's not there.
+    const ArithWord* lookupArithWord(Instruction) noexcept;
+
+    /// The words that are followed by a Value parameter, i.e. `_LITERAL` and superinstructions
+    /// that incorporate it. Ends with nullptr. (Used by the GC to find literals in compiled code.)
+    extern const Word* const kLiteralWords[];
+
+    /// Looks up a word in `kWords` by name, case-insensitively. This uses a perfect hash table
+    /// built at compile time, so it's fast and doesn't allocate. Returns nullptr if not found.
+    const Word* lookupCoreWord(std::string_view name) noexcept;
+
     /// Array of the `_INTERP` family of words.
     /// First array index is whether to tail-call the last word;
     /// Second index is the number of words that follow (0..kMaxInterp-1)
@@ -19,10 +19,12 @@
 #pragma once
 #include "platform.hh"
 #include "value.hh"
+#include <utility>
 
 
 namespace tails {
     union Instruction;
+    struct WordProfile;
 
 
     // If ENABLE_TRACING is defined, a function `TRACE(sp,pc)` will be called before each Instruction.
@@ -38,14 +40,28 @@ namespace tails {
     #endif
 
 
+    // If CACHE_TOS is defined, the top of the stack is kept in a register: it's passed to every
+    // native op as the extra parameter `tos`, and the memory at `sp[0]` is stale. Words written
+    // with the stack macros below (S0, PUSH, POP...) work either way.
+    // (This is a build-time switch because it changes the Op signature.)
+    //#define CACHE_TOS
+
+
     /// A native word is a C++ function with this signature.
     /// Interpreted words consist of an array of (mostly) Op pointers,
     /// but some native ops are followed by a parameter read by the function.
     /// @param sp  Stack pointer. Top is sp[0], below is sp[-1], sp[-2] ...
     /// @param pc  Program counter. Points to the _next_ op to run.
+    /// @param tos (Only if CACHE_TOS is defined) The top of the stack, instead of `sp[0]`.
     /// @return    The updated stack pointer. (But almost all ops tail-call via `NEXT()`
-    ///            instead of explicitly returning a value.)
+    ///            instead of explicitly returning a value.) The top of stack is in memory.
+#ifdef CACHE_TOS
+    using Op = Value* (*)(Value *sp, const Instruction *pc, Value tos);
+    #define NATIVE_PARAMS  Value *sp, const Instruction *pc, Value tos
+#else
     using Op = Value* (*)(Value *sp, const Instruction *pc);
+    #define NATIVE_PARAMS  Value *sp, const Instruction *pc
+#endif
 
 
     /// A Forth instruction. Interpreted code is a sequence of these.
@@ -54,10 +70,12 @@ namespace tails {
         const Instruction* word;    // Interpreted word to call; parameter to INTERP
         intptr_t           offset;  // PC offset; parameter to BRANCH and ZBRANCH
         Value              literal; // Value to push on stack; parameter to LITERAL
+        WordProfile*       profile; // Counters to update; parameter to the _PROFILE ops
 
         constexpr Instruction(Op o)                 :native(o) { }
         constexpr Instruction(const Instruction *w) :word(w) { }
         constexpr Instruction(Value v)              :literal(v) { }
+        constexpr Instruction(WordProfile *p)       :profile(p) { }
         explicit constexpr Instruction(intptr_t o)  :offset(o) { }
 
         static constexpr Instruction withOffset(intptr_t o) {return Instruction(o);}
@@ -72,21 +90,99 @@ namespace tails {
     inline bool operator!= (const Instruction &a, const Instruction &b) {return !(a == b);}
 
 
+    // Stack accessors for use in native ops. `S0` is the top of the stack, `S1` the item below...
+    // `PUSH(v)` pushes a value, `POP()` removes and returns the top, `DROPN(n)` pops n items.
+    // `SPILL()` writes a cached top-of-stack to memory and `RELOAD()` reads it back; they're needed
+    // around code that accesses the stack through `sp` directly. (Without CACHE_TOS they do nothing.)
+    // Note: With CACHE_TOS, calling a Value method on `S0` takes the address of `tos`, which can
+    // keep the compiler from tail-calling in `NEXT()` (unless it supports `musttail`.) So code
+    // that does that should call it on a temporary copy instead, e.g. `Value(S0).length()`.
+#ifdef CACHE_TOS
+    #define S0          tos
+    #define PUSH(V)     do {Value v_ = (V); *sp++ = tos; tos = v_;} while (0)
+    #define POP()       std::exchange(tos, *--sp)
+    #define DROPN(N)    (sp -= (N), tos = *sp)
+    #define SPILL()     (void)(*sp = tos)
+    #define RELOAD()    (void)(tos = *sp)
+#else
+    #define S0          sp[0]
+    #define PUSH(V)     do {Value v_ = (V); *++sp = v_;} while (0)
+    #define POP()       (*sp--)
+    #define DROPN(N)    (void)(sp -= (N))
+    #define SPILL()     (void)0
+    #define RELOAD()    (void)0
+#endif
+    #define S1          sp[-1]
+    #define S2          sp[-2]
+
+
+    /// The number of extra Value slots a caller must allocate _below_ the stack base.
+    /// With CACHE_TOS, calling a word reads the top of stack from `*sp` even if the stack is empty.
+#ifdef CACHE_TOS
+    static constexpr size_t kStackSlop = 1;
+#else
+    static constexpr size_t kStackSlop = 0;
+#endif
+
+
+    // The TRACE function reads the stack from memory, so a cached top-of-stack has to be spilled.
+#if defined(CACHE_TOS) && defined(ENABLE_TRACING)
+    #define TRACE_OP(PC)    (SPILL(), TRACE(sp, PC))
+#else
+    #define TRACE_OP(PC)    TRACE(sp, PC)
+#endif
+
+
     // The standard Forth NEXT routine, found at the end of every native op,
     // that jumps to the next op.
     // It uses tail-recursion, so (in an optimized build) it _literally does jump_,
     // without growing the call stack.
-    #define NEXT()    TRACE(sp, pc); MUSTTAIL return pc->native(sp, pc + 1)
-
-
-    /// Calls an interpreted word pointed to by `fn`. Used by `INTERP` and `run`.
-    /// @param sp    Stack pointer
+#ifdef CACHE_TOS
+    #define NEXT()    TRACE_OP(pc); MUSTTAIL return pc->native(sp, pc + 1, tos)
+#else
+    #define NEXT()    TRACE_OP(pc); MUSTTAIL return pc->native(sp, pc + 1)
+#endif
+
+    // Jumps to an Op that isn't in the code, such as a word's native code, passing it the
+    // current `pc`, as a tail call.
+#ifdef CACHE_TOS
+    #define JUMP_TO(OP)    MUSTTAIL return (OP)(sp, pc, tos)
+#else
+    #define JUMP_TO(OP)    MUSTTAIL return (OP)(sp, pc)
+#endif
+
+
+    /// Calls an interpreted word pointed to by `fn`. Used by `run`.
+    /// (Native ops should use `CALL_WORD` or `TAIL_CALL` instead.)
+    /// @param sp    Stack pointer. (With CACHE_TOS, `*sp` must be readable even if the stack is
+    ///              empty; see \ref kStackSlop.)
     /// @param start The first instruction of the word to run
     /// @return      The stack pointer on completion.
     ALWAYS_INLINE
     static inline Value* call(Value *sp, const Instruction *start) {
         TRACE(sp, start);
+#ifdef CACHE_TOS
+        return start->native(sp, start + 1, *sp);
+#else
         return start->native(sp, start + 1);
+#endif
     }
 
+#ifdef CACHE_TOS
+    /// Calls an interpreted word, passing it the cached top-of-stack.
+    ALWAYS_INLINE
+    static inline Value* call(Value *sp, const Instruction *start, Value tos) {
+        TRACE_OP(start);
+        return start->native(sp, start + 1, tos);
+    }
+
+    // Calls an interpreted word from a native op, updating `sp` (and `tos`.)
+    #define CALL_WORD(START)    (sp = call(sp, (START), tos), RELOAD())
+    // Jumps to an interpreted word from a native op, as a tail call.
+    #define TAIL_CALL(START)    MUSTTAIL return call(sp, (START), tos)
+#else
+    #define CALL_WORD(START)    (void)(sp = call(sp, (START)))
+    #define TAIL_CALL(START)    MUSTTAIL return call(sp, (START))
+#endif
+
 }
@@ -89,3 +89,12 @@
 #else
     #define _pure
 #endif
+
+
+// `_usuallyFalse` tells the compiler a condition is rarely true, so it can move the code it
+// guards out of the fast path.
+#if __has_builtin(__builtin_expect)
+    #define _usuallyFalse(VAL)          __builtin_expect(VAL, false)
+#else
+    #define _usuallyFalse(VAL)          (VAL)
+#endif
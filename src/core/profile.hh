@@ -0,0 +1,104 @@
+//
+// profile.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "instruction.hh"
+#include "platform.hh"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#elif !defined(__aarch64__)
+#   include <chrono>
+#endif
+
+
+namespace tails {
+
+    /// How the compiler instruments the words it compiles, to count and time their calls.
+    enum class ProfileMode : uint8_t {
+        None,       ///< No instrumentation
+        Counts,     ///< Count calls and loop iterations
+        Cycles,     ///< Count, and also total the CPU cycles spent in each call
+    };
+
+
+    /// Reads a cheap, monotonic high-resolution counter: the CPU's timestamp counter on x86, the
+    /// virtual counter on ARM64, or else a nanosecond clock.
+    ALWAYS_INLINE static inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#elif defined(__aarch64__)
+        uint64_t t;
+        __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+        return t;
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+
+    /// The counters of a word compiled with profiling. The word's code points to this; the
+    /// `_PROFILE` ops update it.
+    ///
+    /// The counters are bumped with a relaxed load and store, not an atomic increment, to keep
+    /// the cost to a plain memory increment; so if several threads run the same word at once,
+    /// a few counts may be lost.
+    struct WordProfile {
+        explicit WordProfile(std::string n)         :name(std::move(n)) { }
+
+        void countCall()                            {bump(calls);}
+        void countLoop()                            {bump(loops);}
+
+        /// Called around a timed call. Only the outermost of recursive calls adds its time.
+        void enter()                                {depth.fetch_add(1, std::memory_order_relaxed);}
+        void exit(uint64_t elapsed) {
+            if (depth.fetch_sub(1, std::memory_order_relaxed) == 1)
+                bump(cycles, elapsed);
+        }
+
+        /// Clears the counters. (A word's native code, if any, is kept, and it's not promoted again.)
+        void reset() {
+            calls = 0; loops = 0; cycles = 0; depth = 0;
+        }
+
+        std::string           name;             ///< The word's name, or empty for a quotation
+        std::atomic<uint64_t> calls {0};        ///< Number of times the word was called
+        std::atomic<uint64_t> loops {0};        ///< Number of loop back-edges taken
+        std::atomic<uint64_t> cycles {0};       ///< Total cycles in calls (if timed)
+        std::atomic<uint32_t> depth {0};        ///< Number of timed calls in progress
+        std::atomic<Op>       nativeCode {nullptr}; ///< Machine code, once promoted (NativeTier)
+
+        /// After this many calls, `_PROFILE` has the `promoter` compile the word to native code.
+        static constexpr uint64_t kPromotionCalls = 1000;
+
+        /// Compiles a hot word to native code, given its first instruction (the `_PROFILE`) and
+        /// its profile. The native tier (native_tier.hh), which is above the core, installs it;
+        /// until then hot words stay interpreted.
+        using Promoter = void (*)(const Instruction *code, WordProfile&);
+        static inline std::atomic<Promoter> promoter {nullptr};
+
+    private:
+        static void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+}
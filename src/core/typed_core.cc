@@ -0,0 +1,318 @@
+//
+// typed_core.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "typed_core.hh"
+#include <algorithm>
+#include <cassert>
+
+
+namespace tails {
+    using core_words::ArithOp;
+
+    // This file, like core_words.cc, must be compiled with optimization (and without stack
+    // frames) so that `NEXT` compiles to a jump; see build.sh. It's also compiled without SLP
+    // vectorization, which would merge the adjacent slot accesses of ops like `SWAP` and `ROT`
+    // into 16-byte loads and stores; a 16-byte load can't be forwarded from the two 8-byte stores
+    // that usually just wrote it, and the stalls made a typical loop three times slower.
+
+    // The typed counterparts of the stack macros in instruction.hh, which replace them here.
+    // The top of the stack is always `sp[0]`, since a Slot has no tag bits to spare for a cached
+    // copy's validity.
+    #undef S0
+    #undef S1
+    #undef S2
+    #undef PUSH
+    #undef POP
+    #undef NEXT
+    #define S0          sp[0]
+    #define S1          sp[-1]
+    #define S2          sp[-2]
+    #define PUSH(V)     do {Slot v_ = (V); *++sp = v_;} while (0)
+    #define POP()       (*sp--)
+    #define NEXT()      MUSTTAIL return pc->native(sp, pc + 1)
+
+    // Defines the member op NAME of `TypedCore<Policy>`.
+    #define TYPED_OP(NAME) \
+        template <class Policy> \
+        typename TypedCore<Policy>::Slot* \
+        TypedCore<Policy>::NAME(Slot *sp, const Instruction *pc)
+
+
+#pragma mark - LOOP CONTROL:
+
+
+    template <class Policy>
+    thread_local typename TypedCore<Policy>::LoopFrame *TypedCore<Policy>::tLoopBase = nullptr;
+    template <class Policy>
+    thread_local typename TypedCore<Policy>::LoopFrame *TypedCore<Policy>::tLoopTop = nullptr;
+    template <class Policy>
+    thread_local typename TypedCore<Policy>::LoopFrame *TypedCore<Policy>::tLoopEnd = nullptr;
+
+    template <class Policy>
+    thread_local std::unique_ptr<typename TypedCore<Policy>::LoopFrame[]> TypedCore<Policy>::tLoops;
+
+    template <class Policy>
+    void TypedCore<Policy>::growLoops() {
+        size_t depth = tLoopTop - tLoopBase, capacity = std::max(size_t(16), 2 * depth);
+        auto loops = std::make_unique<LoopFrame[]>(capacity);
+        std::copy(tLoopBase, tLoopTop, loops.get());
+        tLoopBase = loops.get();
+        tLoopTop = tLoopBase + depth;
+        tLoopEnd = tLoopBase + capacity;
+        tLoops = std::move(loops);
+    }
+
+    template <class Policy>
+    inline void TypedCore<Policy>::pushLoop(Slot index, Slot limit) {
+        if (_usuallyFalse(tLoopTop == tLoopEnd))
+            growLoops();
+        *tLoopTop++ = {index, limit};
+    }
+
+    template <class Policy>
+    size_t TypedCore<Policy>::loopDepth() noexcept {
+        return tLoopTop - tLoopBase;
+    }
+
+    template <class Policy>
+    void TypedCore<Policy>::unwindLoops(size_t depth) noexcept {
+        tLoopTop = std::min(tLoopTop, tLoopBase + depth);
+    }
+
+    [[noreturn]] NOINLINE static void notInLoop() {
+        throw std::runtime_error("I used outside of a loop");
+    }
+
+
+#pragma mark - OPS:
+
+
+    TYPED_OP(RETURN)    {(void)pc; return sp;}
+    TYPED_OP(NOP)       {NEXT();}
+    TYPED_OP(ZERO)      {PUSH(0); NEXT();}
+    TYPED_OP(ONE)       {PUSH(1); NEXT();}
+    TYPED_OP(LITERAL)   {PUSH((pc++)->literal); NEXT();}
+    TYPED_OP(DUP)       {PUSH(S0); NEXT();}
+    TYPED_OP(DROP)      {--sp; NEXT();}
+    TYPED_OP(SWAP)      {Slot s0 = S0; S0 = S1; S1 = s0; NEXT();}
+    TYPED_OP(OVER)      {PUSH(S1); NEXT();}
+    TYPED_OP(OVER2)     {Slot s1 = S1; PUSH(s1); PUSH(S1); NEXT();}
+    TYPED_OP(DUPMULT)   {S0 = Policy::mul(S0, S0); NEXT();}
+
+    TYPED_OP(ROT) {
+        Slot s2 = S2;
+        S2 = S1;
+        S1 = S0;
+        S0 = s2;
+        NEXT();
+    }
+
+    TYPED_OP(BRANCH) {
+        pc += pc->offset + 1;
+        NEXT();
+    }
+
+    TYPED_OP(ZBRANCH) {
+        if (!Policy::truthy(POP()))
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+    TYPED_OP(DUP_ZBRANCH) {
+        if (!Policy::truthy(S0))
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+    TYPED_OP(EQZ_ZBRANCH) {
+        if (POP() != 0)
+            pc += pc->offset;
+        ++pc;
+        NEXT();
+    }
+
+    TYPED_OP(RECURSE) {
+        sp = call(sp, pc + 1 + pc->offset);
+        ++pc;
+        NEXT();
+    }
+
+    TYPED_OP(DO) {
+        Slot start = POP();
+        Slot limit = POP();
+        if (start < limit) {
+            pushLoop(start, limit);
+            ++pc;
+        } else {
+            pc += pc->offset + 1;
+        }
+        NEXT();
+    }
+
+    TYPED_OP(LOOP) {
+        LoopFrame &loop = tLoopTop[-1];
+        if (++loop.index < loop.limit) {
+            pc += pc->offset + 1;
+        } else {
+            --tLoopTop;
+            ++pc;
+        }
+        NEXT();
+    }
+
+    TYPED_OP(I) {
+        if (_usuallyFalse(tLoopTop == tLoopBase))
+            notInLoop();
+        PUSH(tLoopTop[-1].index);
+        NEXT();
+    }
+
+
+#pragma mark - ARITHMETIC OPS:
+
+
+    namespace {
+
+        template <class Policy, ArithOp A>
+        ALWAYS_INLINE inline typename Policy::Slot apply(typename Policy::Slot x,
+                                                         typename Policy::Slot y)
+        {
+            using Slot = typename Policy::Slot;
+            if constexpr (A == ArithOp::Plus)        return Policy::add(x, y);
+            else if constexpr (A == ArithOp::Minus)  return Policy::sub(x, y);
+            else if constexpr (A == ArithOp::Mult)   return Policy::mul(x, y);
+            else if constexpr (A == ArithOp::Div)    return Policy::div(x, y);
+            else if constexpr (A == ArithOp::Mod)    return Policy::mod(x, y);
+            else if constexpr (A == ArithOp::Eq)     return Slot(x == y);
+            else if constexpr (A == ArithOp::Ne)     return Slot(x != y);
+            else if constexpr (A == ArithOp::Gt)     return Slot(x > y);
+            else if constexpr (A == ArithOp::Ge)     return Slot(x >= y);
+            else if constexpr (A == ArithOp::Lt)     return Slot(x < y);
+            else                                        return Slot(x <= y);
+        }
+
+        // The op templates behind `TypedCore::binaryOp` etc.
+        #define ARITH_OP(NAME) \
+            template <class Policy, ArithOp A> \
+            typename Policy::Slot* NAME(typename Policy::Slot *sp, \
+                                        const typename TypedCore<Policy>::Instruction *pc)
+
+        ARITH_OP(binary) {
+            sp[-1] = apply<Policy,A>(sp[-1], sp[0]);
+            --sp;
+            NEXT();
+        }
+
+        ARITH_OP(withLiteral) {
+            sp[0] = apply<Policy,A>(sp[0], (pc++)->literal);
+            NEXT();
+        }
+
+        ARITH_OP(dupWithLiteral) {
+            sp[1] = apply<Policy,A>(sp[0], (pc++)->literal);
+            ++sp;
+            NEXT();
+        }
+
+        ARITH_OP(withZero) {
+            sp[0] = apply<Policy,A>(sp[0], 0);
+            NEXT();
+        }
+
+        ARITH_OP(branchUnless) {
+            bool b = apply<Policy,A>(sp[-1], sp[0]);
+            sp -= 2;
+            if (!b)
+                pc += pc->offset;
+            ++pc;
+            NEXT();
+        }
+
+        template <class Policy, size_t N, bool Tail>
+        typename Policy::Slot* interp(typename Policy::Slot *sp,
+                                      const typename TypedCore<Policy>::Instruction *pc)
+        {
+            using Core = TypedCore<Policy>;
+            for (size_t i = 0; i < N - Tail; ++i)
+                sp = Core::call(sp, (pc++)->word);
+            if constexpr (Tail)
+                MUSTTAIL return Core::call(sp, pc->word);
+            else
+                NEXT();
+        }
+
+        #undef ARITH_OP
+    }
+
+
+    // An array of an op template's instantiations, indexed by ArithOp.
+    #define ARITH_OPS(FN) { \
+        &FN<Policy,ArithOp::Plus>, &FN<Policy,ArithOp::Minus>, \
+        &FN<Policy,ArithOp::Mult>, &FN<Policy,ArithOp::Div>, &FN<Policy,ArithOp::Mod>, \
+        &FN<Policy,ArithOp::Eq>, &FN<Policy,ArithOp::Ne>, \
+        &FN<Policy,ArithOp::Gt>, &FN<Policy,ArithOp::Ge>, \
+        &FN<Policy,ArithOp::Lt>, &FN<Policy,ArithOp::Le>}
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::binaryOp(ArithOp arith) {
+        static constexpr Op kOps[] = ARITH_OPS(binary);
+        return kOps[size_t(arith)];
+    }
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::literalOp(ArithOp arith) {
+        static constexpr Op kOps[] = ARITH_OPS(withLiteral);
+        return kOps[size_t(arith)];
+    }
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::dupLiteralOp(ArithOp arith) {
+        static constexpr Op kOps[] = ARITH_OPS(dupWithLiteral);
+        return kOps[size_t(arith)];
+    }
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::zeroOp(ArithOp arith) {
+        static constexpr Op kOps[] = ARITH_OPS(withZero);
+        return kOps[size_t(arith)];
+    }
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::branchUnlessOp(ArithOp arith) {
+        static constexpr Op kOps[] = ARITH_OPS(branchUnless);
+        return kOps[size_t(arith)];
+    }
+
+    template <class Policy>
+    typename TypedCore<Policy>::Op TypedCore<Policy>::interpOp(size_t n, bool tail) {
+        static constexpr Op kOps[2][4] = {
+            {&interp<Policy,1,false>, &interp<Policy,2,false>,
+             &interp<Policy,3,false>, &interp<Policy,4,false>},
+            {&interp<Policy,1,true>,  &interp<Policy,2,true>,
+             &interp<Policy,3,true>,  &interp<Policy,4,true>},
+        };
+        assert(n >= 1 && n <= 4);
+        return kOps[tail][n - 1];
+    }
+
+
+    template class TypedCore<Int64Policy>;
+
+}
@@ -0,0 +1,199 @@
+//
+// typed_core.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "core_words.hh"
+#include "platform.hh"
+#include "value.hh"
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+
+namespace tails {
+
+    // The regular interpreter's stack slots are NaN-tagged `Value`s, so every arithmetic op has
+    // to check the types of its operands. A *value policy* describes a different kind of slot
+    // with a fixed numeric type; `TypedCore<Policy>` is a threaded-code core, built the same way
+    // as the one in instruction.hh and core_words.cc, whose stack holds `Policy::Slot`s and whose
+    // arithmetic is the policy's, inlined into each op. (It's a separate core, not the Value
+    // core templated on its slot type, because each core word is a distinct `Word` whose op
+    // address identifies it to the compiler's tables, the vocabularies and the native tier.)
+    //
+    // The one policy is `Int64Policy`. A number `Value` already is a raw `double`, so a `double`
+    // policy would save little more than the type checks, and it would still have to turn NaN
+    // results into `null` to match the Value core; it ran no faster, and wasn't kept.
+    //
+    // A policy provides:
+    //   - `Slot`, the type of a stack slot;
+    //   - `kName`, a name for it;
+    //   - `fromValue(Value, Slot&)`, which converts a literal, returning false if it can't;
+    //   - `toValue(Slot)`;
+    //   - `truthy(Slot)`, the condition tested by `0BRANCH`;
+    //   - `add`, `sub`, `mul`, `div` and `mod`.
+    //
+    // Code for a TypedCore is translated from words compiled by the regular Compiler; see
+    // typed_word.hh.
+
+
+    /// A value policy using `int64_t` slots, with integer arithmetic: overflow wraps around, and
+    /// `/` only divides exactly, throwing `std::domain_error` if there's a remainder (or the
+    /// divisor is zero) rather than truncating, since the compiler folds constant divisions as
+    /// doubles and the results have to agree. Only literals that are whole numbers can be
+    /// converted.
+    struct Int64Policy {
+        using Slot = int64_t;
+        static constexpr const char* kName = "int64";
+
+        static bool fromValue(Value v, Slot &s) {
+            if (!v.isDouble())
+                return false;
+            double d = v.asDouble();
+            if (!(d >= -0x1p63 && d < 0x1p63) || d != std::trunc(d))
+                return false;
+            s = Slot(d);
+            return true;
+        }
+        static Value toValue(Slot s)                    {return Value(double(s));}
+
+        static bool truthy(Slot s)                      {return s != 0;}
+        static Slot add(Slot a, Slot b)                 {return Slot(uint64_t(a) + uint64_t(b));}
+        static Slot sub(Slot a, Slot b)                 {return Slot(uint64_t(a) - uint64_t(b));}
+        static Slot mul(Slot a, Slot b)                 {return Slot(uint64_t(a) * uint64_t(b));}
+        static Slot div(Slot a, Slot b) {
+            if (_usuallyFalse(b == 0))
+                divideByZero();
+            if (b == -1)
+                return sub(0, a);                       // (INT64_MIN / -1 would overflow)
+            if (_usuallyFalse(a % b != 0))
+                inexactDivision();
+            return a / b;
+        }
+        static Slot mod(Slot a, Slot b) {
+            if (_usuallyFalse(b == 0))
+                divideByZero();
+            return (b == -1) ? 0 : a % b;
+        }
+
+        [[noreturn]] static void divideByZero() {
+            throw std::domain_error("Division by zero");
+        }
+        [[noreturn]] static void inexactDivision() {
+            throw std::domain_error("Division has a remainder");
+        }
+    };
+
+
+    /// A threaded-code interpreter core whose stack slots are `Policy::Slot`s.
+    /// Its ops are defined, and it's instantiated for `Int64Policy`, in typed_core.cc, which is
+    /// compiled like core_words.cc so that `NEXT` is a tail call.
+    template <class Policy>
+    class TypedCore {
+    public:
+        using Slot = typename Policy::Slot;
+
+        union Instruction;
+
+        /// An op, like a native word's function, takes the stack and the next instruction.
+        /// The top of the stack is always in memory.
+        using Op = Slot* (*)(Slot *sp, const Instruction *pc);
+
+        /// A typed instruction: an op or its parameter, as in `tails::Instruction`.
+        union Instruction {
+            Op                 native;
+            const Instruction* word;    // Word to call; parameter to `interpOp`
+            intptr_t           offset;  // PC offset; parameter to branches and loops
+            Slot               literal; // Parameter to `LITERAL` and the `literalOp`s
+
+            constexpr Instruction()                     :word(nullptr) { }
+            constexpr Instruction(Op o)                 :native(o) { }
+            constexpr Instruction(const Instruction *w) :word(w) { }
+            static constexpr Instruction withOffset(intptr_t o) {Instruction i; i.offset = o; return i;}
+            static constexpr Instruction withLiteral(Slot s)    {Instruction i; i.literal = s; return i;}
+        };
+
+        /// Calls typed code starting at `start`, returning the updated stack pointer.
+        static Slot* call(Slot *sp, const Instruction *start) {
+            return start->native(sp, start + 1);
+        }
+
+        /// A running `DO ... LOOP`'s index and limit.
+        struct LoopFrame {
+            Slot index, limit;
+        };
+
+        /// The number of counted loops running on this thread.
+        static size_t loopDepth() noexcept;
+        /// Forgets the innermost running loops, leaving `depth` of them; for use after an
+        /// exception was thrown out of their bodies.
+        static void unwindLoops(size_t depth) noexcept;
+
+        // Ops without parameters, named after the words they implement:
+        static Slot* RETURN(Slot*, const Instruction*);
+        static Slot* NOP(Slot*, const Instruction*);
+        static Slot* ZERO(Slot*, const Instruction*);
+        static Slot* ONE(Slot*, const Instruction*);
+        static Slot* DUP(Slot*, const Instruction*);
+        static Slot* DROP(Slot*, const Instruction*);
+        static Slot* SWAP(Slot*, const Instruction*);
+        static Slot* OVER(Slot*, const Instruction*);
+        static Slot* ROT(Slot*, const Instruction*);
+        static Slot* OVER2(Slot*, const Instruction*);      // `OVER OVER`
+        static Slot* DUPMULT(Slot*, const Instruction*);    // `DUP *`
+        static Slot* I(Slot*, const Instruction*);
+
+        // Ops followed by a literal `Slot`:
+        static Slot* LITERAL(Slot*, const Instruction*);
+
+        // Ops followed by an offset, whose meaning is the same as in the regular core:
+        static Slot* BRANCH(Slot*, const Instruction*);
+        static Slot* ZBRANCH(Slot*, const Instruction*);
+        static Slot* DUP_ZBRANCH(Slot*, const Instruction*);    // `DUP 0BRANCH`
+        static Slot* EQZ_ZBRANCH(Slot*, const Instruction*);    // `0= 0BRANCH`
+        static Slot* RECURSE(Slot*, const Instruction*);
+        static Slot* DO(Slot*, const Instruction*);
+        static Slot* LOOP(Slot*, const Instruction*);
+
+        /// The op applying `arith` to the top two items, `(x y -- x arith y)`.
+        static Op binaryOp(core_words::ArithOp arith);
+        /// The op applying `arith` to the top item and the literal after it, `(x -- x arith lit)`.
+        static Op literalOp(core_words::ArithOp arith);
+        /// The `literalOp` that first duplicates the top item, `(x -- x x arith lit)`.
+        static Op dupLiteralOp(core_words::ArithOp arith);
+        /// The op applying `arith` to the top item and zero, `(x -- x arith 0)`.
+        static Op zeroOp(core_words::ArithOp arith);
+        /// The op that pops two items and branches by the offset after it, unless
+        /// `x arith y` is true: `arith` fused with `0BRANCH`.
+        static Op branchUnlessOp(core_words::ArithOp arith);
+        /// The op that calls the `n` words (1...4) following it; if `tail`, the last by a tail call.
+        static Op interpOp(size_t n, bool tail);
+
+    private:
+        NOINLINE static void growLoops();
+        static void pushLoop(Slot index, Slot limit);
+
+        // The loop-control stack, as in core_words.cc. `tLoopTop` points past the innermost frame.
+        static thread_local LoopFrame *tLoopBase, *tLoopTop, *tLoopEnd;
+        static thread_local std::unique_ptr<LoopFrame[]> tLoops;   // Owns the frames
+    };
+
+
+    extern template class TypedCore<Int64Policy>;
+
+}
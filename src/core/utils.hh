@@ -7,7 +7,11 @@
 #pragma once
 #include "stdint.h"
 #include "stdio.h"
+#include <initializer_list>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 namespace tails {
 
@@ -52,6 +56,75 @@ namespace tails {
     }
 
 
+    constexpr static inline char _toupper(char c) {
+        return (c >= 'a' && c <= 'z') ? char(c - 'a' + 'A') : c;
+    }
+
+
+    // Case-insensitive (ASCII) string hashing and comparison, which don't allocate.
+
+    /// FNV-1a hash of an uppercased string. Different `seed`s give different hash functions.
+    constexpr static inline uint32_t hashNoCase(std::string_view str, uint32_t seed = 0) noexcept {
+        uint32_t h = 2166136261u ^ (seed * 16777619u);
+        for (char c : str) {
+            h ^= uint8_t(_toupper(c));
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    constexpr static inline bool equalNoCase(std::string_view a, std::string_view b) noexcept {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i)
+            if (_toupper(a[i]) != _toupper(b[i]))
+                return false;
+        return true;
+    }
+
+    /// Hash and equality functors for case-insensitive unordered containers.
+    struct HashNoCase {
+        size_t operator() (std::string_view str) const noexcept    {return hashNoCase(str);}
+    };
+    struct EqualNoCase {
+        bool operator() (std::string_view a, std::string_view b) const noexcept {
+            return equalNoCase(a, b);
+        }
+    };
+
+
+    /// A minimal stand-in for C++20's `std::span`: a pointer to contiguous items and a count.
+    template <typename T>
+    class span {
+    public:
+        constexpr span() = default;
+        constexpr span(T *items, size_t size)           :_begin(items), _size(size) { }
+        template <size_t N>
+        constexpr span(T (&items)[N])                   :span(items, N) { }
+        template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*,T*>>>
+        constexpr span(span<U> s)                       :span(s.data(), s.size()) { }
+        template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*,T*>>>
+        span(std::vector<U> &v)                         :span(v.data(), v.size()) { }
+        template <typename U, typename = std::enable_if_t<std::is_convertible_v<const U*,T*>>>
+        span(const std::vector<U> &v)                   :span(v.data(), v.size()) { }
+        /// (Only for spans of const items, since the list's storage is const.)
+        constexpr span(std::initializer_list<std::remove_const_t<T>> list)
+        :span(list.begin(), list.size())
+        {static_assert(std::is_const_v<T>, "span of an initializer_list must be const");}
+
+        constexpr T* data() const                       {return _begin;}
+        constexpr size_t size() const                   {return _size;}
+        constexpr bool empty() const                    {return _size == 0;}
+        constexpr T* begin() const                      {return _begin;}
+        constexpr T* end() const                        {return _begin + _size;}
+        constexpr T& operator[] (size_t i) const        {return _begin[i];}
+
+    private:
+        T*     _begin = nullptr;
+        size_t _size = 0;
+    };
+
+
     template <typename T>
     constexpr static inline int _cmp(T a, T b)    {return (a==b) ? 0 : ((a<b) ? -1 : 1);}
 
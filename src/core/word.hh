@@ -28,7 +28,7 @@ namespace tails {
     /// The subclass \ref CompiledWord builds words at runtime.
     class Word {
     public:
-        enum Flags : uint8_t {
+        enum Flags : uint16_t {
             NoFlags     = 0x00,
             Native      = 0x01, ///< Implemented in native code (at `_instr.op`)
             HasIntParam = 0x02, ///< This word is followed by an integer param (BRANCH, 0BRANCH)
@@ -37,12 +37,17 @@ namespace tails {
             Magic       = 0x10, ///< Low-level, not allowed in parsed code (0BRANCH, INTERP, etc.)
             Inline      = 0x20, ///< Should be inlined at call site
             Recursive   = 0x40, ///< Calls itself recursively
+            Pure        = 0x80, ///< No side effects; outputs depend only on inputs (foldable, or
+                                ///< for a compiled word, able to run on any thread)
+            Metered     = 0x100,///< Uses fuel, so it can be suspended (see continuation.hh)
 
             MagicIntParam  = Magic | HasIntParam,
             MagicValParam  = Magic | HasValParam,
             MagicWordParam = Magic | HasWordParam,
         };
 
+        friend constexpr Flags operator| (Flags a, Flags b)   {return Flags(uint16_t(a) | b);}
+
         constexpr Word(const char *name,
                        Op native,
                        StackEffect effect,
@@ -57,17 +62,19 @@ namespace tails {
 
         constexpr Word(const char *name,
                        StackEffect effect,
-                       const Instruction words[])
+                       const Instruction words[],
+                       Flags flags =NoFlags)
         :_instr(words)
         ,_name(name)
         ,_effect(effect)
-        ,_flags(NoFlags)
-        { }
+        ,_flags(flags)
+        { assert(!(flags & Native)); }
 
         constexpr const char* name() const              {return _name;}
         constexpr Instruction instruction() const       {return _instr;}
         constexpr StackEffect stackEffect() const       {return _effect;}
 
+        constexpr Flags flags() const                   {return _flags;}
         constexpr bool hasFlag(Flags f) const           {return (_flags & f) != 0;}
         constexpr bool isNative() const                 {return hasFlag(Native);}
         constexpr uint8_t parameters() const            {return _nParams;}
@@ -75,6 +82,8 @@ namespace tails {
         constexpr bool hasValParams() const             {return hasFlag(HasValParam);}
         constexpr bool hasWordParams() const            {return hasFlag(HasWordParam);}
         constexpr bool isMagic() const                  {return hasFlag(Magic);}
+        constexpr bool isPure() const                   {return hasFlag(Pure);}
+        constexpr bool isMetered() const                {return hasFlag(Metered);}
 
         constexpr operator Instruction() const          {return _instr;}
 
@@ -98,14 +107,16 @@ namespace tails {
     // Shortcut for defining a native word (see examples in core_words.cc.)
     // It should be followed by the C++ function body in curly braces.
     // The body can use parameters `sp` and `pc`, and should end by calling `NEXT()`.
+    // It should access the stack with the macros `S0`, `PUSH`, `POP` etc. (see instruction.hh),
+    // so that it works whether or not CACHE_TOS is enabled.
     // @param NAME  The C++ name of the Word object to define.
     // @param FORTHNAME  The word's Forth name (a string literal.)
     // @param EFFECT  The \ref StackEffect. Must be accurate!
     // Flags and parameter count may optionally follow, as per the Word constructor.
     #define NATIVE_WORD(NAME, FORTHNAME, EFFECT, ...) \
-        extern "C" Value* f_##NAME(Value *sp, const Instruction *pc); \
+        extern "C" Value* f_##NAME(NATIVE_PARAMS); \
         constexpr Word NAME(FORTHNAME, f_##NAME, EFFECT, ## __VA_ARGS__); \
-        Value* f_##NAME(Value *sp, const Instruction *pc)
+        Value* f_##NAME(NATIVE_PARAMS)
 
 
     // Shortcut for defining a native word implementing a binary operator like `+` or `==`.
@@ -113,9 +124,9 @@ namespace tails {
     // @param FORTHNAME  The word's Forth name (a string literal.)
     // @param INFIXOP  The raw C++ infix operator to implement, e.g. `+` or `==`.
     #define BINARY_OP_WORD(NAME, FORTHNAME, EFFECT, INFIXOP) \
-        NATIVE_WORD(NAME, FORTHNAME, EFFECT) { \
-            sp[-1] = Value(sp[-1] INFIXOP sp[0]);\
-            --sp;\
+        NATIVE_WORD(NAME, FORTHNAME, EFFECT, Word::Pure) { \
+            Value b_ = POP();\
+            S0 = Value(Value(S0) INFIXOP b_);\
             NEXT(); \
         }
 
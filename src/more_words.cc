@@ -17,9 +17,9 @@
 //
 
 #include "more_words.hh"
+#include "interpreter.hh"
 #include "io.hh"
 #include "stack_effect_parser.hh"
-#include <iostream>
 
 
 namespace tails::word {
@@ -28,31 +28,26 @@ namespace tails::word {
 
 #pragma mark - I/O:
 
-    static bool sAtLeftMargin = true;
+    // Where the printing words write. (Per-Interpreter state.)
+    static OutputSink& output()     {return Interpreter::current().output;}
 
     NATIVE_WORD(PRINT, ".", "a --"_sfx) {
-        std::cout << *(sp--);
-        sAtLeftMargin = false;
+        output().writeValue(POP());
         NEXT();
     }
 
     NATIVE_WORD(SP, "SP.", "--"_sfx) {
-        std::cout << ' ';
-        sAtLeftMargin = false;
+        output().write(' ');
         NEXT();
     }
 
     NATIVE_WORD(NL, "NL.", "--"_sfx) {
-        std::cout << '\n';
-        sAtLeftMargin = true;
+        output().write('\n');
         NEXT();
     }
 
     void endLine() {
-        if (!sAtLeftMargin) {
-            std::cout << '\n';
-            sAtLeftMargin = true;
-        }
+        output().endLine();
     }
 
     NATIVE_WORD(NLQ, "NL?", "--"_sfx) {
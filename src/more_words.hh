@@ -12,7 +12,7 @@ namespace tails::word {
     void endLine();
 
     extern const Word
-        PRINT,  // `.` -- print top of stack to stdout
+        PRINT,  // `.` -- print top of stack to the Interpreter's `output`
         SP,     // `SP.` -- print a space character
         NL,     // `NL.` -- print a newline
         NLQ;    // `NL?` -- print a newline only if there are characters on the current line
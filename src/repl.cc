@@ -18,9 +18,12 @@
 
 #include "compiler.hh"
 #include "gc.hh"
+#include "guarded_stack.hh"
+#include "interpreter.hh"
 #include "io.hh"
 #include "more_words.hh"
 #include "vocabulary.hh"
+#include "word_cache.hh"
 #include "linenoise.h"
 #include "utf8.h"
 #include <algorithm>
@@ -84,29 +87,49 @@ namespace repl {
         if (word.stackEffect().inputCount() > stack.size())
             throw compile_error("Stack would underflow", nullptr);
         auto depth = stack.size();
-        stack.resize(depth + word.stackEffect().max());
+        if (word.stackEffect().maxIsUnknown()) {
+            // A recursive word runs on a guarded stack, which turns overflow into an exception:
+            static GuardedStack sGuardedStack;
+            if (depth > sGuardedStack.capacity())
+                throw stack_overflow("Stack overflow");
+            auto base = sGuardedStack.base();
+            std::copy(stack.begin(), stack.end(), base);
+#ifdef ENABLE_TRACING
+            StackBase = base;
+#endif
+            auto stackTop = sGuardedStack.run(word, base + depth - 1);
+            stack.assign(base, stackTop + 1);
+            return stack;
+        }
+        stack.insert(stack.begin(), kStackSlop, NullValue);
+        stack.resize(kStackSlop + depth + word.stackEffect().max());
 
-        auto stackBase = &stack[0];
+        auto stackBase = &stack[kStackSlop];
 #ifdef ENABLE_TRACING
         StackBase = stackBase;
 #endif
-        auto stackTop = call(&stack[depth] - 1, word.instruction().word);
-        stack.resize(stackTop - stackBase + 1);
+        gc::Execution exec(word, stackBase);
+        auto stackTop = call(stackBase + depth - 1, word.instruction().word);
+        stack.resize(stackTop - &stack[0] + 1);
+        stack.erase(stack.begin(), stack.begin() + kStackSlop);
         return stack;
     }
 
 
+    // Lines typed again, or recalled from the history, with the same types on the stack, reuse
+    // their compiled code. (The cache's quotations are GC roots, so `garbageCollect` keeps them.)
     static void eval(const string &source, Stack &stack) {
-        Compiler comp;
-        comp.setInputStack(&stack.front(), &stack.back());
-        comp.parse(source);
-        CompiledWord compiled(move(comp));
-        run(compiled, stack);
+        auto cache = Interpreter::current().wordCache;
+        if (stack.empty())
+            run(cache->compile(source, nullptr, nullptr), stack);
+        else
+            run(cache->compile(source, &stack.front(), &stack.back()), stack);
     }
 
 
     static void garbageCollect(Stack &stack) {
-        Compiler::activeVocabularies.gcScan();
+        gc::object::beginCollection(!gc::object::wantsMajorCollection());
+        Compiler::activeVocabularies().gcScan();
         gc::object::scanStack(&stack.front(), &stack.back());
 #if 1
         gc::object::sweep();
@@ -142,13 +165,18 @@ using namespace repl;
 
 
 int main(int argc, const char **argv) {
+    tails::Interpreter interpreter;
+    tails::Interpreter::Using using_(interpreter);
     tails::Vocabulary defaultVocab(tails::word::kWords);
-    tails::Compiler::activeVocabularies.push(defaultVocab);
-    tails::Compiler::activeVocabularies.setCurrent(defaultVocab);
+    tails::Compiler::activeVocabularies().push(defaultVocab);
+    tails::Compiler::activeVocabularies().setCurrent(defaultVocab);
+    tails::WordCache wordCache(interpreter);
+    interpreter.wordCache = &wordCache;
 
     cout << "Tails interpreter!!  Empty line clears stack.  Ctrl-D to exit.\n";
     Stack stack;
     while (true) {
+        interpreter.output.flush();
         print(stack);
         cout.flush();
         optional<string> line = readLine(" ➤ ");
@@ -166,12 +194,16 @@ int main(int argc, const char **argv) {
                 tails::word::endLine();
                 garbageCollect(stack);
             } catch (const tails::compile_error &x) {
+                interpreter.output.flush();
                 if (x.location) {
                     auto pos = x.location - line->data();
                     assert(pos >= 0 && pos <= line->size());
                     cout << string(kPromptIndent + 3 + pos, ' ') << "⬆︎\n";
                 }
                 cout << string(kPromptIndent + 3, ' ') << "Error: " << x.what() << "\n";
+            } catch (const tails::stack_overflow &x) {
+                interpreter.output.flush();
+                cout << string(kPromptIndent + 3, ' ') << "Error: " << x.what() << "\n";
             }
         }
     }
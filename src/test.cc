@@ -16,17 +16,33 @@
 // limitations under the License.
 //
 
+#include "batch.hh"
 #include "core_words.hh"
 #include "compiler.hh"
+#include "continuation.hh"
 #include "disassembler.hh"
 #include "gc.hh"
+#include "guarded_stack.hh"
+#include "image.hh"
+#include "interpreter.hh"
+#include "invocation.hh"
 #include "more_words.hh"
+#include "native_tier.hh"
+#include "profiler.hh"
 #include "stack_effect_parser.hh"
+#include "thread_pool.hh"
+#include "typed_word.hh"
 #include "vocabulary.hh"
+#include "word_cache.hh"
 #include "io.hh"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdio>
 #include <iomanip>
 #include <iostream>
+#include <thread>
+#include <unistd.h>
 
 using namespace std;
 using namespace tails;
@@ -43,22 +59,36 @@ static Value run(const Word &word) {
     assert(!word.isNative());           // must be interpreted
     assert(word.stackEffect().inputCount() == 0);  // must not require any inputs
     assert(word.stackEffect().outputCount() > 0);  // must produce results
+    if (word.stackEffect().maxIsUnknown()) {
+        // A recursive word runs on a guarded stack, which turns overflow into an exception:
+        static thread_local GuardedStack tStack;
+#ifdef ENABLE_TRACING
+        StackBase = tStack.base();
+#endif
+        return *tStack.run(word, tStack.base() - 1);
+    }
     size_t stackSize = word.stackEffect().max();
     assert(stackSize >= word.stackEffect().outputCount());
     std::vector<Value> stack;
-    stack.resize(stackSize);
-    auto stackBase = &stack.front();
+    stack.resize(kStackSlop + stackSize);
+    auto stackBase = &stack[kStackSlop];
 #ifdef ENABLE_TRACING
     StackBase = stackBase;
 #endif
+    gc::Execution exec(word, stackBase);
     return * call(stackBase - 1, word.instruction().word);
 }
 
 
-static void garbageCollect() {
-    Compiler::activeVocabularies.gcScan();
+static pair<size_t,size_t> garbageCollect(bool minor = false,
+                                          const Value *bottom = nullptr, const Value *top = nullptr)
+{
+    gc::object::beginCollection(minor);
+    Compiler::activeVocabularies().gcScan();
+    gc::object::scanStack(bottom, top);
     auto [preserved, freed] = gc::object::sweep();
     cout << "GC: freed " << freed << " objects; " << preserved << " left.\n";
+    return {preserved, freed};
 }
 
 
@@ -95,11 +125,19 @@ static void printDisassembly(const Word *word) {
         else if (wordRef.word->hasValParams())
             cout << ":<" << wordRef.param.literal << '>';
         else if (wordRef.word->hasWordParams())
-            cout << ":<" << Compiler::activeVocabularies.lookup(wordRef.param.word)->name() << '>';
+            cout << ":<" << Compiler::activeVocabularies().lookup(wordRef.param.word)->name() << '>';
     }
 }
 
 
+static bool usesWord(const Word *word, const Word &used) {
+    for (auto &wordRef : Disassembler::disassembleWord(word->instruction().word))
+        if (wordRef.word == &used)
+            return true;
+    return false;
+}
+
+
 static void _test(std::initializer_list<Compiler::WordRef> words,
                   const char *sourcecode,
                   double expected)
@@ -179,18 +217,106 @@ static void testStackEffect() {
 }
 
 
+// Runs interpreters on multiple threads at once. Each has its own heap and vocabularies.
+static void testThreads() {
+    constexpr int kNumThreads = 4;
+    std::array<double, kNumThreads> results;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; ++t) {
+        threads.emplace_back([t, &results] {
+            Interpreter interpreter;
+            Interpreter::Using using_(interpreter);
+            Vocabulary vocab(word::kWords);
+            interpreter.vocabularies.push(vocab);
+            interpreter.vocabularies.setCurrent(vocab);
+            gc::object::setBudget(1 << 20, 50);
+            auto compile = [](const char *source) {
+                Compiler c;
+                c.parse(string(source));
+                return CompiledWord(move(c));
+            };
+            run(compile(R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE * ELSE DROP 1 THEN} "fact" define 0 )"));
+            double total = 0;
+            for (int i = 0; i < 20; ++i) {
+                CompiledWord word = compile(R"( 0 "" begin over 100 < while "abcdefgh" + swap 1 + swap repeat )"
+                                            R"( swap drop length  5 fact + )");
+                total += run(word).asDouble();
+            }
+            results[t] = total;
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (double result : results)
+        assert(result == 20 * (800 + 120));
+}
+
+
+// Saves words to an image file, then loads them into a different interpreter.
+static void testImage() {
+    auto compile = [](const char *source) {
+        Compiler c;
+        c.parse(string(source));
+        return CompiledWord(move(c));
+    };
+    string path = "/tmp/tails_test_" + to_string(getpid()) + ".img";
+    {
+        Interpreter interpreter;
+        Interpreter::Using using_(interpreter);
+        Vocabulary vocab(word::kWords);
+        interpreter.vocabularies.push(vocab);
+        interpreter.vocabularies.setCurrent(vocab);
+        run(compile(R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE * ELSE DROP 1 THEN} "fact" define 0 )"));
+        run(compile(R"( {(# -- #) ABS 3 *} "abstriple" define 0 )"));
+        run(compile(R"( {(# -- #) fact abstriple} "both" define 0 )"));
+        run(compile(R"( {(# -- $) 0 > {"a positive number"} {"zero or negative"} IFELSE} "sign" define 0 )"));
+        run(compile(R"( {(-- []) [1 "a string inside an array" [2 3]]} "arr" define 0 )"));
+        Image::write(path, vocab);
+    }
+    {
+        Interpreter interpreter;
+        Interpreter::Using using_(interpreter);
+        Vocabulary vocab(word::kWords);
+        interpreter.vocabularies.push(vocab);
+        interpreter.vocabularies.setCurrent(vocab);
+        Image image(path, vocab);
+        assert(image.words().size() == 5);
+        auto effect = vocab.lookup("both")->stackEffect();
+        assert(effect.inputCount() == 1 && effect.outputCount() == 1);
+        for (int pass = 0; pass < 2; ++pass) {
+            assert(run(compile(R"( -4 abstriple  3 both + )")) == Value(12 + 18));
+            assert(run(compile(R"( 5 sign )")) == Value("a positive number"));
+            assert(run(compile(R"( -5 sign )")) == Value("zero or negative"));
+            assert(run(compile(R"( arr )")) == Value({1, "a string inside an array", Value({2, 3})}));
+            garbageCollect();       // the literals must survive this
+        }
+    }
+    remove(path.c_str());
+}
+
+
 int main(int argc, char *argv[]) {
+    Interpreter interpreter;
+    Interpreter::Using using_(interpreter);
     Vocabulary defaultVocab(word::kWords);
-    Compiler::activeVocabularies.push(defaultVocab);
-    Compiler::activeVocabularies.setCurrent(defaultVocab);
+    Compiler::activeVocabularies().push(defaultVocab);
+    Compiler::activeVocabularies().setCurrent(defaultVocab);
 
     testStackEffect();
 
     cout << "Known words:";
-    for (auto word : Compiler::activeVocabularies)
+    for (auto word : Compiler::activeVocabularies())
         cout << ' ' << word->name();
     cout << "\n";
 
+    // Core words are found by a perfect hash table, case-insensitively:
+    for (auto wp = core_words::kWords; *wp; ++wp)
+        assert(lookupCoreWord((*wp)->name()) == *wp);
+    assert(lookupCoreWord("dup") == &DUP);
+    assert(lookupCoreWord("Define") == &DEFINE);
+    assert(lookupCoreWord("DUPE") == nullptr);
+    assert(lookupCoreWord("") == nullptr);
+
     garbageCollect();
 
     TEST(-1234, -1234);
@@ -226,12 +352,81 @@ int main(int argc, char *argv[]) {
     TEST_PARSER(7,    "3 -4 -");
     TEST_PARSER(14,   "4 3 + DUP + ABS");
     TEST_PARSER(9604, "4 3 + SQUARE DUP + SQUARE ABS");
-    TEST_PARSER(2  ,  "2 ABS ABS ABS");                 // testing INTERP2/3/4
+    TEST_PARSER(2  ,  "2 ABS ABS ABS");                 // ABS is inlined, then folded
+    TEST_PARSER(4  ,  "2 ABS ABS ABS DUP +");
     TEST_PARSER(123,  "1 IF 123 ELSE 666 THEN");
     TEST_PARSER(666,  "0 IF 123 ELSE 666 THEN");
 
     TEST_PARSER(120,  "1 5 begin  dup  while  swap over * swap 1 -  repeat  drop");
 
+    // Counted loops; the index is off the data stack, so the body can reach the values below:
+    TEST_PARSER(55,   "0 11 1 DO I + LOOP");
+    TEST_PARSER(7,    "7 5 5 DO I + LOOP");                // an empty range skips the body
+    TEST_PARSER(18,   "0 4 1 DO 4 1 DO I + LOOP LOOP");    // `I` is the innermost index
+    TEST_PARSER(24,   "0 4 1 DO 4 1 DO I + LOOP I + LOOP");
+    {
+        // `I` is known to be a number, so `+` can use its numeric variant:
+        Compiler c;
+        c.parse(string("10 0 DO I 2 * DROP LOOP"));
+        CompiledWord word(move(c));
+        assert(word.stackEffect().inputCount() == 0 && word.stackEffect().outputCount() == 0);
+        assert(usesWord(&word, _LITMULT_NUM));
+    }
+    {
+        bool threw = false;
+        try {
+            _runParser("I");
+        } catch (const runtime_error &x) {
+            cout << "\t-> threw: " << x.what() << "\n";
+            threw = true;
+        }
+        assert(threw && loopDepth() == 0);
+    }
+
+    // Disassembling an unknown instruction fails cleanly:
+    {
+        const Instruction bogus[] = {Instruction::withOffset(0x1234), _RETURN};
+        bool threw = false;
+        try {
+            Disassembler::disassembleWord(bogus);
+        } catch (const runtime_error &x) {
+            cout << "Disassembler threw: " << x.what() << "\n";
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // Constant folding:
+    {
+        Compiler c;
+        c.parse(string("3 4 * 12 =  0 IF 123 ELSE 666 THEN  +"));
+        CompiledWord folded(move(c));
+        cout << "Folded: ";
+        printDisassembly(&folded);
+        cout << "\n";
+        assert(run(folded) == Value(667));
+        assert(Disassembler::disassembleWord(folded.instruction().word).size() == 2);
+    }
+    // Folding a constant loop test can leave branches in a cycle, a true infinite loop; these
+    // are only compiled, as quotations, never run:
+    TEST_PARSER(0,                  R"( {( -- #) BEGIN 1 WHILE REPEAT 3} DROP 0 )");
+    TEST_PARSER(0,                  R"( {( -- ) BEGIN 1 IF ELSE 2 DROP THEN 1 WHILE REPEAT} DROP 0 )");
+
+    // Stack checking where paths join: the max depth includes a deeper path that arrives second,
+    // and an input first needed after the join is deduced once, whichever path gets there first:
+    {
+        Compiler c;
+        c.parse(string("IF 1 DROP ELSE 1 2 3 DROP DROP DROP THEN 5"));
+        CompiledWord word(move(c));
+        assert(word.stackEffect().inputCount() == 1 && word.stackEffect().max() == 3);
+    }
+    {
+        Compiler c;
+        c.parse(string("IF 1 ELSE 2 THEN +"));
+        CompiledWord word(move(c));
+        assert(word.stackEffect().inputCount() == 2 && word.stackEffect().outputCount() == 1);
+    }
+
     garbageCollect();
 
     // Strings:
@@ -239,6 +434,57 @@ int main(int argc, char *argv[]) {
     TEST_PARSER("truthy",           R"( 1 IF "truthy" ELSE "falsey" THEN )");
     TEST_PARSER("HiThere",          R"( "Hi" "There" + )");
     TEST_PARSER(5,                  R"( "hello" LENGTH )");
+    TEST_PARSER(8000,               R"( "" 0 begin dup 1000 < while swap "abcdefgh" + swap 1 + repeat drop length )");
+    TEST_PARSER(true,               R"( "abcdefghijklmnopqrstuvwxyz" "0123456789" + "abcdefghijklmnopqrstuvwxyz0123456789" = )");
+
+    // Long concatenations make Ropes, which are flattened on demand:
+    {
+        Value str = "";
+        for (int i = 0; i < 100000; ++i)
+            str = str + Value("abcdefgh");
+        auto [kept, freed] = garbageCollect(false, &str, &str);     // marks a deep Rope
+        assert(str.length() == Value(800000));
+        string_view flat = str.asString();
+        assert(flat.size() == 800000 && flat.substr(799992) == "abcdefgh");
+        tie(kept, freed) = garbageCollect(false, &str, &str);       // frees the Rope's children
+        assert(freed >= 100000);
+        assert(str.asString() == flat);
+        assert(str == Value(string(flat).c_str()));
+    }
+
+    // String literals are interned:
+    {
+        Value a = Value::internedString("an interned string");
+        Value b = Value::internedString(string("an interned ") + "string");
+        assert(a.asString().data() == b.asString().data());
+        assert(a == b);
+        assert(a == Value("an interned string") && Value("an interned string") == a);
+        assert(a != Value("an interned strinG"));
+        assert(a != Value::internedString("another interned string"));
+
+        Compiler c1, c2;
+        c1.parse(string(R"( "an interned string" )"));
+        c2.parse(string(R"( "an interned string" )"));
+        CompiledWord w1(move(c1)), w2(move(c2));
+        assert(run(w1).asString().data() == a.asString().data());
+        assert(run(w2).asString().data() == a.asString().data());
+
+        // The intern table doesn't keep strings alive:
+        size_t interned = gc::Heap::current().internedCount();
+        garbageCollect(false, &a, &a);
+        assert(gc::Heap::current().internedCount() < interned);
+        assert(a.asString() == "an interned string");
+    }
+
+    // Freeing lots of strings releases the arena pages they were in:
+    {
+        size_t pages = gc::Heap::current().arena().pageCount();
+        for (int i = 0; i < 10000; ++i)
+            (void)Value("not an inline string");
+        assert(gc::Heap::current().arena().pageCount() > pages + 1);
+        garbageCollect();
+        assert(gc::Heap::current().arena().pageCount() <= pages + 1);
+    }
 
     // Arrays:
     TEST_PARSER(Value({12,34,56}),  R"( [12 34 56] )");
@@ -246,9 +492,54 @@ int main(int argc, char *argv[]) {
     TEST_PARSER(Value({12,"hi there",Value({}),56}),
                                     R"( [12 "hi there" [] 56] )");
     TEST_PARSER(3,                  R"( [12 34 56] LENGTH )");
+    TEST_PARSER(Value({1,2,"hi"}),  R"( [1 2] "hi" + )");
+    TEST_PARSER(10000,              R"( [] 0 begin dup 10000 < while swap "x" + swap 1 + repeat drop length )");
+
+    // Arrays share storage, but appending to one doesn't affect others:
+    {
+        Value a = Value({1, 2});
+        Value b = a + Value("b"), c = a + Value("c"), d = b + Value("d");
+        assert(a == Value({1, 2}));
+        assert(b == Value({1, 2, "b"}));
+        assert(c == Value({1, 2, "c"}));
+        assert(d == Value({1, 2, "b", "d"}));
+        assert(a.length() == 2 && b.length() == 3);
+        assert(a < b && b < c);
+    }
 
     garbageCollect();
 
+    // Generational GC:
+    {
+        size_t baseCount = gc::object::instanceCount();
+        Value root = Value({Value("a long string"), Value(1)});
+        (void)Value("garbage garbage");
+        auto [kept, freed] = garbageCollect(true, &root, &root);    // minor
+        assert(freed == 1 && kept == baseCount + 2);
+        assert(gc::object::youngCount() == 0);
+        // The write barrier lets a minor GC find a young string referenced only by an old array:
+        root.appendToArray(Value("a young string"));
+        (void)Value("more garbage");
+        tie(kept, freed) = garbageCollect(true, &root, &root);
+        assert(freed == 1);
+        assert(root.asArray()->back().asString() == "a young string");
+        // A minor GC doesn't free old objects, even unreachable ones; a major GC does:
+        tie(kept, freed) = garbageCollect(true);
+        assert(freed == 0);
+        tie(kept, freed) = garbageCollect();
+        assert(freed == 3 && gc::object::instanceCount() == baseCount);
+    }
+
+    // A loop that exceeds the allocation budget collects garbage at a safepoint:
+    {
+        gc::object::setBudget(1 << 20, 100);
+        size_t baseCount = gc::object::instanceCount();
+        // (The `=` flattens the Rope, making the previous string garbage.)
+        TEST_PARSER(8000, R"( 0 "" begin over 1000 < while "abcdefgh" + dup "" = drop swap 1 + swap repeat swap drop length )");
+        assert(gc::object::instanceCount() < baseCount + 200);
+        gc::object::setBudget(8 << 20, 100000);
+    }
+
     // Quotations and IFELSE:
     TEST_PARSER(3,                  R"( 3 {DUP 4} DROP )");
 
@@ -261,8 +552,73 @@ int main(int argc, char *argv[]) {
     TEST_PARSER(12,                 R"( 3 4  1 {*} {DROP} IFELSE )");
     TEST_PARSER(3,                  R"( 3 4  0 {*} {DROP} IFELSE )");
 
+    // Array combinators. The {2 *}, {0>} and {+} quotes run as numeric kernels; the others are
+    // called per item:
+    TEST_PARSER(Value({2,4,6}),     R"( [1 2 3] {2 *} MAP )");
+    TEST_PARSER(Value({1,4,9}),     R"( [1 2 3] {(# -- #) DUP *} MAP )");
+    TEST_PARSER(Value({3,9}),       R"( [1 4] {(# -- #) 1 + 2 * 1 -} MAP )");
+    TEST_PARSER(Value({"a!","b!"}), R"( ["a" "b"] {"!" +} MAP )");
+    TEST_PARSER(Value({}),          R"( [] {2 *} MAP )");
+    TEST_PARSER(Value({3,5}),       R"( [-1 3 0 5] {0>} FILTER )");
+    TEST_PARSER(Value({-1,"x"}),    R"( [-1 3 "x" 5] {DUP 3 < SWAP "x" = +} FILTER )");
+    TEST_PARSER(10,                 R"( [1 2 3 4] 0 {+} REDUCE )");
+    TEST_PARSER(24,                 R"( [1 2 3 4] 1 {*} REDUCE )");
+    TEST_PARSER(7,                  R"( [] 7 {+} REDUCE )");
+    TEST_PARSER(30,                 R"( [1 2 3 4] 0 {(# # -- #) DUP * +} REDUCE )");
+    TEST_PARSER("abc",              R"( ["b" "c"] "a" {+} REDUCE )");
+    TEST_PARSER(10,                 R"( 0 [1 2 3 4] {+} EACH )");
+    TEST_PARSER(6,                  R"( 1 0 [1 2 3] {(# # # -- # #) ROT * SWAP 1 +} EACH DROP )");
+    TEST_PARSER(6,                  R"( [[1 2] [3]] 0 {(# [] -- #) 0 {(# # -- #) +} REDUCE +} REDUCE )");
+    TEST_PARSER(8,                  R"( 1 3 {2 *} TIMES )");
+    TEST_PARSER(6,                  R"( 0 4 {I +} TIMES )");
+    TEST_PARSER(5,                  R"( 5 0 {1 +} TIMES )");
+    TEST_PARSER(9,                  R"( 0 3 {3 0 DO 1 + LOOP} TIMES )");
+    for (const char *source : {R"( [1 2] {+} MAP )", R"( 0 3 {DROP} TIMES )"}) {
+        // The quotation's stack effect must fit the combinator:
+        bool threw = false;
+        try {
+            _runParser(source);
+        } catch (const compile_error &x) {
+            cout << "\t-> compile error: " << x.what() << "\n";
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // A combinator collects garbage at a safepoint after each call while over budget:
+    {
+        gc::object::setBudget(1 << 10, 2);
+        // (The expected value is created afterwards, since the collection would free it.)
+        Value result = _runParser(R"( ["abcdefgh" "ijklmnop"] {($ -- $) DUP "qrstuvwx" + "" = DROP "yz" +} MAP )");
+        assert(result == Value({"abcdefghyz","ijklmnopyz"}));
+        gc::object::setBudget(8 << 20, 100000);
+    }
+
     // Writing to stdout:
     TEST_PARSER(0,                  R"( "Hello" . SP. 17 . NL. 0 )");
+    interpreter.output.flush();
+
+    // Capturing output:
+    {
+        string captured;
+        int flushes = 0;
+        interpreter.output.setFlush([&](string_view text) {captured += text; ++flushes;}, 0);
+        TEST_PARSER(0,              R"( "Hello" . SP. 17 . NL? NL? 0.5 . SP. -1e21 . SP. [1 "two" [3]] . NL. 0 )");
+        assert(flushes == 0);
+        assert(interpreter.output.atLeftMargin());
+        interpreter.output.writeQuoted(R"(a"b\c)");
+        interpreter.output.flush();
+        assert(flushes == 1);
+        assert(captured == "\"Hello\" 17\n0.5 -1e+21 [1, \"two\", [3]]\n\"a\\\"b\\\\c\"");
+
+        // Writes bigger than the buffer are passed straight through:
+        captured.clear();
+        interpreter.output.setFlush([&](string_view text) {captured += text; ++flushes;}, 8);
+        interpreter.output.write("1234567");
+        interpreter.output.write("abcdefghij");
+        assert(captured == "1234567abcdefghij" && interpreter.output.pending().empty());
+        interpreter.output.setFlush(OutputSink::writeToStdout);
+    }
 
     // Defining a new word:
     TEST_PARSER(0,                  R"( {(# -- #) 3 *} "thrice" define  0 )");
@@ -271,7 +627,7 @@ int main(int argc, char *argv[]) {
     // Define a typical recursive factorial function:
     TEST_PARSER(0,                  R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE * ELSE DROP 1 THEN} "factorial" define  0 )");
     TEST_PARSER(120,                R"( 5 factorial )");
-    auto fact = Compiler::activeVocabularies.lookup("factorial");
+    auto fact = Compiler::activeVocabularies().lookup("factorial");
     assert(fact);
     assert(fact->hasFlag(Word::Recursive));
 
@@ -281,7 +637,7 @@ int main(int argc, char *argv[]) {
     //           n! -> fact(1, n)
     cout << '\n';
     TEST_PARSER(0,                  R"( {(f# i# -- result#) DUP 1 > IF DUP ROT * SWAP 1 - RECURSE ELSE DROP THEN} "fact" define  0 )");
-    fact = Compiler::activeVocabularies.lookup("fact");
+    fact = Compiler::activeVocabularies().lookup("fact");
     assert(fact);
     cout << "`fact` stack effect: ";
     printStackEffect(fact->stackEffect());
@@ -296,7 +652,7 @@ int main(int argc, char *argv[]) {
     // Define a tail-recursive form of triangle-number:
     cout << '\n';
     TEST_PARSER(0,                  R"( {(f# i# -- result#) DUP 1 > IF DUP ROT + SWAP 1 - RECURSE ELSE DROP THEN} "tri" define  0 )");
-    auto tri = Compiler::activeVocabularies.lookup("tri");
+    auto tri = Compiler::activeVocabularies().lookup("tri");
     assert(tri);
     cout << "`tri` stack effect: ";
     printStackEffect(tri->stackEffect());
@@ -307,6 +663,693 @@ int main(int argc, char *argv[]) {
     assert(tri->stackEffect().max() == 2);
 
     TEST_PARSER(15,                R"( 1 5 tri )");
+    assert(usesWord(tri, _DUP_LITGT_NUM));
+    assert(usesWord(tri, _PLUS_NUM));
+    assert(usesWord(tri, _LITMINUS_NUM));
+
+    // Superinstructions:
+    cout << '\n';
+    TEST_PARSER(0,                  R"( {(# # -- #) OVER OVER < IF + ELSE * THEN} "pick" define  0 )");
+    auto pick = Compiler::activeVocabularies().lookup("pick");
+    cout << "`pick` disassembly: ";
+    printDisassembly(pick);
+    cout << "\n";
+    assert(usesWord(pick, _OVER2));
+    assert(usesWord(pick, _LT_ZBRANCH_NUM));
+    assert(usesWord(pick, _PLUS_NUM));
+    TEST_PARSER(7,                  R"( 3 4 pick )");
+    TEST_PARSER(12,                 R"( 4 3 pick )");
+    // Numeric equality is bitwise, like `Value`'s, so declaring `#` doesn't change a result:
+    TEST_PARSER(0,                  R"( {(# -- #) 0 =} "zero#?" define  {(x -- #) 0 =} "zero?" define  0 )");
+    TEST_PARSER(0,                  R"( {(# # -- #) =} "eq#" define  {(# # -- #) = IF 1 ELSE 2 THEN} "eqbr#" define  0 )");
+    assert(usesWord(Compiler::activeVocabularies().lookup("zero#?"), _LITEQ_NUM));
+    assert(usesWord(Compiler::activeVocabularies().lookup("eq#"), _EQ_NUM));
+    assert(usesWord(Compiler::activeVocabularies().lookup("eqbr#"), _EQ_ZBRANCH_NUM));
+    TEST_PARSER(0,                  R"( 0 -1 * zero#? )");
+    TEST_PARSER(0,                  R"( 0 -1 * zero? )");
+    TEST_PARSER(1,                  R"( 0 zero#? )");
+    TEST_PARSER(0,                  R"( 0 -1 * 0 eq# )");
+    TEST_PARSER(2,                  R"( 0 -1 * 0 eqbr# )");
+    TEST_PARSER(1,                  R"( 0 -1 * DUP eqbr# )");
+    TEST_PARSER(15,                 R"( 1 5 begin dup 1 > while dup rot + swap 1 - repeat drop )");
+    // A word can end with a loop (its RETURN is the WHILE's destination):
+    TEST_PARSER(0,                  R"( {(# # -- # #) BEGIN DUP WHILE SWAP 2 + SWAP 1 - REPEAT} "twice" define 0 )");
+    TEST_PARSER(10,                 R"( 0 5 twice DROP )");
+
+    // Batch execution: rows take different branches of `pick`, and loop different numbers of
+    // times in `tri`; `factorial` isn't tail-recursive so it falls back to running each row.
+    {
+        constexpr size_t kRows = 1000;
+        vector<double> as(kRows), bs(kRows);
+        vector<Value> ones(kRows, Value(1));
+        for (size_t r = 0; r < kRows; ++r) {
+            as[r] = double(r);
+            bs[r] = 500;
+        }
+        Batch pickBatch(*pick);
+        assert(pickBatch.isVectorized());
+        Batch::Results picked = pickBatch.run({as.data(), bs.data()}, kRows);
+        assert(picked.size() == 1 && picked[0].size() == kRows);
+        for (size_t r = 0; r < kRows; ++r)
+            assert(picked[0][r] == Value(r < 500 ? r + 500 : r * 500));
+
+        // Vectorized `=` on numbers is bitwise, like the scalar word:
+        Batch eqBatch(*Compiler::activeVocabularies().lookup("eq#"));
+        assert(eqBatch.isVectorized());
+        vector<double> xs {-0.0, 0.0, 1.0}, zeros(3, 0.0);
+        Batch::Results eqs = eqBatch.run({xs.data(), zeros.data()}, xs.size());
+        assert(eqs[0] == (vector<Value>{Value(0), Value(1), Value(0)}));
+
+        Batch triBatch(*tri);
+        assert(triBatch.isVectorized());
+        Batch::Results tris = triBatch.run({ones.data(), as.data()}, kRows);
+        for (size_t r = 1; r < kRows; ++r)
+            assert(tris[0][r] == Value(r * (r + 1) / 2));
+
+        Batch factBatch(*Compiler::activeVocabularies().lookup("factorial"));
+        assert(!factBatch.isVectorized());
+        Batch::Results facts = factBatch.run({as.data()}, 10);
+        assert(facts[0][5] == Value(120) && facts[0][9] == Value(362880));
+    }
+
+    // Words limited to numbers can be translated to a typed core, whose stack holds raw
+    // `int64_t`s, and give the same results:
+    TEST_PARSER(0,                  R"( {(# -- #) 0 SWAP 1 + 1 DO I + LOOP} "dosum" define  0 )");
+    TEST_PARSER(0,                  R"( {(# # -- #) /} "quot" define  0 )");
+    TEST_PARSER(0,                  R"( {(# -- #) DROP 7 2 / 2 *} "foldedHalf" define  0 )");
+    TEST_PARSER(0,                  R"( {(# -- #) 2 / 2 *} "half2" define  0 )");
+    TEST_PARSER(0,                  R"( {(# -- #) 0.5 *} "halve" define  0 )");
+    TEST_PARSER(0,                  R"( {($ -- #) LENGTH 1 +} "len1" define  0 )");
+    TEST_PARSER(0,                  R"( {(# -- #) DUP 0 > IF DUP 1 - RECURSE + THEN} "isum" define  0 )");
+    {
+        auto &vocab = Compiler::activeVocabularies();
+        const Word &fact = *vocab.lookup("factorial"), &dosum = *vocab.lookup("dosum"),
+                   &quot = *vocab.lookup("quot");
+        TypedWord<Int64Policy> pickI(*pick), factI(fact), dosumI(dosum), quotI(quot);
+        for (auto w : {&pickI, &factI, &dosumI, &quotI})
+            assert(w->isTranslated());
+
+        Invocation pickFn = interpreter.prepare(*pick);
+        for (int a = -5; a < 10; ++a) {
+            for (int b = -5; b < 10; ++b) {
+                double expected = pickFn({Value(a), Value(b)}).asDouble();
+                assert(pickI.run({a, b}) == vector<int64_t>{int64_t(expected)});
+            }
+        }
+        assert(factI.run({20}) == vector<int64_t>{2432902008176640000});   // (too big for a double)
+        assert(dosumI.run({100}) == vector<int64_t>{5050});
+
+        // The int64 policy's division is exact, throwing on a remainder or on zero, so it never
+        // disagrees with the compiler's constant folding, which uses doubles:
+        assert(quotI.run({8, 2}) == vector<int64_t>{4});
+        assert(quotI.run({-9, 3}) == vector<int64_t>{-3});
+        auto throwsDomainError = [&](const TypedWord<Int64Policy> &w, vector<int64_t> inputs) {
+            try {
+                w.run(inputs);
+            } catch (const domain_error &x) {
+                cout << "\t-> threw: " << x.what() << "\n";
+                return true;
+            }
+            return false;
+        };
+        assert(throwsDomainError(quotI, {7, 2}));
+        assert(throwsDomainError(quotI, {7, 0}));
+        TypedWord<Int64Policy> foldedI(*vocab.lookup("foldedHalf")),
+                               halfI(*vocab.lookup("half2"));
+        assert(foldedI.isTranslated() && halfI.isTranslated());
+        assert(foldedI.run({0}) == vector<int64_t>{7});             // `7 2 / 2 *` folded as doubles
+        assert(halfI.run({8}) == vector<int64_t>{8});
+        assert(throwsDomainError(halfI, {7}));                      // ...so 7 2 / can't truncate
+
+        // A fractional literal has no int64 form, and strings have no typed form at all:
+        assert(!TypedWord<Int64Policy>(*vocab.lookup("halve")).isTranslated());
+        assert(!TypedWord<Int64Policy>(*vocab.lookup("len1")).isTranslated());
+
+        // A recursive word runs on a GuardedSlotStack, so it can go deeper than the stack size
+        // used for an unknown maximum depth, and overflowing it throws:
+        TypedWord<Int64Policy> isumI(*vocab.lookup("isum"));
+        assert(isumI.isTranslated() && isumI.word().stackEffect().maxIsUnknown());
+        assert(isumI.run({1000}) == vector<int64_t>{500500});
+        assert(isumI.run({100000}) == vector<int64_t>{5000050000});
+#if !__has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+        bool threw = false;
+        try {
+            isumI.run({100000000});
+        } catch (const stack_overflow &x) {
+            cout << "\t-> threw: " << x.what() << "\n";
+            threw = true;
+        }
+        assert(threw);
+        assert(isumI.run({10}) == vector<int64_t>{55});
+#endif
+    }
+
+    // A prepared Invocation runs a word repeatedly without allocating:
+    {
+        Invocation pickFn = interpreter.prepare(*pick);
+        assert(pickFn.inputCount() == 2 && pickFn.outputCount() == 1);
+        size_t objects = gc::object::instanceCount();
+        Value out[1];
+        for (int i = 0; i < 1000; ++i) {
+            pickFn.run({Value(i), Value(500)}, out);
+            assert(out[0] == Value(i < 500 ? i + 500 : i * 500));
+        }
+        assert(pickFn({Value(3), Value(4)}) == Value(7));
+        assert(gc::object::instanceCount() == objects);
+
+        Invocation triFn = interpreter.prepare(*tri);
+        assert(triFn({Value(1), Value(100)}) == Value(5050));
+
+        // `factorial` is non-tail recursive, so it gets a GuardedStack:
+        Invocation factFn = interpreter.prepare(*Compiler::activeVocabularies().lookup("factorial"));
+        assert(factFn({Value(10)}) == Value(3628800));
+    }
+
+    // Small interpreted words are inlined automatically by the parser, branches and all, until
+    // the word's inlining budget runs out:
+    {
+        auto compile = [](const char *source, size_t inlineBudget) {
+            Compiler c;
+            c.setStackEffect("a# b# -- c"_sfx);
+            c.setInlineBudget(inlineBudget);
+            c.parse(string(source));
+            return CompiledWord(move(c));
+        };
+        auto calls = [](const CompiledWord &word, const Word &callee) {
+            auto instrs = Disassembler::disassembleWord(word.instruction().word);
+            return count_if(instrs.begin(), instrs.end(),
+                            [&](auto &ref) {return ref.word == &callee;});
+        };
+        for (size_t budget : {size_t(0), size_t(8), Compiler::kDefaultInlineBudget}) {
+            CompiledWord absMax = compile("ABS SWAP ABS MAX", budget);
+            cout << "ABS SWAP ABS MAX, inline budget " << budget << ": ";
+            printDisassembly(&absMax);
+            cout << "\n";
+            assert(calls(absMax, ABS) == (budget == 0 ? 2 : budget == 8 ? 1 : 0));
+            assert(calls(absMax, MAX) == (budget == Compiler::kDefaultInlineBudget ? 0 : 1));
+            Invocation fn = interpreter.prepare(absMax);
+            assert(fn({Value(-3), Value(2)}) == Value(3));
+            assert(fn({Value(3), Value(-4)}) == Value(4));
+        }
+        // With no inlining, consecutive calls use INTERP2/3/4:
+        CompiledWord abs3 = compile("ABS ABS ABS SWAP DROP", 0);
+        assert(calls(abs3, ABS) == 3);
+        assert(interpreter.prepare(abs3)({Value(1), Value(-5)}) == Value(5));
+    }
+
+    // Overflowing a GuardedStack, or the native stack, throws instead of crashing:
+    {
+        TEST_PARSER(0,              R"( {(# -- #) DUP IF DUP 1 - RECURSE + THEN} "sumTo" define 0 )");
+        auto sumTo = Compiler::activeVocabularies().lookup("sumTo");
+        assert(sumTo->stackEffect().maxIsUnknown());
+        GuardedStack stack(1000);
+        Invocation sumFn = interpreter.prepare(*sumTo, stack);
+        assert(sumFn({Value(100)}) == Value(5050));
+        auto overflows = [](Invocation &fn, Value input) {
+            try {
+                fn({input});
+            } catch (const stack_overflow &x) {
+                cout << "Invocation threw: " << x.what() << "\n";
+                return true;
+            }
+            return false;
+        };
+        assert(overflows(sumFn, Value(100000)));
+        assert(sumFn({Value(10)}) == Value(55));        // the stack is still usable
+
+        // A Batch runs a recursive word on a GuardedStack too, so it can go deeper than the
+        // stack size used for an unknown maximum depth:
+        Batch sumBatch(*sumTo);
+        vector<double> ns {10, 70000};
+        Batch::Results sums = sumBatch.run({ns.data()}, ns.size());
+        assert(sums[0][0] == Value(55) && sums[0][1] == Value(70000.0 * 70001 / 2));
+
+        // The loops the overflow left running are discarded:
+        TEST_PARSER(0,              R"( {(# -- #) DUP IF DUP 1 - 1 0 DO RECURSE LOOP + THEN} "loopSum" define 0 )");
+        Invocation loopSumFn = interpreter.prepare(*Compiler::activeVocabularies().lookup("loopSum"),
+                                                   stack);
+        assert(overflows(loopSumFn, Value(100000)));
+        assert(loopDepth() == 0);
+        assert(loopSumFn({Value(10)}) == Value(55));
+
+#if !__has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+        // This recursion doesn't grow the data stack, so it overflows the native stack:
+        TEST_PARSER(0,              R"( {(# -- #) DUP IF 1 - RECURSE 1 + THEN} "depth" define 0 )");
+        Invocation depthFn = interpreter.prepare(*Compiler::activeVocabularies().lookup("depth"),
+                                                 stack);
+        assert(depthFn({Value(1000)}) == Value(1000));
+        assert(overflows(depthFn, Value(1e9)));
+        assert(depthFn({Value(1000)}) == Value(1000));
+
+        bool batchOverflowed = false;
+        try {
+            vector<double> tooDeep {1e7};
+            sumBatch.run({tooDeep.data()}, 1);
+        } catch (const stack_overflow &x) {
+            cout << "Batch threw: " << x.what() << "\n";
+            batchOverflowed = true;
+        }
+        assert(batchOverflowed);
+#endif
+    }
+
+    // Words compiled with profiling count their calls and loop iterations:
+    {
+        interpreter.profiling = ProfileMode::Cycles;
+        TEST_PARSER(0,              R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE * THEN} "pfact" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP} "psum" define 0 )");
+        interpreter.profiling = ProfileMode::None;
+        auto psum = Compiler::activeVocabularies().lookup("psum");
+        cout << "`psum` disassembly: ";
+        printDisassembly(psum);
+        cout << "\n";
+        assert(usesWord(psum, _PROFILE_TIMED));
+        assert(usesWord(psum, _PROFILE_LOOP));
+
+        Profiler::reset();
+        TEST_PARSER(120,            R"( 5 pfact )");
+        TEST_PARSER(5050,           R"( 100 psum )");
+        auto hot = Profiler::hottest();
+        auto entry = [&](const char *name) {
+            auto i = find_if(hot.begin(), hot.end(), [&](auto &e) {return e.name == name;});
+            assert(i != hot.end());
+            return *i;
+        };
+        assert(entry("PFACT").calls == 5 && entry("PFACT").loops == 0);
+        assert(entry("PSUM").calls == 1 && entry("PSUM").loops == 100);
+        assert(entry("PSUM").cycles > 0);
+        Profiler::report(cout);
+
+        // A word's profile is freed along with its code, and a quotation's when it's collected,
+        // so they drop out of the report:
+        size_t reported = hot.size();
+        interpreter.profiling = ProfileMode::Counts;
+        {
+            Compiler compiler;
+            compiler.parse(string("1 2 +"));
+            CompiledWord word(move(compiler));
+            assert(run(word) == Value(3));
+            assert(Profiler::hottest().size() == reported + 1);
+        }
+        assert(Profiler::hottest().size() == reported);
+        TEST_PARSER(2,              R"( [1 2] {(# -- #) 1 + 3 *} MAP LENGTH )");
+        interpreter.profiling = ProfileMode::None;
+        assert(Profiler::hottest().size() == reported + 1);
+        garbageCollect();
+        assert(Profiler::hottest().size() == reported);
+
+        // A timed call that an exception, or a stack fault, unwinds still ends:
+        interpreter.profiling = ProfileMode::Cycles;
+        TEST_PARSER(0,              R"( {( -- #) I} "pbadI" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) DUP IF DUP 1 - RECURSE + THEN} "psumTo" define 0 )");
+        interpreter.profiling = ProfileMode::None;
+        auto profileOf = [](const char *name) {
+            return Compiler::activeVocabularies().lookup(name)->instruction().word[1].profile;
+        };
+        try {
+            interpreter.prepare(*Compiler::activeVocabularies().lookup("pbadI"))({});
+            assert(false);
+        } catch (const runtime_error &x) {
+            cout << "Timed word threw: " << x.what() << "\n";
+        }
+        assert(profileOf("pbadI")->depth == 0);
+
+        GuardedStack stack(1000);
+        Invocation psumTo = interpreter.prepare(*Compiler::activeVocabularies().lookup("psumTo"),
+                                                stack);
+        try {
+            psumTo({Value(100000)});
+            assert(false);
+        } catch (const stack_overflow&) { }
+        assert(profileOf("psumTo")->depth == 0);
+        uint64_t cycles = profileOf("psumTo")->cycles;
+        assert(psumTo({Value(10)}) == Value(55));
+        assert(profileOf("psumTo")->cycles > cycles);
+    }
+
+    // Hot words compiled with profiling are promoted to native code:
+    {
+        interpreter.profiling = ProfileMode::Counts;
+        TEST_PARSER(0,              R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE SWAP 2 - RECURSE + THEN} "nfib" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP} "nsum" define 0 )");
+        TEST_PARSER(0,              R"( {(# # -- #) / 1 +} "ndiv" define 0 )");
+        TEST_PARSER(0,              R"( {(a -- a) DUP "x" = IF DROP "y" THEN} "nstr" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) nsum 1 MAX} "ncall" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP 0 DO I + LOOP} "nloop" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 1 + nfib} "ntail" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) "" SWAP BEGIN DUP WHILE SWAP "abcdefgh" + DUP "" = DROP SWAP 1 - REPEAT DROP LENGTH} "nbuild" define 0 )");
+        TEST_PARSER(0,              R"( {(# # -- #) OVER = SWAP 0 = +} "neq" define 0 )");
+        TEST_PARSER(0,              R"( {(# # -- #) OVER OVER <> ROT ROT = IF 2 ELSE 4 THEN +} "nequal" define 0 )");
+        TEST_PARSER(0,              R"( {( -- #) I 1 + 2 * 3 + 4 * 5 + 6 * 7 + 8 * 9 + 1 - 2 -} "nidx" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) DUP IF 1 - RECURSE ELSE DROP I THEN} "nidxdeep" define 0 )");
+        interpreter.profiling = ProfileMode::None;
+        auto nativeCode = [](const char *name) {
+            auto word = Compiler::activeVocabularies().lookup(name);
+            return word->instruction().word[1].profile->nativeCode.load();
+        };
+
+        // `nfib` is promoted partway through a call, after its 1000th (recursive) call:
+        Invocation nfibFn = interpreter.prepare(*Compiler::activeVocabularies().lookup("nfib"));
+        assert(nfibFn({Value(10)}) == Value(55));
+        assert(nativeCode("NFIB") == nullptr);
+        assert(nfibFn({Value(15)}) == Value(610));
+        assert((nativeCode("NFIB") != nullptr) == NativeTier::kAvailable);
+        assert(nfibFn({Value(20)}) == Value(6765));
+
+        for (auto name : {"NSUM", "NDIV", "NSTR", "NCALL", "NTAIL", "NBUILD", "NEQ", "NEQUAL"})
+            assert(NativeTier::promote(*Compiler::activeVocabularies().lookup(name))
+                        == NativeTier::kAvailable);
+        TEST_PARSER(5050,           R"( 100 nsum )");
+        TEST_PARSER(1.25,           R"( 1 4 ndiv )");
+        assert(_runParser("0 0 ndiv").isNull());        // NaN + 1 is null, as in `/`
+        TEST_PARSER("y",            R"( "x" nstr )");
+        TEST_PARSER("z",            R"( "z" nstr )");
+        TEST_PARSER(3,              R"( 3 nstr )");
+        TEST_PARSER(55,             R"( 10 ncall )");
+        TEST_PARSER(1,              R"( 0 ncall )");
+        // (`ntail` ends in a `_TAILINTERP` to `nfib`, which the native code makes a jump:)
+        TEST_PARSER(89,             R"( 10 ntail )");
+        // Native `=` and `<>` are bitwise too, so -0 isn't equal to 0:
+        assert(usesWord(Compiler::activeVocabularies().lookup("neq"), _LITEQ_NUM));
+        assert(usesWord(Compiler::activeVocabularies().lookup("neq"), _EQ_NUM));
+        assert(usesWord(Compiler::activeVocabularies().lookup("nequal"), _NE_NUM));
+        assert(usesWord(Compiler::activeVocabularies().lookup("nequal"), _EQ_ZBRANCH_NUM));
+        TEST_PARSER(2,              R"( 0 0 neq )");
+        TEST_PARSER(0,              R"( 0 -1 * 0 neq )");
+        TEST_PARSER(1,              R"( 0 0 -1 * neq )");
+        TEST_PARSER(2,              R"( 0 0 nequal )");
+        TEST_PARSER(5,              R"( 0 -1 * 0 nequal )");
+
+        // An exception thrown by an op that native code calls unwinds through it, including
+        // through native recursion:
+        for (auto name : {"NIDX", "NIDXDEEP"})
+            assert(NativeTier::promote(*Compiler::activeVocabularies().lookup(name))
+                        == NativeTier::kAvailable);
+        for (auto src : {"nidx", "5 nidxdeep"}) {
+            bool threw = false;
+            try {
+                _runParser(src);
+            } catch (const runtime_error &x) {
+                cout << "Native word threw: " << x.what() << "\n";
+                threw = true;
+            }
+            assert(threw);
+        }
+        TEST_PARSER(89,             R"( 10 ntail )");
+
+        // A native loop that allocates collects garbage at its safepoints:
+        gc::object::setBudget(1 << 20, 100);
+        size_t baseCount = gc::object::instanceCount();
+        TEST_PARSER(8000,           R"( 1000 nbuild )");
+        assert(gc::object::instanceCount() < baseCount + 200);
+        gc::object::setBudget(8 << 20, 100000);
+
+        // Native code is freed along with the word's code:
+        size_t nativeCount = NativeTier::count();
+        interpreter.profiling = ProfileMode::Counts;
+        {
+            Compiler compiler;
+            compiler.setStackEffect("# -- # #"_sfx);
+            compiler.parse(string("DUP 1 +"));
+            CompiledWord word(move(compiler));
+            assert(NativeTier::promote(word) == NativeTier::kAvailable);
+            assert(NativeTier::count() == nativeCount + NativeTier::kAvailable);
+        }
+        interpreter.profiling = ProfileMode::None;
+        assert(NativeTier::count() == nativeCount);
+
+        // The tier can't compile DO-LOOP, so `nloop` stays interpreted:
+        assert(!NativeTier::promote(*Compiler::activeVocabularies().lookup("NLOOP")));
+        TEST_PARSER(45,             R"( 10 nloop )");
+    }
+
+    // `DEFINE` shares the quotation's instructions, and keeps it alive, instead of copying it:
+    {
+        Value quote = _runParser(R"( {(# -- #) 5 +} DUP "plus5" define )");
+        auto plus5 = Compiler::activeVocabularies().lookup("plus5");
+        assert(plus5 && plus5->instruction().word == quote.asQuote()->instruction().word);
+        garbageCollect();
+        garbageCollect(true);
+        TEST_PARSER(8,              R"( 3 plus5 )");
+    }
+
+    // A redefined word's literals stay alive, since words compiled earlier still call it:
+    {
+        auto compileNamed = [](const char *name, const char *source) {
+            Compiler c(name);
+            c.setInlineBudget(0);
+            c.parse(string(source));
+            return new CompiledWord(move(c));
+        };
+        CompiledWord *oldFoo = compileNamed("refoo", R"( "the original refoo's string" )");
+        CompiledWord *callFoo = compileNamed("callrefoo", "refoo");
+        assert(usesWord(callFoo, *oldFoo));                 // (it's not inlined)
+        compileNamed("refoo", R"( "the new refoo's string" )");
+        assert(Compiler::activeVocabularies().lookup("refoo") != oldFoo);
+        garbageCollect();
+        for (int i = 0; i < 100; ++i)
+            (void)Value("a string that reuses memory");     // (same size as the literal)
+        assert(run(*callFoo) == Value("the original refoo's string"));
+    }
+
+    // Metered words run as Continuations suspend when they run out of fuel, and can be resumed:
+    {
+        interpreter.metering = true;
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP} "msum" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) DUP 1 > IF DUP 1 - RECURSE SWAP 2 - RECURSE + THEN} "mfib" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP 0 DO I + 3 0 DO 1 + LOOP LOOP} "mloop" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP 0 DO 2 {(# -- #) 3 0 DO 1 + LOOP} TIMES LOOP} "mtimes" define 0 )");
+        TEST_PARSER(0,              R"( {($ # -- $) BEGIN DUP WHILE SWAP "ab" + SWAP 1 - REPEAT DROP} "mcat" define 0 )");
+        TEST_PARSER(0,              R"( {(# -- #) BEGIN DUP WHILE 1 - REPEAT I +} "mbad" define 0 )");
+        interpreter.metering = false;
+        TEST_PARSER(0,              R"( {(# -- #) 2 * msum 1 +} "mcall" define 0 )");
+        auto word = [](const char *name) -> const Word& {
+            return *Compiler::activeVocabularies().lookup(name);
+        };
+        cout << "`msum` disassembly: ";
+        printDisassembly(&word("msum"));
+        cout << "\n";
+        assert(usesWord(&word("msum"), _FUEL) && word("msum").isMetered());
+        assert(!usesWord(&word("mcall"), _FUEL) && word("mcall").isMetered());  // calls `msum`
+        assert(!word("plus5").isMetered());
+        assert(usesWord(&word("mfib"), _RECURSE_METERED) && !usesWord(&word("mfib"), _RECURSE));
+        TEST_PARSER(5050,           R"( 100 msum )");                // Runs normally, too
+
+        // Runs a word with one input as a Continuation, returning its result and the number of
+        // `resume` calls it took:
+        auto runMetered = [&](const char *name, span<const Value> inputs, int64_t fuel) {
+            Continuation cont(word(name), interpreter, inputs);
+            int resumes = 1;
+            while (!cont.resume(fuel))
+                ++resumes;
+            assert(cont.finished() && cont.stack().size() == 1);
+            return make_pair(cont.stack()[0], resumes);
+        };
+        assert(runMetered("msum", {Value(100)}, 1000) == make_pair(Value(5050), 1));
+        assert(runMetered("msum", {Value(100)}, 10) == make_pair(Value(5050), 11));
+        assert(runMetered("mcall", {Value(50)}, 10) == make_pair(Value(5051), 11));
+        assert(runMetered("mfib", {Value(15)}, 7).first == Value(610));
+        assert(runMetered("mloop", {Value(10)}, 3).first == Value(75));
+        assert(loopDepth() == 0);
+        // A quotation called by `TIMES` runs to the end, then the word suspends at its `LOOP`:
+        assert(runMetered("mtimes", {Value(10)}, 1) == make_pair(Value(60), 11));
+
+        // While suspended, a Continuation's stack survives collections, even in another one:
+        gc::object::setBudget(1 << 20, 20);
+        {
+            Continuation a(word("mcat"), interpreter, {Value(""), Value(40)});
+            Continuation b(word("mcat"), interpreter, {Value("x"), Value(30)});
+            for (bool done = false; !done; ) {
+                done = a.resume(3);
+                done = b.resume(3) && done;
+                garbageCollect(true);
+            }
+            string expected = "x";
+            for (int i = 0; i < 30; ++i)
+                expected += "ab";
+            assert(a.stack()[0].asString().size() == 80);
+            assert(b.stack()[0].asString() == expected);
+        }
+        gc::object::setBudget(8 << 20, 100000);
+
+        // A Continuation, its loops included, can be resumed on another thread:
+        {
+            Continuation cont(word("mloop"), interpreter, {Value(100)});
+            for (int i = 0; !cont.finished(); ++i) {
+                if (i % 2)
+                    cont.resume(5);
+                else
+                    std::thread([&] {cont.resume(5);}).join();
+            }
+            assert(cont.stack()[0] == Value(4950 + 300));
+        }
+
+        // An exception thrown by a resumed word propagates, and finishes the Continuation:
+        {
+            Continuation cont(word("mbad"), interpreter, {Value(10)});
+            assert(!cont.resume(3));
+            bool threw = false;
+            try {
+                while (!cont.resume(3)) { }
+            } catch (const std::runtime_error &x) {
+                cout << "Continuation threw: " << x.what() << "\n";
+                threw = true;
+            }
+            assert(threw && cont.finished() && cont.stack().size() == 0);
+        }
+
+        // A metered word can't be promoted to native code, since it couldn't suspend:
+        interpreter.profiling = ProfileMode::Counts;
+        interpreter.metering = true;
+        TEST_PARSER(0,              R"( {(# -- #) 0 SWAP BEGIN DUP WHILE DUP ROT + SWAP 1 - REPEAT DROP} "pmsum" define 0 )");
+        interpreter.metering = false;
+        TEST_PARSER(0,              R"( {(# -- #) pmsum 1 +} "pmcall" define 0 )");
+        interpreter.profiling = ProfileMode::None;
+        assert(!NativeTier::promote(word("pmsum")));
+        assert(!NativeTier::promote(word("pmcall")));
+        TEST_PARSER(56,             R"( 10 pmcall )");
+    }
+
+    // A WordCache compiles the same source, with the same input types, only once:
+    {
+        WordCache cache(interpreter, 4);
+        Value nums[2] = {Value(3), Value(4)}, strs[2] = {Value("a"), Value("b")};
+        auto runWith = [&](const Word &word, span<const Value> inputs) {
+            Continuation cont(word, interpreter, inputs);
+            assert(cont.resume(INT64_MAX));
+            return cont.stack()[cont.stack().size() - 1];
+        };
+        const Word &hyp = cache.compile(" DUP *  SWAP\tDUP * + ", &nums[0], &nums[1]);
+        assert(&cache.compile("DUP * SWAP DUP * +", &nums[0], &nums[1]) == &hyp);
+        assert(cache.hits() == 1 && cache.misses() == 1);
+        assert(runWith(hyp, nums) == Value(25));
+        // Different input types, or whitespace inside a string, make a different key:
+        const Word &numPlus = cache.compile("+", &nums[0], &nums[1]);
+        const Word &strPlus = cache.compile("+", &strs[0], &strs[1]);
+        assert(&numPlus != &strPlus && usesWord(&numPlus, _PLUS_NUM) && !usesWord(&strPlus, _PLUS_NUM));
+        assert(runWith(strPlus, strs) == Value("ab"));
+        assert(&cache.compile(R"( "a b" )", nullptr, nullptr)
+               != &cache.compile(R"( "a  b" )", nullptr, nullptr));
+        assert(cache.size() == 4 && cache.misses() == 5);
+        // The least recently used entry, `hyp`, has been evicted:
+        cache.compile("DUP * SWAP DUP * +", &nums[0], &nums[1]);
+        assert(cache.size() == 4 && cache.misses() == 6);
+
+        // An entry whose source calls a word that's since been redefined is compiled again:
+        TEST_PARSER(0,              R"( {(# -- #) 1 +} "cinc" define 0 )");
+        assert(run(cache.compile("10 cinc", nullptr, nullptr)) == Value(11));
+        TEST_PARSER(0,              R"( {(# -- #) 2 +} "cinc" define 0 )");
+        assert(run(cache.compile("10 cinc", nullptr, nullptr)) == Value(12));
+
+        // As the Interpreter's cache, it shares identical quotations, which survive collections:
+        interpreter.wordCache = &cache;
+        Value quote = run(cache.compile("{(# -- #) 2 *}", nullptr, nullptr));
+        garbageCollect();
+        garbageCollect(true);
+        assert(_runParser(R"( { (# -- #)  2 * } )").asQuote() == quote.asQuote());
+        TEST_PARSER(0,              R"( {(# -- #) 2 *} "dbl" define 0 )");
+        auto dbl = Compiler::activeVocabularies().lookup("dbl");
+        assert(dbl->instruction().word == quote.asQuote()->instruction().word);
+        TEST_PARSER(14,             R"( 7 dbl )");
+        cache.clear();
+        assert(cache.size() == 0);
+    }
+    assert(interpreter.wordCache == nullptr);
+
+    // A ThreadPool runs every chunk of a loop once, and rethrows an exception from any of them:
+    {
+        ThreadPool pool(3);
+        vector<atomic<int>> counts(10'000);
+        pool.parallelFor(counts.size(), 100, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                ++counts[i];
+        });
+        assert(all_of(counts.begin(), counts.end(), [](auto &n) {return n == 1;}));
+        bool threw = false;
+        try {
+            pool.parallelFor(10'000, 100, [&](size_t begin, size_t end) {
+                if (begin == 5000)
+                    throw runtime_error("chunk failed");
+            });
+        } catch (const runtime_error &x) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // PMAP, PFILTER and PREDUCE split a big array between threads, with the same results as MAP,
+    // FILTER and REDUCE (given an associative quotation for PREDUCE):
+    {
+        ThreadPool::shared().setWorkerCount(3);
+        TEST_PARSER(Value({1,4,9}),     R"( [1 2 3] {(# -- #) DUP *} PMAP )");
+        TEST_PARSER(Value({3,5}),       R"( [-1 3 0 5] {0>} PFILTER )");
+        TEST_PARSER(10,                 R"( [1 2 3 4] 0 {+} PREDUCE )");
+
+        auto runOn = [&](const char *source, Value input) {
+            Compiler compiler;
+            compiler.setInputStack(&input, &input);
+            compiler.parse(string(source));
+            CompiledWord word(move(compiler));
+            return interpreter.prepare(word)({input});
+        };
+        vector<Value> numbers, strings;
+        for (int i = 0; i < 100'000; ++i) {
+            numbers.push_back(Value(i % 2000 - 1000));
+            strings.push_back(Value(i % 2 ? "a heap-allocated string" : "short"));
+        }
+        Value nums(move(numbers)), strs(move(strings));
+        gc::object::pushRoot(nums);
+        gc::object::pushRoot(strs);
+        // Compares the results of two sources. (The first is a GC root while the second runs.)
+        auto same = [&](const char *parallel, const char *serial, Value input) {
+            cout << "* Comparing " << parallel << "\n";
+            Value result = runOn(parallel, input);
+            gc::object::pushRoot(result);
+            bool same = (result == runOn(serial, input));
+            gc::object::popRoot();
+            return same;
+        };
+        for (auto [parallel, serial] : {
+                pair{"{(# -- #) DUP * 3 * 7 + 1000 MOD} PMAP", "{(# -- #) DUP * 3 * 7 + 1000 MOD} MAP"},
+                pair{"{(# -- #) DUP * 1000 MOD 500 <} PFILTER", "{(# -- #) DUP * 1000 MOD 500 <} FILTER"},
+                pair{"-5000 {(# # -- #) MAX} PREDUCE", "-5000 {(# # -- #) MAX} REDUCE"},
+                pair{"0 {(# # -- #) SWAP +} PREDUCE", "0 {(# # -- #) SWAP +} REDUCE"}}) {
+            assert(same(parallel, serial, nums));
+        }
+        // Strings can be shared; a quotation that allocates falls back to running serially:
+        assert(same("{($ -- #) LENGTH} PMAP", "{($ -- #) LENGTH} MAP", strs));
+        assert(same("{($ -- $) \"!\" +} PMAP", "{($ -- $) \"!\" +} MAP", strs));
+        gc::object::popRoot();
+        gc::object::popRoot();
+
+        // The quotation must be pure:
+        TEST_PARSER(0,              R"( {(# -- #) 2 *} "twice" define {(# -- #) DUP .} "noisy" define 0 )");
+        assert(Compiler::activeVocabularies().lookup("twice")->isPure());
+        assert(!Compiler::activeVocabularies().lookup("noisy")->isPure());
+        TEST_PARSER(Value({2,4}),       R"( [1 2] {(# -- #) twice} PMAP )");
+        for (const char *source : {R"( [1 2] {(# -- #) noisy} PMAP )",
+                                   R"( [1 2] {(# -- #) DUP . } PFILTER )",
+                                   R"( [1 2] 0 {(# # -- #) I +} PREDUCE )"}) {
+            bool threw = false;
+            try {
+                _runParser(source);
+            } catch (const compile_error &x) {
+                cout << "\t-> compile error: " << x.what() << "\n";
+                threw = true;
+            }
+            assert(threw);
+        }
+        ThreadPool::shared().setWorkerCount(max(thread::hardware_concurrency(), 1u) - 1);
+    }
+
+    TEST_PARSER(0,                  R"( {($ -- $) "!" +} "bang" define  0 )");
+    garbageCollect();
+    TEST_PARSER("hi!",              R"( "hi" bang )");
+    auto bang = Compiler::activeVocabularies().lookup("bang");
+    assert(usesWord(bang, _LITPLUS));                   // not numeric
+    TEST_PARSER(0,                  R"( {(a a -- #) <} "less?" define  0 )");
+    assert(!usesWord(Compiler::activeVocabularies().lookup("less?"), _LT_NUM));
+    TEST_PARSER(1,                  R"( "a" "b" less? )");
 
 #ifndef DEBUG
     auto start = std::chrono::steady_clock::now();
@@ -318,6 +1361,13 @@ int main(int argc, char *argv[]) {
     cout << "Time to compute tri(1e8): " << diff.count() << " s; " << (diff.count() / 1e8 * 1e9) << " ns / iteration\n";
 #endif
 
+    testThreads();
+    testImage();
+
+    // What's left is the quotations of `DEFINE`d words, which their vocabulary keeps alive:
+    garbageCollect();
+    assert(gc::object::instanceCount() > 0);
+    Compiler::activeVocabularies().pop();
     garbageCollect();
     assert(gc::object::instanceCount() == 0);
     
@@ -0,0 +1,138 @@
+//
+// arena.cc
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "arena.hh"
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <assert.h>
+#include <stdint.h>
+
+namespace tails::gc {
+    using namespace std;
+
+    // A block on a free list.
+    struct Arena::FreeBlock {
+        FreeBlock* next;
+    };
+
+    // Header at the start of every page. Pages are aligned to kPageSize, so the page a block
+    // belongs to can be found by masking its address.
+    struct alignas(Arena::kAlignment) Arena::Page {
+        size_t liveCount;       // Number of blocks allocated and not yet freed
+    };
+
+
+    static inline size_t classOf(size_t size)   {return (max(size, size_t(1)) - 1) / Arena::kAlignment;}
+    static inline size_t blockSize(size_t cls)  {return (cls + 1) * Arena::kAlignment;}
+
+    inline Arena::Page* Arena::pageOf(void *block) {
+        return (Page*)(uintptr_t(block) & ~(kPageSize - 1));
+    }
+
+
+    Arena::~Arena() {
+        for (SizeClass &sc : _classes) {
+            for (Page *page : sc.pages)
+                ::operator delete(page, align_val_t(kPageSize));
+        }
+    }
+
+
+    void Arena::addPage(SizeClass &sc, size_t cls) {
+        auto page = (Page*) ::operator new(kPageSize, align_val_t(kPageSize));
+        page->liveCount = 0;
+        sc.pages.push_back(page);
+        sc.bumpPage = page;
+        sc.bump = (char*)(page + 1);
+        size_t size = blockSize(cls);
+        sc.bumpEnd = sc.bump + (kPageSize - sizeof(Page)) / size * size;
+    }
+
+
+    void* Arena::alloc(size_t size) {
+        if (size > kMaxBlockSize)
+            return ::operator new(size);
+        size_t cls = classOf(size);
+        SizeClass &sc = _classes[cls];
+        void *block;
+        if (sc.freeList) {
+            block = sc.freeList;
+            sc.freeList = sc.freeList->next;
+        } else {
+            if (sc.bump == sc.bumpEnd)
+                addPage(sc, cls);
+            block = sc.bump;
+            sc.bump += blockSize(cls);
+        }
+        ++pageOf(block)->liveCount;
+        return block;
+    }
+
+
+    void Arena::free(void *block, size_t size) noexcept {
+        if (size > kMaxBlockSize) {
+            ::operator delete(block);
+            return;
+        }
+        SizeClass &sc = _classes[classOf(size)];
+        auto fb = (FreeBlock*)block;
+        fb->next = sc.freeList;
+        sc.freeList = fb;
+        Page *page = pageOf(block);
+        assert(page->liveCount > 0);
+        if (--page->liveCount == 0)
+            sc.hasEmptyPages = true;
+    }
+
+
+    void Arena::releaseEmptyPages() {
+        for (SizeClass &sc : _classes) {
+            if (!sc.hasEmptyPages)
+                continue;
+            // (The bump page is kept even when empty, so allocation doesn't thrash pages.)
+            auto isEmpty = [&](Page *page) {return page->liveCount == 0 && page != sc.bumpPage;};
+
+            // Remove blocks in empty pages from the free list:
+            for (FreeBlock **link = &sc.freeList; *link; ) {
+                if (isEmpty(pageOf(*link)))
+                    *link = (*link)->next;
+                else
+                    link = &(*link)->next;
+            }
+            // Then free the pages:
+            auto i = remove_if(sc.pages.begin(), sc.pages.end(), [&](Page *page) {
+                if (!isEmpty(page))
+                    return false;
+                ::operator delete(page, align_val_t(kPageSize));
+                return true;
+            });
+            sc.pages.erase(i, sc.pages.end());
+            sc.hasEmptyPages = false;
+        }
+    }
+
+
+    size_t Arena::pageCount() const {
+        size_t count = 0;
+        for (const SizeClass &sc : _classes)
+            count += sc.pages.size();
+        return count;
+    }
+
+}
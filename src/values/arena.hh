@@ -0,0 +1,81 @@
+//
+// arena.hh
+//
+// Copyright (C) 2021 Jens Alfke. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <vector>
+#include <stddef.h>
+
+namespace tails::gc {
+
+    /// The memory allocator for garbage-collected objects.
+    ///
+    /// Small blocks are carved out of pages owned by the arena, one size class (a multiple of
+    /// 16 bytes) per page. A freed block goes on its size class's free list; `releaseEmptyPages`,
+    /// called at the end of a GC sweep, returns pages with no live blocks to the system.
+    /// Blocks larger than `kMaxBlockSize` come from `::operator new`.
+    ///
+    /// All blocks are 16-byte aligned, as `gc::object` requires.
+    ///
+    /// An Arena isn't thread-safe; each `gc::Heap` has its own.
+    class Arena {
+    public:
+        static constexpr size_t kAlignment = 16;
+        static constexpr size_t kMaxBlockSize = 256;
+        static constexpr size_t kPageSize = 64 * 1024;
+
+        Arena() = default;
+        /// Frees all pages. (Large blocks must have been freed already.)
+        ~Arena();
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        /// Allocates a block of at least `size` bytes. Never returns nullptr.
+        void* alloc(size_t size);
+
+        /// Frees a block. `size` must be the same as was passed to `alloc`.
+        void free(void *block, size_t size) noexcept;
+
+        /// Frees any pages that no longer contain any live blocks.
+        void releaseEmptyPages();
+
+        /// The number of pages currently allocated.
+        size_t pageCount() const;
+
+    private:
+        struct FreeBlock;
+        struct Page;
+
+        // The state of one size class.
+        struct SizeClass {
+            FreeBlock*         freeList = nullptr;
+            Page*              bumpPage = nullptr;  // Newest page; may have unused space at its end
+            char*              bump = nullptr;      // Next never-used block in `bumpPage`
+            char*              bumpEnd = nullptr;
+            std::vector<Page*> pages;
+            bool               hasEmptyPages = false;
+        };
+
+        static constexpr size_t kNumClasses = kMaxBlockSize / kAlignment;
+
+        static Page* pageOf(void *block);
+        void addPage(SizeClass&, size_t cls);
+
+        SizeClass _classes[kNumClasses];
+    };
+
+}
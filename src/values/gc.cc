@@ -17,28 +17,81 @@
 //
 
 #include "gc.hh"
-#include "compiler.hh"  // just for CompiledWord
+#include "compiler.hh"
+#include "profiler.hh"
+#include "vocabulary.hh"
 #include "value.hh"
 #include "word.hh"
 #include "core_words.hh"
+#include <algorithm>
+#include <type_traits>
 
 namespace tails::gc {
     using namespace std;
     using namespace tails;
 
 
-    object* object::sFirst = nullptr;
-    size_t object::sInstanceCount = 0;
+    Heap::~Heap() {
+        // Free every object, by sweeping without marking:
+        Heap *prev = setCurrent(this);
+        _rootRanges.clear();
+        object::beginCollection(false);
+        object::sweep();
+        assert(_instanceCount == 0);
+        setCurrent(prev == this ? nullptr : prev);
+    }
 
 
     object::object(int type)
-    :_next(intptr_t(sFirst) | (type & kTypeBits))
     {
-        assert(next() == sFirst);
-        sFirst = this;
-        ++sInstanceCount;
+        Heap &heap = Heap::current();
+        _next = intptr_t(heap._first) | (type & kTypeBits);
+        assert((intptr_t(this) & kTagBits) == 0);  // requires 16-byte alignment
+        assert(next() == heap._first);
+        heap._first = this;
+        ++heap._instanceCount;
+        ++heap._allocationCount;
+        if (++heap._youngCount >= heap._budgetCount)
+            heap._overBudget = true;
+    }
+
+
+    void object::beginCollection(bool minor) {
+        Heap::current()._minor = minor;
     }
 
+
+    void object::setBudget(size_t bytes, size_t count) {
+        Heap &heap = Heap::current();
+        heap._budgetBytes = bytes;
+        heap._budgetCount = count;
+        heap._overBudget = (heap._youngBytes >= bytes || heap._youngCount >= count);
+    }
+
+
+    void object::safepoint(const Value *sp) {
+        Heap &heap = Heap::current();
+        Execution *exec = heap._execution;
+        if (!exec || exec->_prev)
+            return;             // (Budget stays used up, so a later safepoint will try again)
+        beginCollection(!wantsMajorCollection());
+        Compiler::activeVocabularies().gcScan();
+        scanWord(exec->_word);
+        for (auto val : heap._roots)
+            val.mark();
+        scanStack(exec->_stackBottom, sp);
+        sweep();
+    }
+
+
+    bool object::wantsMajorCollection() {
+        static constexpr size_t kMinOldCount = 256;
+        Heap &heap = Heap::current();
+        size_t oldCount = heap._instanceCount - heap._youngCount;
+        return oldCount > 2 * max(heap._oldCountAfterMajor, kMinOldCount);
+    }
+
+
     void object::scanStack(const Value *bottom, const Value *top) {
         if (bottom && top) {
             for (auto val = bottom; val <= top; ++val)
@@ -47,67 +100,156 @@ namespace tails::gc {
     }
 
 
+    void object::addRootRange(const Value *bottom, const Value *top) {
+        Heap::current()._rootRanges.emplace_back(bottom, top);
+    }
+
+
+    void object::removeRootRange(const Value *bottom) {
+        auto &ranges = Heap::current()._rootRanges;
+        auto i = find_if(ranges.begin(), ranges.end(), [=](auto &r) {return r.first == bottom;});
+        if (i != ranges.end())
+            ranges.erase(i);
+    }
+
+
+    // True if the instruction is a word taking a Value parameter, like `_LITERAL`.
+    static bool hasLiteralParam(const Instruction &instr) {
+        for (auto w = core_words::kLiteralWords; *w; ++w) {
+            if (instr == **w)
+                return true;
+        }
+        return false;
+    }
+
+
     void object::scanWord(const Word *word) {
         if (!word->isNative()) {
             for (const Instruction *pc = word->instruction().word; *pc != core_words::_RETURN; ++pc) {
-                if (*pc == core_words::_LITERAL)
+                if (hasLiteralParam(*pc))
                     (++pc)->literal.mark();
             }
         }
     }
 
 
-    pair<size_t,size_t> object::sweep() {
-        size_t freed = 0, kept = 0;
-        object *next, *prev = nullptr, *o;
-        bool fixLink = false;
-
-        auto updateLink = [&] {
-            if (fixLink) {
-                if (prev) prev->setNext(o); else sFirst = o;
-                fixLink = false;
-            }
-        };
-
-        for (o = first(); o; o = next) {
+    // Frees the unmarked objects in `list`, and unmarks & promotes the rest, prepending them to
+    // `oldList`. Returns the number freed.
+    size_t object::sweepList(object *list, object* &oldList, size_t &kept) {
+        size_t freed = 0;
+        object *next;
+        for (object *o = list; o; o = next) {
             next = o->next();
             if (o->isMarked()) {
                 o->unmark();
-                updateLink();
-                prev = o;
+                o->_next |= kOldBit;
+                o->setNext(oldList);
+                oldList = o;
                 ++kept;
             } else {
                 // Free unmarked objects:
                 o->collect();
-                fixLink = true;
                 ++freed;
             }
         }
-        updateLink();
-        assert(kept + freed == sInstanceCount);
-        sInstanceCount -= freed;
+        return freed;
+    }
+
+
+    pair<size_t,size_t> object::sweep() {
+        Heap &heap = Heap::current();
+        for (auto [bottom, top] : heap._rootRanges)
+            scanStack(bottom, top);
+        if (heap._minor) {
+            // Old objects that have been given young references are roots:
+            for (object *obj : heap._remembered)
+                obj->markChildren();
+        }
+
+        size_t freed = 0, kept = 0;
+        object *oldList = nullptr;
+        // In a minor collection old objects are all live (and aren't marked), so keep them as is:
+        if (heap._minor)
+            oldList = heap._oldFirst;
+        else
+            freed += sweepList(heap._oldFirst, oldList, kept);
+        freed += sweepList(heap._first, oldList, kept);
+        if (heap._minor)
+            kept += heap._instanceCount - heap._youngCount;
+
+        heap._first = nullptr;
+        heap._oldFirst = oldList;
+        assert(kept + freed == heap._instanceCount);
+        heap._instanceCount -= freed;
+        heap._youngCount = 0;
+        heap._youngBytes = 0;
+        heap._overBudget = false;
+        if (!heap._minor)
+            heap._oldCountAfterMajor = heap._instanceCount;
+        heap._remembered.clear();   // there are no young objects left
+        heap._minor = false;
+        heap._arena.releaseEmptyPages();
         return {kept, freed};
     }
 
 
+    // Marks the objects an object refers to. (Used for objects in the remembered set.)
+    void object::markChildren() {
+        switch (type()) {
+            case kRopeType:    ((Rope*)this)->markChildren(); break;
+            case kArrayType:   ((Array*)this)->markChildren(); break;
+            default:           break;
+        }
+    }
+
+
     void object::collect() {
         switch (type()) {
-            case kStringType:  delete (String*)this; break;
+            case kRopeType:    delete (Rope*)this; break;
+            case kStringType:  ((String*)this)->free(); break;
             case kArrayType:   delete (Array*)this; break;
-            case kQuoteType:   delete (Quote*)this; break;
+            case kQuoteType:   ((Quote*)this)->free(); break;
             default:           break;
         }
     }
 
 
+#pragma mark - EXECUTION:
+
+
+    Execution::Execution(const Word &word, const Value *stackBottom)
+    :_word(&word)
+    ,_stackBottom(stackBottom)
+    ,_prev(Heap::current()._execution)
+    ,_rootCount(Heap::current()._roots.size())
+    ,_loopDepth(core_words::loopDepth())
+    ,_timedCallDepth(core_words::timedCallDepth())
+    {
+        Heap::current()._execution = this;
+    }
+
+
+    Execution::~Execution() {
+        Heap &heap = Heap::current();
+        assert(heap._execution == this);
+        heap._execution = _prev;
+        heap._roots.resize(_rootCount);       // in case an exception skipped some `popRoot`s
+        core_words::unwindLoops(_loopDepth);  // ...or the ends of some loops
+        core_words::unwindTimedCalls(_timedCallDepth);  // ...or of timed profiled calls
+    }
+
+
 #pragma mark - STRING:
 
 
+    static_assert(is_trivially_destructible_v<String>, "String::free doesn't call the destructor");
+
     String::String(size_t len)
     :object(kStringType)
     ,_len(uint32_t(len))
+    ,_interned(false)
     {
-        assert(len < UINT32_MAX);
+        assert(len < (1u << 31));
         _data[len] = 0;
     }
 
@@ -119,12 +261,168 @@ namespace tails::gc {
     }
 
 
+    String* String::intern(std::string_view str) {
+        auto &table = Heap::current()._interned;
+        if (auto i = table.find(str); i != table.end())
+            return i->second;
+        String *interned = make(str);
+        interned->_interned = true;
+        table.insert({interned->string_view(), interned});
+        return interned;
+    }
+
+
+    uint32_t String::computeHash() const {
+        auto h = uint32_t(std::hash<std::string_view>{}(string_view()));
+        _hash = h ? h : 1;      // (0 means "not computed")
+        return _hash;
+    }
+
+
+    void String::free() {
+        Heap &heap = Heap::current();
+        if (_interned)
+            heap._interned.erase(string_view());    // The intern table holds weak references
+        heap.arena().free(this, allocSize(_len));
+    }
+
+
+#pragma mark - ROPE:
+
+
+    Rope::Rope(Value left, Value right, size_t length)
+    :object(kRopeType)
+    ,_left(left)
+    ,_right(right)
+    ,_length(length)
+    {
+        assert(left.isString() && right.isString());
+    }
+
+
+    // If `v` is a Rope that hasn't been flattened, returns it.
+    Rope* Rope::asUnflattenedRope(Value v) {
+        if (v.isString() && !v.isInline()) {
+            if (auto obj = (object*)v.asPointer(); obj->isRope() && !((Rope*)obj)->_flat)
+                return (Rope*)obj;
+        }
+        return nullptr;
+    }
+
+
+    String* Rope::flatten() {
+        if (!_flat) {
+            String *str = String::make(_length);
+            char *dst = str->_data;
+            // Ropes can be deeply nested, so walk them with a to-do list instead of recursing:
+            vector<Value> todo {_right, _left};
+            while (!todo.empty()) {
+                Value v = todo.back();
+                todo.pop_back();
+                if (Rope *rope = asUnflattenedRope(v)) {
+                    todo.push_back(rope->_right);
+                    todo.push_back(rope->_left);
+                } else {
+                    std::string_view piece = v.asString();
+                    memcpy(dst, piece.data(), piece.size());
+                    dst += piece.size();
+                }
+            }
+            assert(dst == str->_data + _length);
+            _flat = str;
+            _left = _right = NullValue;
+            didWrite();
+        }
+        return _flat;
+    }
+
+
+    void Rope::markChildren() {
+        if (_flat)
+            _flat->mark();
+        _left.mark();
+        _right.mark();
+    }
+
+
+    void Rope::mark() {
+        // Mark nested Ropes with a to-do list instead of recursing, as in `flatten`:
+        vector<Rope*> todo;
+        Rope *rope = this;
+        while (true) {
+            if (rope->object::mark()) {
+                if (rope->_flat)
+                    rope->_flat->mark();
+                for (Value half : {rope->_left, rope->_right}) {
+                    if (Rope *child = asUnflattenedRope(half))
+                        todo.push_back(child);
+                    else
+                        half.mark();
+                }
+            }
+            if (todo.empty())
+                break;
+            rope = todo.back();
+            todo.pop_back();
+        }
+    }
+
+
 #pragma mark - ARRAY:
 
 
+    Array::Array(Buffer &&items)
+    :object(kArrayType)
+    ,_buffer(make_shared<Buffer>(move(items)))
+    ,_size(_buffer->size())
+    {
+        noteAllocation(_buffer->capacity() * sizeof(Value));
+    }
+
+
+    Array::Array(shared_ptr<Buffer> buffer, size_t size)
+    :object(kArrayType)
+    ,_buffer(move(buffer))
+    ,_size(size)
+    { }
+
+
+    // Returns a buffer whose end is the end of this array, copying the items if necessary.
+    Array::Buffer& Array::appendableBuffer() {
+        if (_size != _buffer->size()) {
+            // Other arrays have appended to the buffer, so I can't; make my own copy:
+            auto items = _buffer->data();
+            _buffer = make_shared<Buffer>(items, items + _size);
+            noteAllocation(_buffer->capacity() * sizeof(Value));
+        }
+        return *_buffer;
+    }
+
+
+    Array* Array::plus(Value item) {
+        appendableBuffer().push_back(item);
+        noteAllocation(sizeof(Value));
+        return new Array(_buffer, _size + 1);
+    }
+
+
+    void Array::append(Value item) {
+        appendableBuffer().push_back(item);
+        noteAllocation(sizeof(Value));
+        ++_size;
+        didWrite();
+    }
+
+
+    void Array::markChildren() {
+        for (auto val : items())
+            val.mark();
+    }
+
+
     void Array::mark() {
         if (object::mark()) {
-            for (auto val : _array)
+            for (auto val : items())
                 val.mark();
         }
     }
@@ -133,16 +431,30 @@ namespace tails::gc {
 #pragma mark - QUOTE:
 
 
-    Quote::Quote(CompiledWord *word)
-    :object(kQuoteType)
-    ,_word(word)
-    { }
+    static_assert(is_trivially_destructible_v<Quote>, "Quote::free doesn't call the destructor");
 
-    Quote::~Quote() = default;
+    Quote::Quote(StackEffect effect, Word::Flags flags, const Instruction *code, size_t count)
+    :object(kQuoteType)
+    ,_word(nullptr, effect, _code, flags)
+    ,_size(uint32_t(count))
+    ,_code{code[0]}
+    {
+        assert(count > 0 && code[count - 1] == core_words::_RETURN);
+        memcpy((void*)&_code[1], &code[1], (count - 1) * sizeof(Instruction));
+    }
 
     void Quote::mark() {
-        if (object::mark())
-            scanWord(_word.get());
+        if (object::mark()) {
+            for (const Instruction *pc = _code, *end = _code + _size; pc < end; ++pc) {
+                if (hasLiteralParam(*pc))
+                    (++pc)->literal.mark();
+            }
+        }
+    }
+
+    void Quote::free() {
+        Profiler::freeProfile(_code);
+        Heap::current().arena().free(this, allocSize(_size));
     }
 
 }
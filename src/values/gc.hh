@@ -6,10 +6,17 @@
 
 #pragma once
 #include "value.hh"
+#include "arena.hh"
+#include "word.hh"
 #include <memory>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <assert.h>
 
 namespace tails {
     class Word;
@@ -17,32 +24,152 @@ namespace tails {
 }
 
 namespace tails::gc {
+    class object;
+    class String;
+    class Array;
+    class Execution;
+
+
+    /// A garbage-collected heap: the objects allocated in it, the arena they're allocated from,
+    /// and the collector's bookkeeping. Each thread running Tails has its own current Heap
+    /// (normally owned by an `Interpreter`), which `gc::object`'s static methods operate on.
+    /// Values must not be passed from one heap to another.
+    class Heap {
+    public:
+        Heap() = default;
+        /// Frees all the objects in the heap.
+        ~Heap();
+        Heap(const Heap&) = delete;
+        Heap& operator=(const Heap&) = delete;
+
+        /// The calling thread's current Heap.
+        static Heap& current()                  {assert(sCurrent); return *sCurrent;}
+        /// Sets the calling thread's current Heap, returning the previous one.
+        static Heap* setCurrent(Heap *heap)     {return std::exchange(sCurrent, heap);}
+
+        Arena& arena()                          {return _arena;}
+
+        /// The number of strings in the intern table.
+        size_t internedCount() const            {return _interned.size();}
+
+    private:
+        friend class object;
+        friend class String;
+        friend class Array;
+        friend class Rope;
+        friend class Execution;
+
+        static inline thread_local Heap* sCurrent = nullptr;
+
+        Arena             _arena;
+        object*           _first = nullptr;         // Start of linked list of young objects
+        object*           _oldFirst = nullptr;      // Start of linked list of old objects
+        size_t            _instanceCount = 0;
+        size_t            _allocationCount = 0;     // Objects ever allocated
+        size_t            _youngCount = 0;
+        size_t            _oldCountAfterMajor = 0;
+        size_t            _youngBytes = 0;          // Bytes allocated since the last collection
+        size_t            _budgetBytes = 8 << 20;
+        size_t            _budgetCount = 100000;
+        bool              _overBudget = false;
+        bool              _minor = false;
+        std::unordered_set<object*> _remembered;    // Old objects given young references
+        std::vector<Value> _roots;                  // Values pinned by `pushRoot`
+        std::vector<std::pair<const Value*,const Value*>> _rootRanges; // See `addRootRange`
+        std::unordered_map<std::string_view,String*> _interned; // Intern table (weak refs)
+        Execution*        _execution = nullptr;     // Innermost active Execution
+    };
+
 
     /// Abstract base class of garbage collected objects (referenced by Values.)
     /// This class hierarchy doesn't use C++ virtual methods; instead the subclass is indicated by
     /// two bits in the `_next` pointer. (The only time the subclass needs to be determined this
     /// way is when freeing an object; otherwise the Value that points to the object already knows
     /// the type.)
+    ///
+    /// The collector is generational. New objects are "young"; those that survive a collection
+    /// are promoted to "old". A minor collection only frees young objects, so its cost is roughly
+    /// proportional to what's been allocated since the last collection. A major collection
+    /// frees objects of either generation.
+    ///
+    /// A collection goes: `beginCollection`, then mark the roots (`scanStack`, `scanWord`),
+    /// then `sweep`. The static methods all operate on the current thread's `Heap`.
     class object {
     public:
+        /// Starts a collection. If `minor` is true, only young objects will be freed; old ones
+        /// are assumed to be live, and marking doesn't look inside them.
+        /// (If this isn't called, `sweep` performs a major collection.)
+        static void beginCollection(bool minor);
+        /// True if a minor collection has begun (and not yet been swept.)
+        static bool isMinorCollection()  {return Heap::current()._minor;}
+        /// True if the old generation has grown enough since the last major collection that
+        /// it's worth doing another one.
+        static bool wantsMajorCollection();
+
+        /// Sets the allocation budget: once this many bytes, or this many objects, have been
+        /// allocated since the last collection, the next safepoint will collect garbage.
+        static void setBudget(size_t bytes, size_t count);
+        /// True if the allocation budget has been used up.
+        static bool overBudget()         {return Heap::current()._overBudget;}
+
+        /// Called by native words at a safepoint (a branch or recursive call) when `overBudget`
+        /// is true. If an `Execution` is active, performs a collection, scanning the stack up
+        /// to `sp`. (With CACHE_TOS, the top of stack must be spilled to `*sp` first.)
+        static void safepoint(const Value *sp);
+
+        /// Keeps a Value alive while a native word is using it but it isn't on the stack, like a
+        /// quotation being called. Must be balanced with `popRoot`.
+        static void pushRoot(Value v)    {Heap::current()._roots.push_back(v);}
+        static void popRoot()            {Heap::current()._roots.pop_back();}
+        /// The number of roots pushed by `pushRoot` and not yet popped.
+        static size_t rootDepth()        {return Heap::current()._roots.size();}
+
+        /// Keeps the Values from `bottom` to `top` (inclusive) alive across collections, until
+        /// `removeRootRange(bottom)`. For stacks that hold Values between runs, like that of a
+        /// suspended Continuation.
+        static void addRootRange(const Value *bottom, const Value *top);
+        static void removeRootRange(const Value *bottom);
+
         /// Marks all objects found in the stack from `bottom` to `top` (inclusive.)
+        /// If CACHE_TOS is enabled and a word is running, the cached top of stack must have been
+        /// written back to `*top` first (`SPILL()`). Between runs it always has been, by `_RETURN`.
         static void scanStack(const Value *bottom, const Value *top);
         /// Marks all object literals found in a word.
         static void scanWord(const Word*);
 
-        /// Frees all objects that have not been marked.
+        /// Ends the collection: frees all objects that have not been marked (only young ones,
+        /// in a minor collection), and promotes the survivors to the old generation.
         /// Returns the number still alive, and the number freed.
         static std::pair<size_t,size_t> sweep();
 
-        static object* first()          {return sFirst;}
         object* next() const            {return (object*)(_next & ~kTagBits);}
-        static size_t instanceCount()   {return sInstanceCount;}
+        static size_t instanceCount()   {return Heap::current()._instanceCount;}
+        static size_t youngCount()      {return Heap::current()._youngCount;}
+        /// The number of objects allocated in the heap since it was created.
+        static size_t allocationCount() {return Heap::current()._allocationCount;}
 
         int type() const                {return _next & kTypeBits;}
+        bool isRope() const             {return type() == kRopeType;}
+        bool isOld() const              {return (_next & kOldBit) != 0;}
+
+        // Objects are allocated from the current Heap's `Arena`:
+        static void* operator new(size_t size) {
+            noteAllocation(size);
+            return Heap::current()._arena.alloc(size);
+        }
+        static void operator delete(void *ptr, size_t size) {
+            Heap::current()._arena.free(ptr, size);
+        }
 
     protected:
         object(int type);
-        bool mark()                     {bool chg = !isMarked(); _next |= kMarkedBit; return chg;}
+        bool mark() {
+            if (isOld() && Heap::current()._minor)
+                return false;           // Old objects are live in a minor collection
+            bool chg = !isMarked();
+            _next |= kMarkedBit;
+            return chg;
+        }
         void unmark()                   {_next &= ~kMarkedBit;}
         bool isMarked() const           {return (_next & kMarkedBit) != 0;}
         void collect();
@@ -50,68 +177,197 @@ namespace tails::gc {
 
         enum {
             kTypeBits  = 0x3,           // Bits 0,1 indicate the object's subclass
+                kRopeType   = 0x0,
                 kStringType = 0x1,
                 kArrayType  = 0x2,
                 kQuoteType  = 0x3,
             kMarkedBit = 0x4,           // Bit 2 is set when object is marked as live during GC
-            kTagBits   = kTypeBits | kMarkedBit
+            kOldBit    = 0x8,           // Bit 3 is set when object has survived a collection
+            kTagBits   = kTypeBits | kMarkedBit | kOldBit
         };
 
+        static void noteAllocation(size_t bytes) {
+            Heap &heap = Heap::current();
+            if ((heap._youngBytes += bytes) >= heap._budgetBytes)
+                heap._overBudget = true;
+        }
+
+        /// The write barrier: call after an old object is changed to point to another object.
+        void didWrite()                 {if (isOld()) Heap::current()._remembered.insert(this);}
+
     private:
-        static object* sFirst;          // Start of linked list of all allocated objects
-        static size_t  sInstanceCount;
+        friend class Heap;
+        void markChildren();
+        static size_t sweepList(object *list, object* &oldList, size_t &kept);
 
-        intptr_t _next;                 // Pointer to next object, plus 3 tag bits
+        intptr_t _next;                 // Pointer to next object, plus 4 tag bits
     };
 
 
     /// A heap-allocated garbage-collected string.
     class String : public object {
     public:
-        static String* make(size_t len)         {return new (len) String(len);}
-        static String* make(std::string_view s) {return new (s.size()) String(s);}
+        static String* make(size_t len)         {return ::new (alloc(len)) String(len);}
+        static String* make(std::string_view s) {return ::new (alloc(s.size())) String(s);}
+        /// Returns the unique interned String with these contents, creating it if necessary.
+        /// (The intern table doesn't keep strings alive; unused ones are still collected.)
+        static String* intern(std::string_view);
+
         const char* c_str() const               {return _data;}
         std::string_view string_view() const    {return std::string_view(_data, _len);}
+        /// True if this is in the intern table. Any two interned Strings are unequal.
+        bool isInterned() const                 {return _interned;}
+        /// A hash of the contents; computed the first time it's called, then cached.
+        /// (The contents must not be changed after that.)
+        uint32_t hash() const                   {return _hash ? _hash : computeHash();}
+        bool hasCachedHash() const              {return _hash != 0;}
+
         /// Marks this string as in use.
         void mark()                             {object::mark();}
+        /// Frees the string. (Strings are variable-size, so `delete` can't be used.)
+        void free();
 
-        static void operator delete(void *ptr)  {::operator delete(ptr);}
     private:
-        static void* operator new(size_t baseSize, size_t extra) {
-            return ::operator new(baseSize + extra);
+        static size_t allocSize(size_t len)     {return sizeof(String) + len;}
+        static void* alloc(size_t len) {
+            noteAllocation(allocSize(len));
+            return Heap::current().arena().alloc(allocSize(len));
         }
 
         String(size_t len);
         String(std::string_view str);
 
-        uint32_t _len;
-        char     _data[1]; // actual length is variable
+        friend class Rope;
+        uint32_t computeHash() const;
+
+        uint32_t         _len      :31;
+        uint32_t         _interned :1;
+        mutable uint32_t _hash = 0; // 0 if not computed yet
+        char             _data[1];  // actual length is variable
+    };
+
+
+    /// A lazily-concatenated string: a node that refers to two strings (each possibly a Rope)
+    /// instead of copying them. A string Value can point to a String or a Rope.
+    /// The first time the contents are needed contiguously, the Rope is flattened into a String,
+    /// and lets go of its children. So repeated concatenation takes linear time, not quadratic.
+    class Rope : public object {
+    public:
+        /// Concatenations shorter than this just copy the strings, since that's cheap.
+        static constexpr size_t kMinLength = 32;
+
+        Rope(Value left, Value right, size_t length);
+
+        size_t length() const                   {return _length;}
+        /// The contents as a contiguous String, which is created the first time it's needed.
+        String* flatten();
+        std::string_view string_view()          {return flatten()->string_view();}
+        /// Marks this rope, and the strings it refers to, as in use.
+        void mark();
+    private:
+        friend class object;
+        static Rope* asUnflattenedRope(Value);
+        void markChildren();
+
+        Value   _left, _right;      // The two halves, until flattened
+        String* _flat = nullptr;    // The flattened string, once it's been computed
+        size_t  _length;
     };
 
 
     /// A heap-allocated garbage-collected array.
+    ///
+    /// Arrays are immutable, so they can share storage: an Array is a prefix of a `Buffer` that
+    /// may be shared with longer arrays. Appending to the array that ends at the end of its buffer
+    /// just adds to the buffer, making `+` in a loop amortized O(1) instead of O(n). Appending to
+    /// any other array has to copy its items to a new buffer.
     class Array : public object {
     public:
-        Array()                                 :object(kArrayType) { }
-        Array(std::vector<Value>&& a)           :object(kArrayType), _array(std::move(a)) { }
-        std::vector<Value>& array()             {return _array;}
+        using Buffer = std::vector<Value>;
+
+        Array()                                 :Array(Buffer{}) { }
+        explicit Array(Buffer&&);
+
+        ArrayItems items() const                {return ArrayItems(_buffer->data(), _size);}
+        size_t size() const                     {return _size;}
+
+        /// Returns a new array consisting of this one plus `item`.
+        Array* plus(Value item);
+        /// Appends `item` to this array in place.
+        void append(Value item);
+
         /// Marks this array, and all objects in it, as in use.
         void mark();
     private:
-        std::vector<Value> _array;
+        friend class object;
+        Array(std::shared_ptr<Buffer>, size_t size);
+        void markChildren();
+        Buffer& appendableBuffer();
+
+        std::shared_ptr<Buffer> _buffer;        // Items; may be shared with longer arrays
+        size_t                  _size;          // Number of items of `_buffer` in this array
     };
 
 
-    /// A heap-allocated garbage-collected anonymous Word.
+    /// A heap-allocated garbage-collected anonymous Word. The Word and its instructions live in
+    /// the Quote itself, a single variable-size allocation, as a String's characters do.
     class Quote : public object {
     public:
-        Quote(CompiledWord*);
-        ~Quote();
-        const CompiledWord* word() const        {return _word.get();}
+        /// Creates a Quote with a copy of `code`, whose last instruction must be `_RETURN`.
+        static Quote* make(StackEffect effect, Word::Flags flags,
+                           const Instruction *code, size_t count) {
+            return ::new (alloc(count)) Quote(effect, flags, code, count);
+        }
+
+        const Word* word() const                {return &_word;}
+        /// The number of instructions, including the final `_RETURN`.
+        size_t size() const                     {return _size;}
+
         /// Marks this quote, and any objects it references as literals, as in use.
         void mark();
+        /// Frees the quote. (Quotes are variable-size, so `delete` can't be used.)
+        void free();
+
+    private:
+        static size_t allocSize(size_t count) {
+            return sizeof(Quote) + (count - 1) * sizeof(Instruction);
+        }
+        static void* alloc(size_t count) {
+            noteAllocation(allocSize(count));
+            return Heap::current().arena().alloc(allocSize(count));
+        }
+
+        Quote(StackEffect, Word::Flags, const Instruction *code, size_t count);
+
+        Word        _word;          // Its `instruction()` points to `_code`
+        uint32_t    _size;
+        Instruction _code[1];       // actual length is variable
+    };
+
+
+    /// While one of these is in scope, the code calling `word` with the stack starting at
+    /// `stackBottom` is running, so a `safepoint` can collect garbage. Scopes can be nested, but
+    /// safepoints don't collect while they are, since the outer stacks' extents aren't known.
+    /// If an exception ends the run, the destructor pops the roots and loops it left behind, and
+    /// ends its timed profiling calls.
+    class Execution {
+    public:
+        Execution(const Word &word, const Value *stackBottom);
+        ~Execution();
+
+        /// Makes this the current heap's innermost Execution again, after a `siglongjmp` out of
+        /// Executions nested within it skipped their destructors. (This one's destructor then
+        /// cleans up what they left behind.)
+        void reinstate()                        {Heap::current()._execution = this;}
     private:
-        std::unique_ptr<CompiledWord> _word;
+        friend class object;
+
+        const Word*  _word;
+        const Value* _stackBottom;
+        Execution*   _prev;
+        size_t       _rootCount;
+        size_t       _loopDepth;
+        size_t       _timedCallDepth;
     };
 
 }
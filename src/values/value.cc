@@ -18,8 +18,8 @@
 
 #include "value.hh"
 #include "gc.hh"
-#include "compiler.hh"  // just for CompiledWord
 #include "io.hh"
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <string.h>
@@ -37,7 +37,8 @@ namespace tails {
      - A number is represented as a regular `double` value. (This includes exact storage of integers
        up to ±2^51.)
      - A string has `kStringTag`. If up to 6 bytes long it can be stored inline; the length is
-       determined by the number of trailing zero bytes. Otherwise it points to a gc::String object.
+       determined by the number of trailing zero bytes. Otherwise it points to a gc::String object,
+       or to a gc::Rope (a lazy concatenation of two strings.)
      - An array has `kArrayTag` and points to a `gc::Array` object. (It's never inline.)
      - A quotation has `kQuoteTag` and points to a `gc::Quote` object. (It's never inline.)
      - Null is a singleton value that's tagged as a String but has a null pointer.
@@ -62,6 +63,15 @@ namespace tails {
     }
 
 
+    Value Value::internedString(std::string_view str) {
+        if (str.size() <= NanTagged::kInlineCapacity)
+            return Value(str.data(), str.size());
+        Value result;
+        result.setPointer(gc::String::intern(str));
+        return result;
+    }
+
+
     Value::Value(std::initializer_list<Value> arrayItems)
     :NanTagged((void**)0)
     {
@@ -79,11 +89,10 @@ namespace tails {
     }
 
 
-    Value::Value(CompiledWord *word)
-    :NanTagged(word)
+    Value::Value(gc::Quote *quote)
+    :NanTagged(quote)
     {
-        assert(word);
-        setPointer(new gc::Quote(word));
+        assert(quote);
         setTags(kQuoteTag);
     }
 
@@ -129,17 +138,25 @@ namespace tails {
                     ++len;
                 return string_view(str, len);
             } else if (!isNull()) {
-                return ((gc::String*)asPointer())->string_view();
+                auto obj = (gc::object*)asPointer();
+                if (obj->isRope())
+                    return ((gc::Rope*)obj)->string_view();     // flattens it if necessary
+                return ((gc::String*)obj)->string_view();
             }
         }
         return string_view();
     }
 
 
-    vector<Value>* Value::asArray() const {
-        if (tags() == kArrayTag)
-            return &((gc::Array*)asPointer())->array();
-        return nullptr;
+    optional<ArrayItems> Value::asArray() const {
+        if (isArray())
+            return ((gc::Array*)asPointer())->items();
+        return nullopt;
+    }
+
+
+    bool ArrayItems::operator== (const ArrayItems &other) const {
+        return size() == other.size() && std::equal(begin(), end(), other.begin());
     }
 
 
@@ -151,10 +168,17 @@ namespace tails {
 
 
     void Value::mark() const {
+        if (isDouble())
+            return;             // (a number's bits can look like any tag)
         switch (tags()) {
             case kStringTag:
-                if (!isDouble() && !isInline())
-                    ((gc::String*)asPointer())->mark();
+                if (!isInline() && !isNull()) {
+                    auto obj = (gc::object*)asPointer();
+                    if (obj->isRope())
+                        ((gc::Rope*)obj)->mark();
+                    else
+                        ((gc::String*)obj)->mark();
+                }
                 break;
             case kArrayTag:
                 ((gc::Array*)asPointer())->mark();
@@ -167,6 +191,21 @@ namespace tails {
     }
 
 
+    void Value::appendToArray(Value item) const {
+        assert(isArray());
+        ((gc::Array*)asPointer())->append(item);
+    }
+
+
+    bool Value::prepareToShare() const {
+        if (isArray())
+            return false;
+        if (auto str = heapString(); str)
+            str->hash();
+        return true;
+    }
+
+
     Value::operator bool() const {
         if (isDouble())
             return asDouble() != 0;
@@ -174,14 +213,26 @@ namespace tails {
             return !isNull();
     }
 
-    bool Value::operator== (const Value &v) const {
+    bool Value::operator== (Value v) const {
         if (NanTagged::operator==(v))
             return true;
         Type myType = type();
         if (myType == ANull || myType == ANumber || v.type() != myType)
             return false;
-        else if (myType == AString)
+        else if (myType == AString) {
+            if (auto s1 = heapString(), s2 = v.heapString(); s1 && s2) {
+                if (s1 == s2)
+                    return true;
+                else if (s1->isInterned() && s2->isInterned())
+                    return false;               // Interned strings are unique
+                else if (s1->isInterned() || s2->isInterned()
+                                              || (s1->hasCachedHash() && s2->hasCachedHash())) {
+                    if (s1->hash() != s2->hash())
+                        return false;
+                }
+            }
             return asString() == v.asString();
+        }
         else if (myType == AnArray)
             return *asArray() == *v.asArray();
         else
@@ -199,9 +250,11 @@ namespace tails {
             case ANumber:
                 return _cmp(asDouble(), v.asDouble());
             case AString:
+                if (NanTagged::operator==(v))
+                    return 0;
                 return asString().compare(v.asString());
             case AnArray: {
-                const vector<Value> *a = asArray(), *b = v.asArray();
+                auto a = asArray(), b = v.asArray();
                 auto ia = a->begin(), ib = b->begin();
                 for (size_t n = min(a->size(), b->size()); n > 0; --n, ++ia, ++ib) {
                     if (int c = ia->cmp(*ib); c != 0)
@@ -216,9 +269,30 @@ namespace tails {
     }
 
 
+    // If this is a string stored on the heap, returns its gc::String, flattening it if it's a Rope.
+    gc::String* Value::heapString() const {
+        if (!isString() || isInline())
+            return nullptr;
+        auto obj = (gc::object*)asPointer();
+        if (obj->isRope())
+            return ((gc::Rope*)obj)->flatten();
+        return (gc::String*)obj;
+    }
+
+
+    // The length of a string, without flattening a Rope.
+    size_t Value::stringLength() const {
+        if (!isInline() && !isNull()) {
+            if (auto obj = (gc::object*)asPointer(); obj->isRope())
+                return ((gc::Rope*)obj)->length();
+        }
+        return asString().size();
+    }
+
+
     Value Value::length() const {
         if (isString())
-            return asString().size();
+            return stringLength();
         else if (isArray())
             return asArray()->size();
         else
@@ -232,12 +306,18 @@ namespace tails {
             return Value(asDouble() + v.asDouble());
         } else if (isString() && v.isString()) {
             // String concatenation:
-            auto str1 = asString(), str2 = v.asString();
-            if (str1.size() == 0)
+            size_t len1 = stringLength(), len2 = v.stringLength();
+            if (len1 == 0)
                 return v;
-            else if (str2.size() == 0)
+            else if (len2 == 0)
                 return *this;
-            else {
+            else if (len1 + len2 >= gc::Rope::kMinLength) {
+                // Long strings are concatenated lazily, with a Rope:
+                Value result;
+                result.setPointer(new gc::Rope(*this, v, len1 + len2));
+                return result;
+            } else {
+                auto str1 = asString(), str2 = v.asString();
                 Value result;
                 char *dst = result.allocString(str1.size() + str2.size());
                 memcpy(dst,               str1.data(), str1.size());
@@ -245,11 +325,11 @@ namespace tails {
                 return result;
             }
         } else if (isArray()) {
-            // Add item to array:
-            vector<Value> newArray(*asArray());
-            Value newVal(move(newArray));
-            newVal.asArray()->push_back(v);
-            return newVal;
+            // Add item to array (usually without copying; see gc::Array):
+            Value result;
+            result.setPointer(((gc::Array*)asPointer())->plus(v));
+            result.setTags(kArrayTag);
+            return result;
         } else {
             return NullValue;
         }
@@ -284,7 +364,7 @@ namespace tails {
     }
 
 
-    static std::ostream& operator<< (std::ostream &out, const vector<Value> &array) {
+    static std::ostream& operator<< (std::ostream &out, const ArrayItems &array) {
         out << '[';
         int n = 0;
         for (auto value : array) {
@@ -21,6 +21,7 @@
 #include "nan_tagged.hh"
 #include <stddef.h>
 #include <stdint.h>
+#include <optional>
 #include <string_view>
 #include <vector>
 
@@ -28,7 +29,8 @@
 namespace tails {
 
     class Word;
-    class CompiledWord;
+    class ArrayItems;
+    namespace gc { class Quote; class Rope; class String; }
 
     /// Type of values stored on the stack.
     ///
@@ -47,10 +49,14 @@ namespace tails {
         Value(const char* str);
         Value(const char* str, size_t len);
 
+        /// Returns a string Value whose heap storage, if any, is interned: equal interned strings
+        /// share one object, so comparing them is quick. (The compiler interns string literals.)
+        static Value internedString(std::string_view);
+
         Value(std::initializer_list<Value> arrayItems);
         Value(std::vector<Value>&&);
 
-        explicit Value(CompiledWord*);
+        explicit Value(gc::Quote*);
 
         enum Type {
             ANull,
@@ -73,13 +79,14 @@ namespace tails {
         constexpr double asDouble() const   {return NanTagged::asDouble();}
         constexpr int    asInt() const      {return int(asDoubleOrZero());}
         std::string_view asString() const;
-        std::vector<Value>* asArray() const;
+        /// The items of an array, or `nullopt` if this isn't an array. Arrays are immutable.
+        std::optional<ArrayItems> asArray() const;
         const Word*      asQuote() const;
 
         /// 'Truthiness' -- any Value except 0 and null is considered truthy.
         explicit operator bool() const;
         /// Equality comparison
-        bool operator== (const Value &v) const;
+        bool operator== (Value v) const;
         /// 3-way comparison, like the C++20 `<=>` operator.
         int cmp(Value v) const;
 
@@ -95,18 +102,50 @@ namespace tails {
 
         /// Marks this value as in use during garbage collection. (See `gc.hh` for main GC API.)
         void mark() const;
+        /// Appends an item to an existing array in place, instead of creating a new array as `+`
+        /// does. Only for use while building an array, before other code can see it.
+        void appendToArray(Value item) const;
+
+        /// Prepares this Value to be read by several threads at once, by doing what they'd
+        /// otherwise do lazily: flattening a Rope, and computing a string's hash. Returns false
+        /// if it can't be shared: an array, since `+` may append to its storage in place.
+        bool prepareToShare() const;
 
     private:
+        friend class gc::Rope;
         enum { kStringTag = 0, kArrayTag = 1, kQuoteTag = 2, };
 
         char* allocString(size_t len);
+        size_t stringLength() const;
+        gc::String* heapString() const;
     };
 
     constexpr Value NullValue;
 
-    static inline bool operator!= (const Value &a, const Value &b) {return !(a == b);}
-    static inline bool operator>  (const Value &a, const Value &b) {return a.cmp(b) > 0;}
-    static inline bool operator>= (const Value &a, const Value &b) {return a.cmp(b) >= 0;}
-    static inline bool operator<  (const Value &a, const Value &b) {return a.cmp(b) < 0;}
-    static inline bool operator<= (const Value &a, const Value &b) {return a.cmp(b) <= 0;}
+
+    /// A read-only view of the items of an array Value, as returned by `Value::asArray`.
+    /// It's only valid until the next garbage collection, or until something appends to an array
+    /// sharing its storage (which may move the items.)
+    class ArrayItems {
+    public:
+        constexpr ArrayItems(const Value *items, size_t size) :_begin(items), _end(items + size) { }
+
+        constexpr const Value* begin() const            {return _begin;}
+        constexpr const Value* end() const              {return _end;}
+        constexpr size_t size() const                   {return _end - _begin;}
+        constexpr bool empty() const                    {return _end == _begin;}
+        constexpr const Value& operator[] (size_t i) const {return _begin[i];}
+        constexpr const Value& back() const             {return _end[-1];}
+
+        bool operator== (const ArrayItems&) const;
+
+    private:
+        const Value *_begin, *_end;
+    };
+
+    static inline bool operator!= (Value a, Value b) {return !(a == b);}
+    static inline bool operator>  (Value a, Value b) {return a.cmp(b) > 0;}
+    static inline bool operator>= (Value a, Value b) {return a.cmp(b) >= 0;}
+    static inline bool operator<  (Value a, Value b) {return a.cmp(b) < 0;}
+    static inline bool operator<= (Value a, Value b) {return a.cmp(b) <= 0;}
 }